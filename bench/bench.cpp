@@ -0,0 +1,228 @@
+/***************************************
+
+	Bench and tests for the portable parts of the logger
+
+	Times the loops which every byte of output goes through, each against
+	the plain code it replaced or a naive version of the same thing, and
+	checks they give the same answers.  Usage:
+
+	nssm_bench [--check] [buffer] [text] [batch] [line] [map] [flush]
+		[filter] [gzip] [sink]
+
+	--check runs the tests on small inputs and times each case once, which
+	is what ctest runs.  The exit code is 1 if any check failed.
+
+***************************************/
+
+#include "bench.h"
+
+#include <chrono>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+bool g_bCheck = false;
+uint32_t g_uFailures = 0;
+
+/* xorshift32, never returns 0 for a seed which isn't 0. */
+uint32_t bench_random(uint32_t* pSeed)
+{
+	uint32_t x = *pSeed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*pSeed = x;
+	return x;
+}
+
+/***************************************
+
+	Make some log output
+
+	Lines of 20 to 200 bytes of timestamped words, which is roughly what
+	services write.  BENCH_TEXT_ESCAPES adds quotes, backslashes and tabs
+	to some lines, BENCH_TEXT_UTF8 adds multibyte characters.  Returns
+	the number of lines, the last of which may be cut short.
+
+***************************************/
+
+uint32_t make_log_text(
+	uint8_t* pOutput, uint32_t uLength, uint32_t uSeed, uint32_t uFlags)
+{
+	static const char* g_Words[] = {"request", "served", "from", "cache",
+		"user", "session", "opened", "closed", "GET", "/api/v1/items",
+		"200", "404", "in", "ms", "worker", "queue", "depth", "retry"};
+	static const char* g_Escapes[] = {"\"quoted\"", "C:\\Temp\\x", "\t"};
+	static const char* g_Multibyte[] = {
+		"caf\xC3\xA9", "\xE2\x82\xAC" "5", "\xF0\x9F\x98\x80", "na\xC3\xAFve"};
+	uint32_t uSeed2 = uSeed ? uSeed : 1;
+	uint32_t uLines = 0;
+	uint32_t o = 0;
+	while (o < uLength) {
+		char line[256];
+		uint32_t uTarget = 20 + bench_random(&uSeed2) % 181;
+		int iUsed = snprintf(line, sizeof(line),
+			"2026-10-16 12:%02u:%02u.%03u INFO ", bench_random(&uSeed2) % 60,
+			bench_random(&uSeed2) % 60, bench_random(&uSeed2) % 1000);
+		uint32_t uUsed = static_cast<uint32_t>(iUsed);
+		while (uUsed < uTarget) {
+			uint32_t r = bench_random(&uSeed2);
+			const char* pWord = g_Words[r % 18];
+			if ((uFlags & BENCH_TEXT_ESCAPES) && !(r % 23)) {
+				pWord = g_Escapes[(r >> 8) % 3];
+			} else if ((uFlags & BENCH_TEXT_UTF8) && !(r % 19)) {
+				pWord = g_Multibyte[(r >> 8) % 4];
+			}
+			uint32_t uWord = static_cast<uint32_t>(strlen(pWord));
+			if (uUsed + uWord + 2 > sizeof(line)) {
+				break;
+			}
+			memcpy(line + uUsed, pWord, uWord);
+			uUsed += uWord;
+			line[uUsed++] = ' ';
+		}
+		line[uUsed - 1] = '\n';
+		uint32_t uCopy = (uUsed < uLength - o) ? uUsed : uLength - o;
+		memcpy(pOutput + o, line, uCopy);
+		o += uCopy;
+		uLines++;
+	}
+	return uLines;
+}
+
+void bench_fail(const char* pFormat, ...)
+{
+	va_list args;
+	va_start(args, pFormat);
+	fputs("FAILED: ", stdout);
+	vprintf(pFormat, args);
+	fputc('\n', stdout);
+	va_end(args);
+	g_uFailures++;
+}
+
+/***************************************
+
+	Time a benchmark
+
+	Runs pProc over and over for at least BENCH_MIN_SECONDS, or once in
+	--check mode, and prints the throughput over uBytes per call.
+	Returns MB/s.
+
+***************************************/
+
+double bench_time(
+	const char* pName, BenchProc pProc, void* pParam, uint64_t uBytes)
+{
+	typedef std::chrono::steady_clock clock_type;
+	uint32_t uRuns = 0;
+	double dSeconds = 0.0;
+
+	/* Warm up the caches and the branch predictors first. */
+	if (!g_bCheck) {
+		pProc(pParam);
+	}
+	clock_type::time_point start = clock_type::now();
+	do {
+		pProc(pParam);
+		uRuns++;
+		dSeconds = std::chrono::duration<double>(clock_type::now() - start)
+					   .count();
+	} while (!g_bCheck && (dSeconds < BENCH_MIN_SECONDS));
+
+	double dRate = (dSeconds > 0.0) ?
+		static_cast<double>(uBytes) * uRuns / dSeconds / 1000000.0 :
+		0.0;
+	printf("  %-44s %10.1f MB/s\n", pName, dRate);
+	fflush(stdout);
+	return dRate;
+}
+
+int main(int argc, char** argv)
+{
+	bool bBuffer = false;
+	bool bText = false;
+	bool bBatch = false;
+	bool bLine = false;
+	bool bMap = false;
+	bool bFlush = false;
+	bool bFilter = false;
+	bool bGzip = false;
+	bool bSink = false;
+	bool bAll = true;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--check")) {
+			g_bCheck = true;
+		} else if (!strcmp(argv[i], "buffer")) {
+			bBuffer = true;
+			bAll = false;
+		} else if (!strcmp(argv[i], "text")) {
+			bText = true;
+			bAll = false;
+		} else if (!strcmp(argv[i], "batch")) {
+			bBatch = true;
+			bAll = false;
+		} else if (!strcmp(argv[i], "line")) {
+			bLine = true;
+			bAll = false;
+		} else if (!strcmp(argv[i], "map")) {
+			bMap = true;
+			bAll = false;
+		} else if (!strcmp(argv[i], "flush")) {
+			bFlush = true;
+			bAll = false;
+		} else if (!strcmp(argv[i], "filter")) {
+			bFilter = true;
+			bAll = false;
+		} else if (!strcmp(argv[i], "gzip")) {
+			bGzip = true;
+			bAll = false;
+		} else if (!strcmp(argv[i], "sink")) {
+			bSink = true;
+			bAll = false;
+		} else {
+			fprintf(stderr,
+				"Usage: %s [--check] [buffer] [text] [batch] [line] [map] "
+				"[flush] [filter] [gzip] [sink]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+
+	if (bAll || bBuffer) {
+		bench_buffer();
+	}
+	if (bAll || bText) {
+		bench_text();
+	}
+	if (bAll || bBatch) {
+		bench_batch();
+	}
+	if (bAll || bLine) {
+		bench_line();
+	}
+	if (bAll || bMap) {
+		bench_map();
+	}
+	if (bAll || bFlush) {
+		bench_flush();
+	}
+	if (bAll || bFilter) {
+		bench_filter();
+	}
+	if (bAll || bGzip) {
+		bench_gzip();
+	}
+	if (bAll || bSink) {
+		bench_sink();
+	}
+
+	if (g_uFailures) {
+		printf("%u checks failed\n", g_uFailures);
+		return 1;
+	}
+	if (g_bCheck) {
+		puts("All checks passed");
+	}
+	return 0;
+}
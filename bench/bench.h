@@ -0,0 +1,57 @@
+/***************************************
+
+	Bench and tests for the portable parts of the logger
+
+***************************************/
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+
+// Bytes of generated text each benchmark works through
+#define BENCH_TEXT_SIZE (16U * 1024U * 1024U)
+
+// Bytes of generated text in --check mode
+#define BENCH_CHECK_SIZE (256U * 1024U)
+
+// Least seconds each benchmark is timed for
+#define BENCH_MIN_SECONDS 0.25
+
+typedef void (*BenchProc)(void* pParam);
+
+// Set by --check, which runs the tests and times each case once
+extern bool g_bCheck;
+// Number of failed checks
+extern uint32_t g_uFailures;
+
+extern uint32_t bench_random(uint32_t* pSeed);
+extern uint32_t make_log_text(
+	uint8_t* pOutput, uint32_t uLength, uint32_t uSeed, uint32_t uFlags);
+extern double bench_time(
+	const char* pName, BenchProc pProc, void* pParam, uint64_t uBytes);
+extern void bench_fail(const char* pFormat, ...);
+
+// make_log_text() flags
+#define BENCH_TEXT_ESCAPES 1U
+#define BENCH_TEXT_UTF8 2U
+
+// Record a failed check with where it happened
+#define BENCH_CHECK(x, ...) \
+	do { \
+		if (!(x)) { \
+			bench_fail(__VA_ARGS__); \
+		} \
+	} while (0)
+
+extern void bench_buffer(void);
+extern void bench_text(void);
+extern void bench_batch(void);
+extern void bench_line(void);
+extern void bench_map(void);
+extern void bench_flush(void);
+extern void bench_filter(void);
+extern void bench_gzip(void);
+extern void bench_sink(void);
+
+#endif
@@ -0,0 +1,345 @@
+/***************************************
+
+	Batched log writes
+
+	Fragments are added the way the logger adds them, a copied timestamp
+	then the line itself, and what comes out must match what went in
+	whatever flushes happen on the way.  Copied data is overwritten as
+	soon as it has been added, as the logger's would be.  The same goes
+	for fragments handed over as they are, as to writev().  The benchmark
+	writes log lines to a file one fragment per write, batched into one
+	buffer, and on POSIX batched into one writev() per batch.
+
+***************************************/
+
+#include "bench.h"
+#include "logbatch.h"
+#include "memorymanager.h"
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define BENCH_BATCH_FILE "nssm_bench_batch.log"
+
+struct batch_output_t {
+	std::string m_Output;
+	uint32_t m_uWrites;
+};
+
+struct batch_param_t {
+	const uint8_t* m_pInput;
+	uint32_t m_uLength;
+	HANDLE m_hFile;
+	uint32_t m_uWrites;
+	bool m_bBatched;
+	bool m_bVector;
+};
+
+static int write_string(void* pParam, void* pData, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained)
+{
+	(void)pComplained;
+	batch_output_t* pOutput = static_cast<batch_output_t*>(pParam);
+	pOutput->m_Output.append(static_cast<const char*>(pData), uLength);
+	pOutput->m_uWrites++;
+	*pWritten += uLength;
+	return 0;
+}
+
+static int write_file(void* pParam, void* pData, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained)
+{
+	batch_param_t* pBatch = static_cast<batch_param_t*>(pParam);
+	DWORD uWritten;
+	pBatch->m_uWrites++;
+	if (!WriteFile(pBatch->m_hFile, pData, uLength, &uWritten, NULL)) {
+		*pComplained = 1;
+		return 1;
+	}
+	*pWritten += uWritten;
+	return 0;
+}
+
+static int write_string_fragments(void* pParam,
+	const log_fragment_t* pFragments, uint32_t uCount, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained)
+{
+	(void)pComplained;
+	batch_output_t* pOutput = static_cast<batch_output_t*>(pParam);
+	for (uint32_t i = 0; i < uCount; i++) {
+		pOutput->m_Output.append(
+			static_cast<const char*>(pFragments[i].m_pData),
+			pFragments[i].m_uLength);
+	}
+	pOutput->m_uWrites++;
+	*pWritten += uLength;
+	return 0;
+}
+
+#ifndef _WIN32
+/* One writev() per batch, and more only for what a short write left. */
+static int write_file_fragments(void* pParam,
+	const log_fragment_t* pFragments, uint32_t uCount, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained)
+{
+	batch_param_t* pBatch = static_cast<batch_param_t*>(pParam);
+	struct iovec vectors[NSSM_LOG_BATCH_FRAGMENTS];
+	for (uint32_t i = 0; i < uCount; i++) {
+		vectors[i].iov_base = const_cast<void*>(pFragments[i].m_pData);
+		vectors[i].iov_len = pFragments[i].m_uLength;
+	}
+	struct iovec* pVector = vectors;
+	while (uLength) {
+		pBatch->m_uWrites++;
+		ssize_t iWritten = writev(compat_fd(pBatch->m_hFile), pVector,
+			static_cast<int>(uCount));
+		if (iWritten <= 0) {
+			*pComplained = 1;
+			return 1;
+		}
+		size_t uWritten = static_cast<size_t>(iWritten);
+		*pWritten += static_cast<uint32_t>(uWritten);
+		uLength -= static_cast<uint32_t>(uWritten);
+		while (uCount && (uWritten >= pVector->iov_len)) {
+			uWritten -= pVector->iov_len;
+			pVector++;
+			uCount--;
+		}
+		if (uCount) {
+			pVector->iov_base = static_cast<uint8_t*>(pVector->iov_base) +
+				uWritten;
+			pVector->iov_len -= uWritten;
+		}
+	}
+	return 0;
+}
+#endif
+
+static void init_batch(log_batch_t* pBatch, BatchWriteProc pWrite,
+	void* pParam)
+{
+	memset(pBatch, 0, sizeof(*pBatch));
+	pBatch->m_pWrite = pWrite;
+	pBatch->m_pParam = pParam;
+}
+
+static void free_batch(log_batch_t* pBatch)
+{
+	heap_free(pBatch->m_pGather);
+	pBatch->m_pGather = NULL;
+}
+
+/***************************************
+
+	Checks
+
+***************************************/
+
+/*
+  More lines than fit in one batch, each a copied prefix then the line.
+  Once batch_copy() put its copy in scratch space and then flushed the
+  batch, so the next prefix was copied over it.
+*/
+static void check_batch_lines(void)
+{
+	static const char g_Line[] = "the rest of the line\n";
+	log_batch_t* pBatch = new log_batch_t;
+	batch_output_t output;
+	output.m_uWrites = 0;
+	init_batch(pBatch, write_string, &output);
+
+	std::string expected;
+	uint32_t uWritten = 0;
+	int iComplained = 0;
+	uint32_t uLines = NSSM_LOG_BATCH_FRAGMENTS * 3 + 7;
+	for (uint32_t i = 0; i < uLines; i++) {
+		char prefix[32];
+		int iLength = snprintf(prefix, sizeof(prefix), "line %05u: ", i);
+		expected.append(prefix, static_cast<size_t>(iLength));
+		expected.append(g_Line, sizeof(g_Line) - 1);
+		BENCH_CHECK(!batch_copy(pBatch, prefix, static_cast<uint32_t>(iLength),
+						&uWritten, &iComplained),
+			"batch_copy, line %u", i);
+		memset(prefix, '#', sizeof(prefix));
+		BENCH_CHECK(!batch_append(pBatch, g_Line, sizeof(g_Line) - 1,
+						&uWritten, &iComplained),
+			"batch_append, line %u", i);
+	}
+	BENCH_CHECK(!flush_batch(pBatch, &uWritten, &iComplained), "flush_batch");
+
+	BENCH_CHECK(output.m_Output == expected,
+		"%u lines of two fragments came out wrong", uLines);
+	BENCH_CHECK(uWritten == expected.size(), "wrote %u bytes of %u",
+		uWritten, static_cast<uint32_t>(expected.size()));
+	uint32_t uBatches =
+		(uLines * 2 + NSSM_LOG_BATCH_FRAGMENTS - 1) / NSSM_LOG_BATCH_FRAGMENTS;
+	BENCH_CHECK(output.m_uWrites == uBatches, "%u lines took %u writes",
+		uLines, output.m_uWrites);
+	free_batch(pBatch);
+	delete pBatch;
+}
+
+/* Random fragments, some copied, some big enough to hit the byte limit. */
+static void check_batch_random(void)
+{
+	std::vector<uint8_t> text(NSSM_LOG_BATCH_BYTES * 2);
+	make_log_text(text.data(), static_cast<uint32_t>(text.size()), 5, 0);
+	log_batch_t* pBatch = new log_batch_t;
+	uint32_t uSeed = 8086;
+
+	for (uint32_t uRound = 0; uRound < 20; uRound++) {
+		batch_output_t output;
+		output.m_uWrites = 0;
+		init_batch(pBatch, write_string, &output);
+		if (uRound & 1) {
+			pBatch->m_pWriteFragments = write_string_fragments;
+		}
+		std::string expected;
+		uint32_t uWritten = 0;
+		int iComplained = 0;
+		uint8_t copy[NSSM_LOG_BATCH_SCRATCH];
+
+		for (uint32_t i = 0; i < 3000; i++) {
+			uint32_t r = bench_random(&uSeed);
+			uint32_t uLength;
+			switch (r % 8) {
+			case 0:
+				uLength = 1 + (r >> 8) % (NSSM_LOG_BATCH_BYTES / 2);
+				break;
+			case 1:
+				uLength = 1 + (r >> 8) % (NSSM_LOG_BATCH_SCRATCH / 4);
+				break;
+			default:
+				uLength = 1 + (r >> 8) % 64;
+				break;
+			}
+			uint32_t uOffset =
+				bench_random(&uSeed) % (text.size() - uLength);
+			const uint8_t* pData = text.data() + uOffset;
+			expected.append(reinterpret_cast<const char*>(pData), uLength);
+			if ((r & 0x80000000U) && (uLength <= sizeof(copy))) {
+				memcpy(copy, pData, uLength);
+				batch_copy(pBatch, copy, uLength, &uWritten, &iComplained);
+				memset(copy, 0, uLength);
+			} else {
+				batch_append(pBatch, pData, uLength, &uWritten, &iComplained);
+			}
+			BENCH_CHECK(pBatch->m_uBytes <= NSSM_LOG_BATCH_BYTES ||
+					pBatch->m_uCount == 1,
+				"batch of %u bytes in %u fragments", pBatch->m_uBytes,
+				pBatch->m_uCount);
+		}
+		flush_batch(pBatch, &uWritten, &iComplained);
+		BENCH_CHECK(output.m_Output == expected,
+			"random fragments came out wrong, round %u", uRound);
+		BENCH_CHECK(uWritten == expected.size(),
+			"random fragments wrote %u bytes of %u, round %u", uWritten,
+			static_cast<uint32_t>(expected.size()), uRound);
+		free_batch(pBatch);
+	}
+
+	/* Too big to copy. */
+	batch_output_t output;
+	init_batch(pBatch, write_string, &output);
+	uint32_t uWritten = 0;
+	int iComplained = 0;
+	BENCH_CHECK(batch_copy(pBatch, text.data(), NSSM_LOG_BATCH_SCRATCH + 1,
+					&uWritten, &iComplained) < 0,
+		"batch_copy of more than the scratch space");
+	BENCH_CHECK(!pBatch->m_uCount, "oversized copy was added");
+	delete pBatch;
+}
+
+/***************************************
+
+	Benchmark
+
+***************************************/
+
+static void bench_batch_proc(void* pParam)
+{
+	batch_param_t* pParams = static_cast<batch_param_t*>(pParam);
+	log_batch_t* pBatch = new log_batch_t;
+	init_batch(pBatch, write_file, pParams);
+#ifndef _WIN32
+	if (pParams->m_bVector) {
+		pBatch->m_pWriteFragments = write_file_fragments;
+	}
+#endif
+	pParams->m_uWrites = 0;
+	pParams->m_hFile = CreateFileW(L"" BENCH_BATCH_FILE, GENERIC_WRITE, 0,
+		NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (pParams->m_hFile == INVALID_HANDLE_VALUE) {
+		bench_fail("couldn't create " BENCH_BATCH_FILE);
+		delete pBatch;
+		return;
+	}
+
+	static const char g_Timestamp[] = "2026-10-16 12:00:00.000: ";
+	const uint8_t* pInput = pParams->m_pInput;
+	uint32_t uLength = pParams->m_uLength;
+	uint32_t uWritten = 0;
+	int iComplained = 0;
+	while (uLength) {
+		const uint8_t* pEnd =
+			static_cast<const uint8_t*>(memchr(pInput, '\n', uLength));
+		uint32_t uLine =
+			pEnd ? static_cast<uint32_t>(pEnd - pInput) + 1 : uLength;
+		if (pParams->m_bBatched) {
+			batch_copy(pBatch, g_Timestamp, sizeof(g_Timestamp) - 1,
+				&uWritten, &iComplained);
+			batch_append(pBatch, pInput, uLine, &uWritten, &iComplained);
+		} else {
+			write_file(pParams, const_cast<char*>(g_Timestamp),
+				sizeof(g_Timestamp) - 1, &uWritten, &iComplained);
+			write_file(pParams, const_cast<uint8_t*>(pInput), uLine,
+				&uWritten, &iComplained);
+		}
+		pInput += uLine;
+		uLength -= uLine;
+	}
+	flush_batch(pBatch, &uWritten, &iComplained);
+	CloseHandle(pParams->m_hFile);
+	free_batch(pBatch);
+	delete pBatch;
+}
+
+void bench_batch(void)
+{
+	check_batch_lines();
+	check_batch_random();
+
+	uint32_t uSize = g_bCheck ? BENCH_CHECK_SIZE : BENCH_TEXT_SIZE;
+	std::vector<uint8_t> text(uSize);
+	uint32_t uLines = make_log_text(text.data(), uSize, 6, 0);
+
+	printf("Writing %u timestamped lines to a file\n", uLines);
+	batch_param_t batch;
+	batch.m_pInput = text.data();
+	batch.m_uLength = uSize;
+	batch.m_bBatched = false;
+	batch.m_bVector = false;
+	bench_time("two writes per line", bench_batch_proc, &batch, uSize);
+	printf("  %-44s %10u\n", "writes", batch.m_uWrites);
+	batch.m_bBatched = true;
+	bench_time("batched", bench_batch_proc, &batch, uSize);
+	printf("  %-44s %10u\n", "writes", batch.m_uWrites);
+#ifndef _WIN32
+	batch.m_bVector = true;
+	bench_time("batched, writev()", bench_batch_proc, &batch, uSize);
+	printf("  %-44s %10u\n", "writes", batch.m_uWrites);
+#endif
+	remove(BENCH_BATCH_FILE);
+}
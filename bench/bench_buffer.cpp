@@ -0,0 +1,343 @@
+/***************************************
+
+	Ring buffer for logged output
+
+	The ring buffer is checked against a plain queue through random puts,
+	reads into the free space, consumes and resizes, with the data
+	wrapping around the end.  The benchmark has a thread write log lines
+	into a pipe, one line per write as a program writing to a console
+	would, then 4 KB per write as a program writing through stdio would,
+	while the logger side copies the pipe to a file.  It does that
+	the way the logger did before the ring buffer, reading up to 1 KB and
+	writing each read out, then through the ring buffer, reading again
+	while the pipe has data and writing out what was gathered.
+
+***************************************/
+
+#include "bench.h"
+#include "constants.h"
+#include "logbuffer.h"
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+#include <deque>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define BENCH_BUFFER_FILE "nssm_bench_buffer.log"
+
+// What the logger read into before the ring buffer
+#define BENCH_BUFFER_DIRECT 1024U
+
+struct buffer_param_t {
+	const uint8_t* m_pInput;
+	uint32_t m_uLength;
+	uint32_t m_uChunk;
+	uint32_t m_uReads;
+	uint32_t m_uWrites;
+	uint32_t m_uLargest;
+	bool m_bRing;
+};
+
+/*
+  The application, writing a line at a time, or uChunk bytes at a time
+  as if through a stdio buffer.
+*/
+static void write_output(HANDLE hPipe, const uint8_t* pInput,
+	uint32_t uLength, uint32_t uChunk)
+{
+	while (uLength) {
+		uint32_t uLine = (uChunk < uLength) ? uChunk : uLength;
+		if (!uChunk) {
+			const uint8_t* pEnd =
+				static_cast<const uint8_t*>(memchr(pInput, '\n', uLength));
+			uLine = pEnd ? static_cast<uint32_t>(pEnd - pInput) + 1 : uLength;
+		}
+		DWORD uWritten;
+		if (!WriteFile(hPipe, pInput, uLine, &uWritten, NULL)) {
+			break;
+		}
+		pInput += uWritten;
+		uLength -= uWritten;
+	}
+	CloseHandle(hPipe);
+}
+
+/* Returns false at the end of the output. */
+static bool read_pipe(HANDLE hPipe, void* pBuffer, uint32_t uLength,
+	uint32_t* pRead, buffer_param_t* pParams)
+{
+	DWORD uRead = 0;
+	pParams->m_uReads++;
+	if (!ReadFile(hPipe, pBuffer, uLength, &uRead, NULL) || !uRead) {
+		return false;
+	}
+	*pRead = uRead;
+	return true;
+}
+
+static void write_out(
+	HANDLE hFile, const void* pData, uint32_t uLength, buffer_param_t* pParams)
+{
+	DWORD uWritten;
+	pParams->m_uWrites++;
+	if (uLength > pParams->m_uLargest) {
+		pParams->m_uLargest = uLength;
+	}
+	if (!WriteFile(hFile, pData, uLength, &uWritten, NULL) ||
+		(uWritten != uLength)) {
+		bench_fail("short write to " BENCH_BUFFER_FILE);
+	}
+}
+
+/* Read and write once per read, as log_and_rotate() used to. */
+static void copy_direct(HANDLE hPipe, HANDLE hFile, buffer_param_t* pParams)
+{
+	uint8_t buffer[BENCH_BUFFER_DIRECT];
+	uint32_t uRead;
+	while (read_pipe(hPipe, buffer, sizeof(buffer), &uRead, pParams)) {
+		write_out(hFile, buffer, uRead, pParams);
+	}
+}
+
+/*
+  Read into the ring buffer, reading again while the pipe has more, then
+  write out what was gathered, as the I/O thread does.
+*/
+static void copy_ring(HANDLE hPipe, HANDLE hFile, buffer_param_t* pParams)
+{
+	log_buffer_t buffer;
+	memset(&buffer, 0, sizeof(buffer));
+	if (log_buffer_init(&buffer, NSSM_LOG_BUFFER_MIN, NSSM_LOG_BUFFER_MAX)) {
+		bench_fail("log_buffer_init");
+		return;
+	}
+
+	bool bOpen = true;
+	while (bOpen) {
+		do {
+			void* address;
+			uint32_t uFree = log_buffer_free_span(&buffer, &address);
+			if (!uFree) {
+				break;
+			}
+			uint32_t uRead;
+			bOpen = read_pipe(hPipe, address, uFree, &uRead, pParams);
+			if (!bOpen) {
+				break;
+			}
+			log_buffer_commit(&buffer, uRead);
+
+			DWORD uAvailable = 0;
+			if (!PeekNamedPipe(hPipe, NULL, 0, NULL, &uAvailable, NULL)) {
+				uAvailable = 0;
+			}
+			if (!uAvailable) {
+				break;
+			}
+		} while (true);
+
+		uint32_t uDrained = 0;
+		while (buffer.m_uUsed) {
+			void* address;
+			uint32_t uSpan = log_buffer_used_span(&buffer, &address);
+			write_out(hFile, address, uSpan, pParams);
+			log_buffer_consume(&buffer, uSpan);
+			uDrained += uSpan;
+		}
+		log_buffer_adapt(&buffer, uDrained);
+	}
+	log_buffer_free(&buffer);
+}
+
+/***************************************
+
+	Checks
+
+***************************************/
+
+static void check_buffer(void)
+{
+	uint32_t uSeed = 1979;
+	log_buffer_t buffer;
+	memset(&buffer, 0, sizeof(buffer));
+	if (log_buffer_init(&buffer, 64, 4096)) {
+		bench_fail("log_buffer_init");
+		return;
+	}
+	std::deque<uint8_t> expected;
+	uint8_t uNext = 0;
+
+	for (uint32_t uRound = 0; uRound < 200000; uRound++) {
+		uint32_t r = bench_random(&uSeed);
+		switch (r % 6) {
+		case 0:
+		case 1: {
+			/* A read into the free space, as much as fits in one go. */
+			void* address;
+			uint32_t uFree = log_buffer_free_span(&buffer, &address);
+			uint32_t uLength = uFree ? (r >> 8) % (uFree + 1) : 0;
+			uint8_t* pOutput = static_cast<uint8_t*>(address);
+			for (uint32_t i = 0; i < uLength; i++) {
+				pOutput[i] = uNext;
+				expected.push_back(uNext++);
+			}
+			log_buffer_commit(&buffer, uLength);
+			break;
+		}
+		case 2: {
+			uint8_t data[300];
+			uint32_t uLength = (r >> 8) % sizeof(data);
+			for (uint32_t i = 0; i < uLength; i++) {
+				data[i] = static_cast<uint8_t>(uNext + i);
+			}
+			if (!log_buffer_put(&buffer, data, uLength)) {
+				for (uint32_t i = 0; i < uLength; i++) {
+					expected.push_back(uNext++);
+				}
+			} else {
+				BENCH_CHECK(buffer.m_uSize - buffer.m_uUsed < uLength,
+					"log_buffer_put of %u bytes failed with %u free",
+					uLength, buffer.m_uSize - buffer.m_uUsed);
+			}
+			break;
+		}
+		case 3: {
+			void* address;
+			uint32_t uSpan = log_buffer_used_span(&buffer, &address);
+			uint32_t uLength = uSpan ? 1 + (r >> 8) % uSpan : 0;
+			const uint8_t* pInput = static_cast<const uint8_t*>(address);
+			bool bSame = true;
+			for (uint32_t i = 0; i < uLength; i++) {
+				bSame &= (pInput[i] == expected.front());
+				expected.pop_front();
+			}
+			BENCH_CHECK(bSame, "used span of %u bytes, round %u", uLength,
+				uRound);
+			log_buffer_consume(&buffer, uLength);
+			break;
+		}
+		case 4: {
+			uint8_t peek[200];
+			uint32_t uLength = log_buffer_peek(
+				&buffer, peek, (r >> 8) % sizeof(peek));
+			bool bSame = uLength <= expected.size();
+			for (uint32_t i = 0; bSame && (i < uLength); i++) {
+				bSame = (peek[i] == expected[i]);
+			}
+			BENCH_CHECK(bSame, "peek of %u bytes, round %u", uLength, uRound);
+			break;
+		}
+		default:
+			log_buffer_adapt(&buffer, (r >> 8) % (buffer.m_uSize + 1));
+			break;
+		}
+		BENCH_CHECK(buffer.m_uUsed == expected.size(),
+			"%u bytes used, expected %u, round %u", buffer.m_uUsed,
+			static_cast<uint32_t>(expected.size()), uRound);
+		BENCH_CHECK((buffer.m_uSize >= buffer.m_uMin) &&
+				(buffer.m_uSize <= buffer.m_uMax),
+			"size %u out of range, round %u", buffer.m_uSize, uRound);
+		if (buffer.m_uUsed != expected.size()) {
+			break;
+		}
+	}
+	log_buffer_free(&buffer);
+}
+
+/***************************************
+
+	Benchmark
+
+***************************************/
+
+static void bench_buffer_proc(void* pParam)
+{
+	buffer_param_t* pParams = static_cast<buffer_param_t*>(pParam);
+	pParams->m_uReads = 0;
+	pParams->m_uWrites = 0;
+	pParams->m_uLargest = 0;
+	HANDLE hRead;
+	HANDLE hWrite;
+	if (!CreatePipe(&hRead, &hWrite, NULL, NSSM_LOG_BUFFER_MIN)) {
+		bench_fail("CreatePipe");
+		return;
+	}
+	HANDLE hFile = CreateFileW(L"" BENCH_BUFFER_FILE, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		bench_fail("couldn't create " BENCH_BUFFER_FILE);
+		CloseHandle(hRead);
+		CloseHandle(hWrite);
+		return;
+	}
+
+	std::thread application(write_output, hWrite, pParams->m_pInput,
+		pParams->m_uLength, pParams->m_uChunk);
+	if (pParams->m_bRing) {
+		copy_ring(hRead, hFile, pParams);
+	} else {
+		copy_direct(hRead, hFile, pParams);
+	}
+	application.join();
+	CloseHandle(hRead);
+	CloseHandle(hFile);
+}
+
+static void check_buffer_file(const buffer_param_t* pParams)
+{
+	HANDLE hFile = CreateFileW(L"" BENCH_BUFFER_FILE, GENERIC_READ, 0, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		bench_fail("couldn't open " BENCH_BUFFER_FILE);
+		return;
+	}
+	std::vector<uint8_t> contents(pParams->m_uLength + 1);
+	DWORD uRead = 0;
+	uint32_t uTotal = 0;
+	while (ReadFile(hFile, contents.data() + uTotal,
+			   static_cast<DWORD>(contents.size()) - uTotal, &uRead, NULL) &&
+		uRead) {
+		uTotal += uRead;
+	}
+	CloseHandle(hFile);
+	BENCH_CHECK((uTotal == pParams->m_uLength) &&
+			!memcmp(contents.data(), pParams->m_pInput, uTotal),
+		"%s copy of %u bytes came out wrong",
+		pParams->m_bRing ? "ring buffer" : "direct", pParams->m_uLength);
+}
+
+void bench_buffer(void)
+{
+	check_buffer();
+
+	uint32_t uSize = g_bCheck ? BENCH_CHECK_SIZE : BENCH_TEXT_SIZE;
+	std::vector<uint8_t> text(uSize);
+	uint32_t uLines = make_log_text(text.data(), uSize, 4, 0);
+
+	buffer_param_t buffer;
+	buffer.m_pInput = text.data();
+	buffer.m_uLength = uSize;
+	static const char* g_Names[] = {"1 KB buffer, one write per read",
+		"ring buffer"};
+	for (uint32_t c = 0; c < 2; c++) {
+		buffer.m_uChunk = c ? 4096 : 0;
+		printf("Copying %u lines from a pipe to a file, %s per write\n",
+			uLines, c ? "4096 bytes" : "one line");
+		for (uint32_t i = 0; i < 2; i++) {
+			buffer.m_bRing = (i == 1);
+			bench_time(g_Names[i], bench_buffer_proc, &buffer, uSize);
+			check_buffer_file(&buffer);
+			printf("  %-44s %10u\n", "reads", buffer.m_uReads);
+			printf("  %-44s %10u\n", "writes", buffer.m_uWrites);
+			printf("  %-44s %10u\n", "largest write", buffer.m_uLargest);
+		}
+	}
+	remove(BENCH_BUFFER_FILE);
+}
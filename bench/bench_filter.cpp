@@ -0,0 +1,225 @@
+/***************************************
+
+	Filter automaton
+
+	Lines are checked against a naive search for each pattern in turn,
+	which is also what the automaton is timed against.  Only 8 bit text is
+	tested, as UTF-16 patterns are taken straight from wchar_t strings
+	and wchar_t isn't UTF-16 everywhere.
+
+***************************************/
+
+#include "bench.h"
+#include "filter.h"
+#include "logtext.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct pattern_list_t {
+	// Double null terminated list for compile_filter()
+	std::vector<wchar_t> m_List;
+	// The same patterns as bytes
+	std::vector<std::string> m_Patterns;
+};
+
+struct filter_param_t {
+	const log_filter_t* m_pFilter;
+	const pattern_list_t* m_pInclude;
+	const pattern_list_t* m_pExclude;
+	const uint8_t* m_pInput;
+	uint32_t m_uLength;
+	uint64_t m_uKept;
+};
+
+static void add_pattern(pattern_list_t* pList, const std::string& pattern)
+{
+	if (pList->m_List.empty()) {
+		pList->m_List.push_back(0);
+	}
+	pList->m_List.pop_back();
+	for (size_t i = 0; i < pattern.size(); i++) {
+		pList->m_List.push_back(static_cast<unsigned char>(pattern[i]));
+	}
+	pList->m_List.push_back(0);
+	pList->m_List.push_back(0);
+	pList->m_Patterns.push_back(pattern);
+}
+
+static const wchar_t* pattern_list(const pattern_list_t* pList)
+{
+	return pList->m_List.empty() ? NULL : pList->m_List.data();
+}
+
+static bool contains_any(const uint8_t* pLine, uint32_t uLength,
+	const pattern_list_t* pList)
+{
+	for (size_t i = 0; i < pList->m_Patterns.size(); i++) {
+		const std::string& pattern = pList->m_Patterns[i];
+		if (pattern.size() > uLength) {
+			continue;
+		}
+		for (uint32_t j = 0; j + pattern.size() <= uLength; j++) {
+			if ((pLine[j] == static_cast<uint8_t>(pattern[0])) &&
+				!memcmp(pLine + j, pattern.data(), pattern.size())) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* What the filter should decide for a line. */
+static bool naive_keeps(const uint8_t* pLine, uint32_t uLength,
+	const pattern_list_t* pInclude, const pattern_list_t* pExclude)
+{
+	if (contains_any(pLine, uLength, pExclude)) {
+		return false;
+	}
+	return pInclude->m_Patterns.empty() ||
+		contains_any(pLine, uLength, pInclude);
+}
+
+static bool automaton_keeps(
+	const log_filter_t* pFilter, const uint8_t* pLine, uint32_t uLength)
+{
+	uint32_t uMatched = 0;
+	scan_filter(pFilter, 0, pLine, uLength, &uMatched);
+	return filter_keeps(pFilter, uMatched);
+}
+
+static void check_filter(void)
+{
+	uint32_t uSeed = 31337;
+	for (uint32_t uRound = 0; uRound < 3000; uRound++) {
+		/* A small alphabet makes for overlapping patterns. */
+		pattern_list_t include;
+		pattern_list_t exclude;
+		uint32_t uPatterns = 1 + bench_random(&uSeed) % 6;
+		for (uint32_t i = 0; i < uPatterns; i++) {
+			std::string pattern;
+			uint32_t uLength = 1 + bench_random(&uSeed) % 4;
+			for (uint32_t j = 0; j < uLength; j++) {
+				pattern.push_back(
+					static_cast<char>('a' + bench_random(&uSeed) % 3));
+			}
+			add_pattern((bench_random(&uSeed) & 1) ? &include : &exclude,
+				pattern);
+		}
+
+		log_filter_t* pFilter = compile_filter(
+			pattern_list(&include), pattern_list(&exclude), sizeof(char));
+		if (!pFilter) {
+			bench_fail("compile_filter, round %u", uRound);
+			continue;
+		}
+		for (uint32_t uLine = 0; uLine < 20; uLine++) {
+			uint8_t line[40];
+			uint32_t uLength = bench_random(&uSeed) % sizeof(line);
+			for (uint32_t i = 0; i < uLength; i++) {
+				line[i] = static_cast<uint8_t>('a' + bench_random(&uSeed) % 4);
+			}
+			bool bExpected = naive_keeps(line, uLength, &include, &exclude);
+			BENCH_CHECK(automaton_keeps(pFilter, line, uLength) == bExpected,
+				"filter, round %u line %u", uRound, uLine);
+
+			/* Carrying the state across a split gives the same answer. */
+			uint32_t uSplit = uLength ? bench_random(&uSeed) % uLength : 0;
+			uint32_t uMatched = 0;
+			uint32_t uState = scan_filter(pFilter, 0, line, uSplit, &uMatched);
+			scan_filter(
+				pFilter, uState, line + uSplit, uLength - uSplit, &uMatched);
+			BENCH_CHECK(filter_keeps(pFilter, uMatched) == bExpected,
+				"filter split at %u, round %u line %u", uSplit, uRound, uLine);
+		}
+		free_filter(pFilter);
+	}
+}
+
+static void bench_filter_proc(void* pParam)
+{
+	filter_param_t* pFilter = static_cast<filter_param_t*>(pParam);
+	const uint8_t* pInput = pFilter->m_pInput;
+	uint32_t uLength = pFilter->m_uLength;
+	uint64_t uKept = 0;
+	while (uLength) {
+		uint32_t uLine = find_newline(pInput, uLength, sizeof(char));
+		if (!uLine) {
+			uLine = uLength;
+		}
+		if (pFilter->m_pFilter) {
+			uKept += automaton_keeps(pFilter->m_pFilter, pInput, uLine);
+		} else {
+			uKept += naive_keeps(
+				pInput, uLine, pFilter->m_pInclude, pFilter->m_pExclude);
+		}
+		pInput += uLine;
+		uLength -= uLine;
+	}
+	pFilter->m_uKept = uKept;
+}
+
+void bench_filter(void)
+{
+	check_filter();
+
+	static const char* g_Patterns[] = {"ERROR", "timeout", "/health",
+		"session closed", "retry", "WARN", "denied", "404", "stack trace",
+		"OutOfMemory", "deadlock", "panic", "refused", "reset by peer",
+		"segfault", "assert", "FATAL", "disk full", "throttled", "corrupt",
+		"GET /metrics", "heartbeat", "unreachable", "expired", "invalid",
+		"overflow", "rollback", "abort", "killed", "lost", "stale", "quota"};
+	uint32_t uSize = g_bCheck ? BENCH_CHECK_SIZE : BENCH_TEXT_SIZE;
+	std::vector<uint8_t> text(uSize);
+	make_log_text(text.data(), uSize, 3, 0);
+
+	/* Past the named ones, patterns are error codes like "E1184:". */
+	static const uint32_t g_Counts[] = {1, 8, 32, 128};
+	for (uint32_t c = 0; c < sizeof(g_Counts) / sizeof(g_Counts[0]); c++) {
+		pattern_list_t include;
+		pattern_list_t exclude;
+		for (uint32_t i = 0; i < g_Counts[c]; i++) {
+			char code[16];
+			const char* pPattern = code;
+			if (i < sizeof(g_Patterns) / sizeof(g_Patterns[0])) {
+				pPattern = g_Patterns[i];
+			} else {
+				snprintf(code, sizeof(code), "E%04u:", i * 37);
+			}
+			add_pattern((i & 1) ? &include : &exclude, pPattern);
+		}
+		/* One include which matches, so lines go through both checks. */
+		add_pattern(&include, "request");
+
+		filter_param_t filter;
+		filter.m_pInclude = &include;
+		filter.m_pExclude = &exclude;
+		filter.m_pInput = text.data();
+		filter.m_uLength = uSize;
+		filter.m_pFilter = compile_filter(
+			pattern_list(&include), pattern_list(&exclude), sizeof(char));
+		if (!filter.m_pFilter) {
+			bench_fail("compile_filter with %u patterns", g_Counts[c] + 1);
+			continue;
+		}
+		const log_filter_t* pFilter = filter.m_pFilter;
+
+		printf("Filtering with %u patterns, %u states\n", g_Counts[c] + 1,
+			pFilter->m_uStates);
+		char name[64];
+		filter.m_pFilter = NULL;
+		snprintf(name, sizeof(name), "naive search");
+		bench_time(name, bench_filter_proc, &filter, uSize);
+		uint64_t uExpected = filter.m_uKept;
+		filter.m_pFilter = pFilter;
+		snprintf(name, sizeof(name), "automaton");
+		bench_time(name, bench_filter_proc, &filter, uSize);
+		BENCH_CHECK(filter.m_uKept == uExpected,
+			"%u patterns kept %llu lines, expected %llu", g_Counts[c] + 1,
+			static_cast<unsigned long long>(filter.m_uKept),
+			static_cast<unsigned long long>(uExpected));
+		free_filter(const_cast<log_filter_t*>(pFilter));
+	}
+}
@@ -0,0 +1,302 @@
+/***************************************
+
+	Flush policies for log files
+
+	Log text is written to a file 4 KB at a time, as the I/O thread writes
+	what it gathered from the pipe, and flushed to disk by each of the
+	AppStdoutFlush policies the way check_flush() decides: never, a while
+	after the first unflushed write, once enough bytes are unflushed, and
+	after every write.  Flushing after every write is timed twice, with
+	FlushFileBuffers() called in line after each write, which is the plain
+	per-batch flush, and with group commit as the logger does it, handing
+	the flush to a worker thread and covering whatever was written while
+	it ran with the next flush.  The checks make sure the file comes
+	out right and that every byte was covered by a flush by the end.
+
+***************************************/
+
+#include "bench.h"
+#include "constants.h"
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define BENCH_FLUSH_FILE "nssm_bench_flush.log"
+
+// Bytes per write, what the I/O thread writes out of a full buffer
+#define BENCH_FLUSH_BATCH 4096U
+
+/*
+  Milliseconds for the interval policy.  The default of
+  NSSM_LOG_FLUSH_MILLISECONDS is longer than a run takes.
+*/
+#define BENCH_FLUSH_INTERVAL 10U
+
+struct flush_param_t {
+	const uint8_t* m_pInput;
+	uint32_t m_uLength;
+	uint32_t m_uPolicy;
+	uint32_t m_uAfter;
+	uint32_t m_uWrites;
+	uint32_t m_uFlushes;
+	uint64_t m_uFlushedBytes;
+	bool m_bBackground;
+};
+
+/* The background worker and the one flush it may have in flight. */
+struct flush_worker_t {
+	std::mutex m_Lock;
+	std::condition_variable m_Wake;
+	HANDLE m_hFile;
+	uint32_t m_uFlushes;
+	bool m_bFlushing;
+	bool m_bQuit;
+};
+
+static void run_flush_worker(flush_worker_t* pWorker)
+{
+	std::unique_lock<std::mutex> lock(pWorker->m_Lock);
+	for (;;) {
+		while (!pWorker->m_bFlushing && !pWorker->m_bQuit) {
+			pWorker->m_Wake.wait(lock);
+		}
+		if (!pWorker->m_bFlushing) {
+			return;
+		}
+		lock.unlock();
+		if (!FlushFileBuffers(pWorker->m_hFile)) {
+			bench_fail("FlushFileBuffers, error %u", GetLastError());
+		}
+		lock.lock();
+		pWorker->m_uFlushes++;
+		pWorker->m_bFlushing = false;
+		pWorker->m_Wake.notify_all();
+	}
+}
+
+static bool flush_in_flight(flush_worker_t* pWorker)
+{
+	std::lock_guard<std::mutex> lock(pWorker->m_Lock);
+	return pWorker->m_bFlushing;
+}
+
+/* Wait for the flush in flight, if there is one. */
+static void wait_for_flush(flush_worker_t* pWorker)
+{
+	std::unique_lock<std::mutex> lock(pWorker->m_Lock);
+	while (pWorker->m_bFlushing) {
+		pWorker->m_Wake.wait(lock);
+	}
+}
+
+/* As start_flush(), the bytes written so far are covered by this flush. */
+static void start_flush(flush_param_t* pParams, HANDLE hFile,
+	flush_worker_t* pWorker, uint32_t* pDirty)
+{
+	pParams->m_uFlushedBytes += *pDirty;
+	*pDirty = 0;
+	if (pWorker) {
+		std::lock_guard<std::mutex> lock(pWorker->m_Lock);
+		pWorker->m_bFlushing = true;
+		pWorker->m_Wake.notify_all();
+		return;
+	}
+	if (!FlushFileBuffers(hFile)) {
+		bench_fail("FlushFileBuffers, error %u", GetLastError());
+	}
+	pParams->m_uFlushes++;
+}
+
+static void bench_flush_proc(void* pParam)
+{
+	typedef std::chrono::steady_clock clock_type;
+	flush_param_t* pParams = static_cast<flush_param_t*>(pParam);
+	pParams->m_uWrites = 0;
+	pParams->m_uFlushes = 0;
+	pParams->m_uFlushedBytes = 0;
+	HANDLE hFile = CreateFileW(L"" BENCH_FLUSH_FILE, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		bench_fail("couldn't create " BENCH_FLUSH_FILE);
+		return;
+	}
+
+	flush_worker_t worker;
+	worker.m_hFile = hFile;
+	worker.m_uFlushes = 0;
+	worker.m_bFlushing = false;
+	worker.m_bQuit = false;
+	std::thread thread;
+	flush_worker_t* pWorker = NULL;
+	if (pParams->m_bBackground) {
+		thread = std::thread(run_flush_worker, &worker);
+		pWorker = &worker;
+	}
+
+	const uint8_t* pInput = pParams->m_pInput;
+	uint32_t uLength = pParams->m_uLength;
+	uint32_t uDirty = 0;
+	bool bTimed = false;
+	clock_type::time_point due;
+	while (uLength) {
+		uint32_t uBatch =
+			(uLength < BENCH_FLUSH_BATCH) ? uLength : BENCH_FLUSH_BATCH;
+		DWORD uWritten;
+		if (!WriteFile(hFile, pInput, uBatch, &uWritten, NULL)) {
+			bench_fail("WriteFile, error %u", GetLastError());
+			break;
+		}
+		pParams->m_uWrites++;
+		pInput += uBatch;
+		uLength -= uBatch;
+		uDirty += uBatch;
+
+		/* As check_flush(), nothing is started while a flush is running. */
+		if (pWorker && flush_in_flight(pWorker)) {
+			continue;
+		}
+		switch (pParams->m_uPolicy) {
+		case NSSM_LOG_FLUSH_INTERVAL:
+			/* The I/O thread's timer, checked between writes. */
+			if (!bTimed) {
+				due = clock_type::now() +
+					std::chrono::milliseconds(pParams->m_uAfter);
+				bTimed = true;
+			} else if (clock_type::now() >= due) {
+				start_flush(pParams, hFile, pWorker, &uDirty);
+				bTimed = false;
+			}
+			break;
+
+		case NSSM_LOG_FLUSH_BYTES:
+			if (uDirty >= pParams->m_uAfter) {
+				start_flush(pParams, hFile, pWorker, &uDirty);
+			}
+			break;
+
+		case NSSM_LOG_FLUSH_LINE:
+			start_flush(pParams, hFile, pWorker, &uDirty);
+			break;
+		}
+	}
+
+	/* Flush whatever is left, as check_flush() does when finishing. */
+	if (pWorker) {
+		wait_for_flush(pWorker);
+	}
+	if (uDirty && (pParams->m_uPolicy != NSSM_LOG_FLUSH_NEVER)) {
+		start_flush(pParams, hFile, pWorker, &uDirty);
+		if (pWorker) {
+			wait_for_flush(pWorker);
+		}
+	}
+	if (pWorker) {
+		{
+			std::lock_guard<std::mutex> lock(worker.m_Lock);
+			worker.m_bQuit = true;
+			worker.m_Wake.notify_all();
+		}
+		thread.join();
+		pParams->m_uFlushes = worker.m_uFlushes;
+	}
+	CloseHandle(hFile);
+}
+
+/***************************************
+
+	Checks
+
+***************************************/
+
+static void check_flush(flush_param_t* pParams, const char* pName)
+{
+	BENCH_CHECK(pParams->m_uWrites ==
+			(pParams->m_uLength + BENCH_FLUSH_BATCH - 1) / BENCH_FLUSH_BATCH,
+		"%s made %u writes for %u bytes", pName, pParams->m_uWrites,
+		pParams->m_uLength);
+	if (pParams->m_uPolicy == NSSM_LOG_FLUSH_NEVER) {
+		BENCH_CHECK(!pParams->m_uFlushes && !pParams->m_uFlushedBytes,
+			"%s flushed %u times", pName, pParams->m_uFlushes);
+	} else {
+		BENCH_CHECK(pParams->m_uFlushedBytes == pParams->m_uLength,
+			"%s flushed %llu of %u bytes", pName,
+			static_cast<unsigned long long>(pParams->m_uFlushedBytes),
+			pParams->m_uLength);
+		BENCH_CHECK(pParams->m_uFlushes &&
+				(pParams->m_uFlushes <= pParams->m_uWrites),
+			"%s made %u flushes for %u writes", pName, pParams->m_uFlushes,
+			pParams->m_uWrites);
+	}
+	if ((pParams->m_uPolicy == NSSM_LOG_FLUSH_LINE) &&
+		!pParams->m_bBackground) {
+		BENCH_CHECK(pParams->m_uFlushes == pParams->m_uWrites,
+			"%s made %u flushes for %u writes", pName, pParams->m_uFlushes,
+			pParams->m_uWrites);
+	}
+
+	FILE* fp = fopen(BENCH_FLUSH_FILE, "rb");
+	std::vector<uint8_t> contents(pParams->m_uLength + 1);
+	size_t uRead = fp ? fread(contents.data(), 1, contents.size(), fp) : 0;
+	if (fp) {
+		fclose(fp);
+	}
+	BENCH_CHECK((uRead == pParams->m_uLength) &&
+			!memcmp(contents.data(), pParams->m_pInput, uRead),
+		"%s wrote %u bytes out of %u", pName, static_cast<uint32_t>(uRead),
+		pParams->m_uLength);
+}
+
+/***************************************
+
+	Benchmark
+
+***************************************/
+
+void bench_flush(void)
+{
+	struct policy_t {
+		const char* m_pName;
+		uint32_t m_uPolicy;
+		uint32_t m_uAfter;
+		bool m_bBackground;
+	};
+	static const policy_t g_Policies[] = {
+		{"never", NSSM_LOG_FLUSH_NEVER, 0, false},
+		{"interval, group commit", NSSM_LOG_FLUSH_INTERVAL,
+			BENCH_FLUSH_INTERVAL, true},
+		{"bytes, group commit", NSSM_LOG_FLUSH_BYTES,
+			NSSM_LOG_FLUSH_BYTE_COUNT, true},
+		{"every write, in line", NSSM_LOG_FLUSH_LINE, 0, false},
+		{"every write, group commit", NSSM_LOG_FLUSH_LINE, 0, true}};
+
+	uint32_t uSize = g_bCheck ? BENCH_CHECK_SIZE : BENCH_TEXT_SIZE;
+	std::vector<uint8_t> text(uSize);
+	make_log_text(text.data(), uSize, 9, 0);
+
+	printf("Writing %u bytes to a file %u bytes at a time and flushing\n",
+		uSize, BENCH_FLUSH_BATCH);
+	for (uint32_t i = 0; i < sizeof(g_Policies) / sizeof(g_Policies[0]);
+		 i++) {
+		flush_param_t flush;
+		flush.m_pInput = text.data();
+		flush.m_uLength = uSize;
+		flush.m_uPolicy = g_Policies[i].m_uPolicy;
+		flush.m_uAfter = g_Policies[i].m_uAfter;
+		flush.m_bBackground = g_Policies[i].m_bBackground;
+		bench_time(g_Policies[i].m_pName, bench_flush_proc, &flush, uSize);
+		printf("  %-44s %10u\n", "flushes", flush.m_uFlushes);
+		check_flush(&flush, g_Policies[i].m_pName);
+	}
+	remove(BENCH_FLUSH_FILE);
+}
@@ -0,0 +1,197 @@
+/***************************************
+
+	Log file compression
+
+	gzip_file() is timed at each level on generated log output.  When
+	zlib is around the results are inflated again and compared with the
+	input, and zlib's own gzip writer is timed at the same levels.
+
+***************************************/
+
+#include "bench.h"
+#include "compress.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#if defined(NSSM_BENCH_ZLIB)
+#include <zlib.h>
+#endif
+
+#define BENCH_GZIP_SOURCE "nssm_bench.log"
+#define BENCH_GZIP_DEST "nssm_bench.log.gz"
+
+struct gzip_param_t {
+	uint32_t m_uLevel;
+	uint64_t m_uInputSize;
+	uint64_t m_uOutputSize;
+	int m_iResult;
+};
+
+static bool write_source(const uint8_t* pData, uint32_t uLength)
+{
+	FILE* fp = fopen(BENCH_GZIP_SOURCE, "wb");
+	if (!fp) {
+		return false;
+	}
+	bool bWritten = fwrite(pData, 1, uLength, fp) == uLength;
+	return !fclose(fp) && bWritten;
+}
+
+static void bench_gzip_proc(void* pParam)
+{
+	gzip_param_t* pGzip = static_cast<gzip_param_t*>(pParam);
+	remove(BENCH_GZIP_DEST);
+	pGzip->m_iResult = gzip_file(L"" BENCH_GZIP_SOURCE, L"" BENCH_GZIP_DEST,
+		pGzip->m_uLevel, &pGzip->m_uInputSize, &pGzip->m_uOutputSize);
+}
+
+#if defined(NSSM_BENCH_ZLIB)
+
+/* Inflate the output and compare it with what went in. */
+static bool verify_gzip(const uint8_t* pData, uint32_t uLength)
+{
+	gzFile pFile = gzopen(BENCH_GZIP_DEST, "rb");
+	if (!pFile) {
+		return false;
+	}
+	std::vector<uint8_t> output(uLength + 1);
+	int iRead = gzread(pFile, output.data(), uLength + 1);
+	gzclose(pFile);
+	return (iRead == static_cast<int>(uLength)) &&
+		!memcmp(output.data(), pData, uLength);
+}
+
+static void bench_zlib_proc(void* pParam)
+{
+	gzip_param_t* pGzip = static_cast<gzip_param_t*>(pParam);
+	FILE* fp = fopen(BENCH_GZIP_SOURCE, "rb");
+	char mode[8];
+	snprintf(mode, sizeof(mode), "wb%u", pGzip->m_uLevel);
+	gzFile pFile = gzopen(BENCH_GZIP_DEST, mode);
+	pGzip->m_iResult = 1;
+	if (fp && pFile) {
+		char buffer[65536];
+		size_t uRead;
+		pGzip->m_iResult = 0;
+		while ((uRead = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+			if (gzwrite(pFile, buffer, static_cast<unsigned>(uRead)) <= 0) {
+				pGzip->m_iResult = 5;
+				break;
+			}
+		}
+	}
+	if (pFile) {
+		gzclose(pFile);
+	}
+	if (fp) {
+		fclose(fp);
+	}
+}
+#endif
+
+static void check_gzip(void)
+{
+	uint32_t uSeed = 2718;
+	std::vector<uint8_t> data(300000);
+	for (uint32_t uCase = 0; uCase < 6; uCase++) {
+		uint32_t uLength;
+		switch (uCase) {
+		case 0:
+			uLength = 0;
+			break;
+		case 1:
+			uLength = 1;
+			data[0] = 'x';
+			break;
+		case 2:
+			/* Random bytes don't compress, so go in stored blocks. */
+			uLength = 100000;
+			for (uint32_t i = 0; i < uLength; i++) {
+				data[i] = static_cast<uint8_t>(bench_random(&uSeed));
+			}
+			break;
+		case 3:
+			/* Long runs make for the longest matches. */
+			uLength = 200000;
+			memset(data.data(), 'z', uLength);
+			break;
+		default:
+			uLength = static_cast<uint32_t>(data.size());
+			make_log_text(data.data(), uLength, uCase,
+				(uCase == 5) ? BENCH_TEXT_ESCAPES | BENCH_TEXT_UTF8 : 0);
+			break;
+		}
+		if (!write_source(data.data(), uLength)) {
+			bench_fail("couldn't write " BENCH_GZIP_SOURCE);
+			return;
+		}
+
+		for (uint32_t uLevel = NSSM_COMPRESS_LEVEL_MIN;
+			 uLevel <= NSSM_COMPRESS_LEVEL_MAX; uLevel += 4) {
+			gzip_param_t gzip;
+			gzip.m_uLevel = uLevel;
+			bench_gzip_proc(&gzip);
+			BENCH_CHECK(!gzip.m_iResult && (gzip.m_uInputSize == uLength),
+				"gzip_file case %u level %u returned %d", uCase, uLevel,
+				gzip.m_iResult);
+#if defined(NSSM_BENCH_ZLIB)
+			BENCH_CHECK(verify_gzip(data.data(), uLength),
+				"gzip_file case %u level %u doesn't inflate to its input",
+				uCase, uLevel);
+#endif
+		}
+	}
+
+	/* An existing destination is left alone. */
+	gzip_param_t gzip;
+	BENCH_CHECK(gzip_file(L"" BENCH_GZIP_SOURCE, L"" BENCH_GZIP_DEST, 6,
+					&gzip.m_uInputSize, &gzip.m_uOutputSize) == 2,
+		"gzip_file over an existing file");
+}
+
+void bench_gzip(void)
+{
+	check_gzip();
+
+	uint32_t uSize = g_bCheck ? BENCH_CHECK_SIZE * 4 : BENCH_TEXT_SIZE * 2;
+	std::vector<uint8_t> text(uSize);
+	make_log_text(text.data(), uSize, 4, BENCH_TEXT_ESCAPES);
+	if (!write_source(text.data(), uSize)) {
+		bench_fail("couldn't write " BENCH_GZIP_SOURCE);
+		return;
+	}
+
+	printf("Compression, %u bytes\n", uSize);
+	static const uint32_t g_Levels[] = {1, 6, 9};
+	for (uint32_t i = 0; i < 3; i++) {
+		gzip_param_t gzip;
+		gzip.m_uLevel = g_Levels[i];
+		char name[64];
+#if defined(NSSM_BENCH_ZLIB)
+		snprintf(name, sizeof(name), "zlib level %u", g_Levels[i]);
+		bench_time(name, bench_zlib_proc, &gzip, uSize);
+		FILE* fp = fopen(BENCH_GZIP_DEST, "rb");
+		long lSize = 0;
+		if (fp) {
+			fseek(fp, 0, SEEK_END);
+			lSize = ftell(fp);
+			fclose(fp);
+		}
+		printf("  %-44s %10.2f%%\n", "size", 100.0 * lSize / uSize);
+#endif
+		snprintf(name, sizeof(name), "gzip_file level %u", g_Levels[i]);
+		bench_time(name, bench_gzip_proc, &gzip, uSize);
+		BENCH_CHECK(!gzip.m_iResult, "gzip_file level %u returned %d",
+			g_Levels[i], gzip.m_iResult);
+		printf("  %-44s %10.2f%%\n", "size",
+			100.0 * static_cast<double>(gzip.m_uOutputSize) / uSize);
+#if defined(NSSM_BENCH_ZLIB)
+		BENCH_CHECK(verify_gzip(text.data(), uSize),
+			"gzip_file level %u doesn't inflate to its input", g_Levels[i]);
+#endif
+	}
+	remove(BENCH_GZIP_SOURCE);
+	remove(BENCH_GZIP_DEST);
+}
@@ -0,0 +1,427 @@
+/***************************************
+
+	Log line prefixes and JSON records
+
+	The same output is written a line at a time with a timestamp prefix
+	and as JSON records, in 8 bit and UTF-16, through the code in
+	logline.cpp and a batch, taking the time for every line as the logger
+	does.  Each line written must read back as the line which went in,
+	with a well formed timestamp which never goes backwards, and the
+	cached timestamp must match one formatted from scratch whatever
+	changed since the last update.  The benchmark times the full line
+	format in each mode over the same input and counts the bytes it makes.
+
+***************************************/
+
+#include "bench.h"
+#include "logline.h"
+#include "memorymanager.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// What the records say about where the output came from
+#define BENCH_LINE_STREAM "stdout"
+#define BENCH_LINE_PID 1234U
+
+struct line_param_t {
+	const uint8_t* m_pInput;
+	uint32_t m_uLength;
+	uint32_t m_uCharsize;
+	std::string* m_pOutput;
+	uint64_t m_uOutput;
+	bool m_bJson;
+};
+
+/* Escaped once, as escape_json_service() does it. */
+static const char g_JsonService[] = "nssm \\\"bench\\\"";
+
+static int write_output(void* pParam, void* pData, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained)
+{
+	(void)pComplained;
+	line_param_t* pParams = static_cast<line_param_t*>(pParam);
+	if (pParams->m_pOutput) {
+		pParams->m_pOutput->append(static_cast<const char*>(pData), uLength);
+	}
+	pParams->m_uOutput += uLength;
+	*pWritten += uLength;
+	return 0;
+}
+
+/***************************************
+
+	Write the input a line at a time, as batch_line() does
+
+***************************************/
+
+static void bench_line_proc(void* pParam)
+{
+	line_param_t* pParams = static_cast<line_param_t*>(pParam);
+	log_batch_t* pBatch = new log_batch_t;
+	memset(pBatch, 0, sizeof(*pBatch));
+	pBatch->m_pWrite = write_output;
+	pBatch->m_pParam = pParams;
+	log_timestamp_t timestamp;
+	memset(&timestamp, 0, sizeof(timestamp));
+	pParams->m_uOutput = 0;
+	if (pParams->m_pOutput) {
+		pParams->m_pOutput->clear();
+	}
+
+	const uint8_t* pInput = pParams->m_pInput;
+	uint32_t uLength = pParams->m_uLength;
+	uint32_t uCharsize = pParams->m_uCharsize;
+	uint32_t uSurrogate = 0;
+	uint32_t uWritten = 0;
+	int iComplained = 0;
+	while (uLength) {
+		uint32_t uLine = find_newline(pInput, uLength, uCharsize);
+		if (!uLine) {
+			uLine = uLength;
+		}
+		SYSTEMTIME now;
+		GetSystemTime(&now);
+		update_timestamp(&timestamp, &now);
+		if (pParams->m_bJson) {
+			batch_json_open(pBatch, &timestamp, BENCH_LINE_STREAM,
+				g_JsonService, sizeof(g_JsonService) - 1, BENCH_LINE_PID, NULL,
+				&uWritten, &iComplained);
+			batch_json_text(pBatch, pInput, uLine - uCharsize, uCharsize,
+				&uSurrogate, &uWritten, &iComplained);
+			batch_json_close(pBatch, &uSurrogate, &uWritten, &iComplained);
+		} else {
+			batch_timestamp(
+				pBatch, &timestamp, uCharsize, &uWritten, &iComplained);
+			batch_append(pBatch, pInput, uLine, &uWritten, &iComplained);
+		}
+		pInput += uLine;
+		uLength -= uLine;
+	}
+	flush_batch(pBatch, &uWritten, &iComplained);
+	heap_free(pBatch->m_pGather);
+	delete pBatch;
+}
+
+/***************************************
+
+	Checks
+
+***************************************/
+
+/* Every field of the cached timestamp, against one made from scratch. */
+static void check_timestamp(void)
+{
+	log_timestamp_t cached;
+	memset(&cached, 0, sizeof(cached));
+	uint32_t uSeed = 1970;
+	SYSTEMTIME now;
+	memset(&now, 0, sizeof(now));
+	now.wYear = 2026;
+	now.wMonth = 12;
+	now.wDay = 31;
+	now.wHour = 23;
+	now.wMinute = 59;
+	now.wSecond = 59;
+	now.wMilliseconds = 998;
+
+	for (uint32_t i = 0; i < 5000; i++) {
+		update_timestamp(&cached, &now);
+		char expected[TIMESTAMP_LEN + 1];
+		snprintf(expected, sizeof(expected), TIMESTAMP_FORMAT, now.wYear,
+			now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond,
+			now.wMilliseconds);
+		bool bWide = true;
+		for (uint32_t j = 0; j < TIMESTAMP_LEN; j++) {
+			bWide &= (cached.m_UTF16[j] == static_cast<utf16_t>(expected[j]));
+		}
+		BENCH_CHECK(!memcmp(cached.m_UTF8, expected, TIMESTAMP_LEN) && bWide,
+			"timestamp %.*s should be %s", TIMESTAMP_LEN, cached.m_UTF8,
+			expected);
+
+		/* Move one field on, or several, or jump. */
+		uint32_t r = bench_random(&uSeed);
+		now.wMilliseconds = static_cast<WORD>((now.wMilliseconds + 1) % 1000);
+		if (r & 1) {
+			now.wSecond = static_cast<WORD>(r % 60);
+		}
+		if (r & 2) {
+			now.wMinute = static_cast<WORD>((r >> 8) % 60);
+		}
+		if (r & 4) {
+			now.wHour = static_cast<WORD>((r >> 16) % 24);
+		}
+		if ((r & 0x70) == 0x70) {
+			now.wDay = static_cast<WORD>(1 + (r >> 20) % 28);
+			now.wMonth = static_cast<WORD>(1 + (r >> 24) % 12);
+			now.wYear = static_cast<WORD>(2026 + (r >> 28));
+		}
+	}
+}
+
+/* True if pTime is a timestamp, with cSeparator between date and time. */
+static bool is_timestamp(const char* pTime, char cSeparator)
+{
+	static const char g_Shape[] = "0000-00-00 00:00:00.000";
+	for (uint32_t i = 0; i < TIMESTAMP_DATETIME_LEN; i++) {
+		char c = (i == 10) ? cSeparator : g_Shape[i];
+		if ((c == '0') ? ((pTime[i] < '0') || (pTime[i] > '9')) :
+						 (pTime[i] != c)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Undo the escaping of a JSON string, returns false if it is malformed. */
+static bool unescape_json(
+	const char* pInput, size_t uLength, std::string* pOutput)
+{
+	pOutput->clear();
+	for (size_t i = 0; i < uLength; i++) {
+		char c = pInput[i];
+		if (c == '"') {
+			return false;
+		}
+		if (c != '\\') {
+			pOutput->push_back(c);
+			continue;
+		}
+		if (++i == uLength) {
+			return false;
+		}
+		switch (pInput[i]) {
+		case '"':
+		case '\\':
+		case '/':
+			pOutput->push_back(pInput[i]);
+			break;
+		case 'b':
+			pOutput->push_back('\b');
+			break;
+		case 'f':
+			pOutput->push_back('\f');
+			break;
+		case 'n':
+			pOutput->push_back('\n');
+			break;
+		case 'r':
+			pOutput->push_back('\r');
+			break;
+		case 't':
+			pOutput->push_back('\t');
+			break;
+		case 'u': {
+			/* Only control characters are escaped this way. */
+			unsigned int uChar;
+			if ((i + 4 >= uLength) ||
+				(sscanf(pInput + i + 1, "%4x", &uChar) != 1) ||
+				(uChar >= 0x20)) {
+				return false;
+			}
+			pOutput->push_back(static_cast<char>(uChar));
+			i += 4;
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+  Read the output back a line at a time and check each against the input.
+  Returns the number of lines.
+*/
+static uint32_t check_lines(const std::string& output,
+	const std::vector<uint8_t>& input, bool bJson, const char* pName)
+{
+	static const char g_Middle[] = "Z\",\"stream\":\"" BENCH_LINE_STREAM
+								   "\",\"service\":\"";
+	char tail[64];
+	snprintf(tail, sizeof(tail), "\",\"pid\":%u,\"message\":\"",
+		BENCH_LINE_PID);
+	std::string head = std::string(g_Middle) + g_JsonService + tail;
+
+	const char* pInput = reinterpret_cast<const char*>(input.data());
+	size_t uInput = input.size();
+	size_t o = 0;
+	uint32_t uLines = 0;
+	std::string last(TIMESTAMP_DATETIME_LEN, '0');
+	std::string message;
+	while (uInput) {
+		const char* pEnd =
+			static_cast<const char*>(memchr(pInput, '\n', uInput));
+		size_t uLine = pEnd ? static_cast<size_t>(pEnd - pInput) + 1 : uInput;
+		size_t uNext = output.find('\n', o);
+		if (uNext == std::string::npos) {
+			bench_fail("%s output ends after %u lines", pName, uLines);
+			return uLines;
+		}
+		const char* pOutput = output.data() + o;
+		size_t uOutput = uNext + 1 - o;
+		bool bGood;
+		std::string time;
+		if (bJson) {
+			/* {"time":"...Z","stream":...,"message":"..."}\n */
+			size_t uPrefix = 9 + TIMESTAMP_DATETIME_LEN + head.size();
+			bGood = (uOutput >= uPrefix + 3) &&
+				!memcmp(pOutput, "{\"time\":\"", 9) &&
+				is_timestamp(pOutput + 9, 'T') &&
+				!memcmp(pOutput + 9 + TIMESTAMP_DATETIME_LEN, head.data(),
+					head.size()) &&
+				!memcmp(pOutput + uOutput - 3, "\"}\n", 3) &&
+				unescape_json(pOutput + uPrefix, uOutput - uPrefix - 3,
+					&message) &&
+				(message.size() == uLine - 1) &&
+				!memcmp(message.data(), pInput, uLine - 1);
+			time.assign(pOutput + 9, TIMESTAMP_DATETIME_LEN);
+			time[10] = ' ';
+		} else {
+			bGood = (uOutput == TIMESTAMP_LEN + uLine) &&
+				is_timestamp(pOutput, ' ') &&
+				!memcmp(pOutput + TIMESTAMP_DATETIME_LEN, ": ", 2) &&
+				!memcmp(pOutput + TIMESTAMP_LEN, pInput, uLine);
+			time.assign(pOutput, TIMESTAMP_DATETIME_LEN);
+		}
+		BENCH_CHECK(bGood, "%s line %u came out as %.*s", pName, uLines,
+			static_cast<int>(uOutput), pOutput);
+		BENCH_CHECK(time >= last, "%s line %u went back in time to %s", pName,
+			uLines, time.c_str());
+		if (!bGood) {
+			return uLines;
+		}
+		last = time;
+		o = uNext + 1;
+		pInput += uLine;
+		uInput -= uLine;
+		uLines++;
+	}
+	BENCH_CHECK(o == output.size(), "%s wrote %u bytes past the last line",
+		pName, static_cast<uint32_t>(output.size() - o));
+	return uLines;
+}
+
+/* UTF-8 to UTF-16 and back, a piece at a time. */
+static std::vector<utf16_t> widen(const std::vector<uint8_t>& input)
+{
+	std::vector<utf16_t> output(input.size());
+	uint32_t uPending = 0;
+	uint32_t i = 0;
+	uint32_t o = 0;
+	while (i < input.size()) {
+		uint32_t uConsumed;
+		o += utf8_to_utf16(input.data() + i,
+			static_cast<uint32_t>(input.size()) - i, output.data() + o,
+			static_cast<uint32_t>(output.size()) - o, &uPending, &uConsumed);
+		i += uConsumed;
+	}
+	output.resize(o);
+	return output;
+}
+
+static std::string narrow(const std::string& input)
+{
+	const utf16_t* pInput = reinterpret_cast<const utf16_t*>(input.data());
+	uint32_t uCount = static_cast<uint32_t>(input.size() / sizeof(utf16_t));
+	std::string output;
+	uint32_t uSurrogate = 0;
+	char buffer[4096];
+	while (uCount) {
+		uint32_t uConsumed;
+		uint32_t o = utf16_to_utf8(
+			pInput, uCount, buffer, sizeof(buffer), &uSurrogate, &uConsumed);
+		output.append(buffer, o);
+		pInput += uConsumed;
+		uCount -= uConsumed;
+	}
+	return output;
+}
+
+static void check_line(const std::vector<uint8_t>& text,
+	const std::vector<utf16_t>& wide, uint32_t uLines)
+{
+	std::string output;
+	line_param_t line;
+	line.m_pOutput = &output;
+	for (uint32_t i = 0; i < 4; i++) {
+		line.m_bJson = (i & 1) != 0;
+		line.m_uCharsize = (i & 2) ? sizeof(utf16_t) : sizeof(char);
+		if (line.m_uCharsize == sizeof(char)) {
+			line.m_pInput = text.data();
+			line.m_uLength = static_cast<uint32_t>(text.size());
+		} else {
+			line.m_pInput = reinterpret_cast<const uint8_t*>(wide.data());
+			line.m_uLength =
+				static_cast<uint32_t>(wide.size() * sizeof(utf16_t));
+		}
+		bench_line_proc(&line);
+		BENCH_CHECK(line.m_uOutput == output.size(),
+			"counted %llu bytes of %u",
+			static_cast<unsigned long long>(line.m_uOutput),
+			static_cast<uint32_t>(output.size()));
+
+		/* JSON is always UTF-8, a UTF-16 log is read back as UTF-8. */
+		if ((line.m_uCharsize != sizeof(char)) && !line.m_bJson) {
+			output = narrow(output);
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "%s %s",
+			(line.m_uCharsize == sizeof(char)) ? "8 bit" : "UTF-16",
+			line.m_bJson ? "JSON" : "timestamped");
+		uint32_t uRead = check_lines(output, text, line.m_bJson, name);
+		BENCH_CHECK(uRead == uLines, "%s wrote %u lines of %u", name, uRead,
+			uLines);
+	}
+}
+
+/***************************************
+
+	Benchmark
+
+***************************************/
+
+void bench_line(void)
+{
+	check_timestamp();
+
+	/* Whole lines only, so the text survives a trip through UTF-16. */
+	uint32_t uSize = g_bCheck ? BENCH_CHECK_SIZE : BENCH_TEXT_SIZE;
+	std::vector<uint8_t> text(uSize);
+	uint32_t uLines = make_log_text(
+		text.data(), uSize, 10, BENCH_TEXT_ESCAPES | BENCH_TEXT_UTF8);
+	uint32_t uWhole = find_last_newline(text.data(), uSize, 1);
+	if (uWhole != uSize) {
+		text.resize(uWhole);
+		uLines--;
+	}
+	std::vector<utf16_t> wide = widen(text);
+	check_line(text, wide, uLines);
+
+	printf("Writing %u lines of %u bytes, prefixed and as JSON\n", uLines,
+		static_cast<uint32_t>(text.size()));
+	line_param_t line;
+	line.m_pOutput = NULL;
+	for (uint32_t i = 0; i < 4; i++) {
+		line.m_bJson = (i & 1) != 0;
+		line.m_uCharsize = (i & 2) ? sizeof(utf16_t) : sizeof(char);
+		if (line.m_uCharsize == sizeof(char)) {
+			line.m_pInput = text.data();
+			line.m_uLength = static_cast<uint32_t>(text.size());
+		} else {
+			line.m_pInput = reinterpret_cast<const uint8_t*>(wide.data());
+			line.m_uLength =
+				static_cast<uint32_t>(wide.size() * sizeof(utf16_t));
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "%s, %s",
+			(line.m_uCharsize == sizeof(char)) ? "8 bit" : "UTF-16",
+			line.m_bJson ? "JSON lines" : "timestamp prefix");
+		bench_time(name, bench_line_proc, &line, line.m_uLength);
+		printf("  %-44s %10llu\n", "bytes written",
+			static_cast<unsigned long long>(line.m_uOutput));
+	}
+}
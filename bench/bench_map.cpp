@@ -0,0 +1,229 @@
+/***************************************
+
+	Memory mapped log writes
+
+	Records of random sizes are copied through map_copy() with a small
+	window, so they are cut across windows, and the file must come out
+	the same as the records written one after another.  The benchmark
+	writes records of each size to a file with one WriteFile() per record
+	and through a mapped window, and counts the calls each way.
+
+***************************************/
+
+#include "bench.h"
+#include "logmap.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define BENCH_MAP_FILE "nssm_bench_map.log"
+
+// Window size for the benchmark, as in the README's example
+#define BENCH_MAP_WINDOW (4U * 1024U * 1024U)
+
+// Window size for the checks, the smallest Windows allows
+#define BENCH_MAP_CHECK_WINDOW 65536U
+
+struct map_param_t {
+	const uint8_t* m_pInput;
+	uint32_t m_uLength;
+	uint32_t m_uRecord;
+	uint32_t m_uCalls;
+	bool m_bMapped;
+};
+
+static HANDLE create_map_file(void)
+{
+	HANDLE hFile = CreateFileW(L"" BENCH_MAP_FILE,
+		GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		bench_fail("couldn't create " BENCH_MAP_FILE);
+	}
+	return hFile;
+}
+
+/* Unmap and cut the file back to the output, as stop_map() does. */
+static void finish_map(log_map_t* pMap)
+{
+	LARGE_INTEGER end;
+	end.QuadPart = static_cast<LONGLONG>(pMap->m_uOffset + pMap->m_uUsed);
+	unmap_window(pMap);
+	if (SetFilePointerEx(pMap->m_hFile, end, NULL, FILE_BEGIN)) {
+		SetEndOfFile(pMap->m_hFile);
+	}
+}
+
+static std::vector<uint8_t> read_map_file(HANDLE hFile)
+{
+	std::vector<uint8_t> contents;
+	LARGE_INTEGER size;
+	LARGE_INTEGER zero;
+	zero.QuadPart = 0;
+	if (!GetFileSizeEx(hFile, &size) ||
+		!SetFilePointerEx(hFile, zero, NULL, FILE_BEGIN)) {
+		return contents;
+	}
+	contents.resize(static_cast<size_t>(size.QuadPart));
+	DWORD uRead = 0;
+	if (!contents.empty() &&
+		!ReadFile(hFile, contents.data(), static_cast<DWORD>(size.QuadPart),
+			&uRead, NULL)) {
+		uRead = 0;
+	}
+	contents.resize(uRead);
+	return contents;
+}
+
+/***************************************
+
+	Checks
+
+***************************************/
+
+static void check_map(void)
+{
+	std::vector<uint8_t> text(BENCH_MAP_CHECK_WINDOW * 5 + 123);
+	make_log_text(text.data(), static_cast<uint32_t>(text.size()), 7,
+		BENCH_TEXT_UTF8);
+	uint32_t uSeed = 6502;
+
+	for (uint32_t uRound = 0; uRound < 20; uRound++) {
+		HANDLE hFile = create_map_file();
+		if (hFile == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		log_map_t map;
+		memset(&map, 0, sizeof(map));
+		map.m_hFile = hFile;
+		map.m_uWindow = BENCH_MAP_CHECK_WINDOW;
+		const wchar_t* pFunction = NULL;
+		unsigned long error = map_window(&map, 0, &pFunction);
+		BENCH_CHECK(!error, "map_window, error %lu, round %u", error, uRound);
+		if (error) {
+			CloseHandle(hFile);
+			return;
+		}
+
+		/* Up to the whole text, cut into pieces of every size. */
+		uint32_t uLength = static_cast<uint32_t>(text.size()) -
+			bench_random(&uSeed) % BENCH_MAP_CHECK_WINDOW;
+		uint32_t uMax = (uRound & 1) ? 300 : BENCH_MAP_CHECK_WINDOW * 2;
+		for (uint32_t i = 0; i < uLength;) {
+			uint32_t uPiece = 1 + bench_random(&uSeed) % uMax;
+			if (uPiece > uLength - i) {
+				uPiece = uLength - i;
+			}
+			uint32_t uCopied = 0;
+			error = map_copy(&map, text.data() + i, uPiece, &uCopied,
+				&pFunction);
+			BENCH_CHECK(!error && (uCopied == uPiece),
+				"map_copy of %u bytes at %u copied %u, round %u", uPiece, i,
+				uCopied, uRound);
+			if (error) {
+				break;
+			}
+			i += uPiece;
+		}
+		BENCH_CHECK(map.m_uOffset + map.m_uUsed == uLength,
+			"mapped output ends at %llu, not %u, round %u",
+			static_cast<unsigned long long>(map.m_uOffset + map.m_uUsed),
+			uLength, uRound);
+
+		finish_map(&map);
+		std::vector<uint8_t> contents = read_map_file(hFile);
+		BENCH_CHECK((contents.size() == uLength) &&
+				!memcmp(contents.data(), text.data(), uLength),
+			"mapped file of %u bytes came out wrong, round %u", uLength,
+			uRound);
+		CloseHandle(hFile);
+	}
+	remove(BENCH_MAP_FILE);
+}
+
+/***************************************
+
+	Benchmark
+
+***************************************/
+
+static void bench_map_proc(void* pParam)
+{
+	map_param_t* pParams = static_cast<map_param_t*>(pParam);
+	pParams->m_uCalls = 0;
+	HANDLE hFile = create_map_file();
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	log_map_t map;
+	memset(&map, 0, sizeof(map));
+	map.m_hFile = hFile;
+	map.m_uWindow = BENCH_MAP_WINDOW;
+	const wchar_t* pFunction;
+	if (pParams->m_bMapped && map_window(&map, 0, &pFunction)) {
+		bench_fail("map_window");
+		CloseHandle(hFile);
+		return;
+	}
+
+	const uint8_t* pInput = pParams->m_pInput;
+	uint32_t uLength = pParams->m_uLength;
+	while (uLength) {
+		uint32_t uRecord =
+			(uLength < pParams->m_uRecord) ? uLength : pParams->m_uRecord;
+		if (pParams->m_bMapped) {
+			uint32_t uCopied;
+			map_copy(&map, pInput, uRecord, &uCopied, &pFunction);
+		} else {
+			DWORD uWritten;
+			WriteFile(hFile, pInput, uRecord, &uWritten, NULL);
+			pParams->m_uCalls++;
+		}
+		pInput += uRecord;
+		uLength -= uRecord;
+	}
+
+	if (pParams->m_bMapped) {
+		/*
+		  CreateFileMapping(), MapViewOfFile(), UnmapViewOfFile() and
+		  CloseHandle() per window, then the seek and truncate.
+		*/
+		pParams->m_uCalls =
+			4 * static_cast<uint32_t>(map.m_uOffset / BENCH_MAP_WINDOW + 1) +
+			2;
+		finish_map(&map);
+	}
+	CloseHandle(hFile);
+}
+
+void bench_map(void)
+{
+	check_map();
+
+	uint32_t uSize = g_bCheck ? BENCH_CHECK_SIZE : BENCH_TEXT_SIZE;
+	std::vector<uint8_t> text(uSize);
+	make_log_text(text.data(), uSize, 8, 0);
+
+	static const uint32_t g_Records[] = {32, 128, 512, 4096, 65536};
+	printf("Writing %u bytes to a file, %u byte window\n", uSize,
+		BENCH_MAP_WINDOW);
+	for (uint32_t r = 0; r < sizeof(g_Records) / sizeof(g_Records[0]); r++) {
+		map_param_t map;
+		map.m_pInput = text.data();
+		map.m_uLength = uSize;
+		map.m_uRecord = g_Records[r];
+		char name[64];
+		map.m_bMapped = false;
+		snprintf(name, sizeof(name), "%u byte records, WriteFile()",
+			g_Records[r]);
+		bench_time(name, bench_map_proc, &map, uSize);
+		printf("  %-44s %10u\n", "calls", map.m_uCalls);
+		map.m_bMapped = true;
+		snprintf(name, sizeof(name), "%u byte records, mapped", g_Records[r]);
+		bench_time(name, bench_map_proc, &map, uSize);
+		printf("  %-44s %10u\n", "calls", map.m_uCalls);
+	}
+	remove(BENCH_MAP_FILE);
+}
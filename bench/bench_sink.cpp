@@ -0,0 +1,481 @@
+/***************************************
+
+	Log sinks
+
+	Log output is queued for a sink 4 KB at a time, as the I/O thread hands
+	on what it wrote to the file, and sent the way pump_sink() sends it:
+	one syslog message per line, through a loopback UDP socket, and as a
+	stream through a pipe.  The checks compare what arrives with what the
+	syslog framing should make of the input, line by line, and with the
+	input itself for the pipe.  They also check that a full queue drops
+	whole writes and counts them, and how addresses are split.
+
+***************************************/
+
+#include "bench.h"
+#include "logsink.h"
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+#ifdef _WIN32
+#include <WS2tcpip.h>
+#include <WinSock2.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bytes queued per write, what the I/O thread writes out of a full buffer
+#define BENCH_SINK_BATCH 4096U
+
+// Queue sizes, as NSSM_LOG_SINK_QUEUE_MIN and the AppLogSinkQueue default
+#define BENCH_SINK_QUEUE_MIN 65536U
+#define BENCH_SINK_QUEUE_MAX 1048576U
+
+// Milliseconds to wait for a datagram before deciding it was lost
+#define BENCH_SINK_TIMEOUT 1000
+
+// How each case sends what is framed
+#define BENCH_SINK_FRAME 0
+#define BENCH_SINK_UDP 1
+#define BENCH_SINK_PIPE 2
+
+// Tag the syslog messages are sent with
+static const utf16_t g_Tag[] = {'b', 'e', 'n', 'c', 'h'};
+#define BENCH_SINK_TAG_LENGTH (sizeof(g_Tag) / sizeof(g_Tag[0]))
+
+struct sink_param_t {
+	const uint8_t* m_pInput;
+	uint32_t m_uLength;
+	uint32_t m_uKind;
+	uint32_t m_uTransport;
+	uint32_t m_uMessages;
+	// Receiving socket and connected sending socket for UDP
+	SOCKET m_hReceive;
+	SOCKET m_hSend;
+	// Everything which arrived, each syslog message followed by a newline
+	std::string m_Received;
+};
+
+/***************************************
+
+	Loopback UDP sockets, standing in for a syslog server
+
+***************************************/
+
+static bool open_udp(sink_param_t* pParams)
+{
+#ifdef _WIN32
+	WSADATA data;
+	if (WSAStartup(MAKEWORD(2, 2), &data)) {
+		return false;
+	}
+#endif
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	socklen_t iLength = sizeof(address);
+
+	pParams->m_hReceive = socket(AF_INET, SOCK_DGRAM, 0);
+	pParams->m_hSend = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((pParams->m_hReceive == INVALID_SOCKET) ||
+		(pParams->m_hSend == INVALID_SOCKET) ||
+		bind(pParams->m_hReceive, reinterpret_cast<sockaddr*>(&address),
+			sizeof(address)) ||
+		getsockname(pParams->m_hReceive,
+			reinterpret_cast<sockaddr*>(&address), &iLength) ||
+		connect(pParams->m_hSend, reinterpret_cast<sockaddr*>(&address),
+			sizeof(address))) {
+		return false;
+	}
+
+	/* A lost datagram fails the check rather than hanging it. */
+#ifdef _WIN32
+	DWORD uTimeout = BENCH_SINK_TIMEOUT;
+#else
+	struct timeval uTimeout;
+	uTimeout.tv_sec = BENCH_SINK_TIMEOUT / 1000;
+	uTimeout.tv_usec = (BENCH_SINK_TIMEOUT % 1000) * 1000;
+#endif
+	setsockopt(pParams->m_hReceive, SOL_SOCKET, SO_RCVTIMEO,
+		reinterpret_cast<const char*>(&uTimeout), sizeof(uTimeout));
+	return true;
+}
+
+static void close_udp(sink_param_t* pParams)
+{
+	if (pParams->m_hReceive != INVALID_SOCKET) {
+		closesocket(pParams->m_hReceive);
+	}
+	if (pParams->m_hSend != INVALID_SOCKET) {
+		closesocket(pParams->m_hSend);
+	}
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+/* Send one datagram and take it off the other end. */
+static bool send_udp(sink_param_t* pParams, const uint8_t* pData,
+	uint32_t uLength)
+{
+	if (send(pParams->m_hSend, reinterpret_cast<const char*>(pData),
+			static_cast<int>(uLength), 0) != static_cast<int>(uLength)) {
+		bench_fail("send() of %u bytes", uLength);
+		return false;
+	}
+	char buffer[NSSM_SYSLOG_MAX + 1];
+	int iLength = static_cast<int>(
+		recv(pParams->m_hReceive, buffer, sizeof(buffer), 0));
+	if (iLength < 0) {
+		bench_fail("recv() after sending %u messages", pParams->m_uMessages);
+		return false;
+	}
+	pParams->m_Received.append(buffer, static_cast<size_t>(iLength));
+	pParams->m_Received.push_back('\n');
+	return true;
+}
+
+/* The collector's end of the pipe. */
+static void read_sink_pipe(HANDLE hPipe, std::string* pReceived)
+{
+	std::vector<char> buffer(NSSM_LOG_SINK_SEND);
+	DWORD uRead;
+	while (ReadFile(hPipe, buffer.data(), NSSM_LOG_SINK_SEND, &uRead, NULL) &&
+		uRead) {
+		pReceived->append(buffer.data(), uRead);
+	}
+	CloseHandle(hPipe);
+}
+
+/***************************************
+
+	Queue the output and send it on
+
+	The input is queued a write at a time, each ending after a line where
+	there is one, as when each line is timestamped.  Everything queued is
+	sent before the next write, as pump_sink() would with a consumer which
+	keeps up.
+
+***************************************/
+
+static void bench_sink_proc(void* pParam)
+{
+	sink_param_t* pParams = static_cast<sink_param_t*>(pParam);
+	pParams->m_uMessages = 0;
+	pParams->m_Received.clear();
+
+	std::vector<uint8_t> send(NSSM_LOG_SINK_SEND);
+	log_sink_t sink;
+	memset(&sink, 0, sizeof(sink));
+	sink.m_uKind = pParams->m_uKind;
+	sink.m_pSend = send.data();
+	if (log_buffer_init(
+			&sink.m_Queue, BENCH_SINK_QUEUE_MIN, BENCH_SINK_QUEUE_MAX)) {
+		bench_fail("log_buffer_init");
+		return;
+	}
+	if (sink.m_uKind == NSSM_LOG_SINK_SYSLOG) {
+		syslog_header(&sink, NSSM_SYSLOG_INFO, g_Tag, BENCH_SINK_TAG_LENGTH);
+	}
+
+	HANDLE hRead = NULL;
+	HANDLE hWrite = NULL;
+	std::thread reader;
+	if (pParams->m_uTransport == BENCH_SINK_PIPE) {
+		if (!CreatePipe(&hRead, &hWrite, NULL, 0)) {
+			bench_fail("CreatePipe, error %u", GetLastError());
+			log_buffer_free(&sink.m_Queue);
+			return;
+		}
+		reader = std::thread(read_sink_pipe, hRead, &pParams->m_Received);
+	}
+
+	const uint8_t* pInput = pParams->m_pInput;
+	uint32_t uLength = pParams->m_uLength;
+	bool bFailed = false;
+	while (uLength && !bFailed) {
+		uint32_t uBatch =
+			(uLength < BENCH_SINK_BATCH) ? uLength : BENCH_SINK_BATCH;
+		if (uBatch < uLength) {
+			for (uint32_t i = uBatch; i; i--) {
+				if (pInput[i - 1] == '\n') {
+					uBatch = i;
+					break;
+				}
+			}
+		}
+		queue_for_sink(&sink, pInput, uBatch);
+		pInput += uBatch;
+		uLength -= uBatch;
+
+		while (sink.m_Queue.m_uUsed && !bFailed) {
+			uint32_t uMessage = next_sink_message(&sink);
+			/* Empty syslog messages aren't sent. */
+			if (uMessage) {
+				pParams->m_uMessages++;
+				switch (pParams->m_uTransport) {
+				case BENCH_SINK_FRAME:
+					pParams->m_Received.append(
+						reinterpret_cast<const char*>(send.data()), uMessage);
+					pParams->m_Received.push_back('\n');
+					break;
+
+				case BENCH_SINK_UDP:
+					bFailed = !send_udp(pParams, send.data(), uMessage);
+					break;
+
+				case BENCH_SINK_PIPE: {
+					DWORD uWritten;
+					if (!WriteFile(
+							hWrite, send.data(), uMessage, &uWritten, NULL) ||
+						(uWritten != uMessage)) {
+						bench_fail("WriteFile, error %u", GetLastError());
+						bFailed = true;
+					}
+					break;
+				}
+				}
+			}
+			log_buffer_consume(&sink.m_Queue, sink.m_uSending);
+			sink.m_uSending = 0;
+		}
+	}
+
+	if (reader.joinable()) {
+		CloseHandle(hWrite);
+		reader.join();
+	}
+	BENCH_CHECK(!sink.m_uDropped, "dropped %llu bytes",
+		static_cast<unsigned long long>(sink.m_uDropped));
+	log_buffer_free(&sink.m_Queue);
+}
+
+/***************************************
+
+	Checks
+
+***************************************/
+
+/*
+  What the syslog framing should make of the input, written out plainly:
+  every line without its line ending, cut into pieces which fit after the
+  header, and no empty messages.
+*/
+static std::string expected_syslog(
+	const uint8_t* pInput, uint32_t uLength, const std::string& header)
+{
+	uint32_t uRoom = NSSM_SYSLOG_MAX - static_cast<uint32_t>(header.size());
+	std::string expected;
+	while (uLength) {
+		const uint8_t* pNewline =
+			static_cast<const uint8_t*>(memchr(pInput, '\n', uLength));
+		uint32_t uLine =
+			pNewline ? static_cast<uint32_t>(pNewline - pInput) : uLength;
+		uint32_t uNext = pNewline ? uLine + 1 : uLength;
+		const char* pLine = reinterpret_cast<const char*>(pInput);
+		while (uLine >= uRoom) {
+			expected += header + std::string(pLine, uRoom) + "\n";
+			pLine += uRoom;
+			uLine -= uRoom;
+		}
+		if (pNewline && uLine && (pLine[uLine - 1] == '\r')) {
+			uLine--;
+		}
+		if (uLine) {
+			expected += header + std::string(pLine, uLine) + "\n";
+		}
+		pInput += uNext;
+		uLength -= uNext;
+	}
+	return expected;
+}
+
+static void check_received(
+	const sink_param_t* pParams, const std::string& expected, const char* pName)
+{
+	const std::string& received = pParams->m_Received;
+	size_t uSame = 0;
+	while ((uSame < received.size()) && (uSame < expected.size()) &&
+		(received[uSame] == expected[uSame])) {
+		uSame++;
+	}
+	BENCH_CHECK(received == expected,
+		"%s received %u bytes, expected %u, the first %u match", pName,
+		static_cast<uint32_t>(received.size()),
+		static_cast<uint32_t>(expected.size()), static_cast<uint32_t>(uSame));
+}
+
+/* A queue which isn't drained keeps whole writes until it is full. */
+static void check_queue_bound(const uint8_t* pInput, uint32_t uLength)
+{
+	const uint32_t uMax = 16384;
+	uint8_t send[NSSM_LOG_SINK_SEND];
+	log_sink_t sink;
+	memset(&sink, 0, sizeof(sink));
+	sink.m_uKind = NSSM_LOG_SINK_PIPE;
+	sink.m_pSend = send;
+	if (log_buffer_init(&sink.m_Queue, 4096, uMax)) {
+		bench_fail("log_buffer_init");
+		return;
+	}
+
+	uint32_t uQueued = 0;
+	uint32_t uLost = 0;
+	for (uint32_t o = 0; (o + 1000) <= uLength; o += 1000) {
+		queue_for_sink(&sink, pInput + o, 1000);
+		if ((uQueued + 1000) <= uMax) {
+			uQueued += 1000;
+		} else {
+			uLost += 1000;
+		}
+	}
+	BENCH_CHECK((sink.m_Queue.m_uUsed == uQueued) && (sink.m_uLost == uLost) &&
+			(sink.m_uDropped == uLost),
+		"queue bound kept %u bytes and lost %llu, expected %u and %u",
+		sink.m_Queue.m_uUsed, static_cast<unsigned long long>(sink.m_uLost),
+		uQueued, uLost);
+
+	/* What was kept comes out first, in one piece. */
+	uint32_t uMessage = next_sink_message(&sink);
+	BENCH_CHECK((uMessage == uQueued) && (sink.m_uSending == uQueued) &&
+			!memcmp(send, pInput, uQueued),
+		"queue bound sent %u bytes of %u", uMessage, uQueued);
+	log_buffer_consume(&sink.m_Queue, sink.m_uSending);
+
+	/* Room is made again once the queue has been sent. */
+	queue_for_sink(&sink, pInput, 1000);
+	BENCH_CHECK((sink.m_Queue.m_uUsed == 1000) && (sink.m_uLost == uLost),
+		"queue bound didn't take output once drained");
+	log_buffer_free(&sink.m_Queue);
+}
+
+static void check_split_address(void)
+{
+	struct address_t {
+		const wchar_t* m_pInput;
+		const wchar_t* m_pHost;
+		const wchar_t* m_pPort;
+	};
+	static const address_t g_Addresses[] = {
+		{L"localhost", L"localhost", L"514"},
+		{L"192.0.2.1:5514", L"192.0.2.1", L"5514"},
+		{L"[::1]:514", L"::1", L"514"}, {L"[::1]", L"::1", L"514"},
+		{L"fe80::1", L"fe80::1", L"514"},
+		{L"log.example.com:6514", L"log.example.com", L"6514"}};
+	for (uint32_t i = 0; i < sizeof(g_Addresses) / sizeof(g_Addresses[0]);
+		 i++) {
+		wchar_t host[NSSM_HOST_LENGTH];
+		wchar_t port[NSSM_PORT_LENGTH];
+		wcscpy(port, L"514");
+		split_address(g_Addresses[i].m_pInput, host, NSSM_HOST_LENGTH, port,
+			NSSM_PORT_LENGTH);
+		BENCH_CHECK(!wcscmp(host, g_Addresses[i].m_pHost) &&
+				!wcscmp(port, g_Addresses[i].m_pPort),
+			"split_address(%ls) gave %ls and %ls", g_Addresses[i].m_pInput,
+			host, port);
+	}
+
+	/* A host too long for its buffer is cut short, not overrun. */
+	wchar_t host[8];
+	wchar_t port[NSSM_PORT_LENGTH];
+	split_address(
+		L"a.long.host.name:514", host, 8, port, NSSM_PORT_LENGTH);
+	BENCH_CHECK(!wcscmp(host, L"a.long.") && !wcscmp(port, L"514"),
+		"split_address() of a long host gave %ls", host);
+}
+
+/***************************************
+
+	Benchmark
+
+***************************************/
+
+void bench_sink(void)
+{
+	uint32_t uSize = g_bCheck ? BENCH_CHECK_SIZE : BENCH_TEXT_SIZE;
+	std::vector<uint8_t> text(uSize);
+	make_log_text(text.data(), uSize, 11, BENCH_TEXT_UTF8);
+
+	/*
+	  Lines which are too long for one message, only a line ending, or
+	  exactly fill a message, and output which doesn't end a line.
+	*/
+	uint8_t header[NSSM_SYSLOG_MAX];
+	log_sink_t probe;
+	memset(&probe, 0, sizeof(probe));
+	probe.m_pSend = header;
+	uint32_t uHeader = syslog_header(
+		&probe, NSSM_SYSLOG_INFO, g_Tag, BENCH_SINK_TAG_LENGTH);
+	std::string awkward(3000, 'x');
+	awkward += "\n\n\r\nline\r\n";
+	awkward += std::string(NSSM_SYSLOG_MAX - uHeader, 'y') + "\r\n";
+	awkward += std::string(NSSM_SYSLOG_MAX - uHeader - 1, 'z') + "\r\n";
+	awkward += "no newline";
+	text.insert(text.end(), awkward.begin(), awkward.end());
+	uSize = static_cast<uint32_t>(text.size());
+
+	if (g_bCheck) {
+		std::string tag(reinterpret_cast<const char*>(header), uHeader);
+		BENCH_CHECK(tag == "<14>bench: ", "syslog header is %s", tag.c_str());
+		check_split_address();
+		check_queue_bound(text.data(), uSize);
+	}
+
+	struct case_t {
+		const char* m_pName;
+		uint32_t m_uKind;
+		uint32_t m_uTransport;
+	};
+	static const case_t g_Cases[] = {
+		{"syslog, framing only", NSSM_LOG_SINK_SYSLOG, BENCH_SINK_FRAME},
+		{"syslog, loopback UDP", NSSM_LOG_SINK_SYSLOG, BENCH_SINK_UDP},
+		{"pipe", NSSM_LOG_SINK_PIPE, BENCH_SINK_PIPE}};
+
+	std::string expected = expected_syslog(text.data(), uSize,
+		std::string(reinterpret_cast<const char*>(header), uHeader));
+	std::string stream(reinterpret_cast<const char*>(text.data()), uSize);
+
+	printf("Sending %u bytes to a log sink %u bytes at a time\n", uSize,
+		BENCH_SINK_BATCH);
+	for (uint32_t i = 0; i < sizeof(g_Cases) / sizeof(g_Cases[0]); i++) {
+		sink_param_t sink;
+		sink.m_pInput = text.data();
+		sink.m_uLength = uSize;
+		sink.m_uKind = g_Cases[i].m_uKind;
+		sink.m_uTransport = g_Cases[i].m_uTransport;
+		sink.m_uMessages = 0;
+		sink.m_hReceive = INVALID_SOCKET;
+		sink.m_hSend = INVALID_SOCKET;
+		if ((sink.m_uTransport == BENCH_SINK_UDP) && !open_udp(&sink)) {
+			bench_fail("couldn't open loopback UDP sockets");
+			close_udp(&sink);
+			continue;
+		}
+		bench_time(g_Cases[i].m_pName, bench_sink_proc, &sink, uSize);
+		printf("  %-44s %10u\n", "messages", sink.m_uMessages);
+		check_received(&sink,
+			(sink.m_uKind == NSSM_LOG_SINK_SYSLOG) ? expected : stream,
+			g_Cases[i].m_pName);
+		if (sink.m_uTransport == BENCH_SINK_UDP) {
+			close_udp(&sink);
+		}
+	}
+}
@@ -0,0 +1,603 @@
+/***************************************
+
+	Newline scanning, JSON escaping and transcoding
+
+	Each kernel in logtext.cpp is checked against a plain loop doing the
+	same job one character at a time, fed whole and in random pieces, and
+	timed against it.
+
+***************************************/
+
+#include "bench.h"
+#include "logtext.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct scan_param_t {
+	ScanNewlinesProc m_pScan;
+	const uint8_t* m_pInput;
+	uint32_t m_uLength;
+	uint32_t m_uCharsize;
+	uint64_t m_uLines;
+};
+
+struct transcode_param_t {
+	const void* m_pInput;
+	uint32_t m_uCount;
+	uint64_t m_uOutput;
+};
+
+static const char* g_KernelNames[] = {"scalar", "sse2", "avx2"};
+
+/***************************************
+
+	Plain versions to check against
+
+***************************************/
+
+/* The byte at a time loop the kernels replaced. */
+static uint32_t scan_newlines_bytes(const uint8_t* pInput, uint32_t uLength,
+	uint32_t uCharsize, uint32_t* pEnds, uint32_t uMaxEnds)
+{
+	uint32_t uCount = 0;
+	for (uint32_t i = 0; (i + uCharsize) <= uLength; i += uCharsize) {
+		if ((pInput[i] == '\n') && ((uCharsize == 1) || !pInput[i + 1])) {
+			pEnds[uCount++] = i + uCharsize;
+			if (uCount == uMaxEnds) {
+				break;
+			}
+		}
+	}
+	return uCount;
+}
+
+static uint32_t plain_json_span(const uint8_t* pInput, uint32_t uLength)
+{
+	uint32_t i = 0;
+	while ((i < uLength) && (pInput[i] >= 0x20) && (pInput[i] != '"') &&
+		(pInput[i] != '\\')) {
+		i++;
+	}
+	return i;
+}
+
+static void append_utf8(std::string* pOutput, uint32_t c)
+{
+	if (c < 0x80) {
+		pOutput->push_back(static_cast<char>(c));
+	} else if (c < 0x800) {
+		pOutput->push_back(static_cast<char>(0xC0 | (c >> 6)));
+		pOutput->push_back(static_cast<char>(0x80 | (c & 0x3F)));
+	} else if (c < 0x10000) {
+		pOutput->push_back(static_cast<char>(0xE0 | (c >> 12)));
+		pOutput->push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+		pOutput->push_back(static_cast<char>(0x80 | (c & 0x3F)));
+	} else {
+		pOutput->push_back(static_cast<char>(0xF0 | (c >> 18)));
+		pOutput->push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+		pOutput->push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+		pOutput->push_back(static_cast<char>(0x80 | (c & 0x3F)));
+	}
+}
+
+/* UTF-16 to UTF-8 or escaped JSON, unpaired surrogates become U+FFFD. */
+static std::string plain_from_utf16(
+	const utf16_t* pInput, uint32_t uCount, bool bJson)
+{
+	std::string output;
+	for (uint32_t i = 0; i < uCount; i++) {
+		uint32_t c = pInput[i];
+		if ((c >= 0xD800) && (c <= 0xDBFF) && (i + 1 < uCount) &&
+			(pInput[i + 1] >= 0xDC00) && (pInput[i + 1] <= 0xDFFF)) {
+			c = 0x10000 + ((c - 0xD800) << 10) + (pInput[i + 1] - 0xDC00);
+			i++;
+		} else if ((c >= 0xD800) && (c <= 0xDFFF)) {
+			c = 0xFFFD;
+		}
+		if (bJson) {
+			char escaped[NSSM_JSON_CHAR_MAX];
+			output.append(escaped, json_put_char(c, escaped));
+		} else {
+			append_utf8(&output, c);
+		}
+	}
+	return output;
+}
+
+/* Valid UTF-8 to UTF-16 with no checking at all. */
+static uint32_t plain_to_utf16(
+	const uint8_t* pInput, uint32_t uLength, utf16_t* pOutput)
+{
+	uint32_t o = 0;
+	for (uint32_t i = 0; i < uLength;) {
+		uint32_t c = pInput[i];
+		uint32_t uExtra = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0);
+		c &= 0x7FU >> (uExtra ? uExtra + 1 : 0);
+		for (uint32_t j = 1; (j <= uExtra) && (i + j < uLength); j++) {
+			c = (c << 6) | (pInput[i + j] & 0x3FU);
+		}
+		i += uExtra + 1;
+		if (c >= 0x10000) {
+			c -= 0x10000;
+			pOutput[o++] = static_cast<utf16_t>(0xD800 + (c >> 10));
+			pOutput[o++] = static_cast<utf16_t>(0xDC00 + (c & 0x3FF));
+		} else {
+			pOutput[o++] = static_cast<utf16_t>(c);
+		}
+	}
+	return o;
+}
+
+/***************************************
+
+	Drive the converters a piece at a time
+
+	uPiece and uRoom are the most input and output per call, picked at
+	random when uSeed isn't 0.  No input at all would mean a flush.
+
+***************************************/
+
+static std::string run_from_utf16(const utf16_t* pInput, uint32_t uCount,
+	bool bJson, uint32_t uSeed)
+{
+	std::string output;
+	char buffer[256];
+	uint32_t uSurrogate = 0;
+	uint32_t i = 0;
+	while (i < uCount) {
+		uint32_t uPiece = uCount - i;
+		uint32_t uRoom = sizeof(buffer);
+		if (uSeed) {
+			uPiece = 1 + bench_random(&uSeed) % uPiece;
+			uRoom = NSSM_JSON_CHAR_MAX + bench_random(&uSeed) % 64;
+		}
+		uint32_t uConsumed;
+		uint32_t o = bJson ?
+			json_escape_utf16(pInput + i, uPiece, buffer, uRoom, &uSurrogate,
+				&uConsumed) :
+			utf16_to_utf8(pInput + i, uPiece, buffer, uRoom, &uSurrogate,
+				&uConsumed);
+		output.append(buffer, o);
+		i += uConsumed;
+	}
+
+	if (bJson) {
+		uint32_t uConsumed;
+		uint32_t o = json_escape_utf16(
+			pInput, 0, buffer, sizeof(buffer), &uSurrogate, &uConsumed);
+		output.append(buffer, o);
+	}
+	return output;
+}
+
+static std::vector<utf16_t> run_to_utf16(
+	const uint8_t* pInput, uint32_t uLength, uint32_t uSeed)
+{
+	std::vector<utf16_t> output;
+	utf16_t buffer[128];
+	uint32_t uPending = 0;
+	uint32_t i = 0;
+	while (i < uLength) {
+		uint32_t uPiece = uLength - i;
+		uint32_t uRoom = sizeof(buffer) / sizeof(buffer[0]);
+		if (uSeed) {
+			uPiece = 1 + bench_random(&uSeed) % uPiece;
+			uRoom = NSSM_UTF16_CHAR_MAX + bench_random(&uSeed) % 64;
+		}
+		uint32_t uConsumed;
+		uint32_t o = utf8_to_utf16(
+			pInput + i, uPiece, buffer, uRoom, &uPending, &uConsumed);
+		output.insert(output.end(), buffer, buffer + o);
+		i += uConsumed;
+	}
+
+	uint32_t uConsumed;
+	uint32_t o = utf8_to_utf16(pInput, 0, buffer,
+		sizeof(buffer) / sizeof(buffer[0]), &uPending, &uConsumed);
+	output.insert(output.end(), buffer, buffer + o);
+	return output;
+}
+
+/***************************************
+
+	Checks
+
+***************************************/
+
+static void check_scan(void)
+{
+	uint32_t uSeed = 12345;
+	uint8_t buffer[320];
+	uint32_t expected[NSSM_NEWLINE_BATCH];
+	uint32_t found[NSSM_NEWLINE_BATCH];
+
+	for (uint32_t uRound = 0; uRound < 20000; uRound++) {
+		uint32_t uLength = bench_random(&uSeed) % sizeof(buffer);
+		uint32_t uDensity = 1 + bench_random(&uSeed) % 40;
+		for (uint32_t i = 0; i < uLength; i++) {
+			uint32_t r = bench_random(&uSeed);
+			/* Zeros and stray newlines at odd offsets test UTF-16 too. */
+			buffer[i] = !(r % uDensity) ? '\n' : (r & 0x100) ? 0 : 'a';
+		}
+		uint32_t uCharsize = (uRound & 1) ? 2 : 1;
+		uint32_t uMaxEnds = 1 + bench_random(&uSeed) % NSSM_NEWLINE_BATCH;
+		uint32_t uExpected = scan_newlines_bytes(
+			buffer, uLength, uCharsize, expected, uMaxEnds);
+
+		for (uint32_t k = 0; k < 3; k++) {
+			ScanNewlinesProc pScan = scan_newlines_kernel(k);
+			if (!pScan) {
+				continue;
+			}
+			uint32_t uFound =
+				pScan(buffer, uLength, uCharsize, found, uMaxEnds);
+			BENCH_CHECK((uFound == uExpected) &&
+					!memcmp(found, expected, uFound * sizeof(uint32_t)),
+				"scan_newlines %s, %u bytes of charsize %u, round %u",
+				g_KernelNames[k], uLength, uCharsize, uRound);
+		}
+
+		uint32_t uLast = 0;
+		uint32_t uAll = scan_newlines_bytes(
+			buffer, uLength, uCharsize, expected, NSSM_NEWLINE_BATCH);
+		if (uAll) {
+			uLast = expected[uAll - 1];
+		}
+		if (uAll < NSSM_NEWLINE_BATCH) {
+			BENCH_CHECK(find_last_newline(buffer, uLength, uCharsize) == uLast,
+				"find_last_newline, round %u", uRound);
+			BENCH_CHECK(count_lines(buffer, uLength, uCharsize) == uAll,
+				"count_lines, round %u", uRound);
+		}
+		BENCH_CHECK(find_newline(buffer, uLength, uCharsize) ==
+				(uAll ? expected[0] : 0),
+			"find_newline, round %u", uRound);
+	}
+}
+
+static void check_json(void)
+{
+	char escaped[NSSM_JSON_CHAR_MAX];
+	static const struct {
+		uint32_t m_uChar;
+		const char* m_pExpected;
+	} g_Cases[] = {{'"', "\\\""}, {'\\', "\\\\"}, {'\n', "\\n"},
+		{1, "\\u0001"}, {0x1F, "\\u001f"}, {'a', "a"}, {0xE9, "\xC3\xA9"},
+		{0x20AC, "\xE2\x82\xAC"}, {0x1F600, "\xF0\x9F\x98\x80"}};
+	for (uint32_t i = 0; i < sizeof(g_Cases) / sizeof(g_Cases[0]); i++) {
+		uint32_t uLength = json_put_char(g_Cases[i].m_uChar, escaped);
+		BENCH_CHECK((uLength == strlen(g_Cases[i].m_pExpected)) &&
+				!memcmp(escaped, g_Cases[i].m_pExpected, uLength),
+			"json_put_char of U+%04X", g_Cases[i].m_uChar);
+	}
+
+	uint32_t uSeed = 777;
+	uint8_t bytes[200];
+	utf16_t chars[200];
+	for (uint32_t uRound = 0; uRound < 20000; uRound++) {
+		uint32_t uLength = bench_random(&uSeed) % sizeof(bytes);
+		for (uint32_t i = 0; i < uLength; i++) {
+			uint32_t r = bench_random(&uSeed);
+			static const uint8_t g_Special[] = {'"', '\\', '\n', 1, 0x80, 0xE9};
+			bytes[i] = (r % 17) ? 'a' + (r >> 8) % 26 : g_Special[(r >> 8) % 6];
+			/* Sprinkle in surrogates, paired and not. */
+			chars[i] = ((r % 13) == 1) ? 0xD800 + (r >> 16) % 0x800
+				: ((r % 13) == 2)     ? 0x100 + (r >> 16) % 0x2000
+									  : bytes[i];
+		}
+
+		uint32_t uSpan = json_plain_span(bytes, uLength);
+		BENCH_CHECK(uSpan == plain_json_span(bytes, uLength),
+			"json_plain_span, %u bytes, round %u", uLength, uRound);
+
+		std::string expected = plain_from_utf16(chars, uLength, true);
+		BENCH_CHECK(run_from_utf16(chars, uLength, true, 0) == expected,
+			"json_escape_utf16 whole, round %u", uRound);
+		BENCH_CHECK(
+			run_from_utf16(chars, uLength, true, uRound + 1) == expected,
+			"json_escape_utf16 in pieces, round %u", uRound);
+	}
+}
+
+static void check_transcode(void)
+{
+	/* Bad sequences are kept as Latin-1. */
+	static const struct {
+		const char* m_pInput;
+		uint32_t m_uLength;
+		utf16_t m_Expected[8];
+		uint32_t m_uCount;
+	} g_Cases[] = {
+		{"\xC3\xA9", 2, {0xE9}, 1},
+		{"\xF0\x9F\x98\x80", 4, {0xD83D, 0xDE00}, 2},
+		{"\xC3(", 2, {0xC3, '('}, 2},
+		{"\xE2\x82", 2, {0xE2, 0x82}, 2},
+		{"\xC0\xAF", 2, {0xC0, 0xAF}, 2},
+		{"\xED\xA0\x80", 3, {0xED, 0xA0, 0x80}, 3},
+		{"\xF4\x90\x80\x80", 4, {0xF4, 0x90, 0x80, 0x80}, 4},
+		{"\xE0\x80\x80x", 4, {0xE0, 0x80, 0x80, 'x'}, 4},
+	};
+	for (uint32_t i = 0; i < sizeof(g_Cases) / sizeof(g_Cases[0]); i++) {
+		for (uint32_t uSeed = 0; uSeed < 50; uSeed++) {
+			std::vector<utf16_t> output = run_to_utf16(
+				reinterpret_cast<const uint8_t*>(g_Cases[i].m_pInput),
+				g_Cases[i].m_uLength, uSeed);
+			BENCH_CHECK((output.size() == g_Cases[i].m_uCount) &&
+					!memcmp(output.data(), g_Cases[i].m_Expected,
+						g_Cases[i].m_uCount * sizeof(utf16_t)),
+				"utf8_to_utf16 case %u, seed %u", i, uSeed);
+		}
+	}
+
+	/* Round trips and pieces against whole. */
+	uint32_t uSize = 64 * 1024;
+	std::vector<uint8_t> text(uSize);
+	make_log_text(text.data(), uSize, 99, BENCH_TEXT_ESCAPES | BENCH_TEXT_UTF8);
+	/* Don't cut a character in half at the end. */
+	while (uSize && (text[uSize - 1] & 0x80)) {
+		uSize--;
+	}
+	std::vector<utf16_t> chars(uSize);
+	chars.resize(plain_to_utf16(text.data(), uSize, chars.data()));
+	uint32_t uCount = static_cast<uint32_t>(chars.size());
+
+	std::vector<utf16_t> whole = run_to_utf16(text.data(), uSize, 0);
+	BENCH_CHECK(whole == chars, "utf8_to_utf16 of valid text");
+	std::string expected(reinterpret_cast<const char*>(text.data()), uSize);
+	BENCH_CHECK(run_from_utf16(chars.data(), uCount, false, 0) == expected,
+		"utf16_to_utf8 of valid text");
+
+	uint32_t uSeed = 4242;
+	for (uint32_t uRound = 1; uRound <= 200; uRound++) {
+		/* Garbage in, still the same however it's cut up. */
+		uint8_t bytes[300];
+		uint32_t uLength = bench_random(&uSeed) % sizeof(bytes);
+		for (uint32_t i = 0; i < uLength; i++) {
+			uint32_t r = bench_random(&uSeed);
+			bytes[i] = (r & 1) ? text[(r >> 1) % uSize] : (r >> 8) & 0xFF;
+		}
+		BENCH_CHECK(run_to_utf16(bytes, uLength, uRound) ==
+				run_to_utf16(bytes, uLength, 0),
+			"utf8_to_utf16 in pieces, round %u", uRound);
+
+		BENCH_CHECK(run_to_utf16(text.data(), uSize, uRound) == chars,
+			"utf8_to_utf16 of valid text in pieces, round %u", uRound);
+		BENCH_CHECK(
+			run_from_utf16(chars.data(), uCount, false, uRound) == expected,
+			"utf16_to_utf8 of valid text in pieces, round %u", uRound);
+	}
+
+	/* Unpaired surrogates become U+FFFD. */
+	static const utf16_t g_Lonely[] = {'a', 0xDC00, 'b', 0xD800, 'c'};
+	BENCH_CHECK(run_from_utf16(g_Lonely, 5, false, 0) ==
+			"a\xEF\xBF\xBD" "b\xEF\xBF\xBD" "c",
+		"utf16_to_utf8 of unpaired surrogates");
+}
+
+/***************************************
+
+	Benchmarks
+
+***************************************/
+
+static void bench_scan_proc(void* pParam)
+{
+	scan_param_t* pScan = static_cast<scan_param_t*>(pParam);
+	const uint8_t* pInput = pScan->m_pInput;
+	uint32_t uLength = pScan->m_uLength;
+	uint32_t ends[NSSM_NEWLINE_BATCH];
+	uint64_t uLines = 0;
+	uint32_t uFound;
+	do {
+		uFound = pScan->m_pScan(
+			pInput, uLength, pScan->m_uCharsize, ends, NSSM_NEWLINE_BATCH);
+		uLines += uFound;
+		if (uFound) {
+			pInput += ends[uFound - 1];
+			uLength -= ends[uFound - 1];
+		}
+	} while (uFound == NSSM_NEWLINE_BATCH);
+	pScan->m_uLines = uLines;
+}
+
+static void bench_span_proc(void* pParam)
+{
+	transcode_param_t* pSpan = static_cast<transcode_param_t*>(pParam);
+	const uint8_t* pInput = static_cast<const uint8_t*>(pSpan->m_pInput);
+	uint64_t uPlain = 0;
+	for (uint32_t i = 0; i < pSpan->m_uCount;) {
+		uint32_t uSpan = json_plain_span(pInput + i, pSpan->m_uCount - i);
+		uPlain += uSpan;
+		i += uSpan + 1;
+	}
+	pSpan->m_uOutput = uPlain;
+}
+
+static void bench_plain_span_proc(void* pParam)
+{
+	transcode_param_t* pSpan = static_cast<transcode_param_t*>(pParam);
+	const uint8_t* pInput = static_cast<const uint8_t*>(pSpan->m_pInput);
+	uint64_t uPlain = 0;
+	for (uint32_t i = 0; i < pSpan->m_uCount;) {
+		uint32_t uSpan = plain_json_span(pInput + i, pSpan->m_uCount - i);
+		uPlain += uSpan;
+		i += uSpan + 1;
+	}
+	pSpan->m_uOutput = uPlain;
+}
+
+static void bench_escape_proc(void* pParam)
+{
+	transcode_param_t* pEscape = static_cast<transcode_param_t*>(pParam);
+	const utf16_t* pInput = static_cast<const utf16_t*>(pEscape->m_pInput);
+	char buffer[1024];
+	uint32_t uSurrogate = 0;
+	uint64_t uOutput = 0;
+	for (uint32_t i = 0; i < pEscape->m_uCount;) {
+		uint32_t uConsumed;
+		uOutput += json_escape_utf16(pInput + i, pEscape->m_uCount - i,
+			buffer, sizeof(buffer), &uSurrogate, &uConsumed);
+		i += uConsumed;
+	}
+	pEscape->m_uOutput = uOutput;
+}
+
+static void bench_plain_escape_proc(void* pParam)
+{
+	transcode_param_t* pEscape = static_cast<transcode_param_t*>(pParam);
+	pEscape->m_uOutput = plain_from_utf16(
+		static_cast<const utf16_t*>(pEscape->m_pInput), pEscape->m_uCount,
+		true)
+							 .size();
+}
+
+static void bench_to_utf8_proc(void* pParam)
+{
+	transcode_param_t* pTranscode = static_cast<transcode_param_t*>(pParam);
+	const utf16_t* pInput = static_cast<const utf16_t*>(pTranscode->m_pInput);
+	char buffer[1024 * NSSM_UTF8_CHAR_MAX];
+	uint32_t uSurrogate = 0;
+	uint64_t uOutput = 0;
+	for (uint32_t i = 0; i < pTranscode->m_uCount;) {
+		uint32_t uConsumed;
+		uOutput += utf16_to_utf8(pInput + i, pTranscode->m_uCount - i, buffer,
+			sizeof(buffer), &uSurrogate, &uConsumed);
+		i += uConsumed;
+	}
+	pTranscode->m_uOutput = uOutput;
+}
+
+static void bench_plain_to_utf8_proc(void* pParam)
+{
+	transcode_param_t* pTranscode = static_cast<transcode_param_t*>(pParam);
+	pTranscode->m_uOutput =
+		plain_from_utf16(static_cast<const utf16_t*>(pTranscode->m_pInput),
+			pTranscode->m_uCount, false)
+			.size();
+}
+
+static void bench_to_utf16_proc(void* pParam)
+{
+	transcode_param_t* pTranscode = static_cast<transcode_param_t*>(pParam);
+	const uint8_t* pInput = static_cast<const uint8_t*>(pTranscode->m_pInput);
+	utf16_t buffer[1024];
+	uint32_t uPending = 0;
+	uint64_t uOutput = 0;
+	for (uint32_t i = 0; i < pTranscode->m_uCount;) {
+		uint32_t uConsumed;
+		uOutput += utf8_to_utf16(pInput + i, pTranscode->m_uCount - i, buffer,
+			sizeof(buffer) / sizeof(buffer[0]), &uPending, &uConsumed);
+		i += uConsumed;
+	}
+	pTranscode->m_uOutput = uOutput;
+}
+
+static void bench_plain_to_utf16_proc(void* pParam)
+{
+	static std::vector<utf16_t> s_Output;
+	transcode_param_t* pTranscode = static_cast<transcode_param_t*>(pParam);
+	s_Output.resize(pTranscode->m_uCount);
+	pTranscode->m_uOutput =
+		plain_to_utf16(static_cast<const uint8_t*>(pTranscode->m_pInput),
+			pTranscode->m_uCount, s_Output.data());
+}
+
+void bench_text(void)
+{
+	check_scan();
+	check_json();
+	check_transcode();
+
+	uint32_t uSize = g_bCheck ? BENCH_CHECK_SIZE : BENCH_TEXT_SIZE;
+	std::vector<uint8_t> plain(uSize);
+	uint32_t uLines = make_log_text(plain.data(), uSize, 1, 0);
+	std::vector<uint8_t> mixed(uSize);
+	make_log_text(mixed.data(), uSize, 2, BENCH_TEXT_ESCAPES | BENCH_TEXT_UTF8);
+	while (uSize && (mixed[uSize - 1] & 0x80)) {
+		mixed[--uSize] = ' ';
+	}
+	uSize = static_cast<uint32_t>(plain.size());
+
+	std::vector<utf16_t> wide(uSize);
+	for (uint32_t i = 0; i < uSize; i++) {
+		wide[i] = plain[i];
+	}
+	std::vector<utf16_t> mixedWide(uSize);
+	mixedWide.resize(plain_to_utf16(mixed.data(), uSize, mixedWide.data()));
+
+	printf("Newline scanning, %u bytes, %u lines\n", uSize, uLines);
+	for (uint32_t uCharsize = 1; uCharsize <= 2; uCharsize++) {
+		scan_param_t scan;
+		scan.m_pInput = (uCharsize == 1) ?
+			plain.data() :
+			reinterpret_cast<const uint8_t*>(wide.data());
+		scan.m_uLength = uSize * uCharsize;
+		scan.m_uCharsize = uCharsize;
+		char name[64];
+		snprintf(name, sizeof(name), "%s byte loop",
+			(uCharsize == 1) ? "8 bit" : "UTF-16");
+		scan.m_pScan = scan_newlines_bytes;
+		bench_time(name, bench_scan_proc, &scan, scan.m_uLength);
+		uint64_t uExpected = scan.m_uLines;
+		for (uint32_t k = 0; k < 3; k++) {
+			scan.m_pScan = scan_newlines_kernel(k);
+			if (!scan.m_pScan) {
+				continue;
+			}
+			snprintf(name, sizeof(name), "%s %s",
+				(uCharsize == 1) ? "8 bit" : "UTF-16", g_KernelNames[k]);
+			bench_time(name, bench_scan_proc, &scan, scan.m_uLength);
+			BENCH_CHECK(scan.m_uLines == uExpected, "%s line count", name);
+		}
+	}
+
+	printf("JSON escaping\n");
+	transcode_param_t transcode;
+	transcode.m_pInput = mixed.data();
+	transcode.m_uCount = uSize;
+	bench_time("json_plain_span byte loop", bench_plain_span_proc, &transcode,
+		uSize);
+	bench_time("json_plain_span", bench_span_proc, &transcode, uSize);
+
+	transcode.m_pInput = wide.data();
+	transcode.m_uCount = uSize;
+	bench_time("UTF-16 ASCII, json_put_char loop", bench_plain_escape_proc,
+		&transcode, uSize * sizeof(utf16_t));
+	bench_time("UTF-16 ASCII, json_escape_utf16", bench_escape_proc,
+		&transcode, uSize * sizeof(utf16_t));
+	transcode.m_pInput = mixedWide.data();
+	transcode.m_uCount = static_cast<uint32_t>(mixedWide.size());
+	bench_time("UTF-16 mixed, json_put_char loop", bench_plain_escape_proc,
+		&transcode, mixedWide.size() * sizeof(utf16_t));
+	bench_time("UTF-16 mixed, json_escape_utf16", bench_escape_proc,
+		&transcode, mixedWide.size() * sizeof(utf16_t));
+
+	printf("Transcoding\n");
+	transcode.m_pInput = wide.data();
+	transcode.m_uCount = uSize;
+	bench_time("UTF-16 ASCII to UTF-8, plain loop", bench_plain_to_utf8_proc,
+		&transcode, uSize * sizeof(utf16_t));
+	bench_time("UTF-16 ASCII to UTF-8, utf16_to_utf8", bench_to_utf8_proc,
+		&transcode, uSize * sizeof(utf16_t));
+	transcode.m_pInput = mixedWide.data();
+	transcode.m_uCount = static_cast<uint32_t>(mixedWide.size());
+	bench_time("UTF-16 mixed to UTF-8, plain loop", bench_plain_to_utf8_proc,
+		&transcode, mixedWide.size() * sizeof(utf16_t));
+	bench_time("UTF-16 mixed to UTF-8, utf16_to_utf8", bench_to_utf8_proc,
+		&transcode, mixedWide.size() * sizeof(utf16_t));
+
+	transcode.m_pInput = plain.data();
+	transcode.m_uCount = uSize;
+	bench_time("UTF-8 ASCII to UTF-16, plain loop", bench_plain_to_utf16_proc,
+		&transcode, uSize);
+	bench_time("UTF-8 ASCII to UTF-16, utf8_to_utf16", bench_to_utf16_proc,
+		&transcode, uSize);
+	transcode.m_pInput = mixed.data();
+	bench_time("UTF-8 mixed to UTF-16, plain loop", bench_plain_to_utf16_proc,
+		&transcode, uSize);
+	bench_time("UTF-8 mixed to UTF-16, utf8_to_utf16", bench_to_utf16_proc,
+		&transcode, uSize);
+}
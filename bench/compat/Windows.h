@@ -0,0 +1,408 @@
+/***************************************
+
+	Windows API stand-ins for building the bench elsewhere
+
+	Just enough of the file API, over POSIX file descriptors, for the
+	portable parts of NSSM which the bench links in.  Only used when the
+	bench is built on something other than Windows.
+
+***************************************/
+
+#ifndef __BENCH_COMPAT_WINDOWS_H__
+#define __BENCH_COMPAT_WINDOWS_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+typedef void* HANDLE;
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef int64_t LONGLONG;
+typedef uint16_t WORD;
+
+typedef union {
+	struct {
+		DWORD LowPart;
+		int32_t HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef union {
+	struct {
+		DWORD LowPart;
+		DWORD HighPart;
+	};
+	uint64_t QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct {
+	WORD wYear;
+	WORD wMonth;
+	WORD wDayOfWeek;
+	WORD wDay;
+	WORD wHour;
+	WORD wMinute;
+	WORD wSecond;
+	WORD wMilliseconds;
+} SYSTEMTIME;
+
+/* Only carried around, nothing here is overlapped. */
+typedef struct {
+	uintptr_t Internal;
+	uintptr_t InternalHigh;
+	DWORD Offset;
+	DWORD OffsetHigh;
+	HANDLE hEvent;
+} OVERLAPPED;
+
+#define INVALID_HANDLE_VALUE (reinterpret_cast<HANDLE>(intptr_t(-1)))
+
+#define GENERIC_READ 0x80000000U
+#define GENERIC_WRITE 0x40000000U
+#define FILE_SHARE_READ 0x00000001U
+#define FILE_SHARE_WRITE 0x00000002U
+#define FILE_SHARE_DELETE 0x00000004U
+#define CREATE_NEW 1U
+#define CREATE_ALWAYS 2U
+#define OPEN_EXISTING 3U
+#define FILE_ATTRIBUTE_NORMAL 0x00000080U
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000U
+#define FILE_BEGIN 0U
+#define FILE_CURRENT 1U
+#define FILE_END 2U
+#define PAGE_READWRITE 0x04U
+#define FILE_MAP_WRITE 0x0002U
+
+#define ERROR_FILE_NOT_FOUND 2L
+#define ERROR_ACCESS_DENIED 5L
+#define ERROR_NOT_ENOUGH_MEMORY 8L
+#define ERROR_WRITE_FAULT 29L
+#define ERROR_READ_FAULT 30L
+#define ERROR_FILE_EXISTS 80L
+#define ERROR_DISK_FULL 112L
+#define ERROR_INVALID_PARAMETER 87L
+
+/* One last error shared by every file which includes this. */
+inline DWORD* compat_last_error(void)
+{
+	static DWORD s_uError = 0;
+	return &s_uError;
+}
+
+inline DWORD GetLastError(void)
+{
+	return *compat_last_error();
+}
+
+inline void SetLastError(DWORD uError)
+{
+	*compat_last_error() = uError;
+}
+
+inline void compat_set_errno(int iError, DWORD uDefault)
+{
+	switch (iError) {
+	case ENOENT:
+		SetLastError(ERROR_FILE_NOT_FOUND);
+		break;
+	case EEXIST:
+		SetLastError(ERROR_FILE_EXISTS);
+		break;
+	case EACCES:
+	case EPERM:
+		SetLastError(ERROR_ACCESS_DENIED);
+		break;
+	case ENOMEM:
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		break;
+	case ENOSPC:
+		SetLastError(ERROR_DISK_FULL);
+		break;
+	default:
+		SetLastError(uDefault);
+		break;
+	}
+}
+
+/* The time now in UTC. */
+inline void GetSystemTime(SYSTEMTIME* pTime)
+{
+	struct timespec now;
+	struct tm utc;
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &utc);
+	pTime->wYear = static_cast<WORD>(utc.tm_year + 1900);
+	pTime->wMonth = static_cast<WORD>(utc.tm_mon + 1);
+	pTime->wDayOfWeek = static_cast<WORD>(utc.tm_wday);
+	pTime->wDay = static_cast<WORD>(utc.tm_mday);
+	pTime->wHour = static_cast<WORD>(utc.tm_hour);
+	pTime->wMinute = static_cast<WORD>(utc.tm_min);
+	pTime->wSecond = static_cast<WORD>(utc.tm_sec);
+	pTime->wMilliseconds = static_cast<WORD>(now.tv_nsec / 1000000);
+}
+
+inline int compat_fd(HANDLE hFile)
+{
+	return static_cast<int>(reinterpret_cast<intptr_t>(hFile));
+}
+
+inline HANDLE CreateFileW(const wchar_t* pPath, DWORD uAccess, DWORD uShare,
+	void* pSecurity, DWORD uDisposition, DWORD uFlags, HANDLE hTemplate)
+{
+	(void)uShare;
+	(void)pSecurity;
+	(void)uFlags;
+	(void)hTemplate;
+	char path[PATH_MAX];
+	if (wcstombs(path, pPath, sizeof(path)) >= sizeof(path)) {
+		SetLastError(ERROR_FILE_NOT_FOUND);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	int iFlags = (uAccess & GENERIC_WRITE) ?
+		((uAccess & GENERIC_READ) ? O_RDWR : O_WRONLY) :
+		O_RDONLY;
+	if (uDisposition == CREATE_NEW) {
+		iFlags |= O_CREAT | O_EXCL;
+	} else if (uDisposition == CREATE_ALWAYS) {
+		iFlags |= O_CREAT | O_TRUNC;
+	}
+	int iFile = open(path, iFlags, 0644);
+	if (iFile < 0) {
+		compat_set_errno(errno, ERROR_ACCESS_DENIED);
+		return INVALID_HANDLE_VALUE;
+	}
+	return reinterpret_cast<HANDLE>(static_cast<intptr_t>(iFile));
+}
+
+inline BOOL ReadFile(HANDLE hFile, void* pBuffer, DWORD uLength,
+	DWORD* pRead, void* pOverlapped)
+{
+	(void)pOverlapped;
+	ssize_t iRead;
+	do {
+		iRead = read(compat_fd(hFile), pBuffer, uLength);
+	} while ((iRead < 0) && (errno == EINTR));
+	if (iRead < 0) {
+		compat_set_errno(errno, ERROR_READ_FAULT);
+		*pRead = 0;
+		return 0;
+	}
+	*pRead = static_cast<DWORD>(iRead);
+	return 1;
+}
+
+inline BOOL WriteFile(HANDLE hFile, const void* pBuffer, DWORD uLength,
+	DWORD* pWritten, void* pOverlapped)
+{
+	(void)pOverlapped;
+	ssize_t iWritten;
+	do {
+		iWritten = write(compat_fd(hFile), pBuffer, uLength);
+	} while ((iWritten < 0) && (errno == EINTR));
+	if (iWritten < 0) {
+		compat_set_errno(errno, ERROR_WRITE_FAULT);
+		*pWritten = 0;
+		return 0;
+	}
+	*pWritten = static_cast<DWORD>(iWritten);
+	return 1;
+}
+
+inline BOOL FlushFileBuffers(HANDLE hFile)
+{
+	if (fsync(compat_fd(hFile))) {
+		compat_set_errno(errno, ERROR_WRITE_FAULT);
+		return 0;
+	}
+	return 1;
+}
+
+inline BOOL CloseHandle(HANDLE hFile)
+{
+	return !close(compat_fd(hFile));
+}
+
+inline BOOL DeleteFileW(const wchar_t* pPath)
+{
+	char path[PATH_MAX];
+	if (wcstombs(path, pPath, sizeof(path)) >= sizeof(path)) {
+		SetLastError(ERROR_FILE_NOT_FOUND);
+		return 0;
+	}
+	if (unlink(path)) {
+		compat_set_errno(errno, ERROR_ACCESS_DENIED);
+		return 0;
+	}
+	return 1;
+}
+
+inline BOOL SetFilePointerEx(
+	HANDLE hFile, LARGE_INTEGER distance, LARGE_INTEGER* pNew, DWORD uMethod)
+{
+	int iWhence = (uMethod == FILE_END) ? SEEK_END :
+		(uMethod == FILE_CURRENT)       ? SEEK_CUR :
+										  SEEK_SET;
+	off_t iPosition = lseek(compat_fd(hFile), distance.QuadPart, iWhence);
+	if (iPosition < 0) {
+		compat_set_errno(errno, ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+	if (pNew) {
+		pNew->QuadPart = iPosition;
+	}
+	return 1;
+}
+
+inline BOOL SetEndOfFile(HANDLE hFile)
+{
+	off_t iPosition = lseek(compat_fd(hFile), 0, SEEK_CUR);
+	if ((iPosition < 0) || ftruncate(compat_fd(hFile), iPosition)) {
+		compat_set_errno(errno, ERROR_WRITE_FAULT);
+		return 0;
+	}
+	return 1;
+}
+
+inline BOOL GetFileSizeEx(HANDLE hFile, LARGE_INTEGER* pSize)
+{
+	struct stat info;
+	if (fstat(compat_fd(hFile), &info)) {
+		compat_set_errno(errno, ERROR_READ_FAULT);
+		return 0;
+	}
+	pSize->QuadPart = info.st_size;
+	return 1;
+}
+
+/*
+  A mapping is a duplicate of the file descriptor, after growing the file
+  to the size of the mapping as Windows does.
+*/
+inline HANDLE CreateFileMappingW(HANDLE hFile, void* pSecurity,
+	DWORD uProtect, DWORD uSizeHigh, DWORD uSizeLow, const wchar_t* pName)
+{
+	(void)pSecurity;
+	(void)uProtect;
+	(void)pName;
+	off_t iSize = static_cast<off_t>(
+		(static_cast<uint64_t>(uSizeHigh) << 32) | uSizeLow);
+	struct stat info;
+	if (fstat(compat_fd(hFile), &info) ||
+		((info.st_size < iSize) && ftruncate(compat_fd(hFile), iSize))) {
+		compat_set_errno(errno, ERROR_WRITE_FAULT);
+		return NULL;
+	}
+	int iMapping = dup(compat_fd(hFile));
+	if (iMapping < 0) {
+		compat_set_errno(errno, ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+	return reinterpret_cast<HANDLE>(static_cast<intptr_t>(iMapping));
+}
+
+/* munmap() needs the length, which UnmapViewOfFile() isn't given. */
+struct compat_view_t {
+	void* m_pView;
+	size_t m_uLength;
+};
+
+inline compat_view_t* compat_views(void)
+{
+	static compat_view_t s_Views[16];
+	return s_Views;
+}
+
+inline void* MapViewOfFile(HANDLE hMapping, DWORD uAccess,
+	DWORD uOffsetHigh, DWORD uOffsetLow, size_t uLength)
+{
+	(void)uAccess;
+	compat_view_t* pViews = compat_views();
+	uint32_t i = 0;
+	while ((i < 16) && pViews[i].m_pView) {
+		i++;
+	}
+	if (i == 16) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+	off_t iOffset = static_cast<off_t>(
+		(static_cast<uint64_t>(uOffsetHigh) << 32) | uOffsetLow);
+	void* pView = mmap(NULL, uLength, PROT_READ | PROT_WRITE, MAP_SHARED,
+		compat_fd(hMapping), iOffset);
+	if (pView == MAP_FAILED) {
+		compat_set_errno(errno, ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+	pViews[i].m_pView = pView;
+	pViews[i].m_uLength = uLength;
+	return pView;
+}
+
+inline BOOL UnmapViewOfFile(const void* pView)
+{
+	compat_view_t* pViews = compat_views();
+	for (uint32_t i = 0; i < 16; i++) {
+		if (pViews[i].m_pView == pView) {
+			munmap(pViews[i].m_pView, pViews[i].m_uLength);
+			pViews[i].m_pView = NULL;
+			return 1;
+		}
+	}
+	SetLastError(ERROR_INVALID_PARAMETER);
+	return 0;
+}
+
+inline BOOL FlushViewOfFile(const void* pView, size_t uLength)
+{
+	if (msync(const_cast<void*>(pView), uLength, MS_SYNC)) {
+		compat_set_errno(errno, ERROR_WRITE_FAULT);
+		return 0;
+	}
+	return 1;
+}
+
+inline BOOL CreatePipe(
+	HANDLE* pRead, HANDLE* pWrite, void* pSecurity, DWORD uSize)
+{
+	(void)pSecurity;
+	(void)uSize;
+	int files[2];
+	if (pipe(files)) {
+		compat_set_errno(errno, ERROR_NOT_ENOUGH_MEMORY);
+		return 0;
+	}
+	*pRead = reinterpret_cast<HANDLE>(static_cast<intptr_t>(files[0]));
+	*pWrite = reinterpret_cast<HANDLE>(static_cast<intptr_t>(files[1]));
+	return 1;
+}
+
+/* Only says how many bytes are waiting. */
+inline BOOL PeekNamedPipe(HANDLE hPipe, void* pBuffer, DWORD uLength,
+	DWORD* pRead, DWORD* pAvailable, DWORD* pLeft)
+{
+	(void)pBuffer;
+	(void)uLength;
+	(void)pRead;
+	(void)pLeft;
+	int iAvailable = 0;
+	if (ioctl(compat_fd(hPipe), FIONREAD, &iAvailable)) {
+		compat_set_errno(errno, ERROR_READ_FAULT);
+		return 0;
+	}
+	*pAvailable = static_cast<DWORD>(iAvailable);
+	return 1;
+}
+
+#endif
@@ -0,0 +1,78 @@
+/***************************************
+
+	Support functions for the bench
+
+	Stand-ins for memorymanager.cpp and utf8.cpp, which pull in the rest
+	of NSSM.
+
+***************************************/
+
+#include "memorymanager.h"
+#include "utf8.h"
+
+#include <stdlib.h>
+#include <wchar.h>
+
+void* heap_alloc(uintptr_t uSize)
+{
+	return malloc(uSize ? uSize : 1);
+}
+
+void* heap_calloc(uintptr_t uSize)
+{
+	return calloc(uSize ? uSize : 1, 1);
+}
+
+int heap_free(void* pInput)
+{
+	free(pInput);
+	return 0;
+}
+
+/* Convert a wide string to UTF-8, whether wchar_t is UTF-16 or UTF-32. */
+int to_utf8(const wchar_t* pInput, char** ppOutput, uint32_t* pOutputLength)
+{
+	*ppOutput = NULL;
+	if (pOutputLength) {
+		*pOutputLength = 0;
+	}
+
+	size_t uCount = wcslen(pInput);
+	char* pOutput = static_cast<char*>(heap_alloc(uCount * 4 + 1));
+	if (!pOutput) {
+		return 2;
+	}
+
+	uint32_t o = 0;
+	for (size_t i = 0; i < uCount; i++) {
+		uint32_t c = static_cast<uint32_t>(pInput[i]);
+		if ((c >= 0xD800) && (c <= 0xDBFF) && (i + 1 < uCount)) {
+			uint32_t uLow = static_cast<uint32_t>(pInput[i + 1]);
+			if ((uLow >= 0xDC00) && (uLow <= 0xDFFF)) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (uLow - 0xDC00);
+				i++;
+			}
+		}
+		if (c < 0x80) {
+			pOutput[o++] = static_cast<char>(c);
+		} else if (c < 0x800) {
+			pOutput[o++] = static_cast<char>(0xC0 | (c >> 6));
+			pOutput[o++] = static_cast<char>(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			pOutput[o++] = static_cast<char>(0xE0 | (c >> 12));
+			pOutput[o++] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+			pOutput[o++] = static_cast<char>(0x80 | (c & 0x3F));
+		} else {
+			pOutput[o++] = static_cast<char>(0xF0 | (c >> 18));
+			pOutput[o++] = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+			pOutput[o++] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+			pOutput[o++] = static_cast<char>(0x80 | (c & 0x3F));
+		}
+	}
+	pOutput[o] = 0;
+	*ppOutput = pOutput;
+	if (pOutputLength) {
+		*pOutputLength = o;
+	}
+	return 0;
+}
@@ -0,0 +1,1018 @@
+/***************************************
+
+	Log file compression
+
+	Rotated log files are compressed into the gzip format (RFC 1952) so
+	they can be read with the usual tools.  The deflate encoder (RFC 1951)
+	streams the file through a sliding window, finds matches with hash
+	chains and lazy evaluation, and picks the smallest of a stored, fixed
+	Huffman or dynamic Huffman encoding for each block.
+
+***************************************/
+
+#include "compress.h"
+#include "memorymanager.h"
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+#include <string.h>
+
+// Largest distance back a match may refer to
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_WINDOW_MASK (DEFLATE_WINDOW - 1)
+
+// Shortest and longest matches
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+// Bytes kept ahead of the current position so a match can always complete
+#define DEFLATE_MIN_LOOKAHEAD (DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH + 1)
+
+// Furthest back a match is looked for so it stays inside the window
+#define DEFLATE_MAX_DISTANCE (DEFLATE_WINDOW - DEFLATE_MIN_LOOKAHEAD)
+
+// Hash of three bytes used to find match candidates
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_HASH_MASK (DEFLATE_HASH_SIZE - 1)
+#define DEFLATE_HASH_SHIFT 5
+
+// Number of literals and matches collected into each block
+#define DEFLATE_SYMBOLS 16384
+
+// Number of codes in each Huffman alphabet
+#define DEFLATE_LITERALS 286
+#define DEFLATE_DISTANCES 30
+#define DEFLATE_CODE_LENGTHS 19
+#define DEFLATE_END_OF_BLOCK 256
+
+// Longest Huffman codes allowed
+#define DEFLATE_MAX_BITS 15
+#define DEFLATE_MAX_CODE_LENGTH_BITS 7
+
+// Output is written to the file in chunks of this size
+#define DEFLATE_OUTPUT 65536
+
+// Largest stored block
+#define DEFLATE_MAX_STORED 65535
+
+// Operating system field of the gzip header, NTFS
+#define GZIP_OS_NTFS 11
+
+struct deflate_config_t {
+	// Stop searching so hard once a match this long has been found
+	uint16_t m_uGoodLength;
+	// Don't look for a better match after one this long
+	uint16_t m_uMaxLazy;
+	// Stop searching altogether after a match this long
+	uint16_t m_uNiceLength;
+	// Most hash chain entries to check
+	uint16_t m_uMaxChain;
+};
+
+// Tuned as zlib does for each level, 1 is fastest and 9 is smallest
+static const deflate_config_t g_DeflateConfig[NSSM_COMPRESS_LEVEL_MAX] = {
+	{4, 4, 8, 4}, {4, 5, 16, 8}, {4, 6, 32, 32}, {4, 4, 16, 16},
+	{8, 16, 32, 32}, {8, 16, 128, 128}, {8, 32, 128, 256},
+	{32, 128, 258, 1024}, {32, 258, 258, 4096}};
+
+static const uint16_t g_LengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13,
+	15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195,
+	227, 258};
+static const uint8_t g_LengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1,
+	1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t g_DistanceBase[DEFLATE_DISTANCES] = {1, 2, 3, 4, 5, 7,
+	9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537,
+	2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t g_DistanceExtra[DEFLATE_DISTANCES] = {0, 0, 0, 0, 1, 1,
+	2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12,
+	13, 13};
+static const uint8_t g_CodeLengthOrder[DEFLATE_CODE_LENGTHS] = {16, 17, 18,
+	0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+struct deflate_t {
+	// File being compressed
+	HANDLE m_hInput;
+	// Compressed file
+	HANDLE m_hOutput;
+
+	// Match finding parameters for the compression level
+	deflate_config_t m_Config;
+
+	// Sliding window, with room for compares to run past the end
+	uint8_t m_Window[DEFLATE_WINDOW * 2 + DEFLATE_MAX_MATCH];
+	// Most recent position for each hash, 0 for none
+	uint16_t m_Head[DEFLATE_HASH_SIZE];
+	// Previous position with the same hash, indexed by position
+	uint16_t m_Prev[DEFLATE_WINDOW];
+
+	// Match length or literal byte for each symbol in the block
+	uint16_t m_SymbolLength[DEFLATE_SYMBOLS];
+	// Match distance for each symbol in the block, 0 for a literal
+	uint16_t m_SymbolDistance[DEFLATE_SYMBOLS];
+	// Frequency of each literal/length code in the block
+	uint32_t m_LiteralFreq[DEFLATE_LITERALS];
+	// Frequency of each distance code in the block
+	uint32_t m_DistanceFreq[DEFLATE_DISTANCES];
+
+	// Length code for each match length less DEFLATE_MIN_MATCH
+	uint8_t m_LengthCode[256];
+	// Distance code for distances below 257, then for each 128 above
+	uint8_t m_DistanceCode[512];
+	// CRC-32 lookup table
+	uint32_t m_CRCTable[256];
+
+	// Compressed data waiting to be written
+	uint8_t m_Output[DEFLATE_OUTPUT];
+	// Bits waiting to be added to m_Output
+	uint64_t m_uBits;
+	// Number of bits in m_uBits
+	uint32_t m_uBitCount;
+	// Bytes of m_Output in use
+	uint32_t m_uOutputUsed;
+
+	// Running CRC-32 of the input
+	uint32_t m_uCRC;
+	// Total bytes read from the input
+	uint64_t m_uInputSize;
+	// Total bytes written to the output
+	uint64_t m_uOutputSize;
+
+	// Window position being matched
+	uint32_t m_uStart;
+	// Valid bytes in the window from m_uStart onwards
+	uint32_t m_uLookahead;
+	// Window position of the first byte in the current block
+	uint32_t m_uBlockStart;
+	// Window position after the last byte in the current block
+	uint32_t m_uBlockEnd;
+	// Window position of the last match found
+	uint32_t m_uMatchStart;
+	// Rolling hash of the next three bytes
+	uint32_t m_uHash;
+	// Number of symbols in the block
+	uint32_t m_uSymbols;
+
+	// Error code from the first read or write which failed
+	unsigned long m_uError;
+	// 0, or the return code for gzip_file() once something has failed
+	int m_iFailed;
+	// True once the whole input has been read
+	bool m_bEOF;
+};
+
+/***************************************
+
+	Fill in the lookup tables
+
+***************************************/
+
+static void deflate_init(deflate_t* pDeflate, uint32_t uLevel)
+{
+	pDeflate->m_Config = g_DeflateConfig[uLevel - 1];
+
+	uint32_t uCode;
+	uint32_t i;
+	for (uCode = 0; uCode < 28; uCode++) {
+		for (i = 0; i < (1U << g_LengthExtra[uCode]); i++) {
+			uint32_t uLength = g_LengthBase[uCode] - DEFLATE_MIN_MATCH + i;
+			pDeflate->m_LengthCode[uLength] = static_cast<uint8_t>(uCode);
+		}
+	}
+	/* 258 has its own code, though 227 plus 31 would also fit code 27. */
+	pDeflate->m_LengthCode[255] = 28;
+
+	for (uCode = 0; uCode < DEFLATE_DISTANCES; uCode++) {
+		uint32_t uBase = g_DistanceBase[uCode] - 1U;
+		uint32_t uCount = 1U << g_DistanceExtra[uCode];
+		for (i = 0; i < uCount; i++) {
+			uint32_t uDistance = uBase + i;
+			if (uDistance < 256) {
+				pDeflate->m_DistanceCode[uDistance] =
+					static_cast<uint8_t>(uCode);
+			} else {
+				pDeflate->m_DistanceCode[256 + (uDistance >> 7)] =
+					static_cast<uint8_t>(uCode);
+			}
+		}
+	}
+
+	for (i = 0; i < 256; i++) {
+		uint32_t uCRC = i;
+		for (uint32_t j = 0; j < 8; j++) {
+			uCRC = (uCRC >> 1) ^ ((uCRC & 1) ? 0xEDB88320U : 0);
+		}
+		pDeflate->m_CRCTable[i] = uCRC;
+	}
+	pDeflate->m_uCRC = 0xFFFFFFFFU;
+}
+
+static inline uint32_t distance_code(deflate_t* pDeflate, uint32_t uDistance)
+{
+	uDistance--;
+	if (uDistance < 256) {
+		return pDeflate->m_DistanceCode[uDistance];
+	}
+	return pDeflate->m_DistanceCode[256 + (uDistance >> 7)];
+}
+
+/***************************************
+
+	Output
+
+***************************************/
+
+static void flush_output(deflate_t* pDeflate)
+{
+	uint32_t uOffset = 0;
+	while (!pDeflate->m_iFailed && (uOffset < pDeflate->m_uOutputUsed)) {
+		DWORD uWritten;
+		if (!WriteFile(pDeflate->m_hOutput, pDeflate->m_Output + uOffset,
+				pDeflate->m_uOutputUsed - uOffset, &uWritten, NULL)) {
+			pDeflate->m_uError = GetLastError();
+			pDeflate->m_iFailed = 5;
+			break;
+		}
+		uOffset += uWritten;
+	}
+	pDeflate->m_uOutputSize += pDeflate->m_uOutputUsed;
+	pDeflate->m_uOutputUsed = 0;
+}
+
+static inline void put_byte(deflate_t* pDeflate, uint32_t uByte)
+{
+	pDeflate->m_Output[pDeflate->m_uOutputUsed++] = static_cast<uint8_t>(uByte);
+	if (pDeflate->m_uOutputUsed == DEFLATE_OUTPUT) {
+		flush_output(pDeflate);
+	}
+}
+
+static inline void put_le32(deflate_t* pDeflate, uint32_t uValue)
+{
+	put_byte(pDeflate, uValue & 0xFF);
+	put_byte(pDeflate, (uValue >> 8) & 0xFF);
+	put_byte(pDeflate, (uValue >> 16) & 0xFF);
+	put_byte(pDeflate, uValue >> 24);
+}
+
+/* Add bits to the stream, least significant first. */
+static inline void put_bits(
+	deflate_t* pDeflate, uint32_t uValue, uint32_t uCount)
+{
+	pDeflate->m_uBits |= static_cast<uint64_t>(uValue) << pDeflate->m_uBitCount;
+	pDeflate->m_uBitCount += uCount;
+	while (pDeflate->m_uBitCount >= 8) {
+		put_byte(pDeflate, static_cast<uint32_t>(pDeflate->m_uBits & 0xFF));
+		pDeflate->m_uBits >>= 8;
+		pDeflate->m_uBitCount -= 8;
+	}
+}
+
+/* Pad the stream with zero bits to a byte boundary. */
+static inline void align_bits(deflate_t* pDeflate)
+{
+	if (pDeflate->m_uBitCount) {
+		put_bits(pDeflate, 0, 8 - pDeflate->m_uBitCount);
+	}
+}
+
+/***************************************
+
+	Huffman codes
+
+***************************************/
+
+/*
+  Work out code lengths for the given symbol frequencies, no longer than
+  uLimit bits.  If the optimal code is too long the frequencies are
+  flattened and the code is built again, which costs little in practice.
+*/
+static void build_lengths(const uint32_t* pFreq, uint32_t uCount,
+	uint32_t uLimit, uint8_t* pLengths)
+{
+	uint32_t Weight[DEFLATE_LITERALS * 2];
+	uint32_t Parent[DEFLATE_LITERALS * 2];
+	uint32_t Leaves[DEFLATE_LITERALS];
+	uint32_t Freq[DEFLATE_LITERALS];
+
+	uint32_t uLeaves = 0;
+	uint32_t i;
+	for (i = 0; i < uCount; i++) {
+		pLengths[i] = 0;
+		Freq[i] = pFreq[i];
+		if (Freq[i]) {
+			Leaves[uLeaves++] = i;
+		}
+	}
+	if (!uLeaves) {
+		return;
+	}
+	if (uLeaves == 1) {
+		pLengths[Leaves[0]] = 1;
+		return;
+	}
+
+	while (true) {
+		/* Sort the leaves by frequency, there are few enough for this. */
+		for (i = 1; i < uLeaves; i++) {
+			uint32_t uLeaf = Leaves[i];
+			uint32_t j = i;
+			while (j && (Freq[Leaves[j - 1]] > Freq[uLeaf])) {
+				Leaves[j] = Leaves[j - 1];
+				j--;
+			}
+			Leaves[j] = uLeaf;
+		}
+
+		/*
+		  Nodes 0 to uLeaves-1 are the sorted leaves, internal nodes follow
+		  in the order they are made, which is also by increasing weight, so
+		  the two lightest nodes are always at the front of one of the two
+		  queues.
+		*/
+		for (i = 0; i < uLeaves; i++) {
+			Weight[i] = Freq[Leaves[i]];
+		}
+		uint32_t uNextLeaf = 0;
+		uint32_t uNextNode = uLeaves;
+		uint32_t uNodes = uLeaves;
+		while (uNodes < (uLeaves * 2 - 1)) {
+			uint32_t Pick[2];
+			for (uint32_t j = 0; j < 2; j++) {
+				if ((uNextLeaf < uLeaves) &&
+					((uNextNode >= uNodes) ||
+						(Weight[uNextLeaf] <= Weight[uNextNode]))) {
+					Pick[j] = uNextLeaf++;
+				} else {
+					Pick[j] = uNextNode++;
+				}
+			}
+			Weight[uNodes] = Weight[Pick[0]] + Weight[Pick[1]];
+			Parent[Pick[0]] = uNodes;
+			Parent[Pick[1]] = uNodes;
+			uNodes++;
+		}
+
+		/* Depth of each node is one more than its parent's. */
+		uint32_t uRoot = uNodes - 1;
+		Weight[uRoot] = 0;
+		uint32_t uLongest = 0;
+		for (i = uRoot; i-- > 0;) {
+			Weight[i] = Weight[Parent[i]] + 1;
+		}
+		for (i = 0; i < uLeaves; i++) {
+			if (Weight[i] > uLongest) {
+				uLongest = Weight[i];
+			}
+		}
+		if (uLongest <= uLimit) {
+			for (i = 0; i < uLeaves; i++) {
+				pLengths[Leaves[i]] = static_cast<uint8_t>(Weight[i]);
+			}
+			return;
+		}
+
+		for (i = 0; i < uLeaves; i++) {
+			Freq[Leaves[i]] = (Freq[Leaves[i]] + 1) >> 1;
+		}
+	}
+}
+
+/* Assign canonical codes for the lengths, bit reversed for output. */
+static void build_codes(
+	const uint8_t* pLengths, uint32_t uCount, uint16_t* pCodes)
+{
+	uint32_t Counts[DEFLATE_MAX_BITS + 1];
+	uint32_t Next[DEFLATE_MAX_BITS + 1];
+	memset(Counts, 0, sizeof(Counts));
+
+	uint32_t i;
+	for (i = 0; i < uCount; i++) {
+		Counts[pLengths[i]]++;
+	}
+	Counts[0] = 0;
+	uint32_t uCode = 0;
+	for (i = 1; i <= DEFLATE_MAX_BITS; i++) {
+		uCode = (uCode + Counts[i - 1]) << 1;
+		Next[i] = uCode;
+	}
+
+	for (i = 0; i < uCount; i++) {
+		uint32_t uLength = pLengths[i];
+		if (!uLength) {
+			pCodes[i] = 0;
+			continue;
+		}
+		uCode = Next[uLength]++;
+		uint32_t uReversed = 0;
+		for (uint32_t j = 0; j < uLength; j++) {
+			uReversed = (uReversed << 1) | (uCode & 1);
+			uCode >>= 1;
+		}
+		pCodes[i] = static_cast<uint16_t>(uReversed);
+	}
+}
+
+/*
+  Run length encode the literal/length and distance code lengths as a
+  single sequence of code length symbols.  The repeat count is stored in
+  the top byte of each entry.
+*/
+static uint32_t encode_lengths(const uint8_t* pLengths, uint32_t uCount,
+	uint16_t* pOutput, uint32_t* pFreq)
+{
+	uint32_t uOutput = 0;
+	uint32_t i = 0;
+	while (i < uCount) {
+		uint32_t uLength = pLengths[i];
+		uint32_t uRun = 1;
+		while (((i + uRun) < uCount) && (pLengths[i + uRun] == uLength)) {
+			uRun++;
+		}
+		i += uRun;
+
+		if (!uLength) {
+			while (uRun >= 11) {
+				uint32_t uRepeat = (uRun > 138) ? 138 : uRun;
+				pOutput[uOutput++] =
+					static_cast<uint16_t>(18 | ((uRepeat - 11) << 8));
+				pFreq[18]++;
+				uRun -= uRepeat;
+			}
+			if (uRun >= 3) {
+				pOutput[uOutput++] =
+					static_cast<uint16_t>(17 | ((uRun - 3) << 8));
+				pFreq[17]++;
+				uRun = 0;
+			}
+		} else {
+			pOutput[uOutput++] = static_cast<uint16_t>(uLength);
+			pFreq[uLength]++;
+			uRun--;
+			while (uRun >= 3) {
+				uint32_t uRepeat = (uRun > 6) ? 6 : uRun;
+				pOutput[uOutput++] =
+					static_cast<uint16_t>(16 | ((uRepeat - 3) << 8));
+				pFreq[16]++;
+				uRun -= uRepeat;
+			}
+		}
+		while (uRun) {
+			pOutput[uOutput++] = static_cast<uint16_t>(uLength);
+			pFreq[uLength]++;
+			uRun--;
+		}
+	}
+	return uOutput;
+}
+
+/***************************************
+
+	Blocks
+
+***************************************/
+
+/* Bits needed for the symbols in the block with the given code lengths. */
+static uint64_t block_cost(deflate_t* pDeflate, const uint8_t* pLiteralLengths,
+	const uint8_t* pDistanceLengths)
+{
+	uint64_t uCost = 0;
+	uint32_t i;
+	for (i = 0; i < DEFLATE_LITERALS; i++) {
+		uCost += static_cast<uint64_t>(pDeflate->m_LiteralFreq[i]) *
+			pLiteralLengths[i];
+		if (i > DEFLATE_END_OF_BLOCK) {
+			uCost += static_cast<uint64_t>(pDeflate->m_LiteralFreq[i]) *
+				g_LengthExtra[i - DEFLATE_END_OF_BLOCK - 1];
+		}
+	}
+	for (i = 0; i < DEFLATE_DISTANCES; i++) {
+		uCost += static_cast<uint64_t>(pDeflate->m_DistanceFreq[i]) *
+			(pDistanceLengths[i] + g_DistanceExtra[i]);
+	}
+	return uCost;
+}
+
+static void write_symbols(deflate_t* pDeflate, const uint8_t* pLiteralLengths,
+	const uint16_t* pLiteralCodes, const uint8_t* pDistanceLengths,
+	const uint16_t* pDistanceCodes)
+{
+	for (uint32_t i = 0; i < pDeflate->m_uSymbols; i++) {
+		uint32_t uLength = pDeflate->m_SymbolLength[i];
+		uint32_t uDistance = pDeflate->m_SymbolDistance[i];
+		if (!uDistance) {
+			put_bits(
+				pDeflate, pLiteralCodes[uLength], pLiteralLengths[uLength]);
+			continue;
+		}
+
+		uint32_t uCode = pDeflate->m_LengthCode[uLength - DEFLATE_MIN_MATCH];
+		uint32_t uSymbol = uCode + DEFLATE_END_OF_BLOCK + 1;
+		put_bits(pDeflate, pLiteralCodes[uSymbol], pLiteralLengths[uSymbol]);
+		put_bits(pDeflate, uLength - g_LengthBase[uCode], g_LengthExtra[uCode]);
+
+		uCode = distance_code(pDeflate, uDistance);
+		put_bits(pDeflate, pDistanceCodes[uCode], pDistanceLengths[uCode]);
+		put_bits(pDeflate, uDistance - g_DistanceBase[uCode],
+			g_DistanceExtra[uCode]);
+	}
+	put_bits(pDeflate, pLiteralCodes[DEFLATE_END_OF_BLOCK],
+		pLiteralLengths[DEFLATE_END_OF_BLOCK]);
+}
+
+/***************************************
+
+	Write out the symbols collected so far as a block, using whichever of
+	the three block types is smallest.
+
+***************************************/
+
+static void flush_block(deflate_t* pDeflate, bool bLast)
+{
+	uint32_t i;
+	pDeflate->m_LiteralFreq[DEFLATE_END_OF_BLOCK]++;
+
+	/* Fixed codes from the RFC. */
+	uint8_t FixedLiteralLengths[DEFLATE_LITERALS + 2];
+	uint8_t FixedDistanceLengths[DEFLATE_DISTANCES];
+	for (i = 0; i < DEFLATE_LITERALS + 2; i++) {
+		FixedLiteralLengths[i] =
+			(i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+	}
+	memset(FixedDistanceLengths, 5, sizeof(FixedDistanceLengths));
+	uint64_t uFixedCost =
+		3 + block_cost(pDeflate, FixedLiteralLengths, FixedDistanceLengths);
+
+	/*
+	  Dynamic codes.  Some decoders object to a distance code with fewer
+	  than two symbols, so make sure there are at least two.
+	*/
+	uint8_t LiteralLengths[DEFLATE_LITERALS];
+	uint8_t DistanceLengths[DEFLATE_DISTANCES];
+	uint32_t uUsed = 0;
+	for (i = 0; i < DEFLATE_DISTANCES; i++) {
+		if (pDeflate->m_DistanceFreq[i]) {
+			uUsed++;
+		}
+	}
+	for (i = 0; uUsed < 2; i++) {
+		if (!pDeflate->m_DistanceFreq[i]) {
+			pDeflate->m_DistanceFreq[i] = 1;
+			uUsed++;
+		}
+	}
+	build_lengths(pDeflate->m_LiteralFreq, DEFLATE_LITERALS,
+		DEFLATE_MAX_BITS, LiteralLengths);
+	build_lengths(pDeflate->m_DistanceFreq, DEFLATE_DISTANCES,
+		DEFLATE_MAX_BITS, DistanceLengths);
+
+	uint32_t uLiterals = DEFLATE_LITERALS;
+	while ((uLiterals > 257) && !LiteralLengths[uLiterals - 1]) {
+		uLiterals--;
+	}
+	uint32_t uDistances = DEFLATE_DISTANCES;
+	while ((uDistances > 1) && !DistanceLengths[uDistances - 1]) {
+		uDistances--;
+	}
+
+	uint8_t AllLengths[DEFLATE_LITERALS + DEFLATE_DISTANCES];
+	memcpy(AllLengths, LiteralLengths, uLiterals);
+	memcpy(AllLengths + uLiterals, DistanceLengths, uDistances);
+	uint16_t Runs[DEFLATE_LITERALS + DEFLATE_DISTANCES];
+	uint32_t CodeLengthFreq[DEFLATE_CODE_LENGTHS];
+	memset(CodeLengthFreq, 0, sizeof(CodeLengthFreq));
+	uint32_t uRuns = encode_lengths(
+		AllLengths, uLiterals + uDistances, Runs, CodeLengthFreq);
+
+	uint8_t CodeLengthLengths[DEFLATE_CODE_LENGTHS];
+	build_lengths(CodeLengthFreq, DEFLATE_CODE_LENGTHS,
+		DEFLATE_MAX_CODE_LENGTH_BITS, CodeLengthLengths);
+	uint32_t uCodeLengths = DEFLATE_CODE_LENGTHS;
+	while ((uCodeLengths > 4) &&
+		!CodeLengthLengths[g_CodeLengthOrder[uCodeLengths - 1]]) {
+		uCodeLengths--;
+	}
+
+	uint64_t uDynamicCost = 3 + 5 + 5 + 4 + 3 * uCodeLengths +
+		block_cost(pDeflate, LiteralLengths, DistanceLengths);
+	for (i = 0; i < DEFLATE_CODE_LENGTHS; i++) {
+		uDynamicCost += static_cast<uint64_t>(CodeLengthFreq[i]) *
+			CodeLengthLengths[i];
+	}
+	uDynamicCost += CodeLengthFreq[16] * 2ULL + CodeLengthFreq[17] * 3ULL +
+		CodeLengthFreq[18] * 7ULL;
+
+	/* Stored, with the header padded to a byte boundary. */
+	uint32_t uBlockLength = pDeflate->m_uBlockEnd - pDeflate->m_uBlockStart;
+	uint64_t uStoredCost =
+		((pDeflate->m_uBitCount + 3 + 7) & ~7U) + 32 + uBlockLength * 8ULL;
+	if (uBlockLength > DEFLATE_MAX_STORED) {
+		uStoredCost = ~0ULL;
+	}
+
+	if ((uStoredCost <= uFixedCost) && (uStoredCost <= uDynamicCost)) {
+		put_bits(pDeflate, bLast ? 1 : 0, 3);
+		align_bits(pDeflate);
+		put_byte(pDeflate, uBlockLength & 0xFF);
+		put_byte(pDeflate, uBlockLength >> 8);
+		put_byte(pDeflate, ~uBlockLength & 0xFF);
+		put_byte(pDeflate, (~uBlockLength >> 8) & 0xFF);
+		const uint8_t* pInput = pDeflate->m_Window + pDeflate->m_uBlockStart;
+		for (i = 0; i < uBlockLength; i++) {
+			put_byte(pDeflate, pInput[i]);
+		}
+	} else if (uFixedCost <= uDynamicCost) {
+		uint16_t FixedLiteralCodes[DEFLATE_LITERALS + 2];
+		uint16_t FixedDistanceCodes[DEFLATE_DISTANCES];
+		build_codes(
+			FixedLiteralLengths, DEFLATE_LITERALS + 2, FixedLiteralCodes);
+		build_codes(
+			FixedDistanceLengths, DEFLATE_DISTANCES, FixedDistanceCodes);
+		put_bits(pDeflate, bLast ? 3 : 2, 3);
+		write_symbols(pDeflate, FixedLiteralLengths, FixedLiteralCodes,
+			FixedDistanceLengths, FixedDistanceCodes);
+	} else {
+		uint16_t LiteralCodes[DEFLATE_LITERALS];
+		uint16_t DistanceCodes[DEFLATE_DISTANCES];
+		uint16_t CodeLengthCodes[DEFLATE_CODE_LENGTHS];
+		build_codes(LiteralLengths, DEFLATE_LITERALS, LiteralCodes);
+		build_codes(DistanceLengths, DEFLATE_DISTANCES, DistanceCodes);
+		build_codes(CodeLengthLengths, DEFLATE_CODE_LENGTHS, CodeLengthCodes);
+
+		put_bits(pDeflate, bLast ? 5 : 4, 3);
+		put_bits(pDeflate, uLiterals - 257, 5);
+		put_bits(pDeflate, uDistances - 1, 5);
+		put_bits(pDeflate, uCodeLengths - 4, 4);
+		for (i = 0; i < uCodeLengths; i++) {
+			put_bits(pDeflate, CodeLengthLengths[g_CodeLengthOrder[i]], 3);
+		}
+		for (i = 0; i < uRuns; i++) {
+			uint32_t uSymbol = Runs[i] & 0xFF;
+			put_bits(pDeflate, CodeLengthCodes[uSymbol],
+				CodeLengthLengths[uSymbol]);
+			if (uSymbol == 16) {
+				put_bits(pDeflate, Runs[i] >> 8, 2);
+			} else if (uSymbol == 17) {
+				put_bits(pDeflate, Runs[i] >> 8, 3);
+			} else if (uSymbol == 18) {
+				put_bits(pDeflate, Runs[i] >> 8, 7);
+			}
+		}
+		write_symbols(pDeflate, LiteralLengths, LiteralCodes, DistanceLengths,
+			DistanceCodes);
+	}
+
+	memset(pDeflate->m_LiteralFreq, 0, sizeof(pDeflate->m_LiteralFreq));
+	memset(pDeflate->m_DistanceFreq, 0, sizeof(pDeflate->m_DistanceFreq));
+	pDeflate->m_uSymbols = 0;
+	pDeflate->m_uBlockStart = pDeflate->m_uBlockEnd;
+}
+
+static inline void tally_literal(deflate_t* pDeflate, uint32_t uPosition)
+{
+	uint32_t uLiteral = pDeflate->m_Window[uPosition];
+	pDeflate->m_SymbolLength[pDeflate->m_uSymbols] =
+		static_cast<uint16_t>(uLiteral);
+	pDeflate->m_SymbolDistance[pDeflate->m_uSymbols] = 0;
+	pDeflate->m_uSymbols++;
+	pDeflate->m_LiteralFreq[uLiteral]++;
+	pDeflate->m_uBlockEnd = uPosition + 1;
+	if (pDeflate->m_uSymbols == DEFLATE_SYMBOLS) {
+		flush_block(pDeflate, false);
+	}
+}
+
+static inline void tally_match(deflate_t* pDeflate, uint32_t uPosition,
+	uint32_t uLength, uint32_t uDistance)
+{
+	pDeflate->m_SymbolLength[pDeflate->m_uSymbols] =
+		static_cast<uint16_t>(uLength);
+	pDeflate->m_SymbolDistance[pDeflate->m_uSymbols] =
+		static_cast<uint16_t>(uDistance);
+	pDeflate->m_uSymbols++;
+	uint32_t uCode = pDeflate->m_LengthCode[uLength - DEFLATE_MIN_MATCH];
+	pDeflate->m_LiteralFreq[uCode + DEFLATE_END_OF_BLOCK + 1]++;
+	pDeflate->m_DistanceFreq[distance_code(pDeflate, uDistance)]++;
+	pDeflate->m_uBlockEnd = uPosition + uLength;
+	if (pDeflate->m_uSymbols == DEFLATE_SYMBOLS) {
+		flush_block(pDeflate, false);
+	}
+}
+
+/***************************************
+
+	Input
+
+***************************************/
+
+/*
+  Top up the window so there is enough lookahead for a match, sliding it
+  down first if the current position is near the end.  Any block in
+  progress is written out before sliding so it can still be stored.
+*/
+static void fill_window(deflate_t* pDeflate)
+{
+	uint32_t i;
+	while ((pDeflate->m_uLookahead < DEFLATE_MIN_LOOKAHEAD) &&
+		!pDeflate->m_bEOF) {
+		if (pDeflate->m_uStart >= (DEFLATE_WINDOW + DEFLATE_MAX_DISTANCE)) {
+			if (pDeflate->m_uSymbols) {
+				flush_block(pDeflate, false);
+			}
+			memcpy(pDeflate->m_Window, pDeflate->m_Window + DEFLATE_WINDOW,
+				DEFLATE_WINDOW);
+			pDeflate->m_uStart -= DEFLATE_WINDOW;
+			pDeflate->m_uMatchStart -= DEFLATE_WINDOW;
+			pDeflate->m_uBlockStart -= DEFLATE_WINDOW;
+			pDeflate->m_uBlockEnd -= DEFLATE_WINDOW;
+			for (i = 0; i < DEFLATE_HASH_SIZE; i++) {
+				uint32_t uPosition = pDeflate->m_Head[i];
+				pDeflate->m_Head[i] = static_cast<uint16_t>(
+					(uPosition >= DEFLATE_WINDOW) ? uPosition - DEFLATE_WINDOW
+												  : 0);
+			}
+			for (i = 0; i < DEFLATE_WINDOW; i++) {
+				uint32_t uPosition = pDeflate->m_Prev[i];
+				pDeflate->m_Prev[i] = static_cast<uint16_t>(
+					(uPosition >= DEFLATE_WINDOW) ? uPosition - DEFLATE_WINDOW
+												  : 0);
+			}
+		}
+
+		uint32_t uEnd = pDeflate->m_uStart + pDeflate->m_uLookahead;
+		DWORD uRead;
+		if (!ReadFile(pDeflate->m_hInput, pDeflate->m_Window + uEnd,
+				DEFLATE_WINDOW * 2 - uEnd, &uRead, NULL)) {
+			pDeflate->m_uError = GetLastError();
+			pDeflate->m_iFailed = 4;
+			pDeflate->m_bEOF = true;
+			break;
+		}
+		if (!uRead) {
+			pDeflate->m_bEOF = true;
+			break;
+		}
+
+		const uint8_t* pInput = pDeflate->m_Window + uEnd;
+		uint32_t uCRC = pDeflate->m_uCRC;
+		for (i = 0; i < uRead; i++) {
+			uCRC =
+				pDeflate->m_CRCTable[(uCRC ^ pInput[i]) & 0xFF] ^ (uCRC >> 8);
+		}
+		pDeflate->m_uCRC = uCRC;
+		pDeflate->m_uInputSize += uRead;
+		pDeflate->m_uLookahead += uRead;
+	}
+
+	/* Don't let matches run into stale data past the end of the input. */
+	if (pDeflate->m_bEOF) {
+		uint32_t uEnd = pDeflate->m_uStart + pDeflate->m_uLookahead;
+		memset(pDeflate->m_Window + uEnd, 0, DEFLATE_MAX_MATCH);
+	}
+}
+
+/***************************************
+
+	Matching
+
+***************************************/
+
+static inline uint32_t insert_string(deflate_t* pDeflate, uint32_t uPosition)
+{
+	uint32_t uNext = pDeflate->m_Window[uPosition + DEFLATE_MIN_MATCH - 1];
+	pDeflate->m_uHash =
+		((pDeflate->m_uHash << DEFLATE_HASH_SHIFT) ^ uNext) & DEFLATE_HASH_MASK;
+	uint32_t uHead = pDeflate->m_Head[pDeflate->m_uHash];
+	pDeflate->m_Prev[uPosition & DEFLATE_WINDOW_MASK] =
+		static_cast<uint16_t>(uHead);
+	pDeflate->m_Head[pDeflate->m_uHash] = static_cast<uint16_t>(uPosition);
+	return uHead;
+}
+
+/*
+  Follow the hash chain from uCandidate looking for the longest match at
+  the current position which beats uBest.  Returns the match length,
+  which is no more than uBest if nothing better was found.
+*/
+static uint32_t longest_match(
+	deflate_t* pDeflate, uint32_t uCandidate, uint32_t uBest)
+{
+	uint32_t uChain = pDeflate->m_Config.m_uMaxChain;
+	if (uBest >= pDeflate->m_Config.m_uGoodLength) {
+		uChain >>= 2;
+	}
+	uint32_t uNice = pDeflate->m_Config.m_uNiceLength;
+	if (uNice > pDeflate->m_uLookahead) {
+		uNice = pDeflate->m_uLookahead;
+	}
+	uint32_t uLimit = (pDeflate->m_uStart > DEFLATE_MAX_DISTANCE)
+		? pDeflate->m_uStart - DEFLATE_MAX_DISTANCE
+		: 0;
+
+	const uint8_t* pScan = pDeflate->m_Window + pDeflate->m_uStart;
+	do {
+		/* Only compare in full if it could beat the best so far. */
+		const uint8_t* pMatch = pDeflate->m_Window + uCandidate;
+		if ((pMatch[uBest] == pScan[uBest]) &&
+			(pMatch[uBest - 1] == pScan[uBest - 1]) &&
+			(pMatch[0] == pScan[0]) && (pMatch[1] == pScan[1])) {
+			uint32_t uLength = 2;
+			while ((uLength < DEFLATE_MAX_MATCH) &&
+				(pMatch[uLength] == pScan[uLength])) {
+				uLength++;
+			}
+			if (uLength > uBest) {
+				pDeflate->m_uMatchStart = uCandidate;
+				uBest = uLength;
+				if (uLength >= uNice) {
+					break;
+				}
+			}
+		}
+		uCandidate = pDeflate->m_Prev[uCandidate & DEFLATE_WINDOW_MASK];
+	} while ((uCandidate > uLimit) && --uChain);
+
+	if (uBest > pDeflate->m_uLookahead) {
+		uBest = pDeflate->m_uLookahead;
+	}
+	return uBest;
+}
+
+/***************************************
+
+	Compress the whole input with lazy matching: a match is only taken if
+	the match starting at the next byte is no longer.
+
+***************************************/
+
+static void deflate_stream(deflate_t* pDeflate)
+{
+	uint32_t uMatchLength = DEFLATE_MIN_MATCH - 1;
+	bool bPending = false;
+
+	fill_window(pDeflate);
+	if (pDeflate->m_uLookahead >= 2) {
+		pDeflate->m_uHash = ((pDeflate->m_Window[0] << DEFLATE_HASH_SHIFT) ^
+								pDeflate->m_Window[1]) &
+			DEFLATE_HASH_MASK;
+	}
+
+	while (!pDeflate->m_iFailed) {
+		if (pDeflate->m_uLookahead < DEFLATE_MIN_LOOKAHEAD) {
+			fill_window(pDeflate);
+			if (!pDeflate->m_uLookahead) {
+				break;
+			}
+		}
+
+		uint32_t uHead = 0;
+		if (pDeflate->m_uLookahead >= DEFLATE_MIN_MATCH) {
+			uHead = insert_string(pDeflate, pDeflate->m_uStart);
+		}
+
+		uint32_t uPrevLength = uMatchLength;
+		uint32_t uPrevMatch = pDeflate->m_uMatchStart;
+		uMatchLength = DEFLATE_MIN_MATCH - 1;
+		if (uHead && (uPrevLength < pDeflate->m_Config.m_uMaxLazy) &&
+			((pDeflate->m_uStart - uHead) <= DEFLATE_MAX_DISTANCE)) {
+			uMatchLength = longest_match(pDeflate, uHead, uPrevLength);
+			if (uMatchLength <= uPrevLength) {
+				uMatchLength = DEFLATE_MIN_MATCH - 1;
+			} else if ((uMatchLength == DEFLATE_MIN_MATCH) &&
+				((pDeflate->m_uStart - pDeflate->m_uMatchStart) > 4096)) {
+				/* A short match a long way back costs more than literals. */
+				uMatchLength = DEFLATE_MIN_MATCH - 1;
+			}
+		}
+
+		if ((uPrevLength >= DEFLATE_MIN_MATCH) &&
+			(uMatchLength <= uPrevLength)) {
+			/* The previous match was better, so take it. */
+			uint32_t uPosition = pDeflate->m_uStart - 1;
+			uint32_t uMaxInsert =
+				pDeflate->m_uStart + pDeflate->m_uLookahead - DEFLATE_MIN_MATCH;
+			tally_match(
+				pDeflate, uPosition, uPrevLength, uPosition - uPrevMatch);
+
+			/* Hash the rest of the match, the first two are already in. */
+			pDeflate->m_uLookahead -= uPrevLength - 1;
+			for (uint32_t i = uPrevLength - 2; i; i--) {
+				if (++pDeflate->m_uStart <= uMaxInsert) {
+					insert_string(pDeflate, pDeflate->m_uStart);
+				}
+			}
+			pDeflate->m_uStart++;
+			bPending = false;
+			uMatchLength = DEFLATE_MIN_MATCH - 1;
+		} else {
+			if (bPending) {
+				tally_literal(pDeflate, pDeflate->m_uStart - 1);
+			}
+			bPending = true;
+			pDeflate->m_uStart++;
+			pDeflate->m_uLookahead--;
+		}
+	}
+
+	if (bPending) {
+		tally_literal(pDeflate, pDeflate->m_uStart - 1);
+	}
+	flush_block(pDeflate, true);
+	align_bits(pDeflate);
+}
+
+/***************************************
+
+	Compress pSource into a new gzip file, pDest
+
+	The source is left alone.  On failure the destination is deleted and
+	GetLastError() says why.
+	Returns 0 on success, 1 if the source couldn't be opened, 2 if the
+	destination couldn't be created, 3 if memory ran out, 4 if reading
+	failed or 5 if writing failed.
+
+***************************************/
+
+int gzip_file(const wchar_t* pSource, const wchar_t* pDest, uint32_t uLevel,
+	uint64_t* pInputSize, uint64_t* pOutputSize)
+{
+	if (uLevel < NSSM_COMPRESS_LEVEL_MIN) {
+		uLevel = NSSM_COMPRESS_LEVEL_MIN;
+	} else if (uLevel > NSSM_COMPRESS_LEVEL_MAX) {
+		uLevel = NSSM_COMPRESS_LEVEL_MAX;
+	}
+
+	HANDLE hInput = CreateFileW(pSource, GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hInput == INVALID_HANDLE_VALUE) {
+		return 1;
+	}
+	HANDLE hOutput = CreateFileW(pDest, GENERIC_WRITE, 0, NULL, CREATE_NEW,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hOutput == INVALID_HANDLE_VALUE) {
+		unsigned long error = GetLastError();
+		CloseHandle(hInput);
+		SetLastError(error);
+		return 2;
+	}
+
+	int ret = 0;
+	unsigned long error = 0;
+	deflate_t* pDeflate =
+		static_cast<deflate_t*>(heap_calloc(sizeof(deflate_t)));
+	if (!pDeflate) {
+		error = ERROR_NOT_ENOUGH_MEMORY;
+		ret = 3;
+	} else {
+		pDeflate->m_hInput = hInput;
+		pDeflate->m_hOutput = hOutput;
+		deflate_init(pDeflate, uLevel);
+
+		/* Header with no name or timestamp. */
+		put_byte(pDeflate, 0x1F);
+		put_byte(pDeflate, 0x8B);
+		put_byte(pDeflate, 8);
+		put_byte(pDeflate, 0);
+		put_le32(pDeflate, 0);
+		put_byte(pDeflate, (uLevel == NSSM_COMPRESS_LEVEL_MAX) ? 2
+				: (uLevel == NSSM_COMPRESS_LEVEL_MIN)          ? 4
+															   : 0);
+		put_byte(pDeflate, GZIP_OS_NTFS);
+
+		deflate_stream(pDeflate);
+
+		put_le32(pDeflate, ~pDeflate->m_uCRC);
+		put_le32(pDeflate, static_cast<uint32_t>(pDeflate->m_uInputSize));
+		flush_output(pDeflate);
+
+		if (pDeflate->m_iFailed) {
+			error = pDeflate->m_uError;
+			ret = pDeflate->m_iFailed;
+		} else {
+			if (pInputSize) {
+				*pInputSize = pDeflate->m_uInputSize;
+			}
+			if (pOutputSize) {
+				*pOutputSize = pDeflate->m_uOutputSize;
+			}
+		}
+		heap_free(pDeflate);
+	}
+
+	CloseHandle(hInput);
+	if (!ret && !FlushFileBuffers(hOutput)) {
+		error = GetLastError();
+		ret = 5;
+	}
+	CloseHandle(hOutput);
+	if (ret) {
+		DeleteFileW(pDest);
+		SetLastError(error);
+	}
+	return ret;
+}
@@ -0,0 +1,19 @@
+/***************************************
+
+	Log file compression
+
+***************************************/
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdint.h>
+
+// Lowest and highest gzip compression levels
+#define NSSM_COMPRESS_LEVEL_MIN 1
+#define NSSM_COMPRESS_LEVEL_MAX 9
+
+extern int gzip_file(const wchar_t* pSource, const wchar_t* pDest,
+	uint32_t uLevel, uint64_t* pInputSize, uint64_t* pOutputSize);
+
+#endif
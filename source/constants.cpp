@@ -63,23 +63,57 @@ const wchar_t g_NSSMRegStdOutSharing[] = L"AppStdoutShareMode";
 const wchar_t g_NSSMRegStdOutDisposition[] = L"AppStdoutCreationDisposition";
 const wchar_t g_NSSMRegStdOutFlags[] = L"AppStdoutFlagsAndAttributes";
 const wchar_t g_NSSMRegStdOutCopyAndTruncate[] = L"AppStdoutCopyAndTruncate";
+const wchar_t g_NSSMRegStdOutFlush[] = L"AppStdoutFlush";
+const wchar_t g_NSSMRegStdOutFlushAfter[] = L"AppStdoutFlushAfter";
 const wchar_t g_NSSMRegStdErr[] = L"AppStderr";
 const wchar_t g_NSSMRegStdErrSharing[] = L"AppStderrShareMode";
 const wchar_t g_NSSMRegStdErrDisposition[] = L"AppStderrCreationDisposition";
 const wchar_t g_NSSMRegStdErrFlags[] = L"AppStderrFlagsAndAttributes";
 const wchar_t g_NSSMRegStdErrCopyAndTruncate[] = L"AppStderrCopyAndTruncate";
+const wchar_t g_NSSMRegStdErrFlush[] = L"AppStderrFlush";
+const wchar_t g_NSSMRegStdErrFlushAfter[] = L"AppStderrFlushAfter";
 const wchar_t g_NSSMRegStdIOSharing[] = L"ShareMode";
 const wchar_t g_NSSMRegStdIODisposition[] = L"CreationDisposition";
 const wchar_t g_NSSMRegStdIOFlags[] = L"FlagsAndAttributes";
 const wchar_t g_NSSMRegStdIOCopyAndTruncate[] = L"CopyAndTruncate";
+const wchar_t g_NSSMRegStdIOFlush[] = L"Flush";
+const wchar_t g_NSSMRegStdIOFlushAfter[] = L"FlushAfter";
 const wchar_t g_NSSMRegHookShareOutputHandles[] = L"AppRedirectHook";
 const wchar_t g_NSSMRegRotate[] = L"AppRotateFiles";
 const wchar_t g_NSSMRegRotateOnline[] = L"AppRotateOnline";
 const wchar_t g_NSSMRegRotateSeconds[] = L"AppRotateSeconds";
+const wchar_t g_NSSMRegRotateInterval[] = L"AppRotateInterval";
 const wchar_t g_NSSMRegRotateBytesLow[] = L"AppRotateBytes";
 const wchar_t g_NSSMRegRotateBytesHigh[] = L"AppRotateBytesHigh";
+const wchar_t g_NSSMRegRotatePreallocate[] = L"AppRotatePreallocate";
+const wchar_t g_NSSMRegLogBufferMin[] = L"AppLogBufferMin";
+const wchar_t g_NSSMRegLogBufferMax[] = L"AppLogBufferMax";
+const wchar_t g_NSSMRegLogSpillMax[] = L"AppLogSpillMax";
+const wchar_t g_NSSMRegLogBackpressure[] = L"AppLogBackpressure";
+const wchar_t g_NSSMRegLogMapWindow[] = L"AppLogMapWindow";
+const wchar_t g_NSSMRegLogWriteBuffers[] = L"AppLogWriteBuffers";
+const wchar_t g_NSSMRegLogSyslog[] = L"AppLogSyslog";
+const wchar_t g_NSSMRegLogPipe[] = L"AppLogPipe";
+const wchar_t g_NSSMRegLogSinkQueue[] = L"AppLogSinkQueue";
+const wchar_t g_NSSMRegLogRateLines[] = L"AppLogRateLines";
+const wchar_t g_NSSMRegLogRateBytes[] = L"AppLogRateBytes";
+const wchar_t g_NSSMRegLogRateBurst[] = L"AppLogRateBurst";
+const wchar_t g_NSSMRegLogInclude[] = L"AppLogInclude";
+const wchar_t g_NSSMRegLogExclude[] = L"AppLogExclude";
+const wchar_t g_NSSMRegLogCollapse[] = L"AppLogCollapse";
+const wchar_t g_NSSMRegLogTail[] = L"AppLogTail";
+const wchar_t g_NSSMRegLogTimeIndex[] = L"AppLogTimeIndex";
 const wchar_t g_NSSMRegRotateDelay[] = L"AppRotateDelay";
+const wchar_t g_NSSMRegRotateCompress[] = L"AppRotateCompress";
+const wchar_t g_NSSMRegRotateMaxFiles[] = L"AppRotateMaxFiles";
+const wchar_t g_NSSMRegRotateMaxBytesLow[] = L"AppRotateMaxBytes";
+const wchar_t g_NSSMRegRotateMaxBytesHigh[] = L"AppRotateMaxBytesHigh";
+const wchar_t g_NSSMRegRotateMaxAge[] = L"AppRotateMaxAge";
 const wchar_t g_NSSMRegTimeStampLog[] = L"AppTimestampLog";
+const wchar_t g_NSSMRegJsonLog[] = L"AppJsonLog";
+const wchar_t g_NSSMRegUtf8Log[] = L"AppUtf8Log";
+const wchar_t g_NSSMRegMergeTags[] = L"AppMergeTags";
+const wchar_t g_NSSMRegMergeSequence[] = L"AppMergeSequence";
 const wchar_t g_NSSMRegPriority[] = L"AppPriority";
 const wchar_t g_NSSMRegAffinity[] = L"AppAffinity";
 const wchar_t g_NSSMRegNoConsole[] = L"AppNoConsole";
@@ -81,6 +81,78 @@
 // How many milliseconds to pause after rotating logs.
 #define NSSM_ROTATE_DELAY 0
 
+/*
+  Smallest and largest size in bytes of the buffer used by a logging thread
+  to read from the application's pipe.  The buffer starts at the smallest
+  size and grows when reads fill it, shrinking again when the application
+  goes quiet.  Override in registry.
+*/
+#define NSSM_LOG_BUFFER_MIN 65536
+#define NSSM_LOG_BUFFER_MAX 4194304
+
+// Nothing smaller than this is worth reading from a pipe.
+#define NSSM_LOG_BUFFER_FLOOR 4096
+
+/*
+  Largest size in bytes of the memory used to hold output while the disk
+  the log file is on is full.  0 disables it, so the logging thread waits
+  for the disk instead.  Override in registry.
+*/
+#define NSSM_LOG_SPILL_MAX 16777216
+
+// What to do when the log buffer is full and can't grow.  Override in
+// registry.
+#define NSSM_LOG_BACKPRESSURE_BLOCK 0
+#define NSSM_LOG_BACKPRESSURE_DROP_OLDEST 1
+#define NSSM_LOG_BACKPRESSURE_DROP_NEWEST 2
+
+/*
+  Largest size in bytes of each window of the log file mapped into memory
+  when AppLogMapWindow is set.  Override in registry.
+*/
+#define NSSM_LOG_MAP_WINDOW_MAX 67108864
+
+/*
+  Most overlapped writes to each log file in flight at once when
+  AppLogWriteBuffers is set.  Override in registry.
+*/
+#define NSSM_LOG_WRITE_BUFFERS_MAX 16
+
+/*
+  Largest size in bytes of the queue of output waiting to be sent to each
+  syslog or named pipe sink.  Override in registry.
+*/
+#define NSSM_LOG_SINK_QUEUE 1048576
+
+/*
+  Milliseconds worth of output let through at once by the log rate limit,
+  and the most allowed.  Override in registry.
+*/
+#define NSSM_LOG_RATE_BURST 10000
+#define NSSM_LOG_RATE_BURST_MAX 3600000
+
+/*
+  Bytes of recent output kept in memory for each of stdout and stderr, and
+  the most allowed.  Override in registry.
+*/
+#define NSSM_LOG_TAIL 65536
+#define NSSM_LOG_TAIL_MAX 16777216
+
+/*
+  When to flush each log file to disk.  Never leaves it to Windows, the
+  others flush once AppStdoutFlushAfter milliseconds have passed or bytes
+  have been written since the last flush, or after every write.  Override
+  in registry.
+*/
+#define NSSM_LOG_FLUSH_NEVER 0
+#define NSSM_LOG_FLUSH_INTERVAL 1
+#define NSSM_LOG_FLUSH_BYTES 2
+#define NSSM_LOG_FLUSH_LINE 3
+
+// Defaults for AppStdoutFlushAfter with the interval and bytes policies.
+#define NSSM_LOG_FLUSH_MILLISECONDS 1000
+#define NSSM_LOG_FLUSH_BYTE_COUNT 1048576
+
 // Margin of error for service status wait hints in milliseconds.
 #define NSSM_WAITHINT_MARGIN 2000
 
@@ -138,23 +210,57 @@ extern const wchar_t g_NSSMRegStdOutSharing[];
 extern const wchar_t g_NSSMRegStdOutDisposition[];
 extern const wchar_t g_NSSMRegStdOutFlags[];
 extern const wchar_t g_NSSMRegStdOutCopyAndTruncate[];
+extern const wchar_t g_NSSMRegStdOutFlush[];
+extern const wchar_t g_NSSMRegStdOutFlushAfter[];
 extern const wchar_t g_NSSMRegStdErr[];
 extern const wchar_t g_NSSMRegStdErrSharing[];
 extern const wchar_t g_NSSMRegStdErrDisposition[];
 extern const wchar_t g_NSSMRegStdErrFlags[];
 extern const wchar_t g_NSSMRegStdErrCopyAndTruncate[];
+extern const wchar_t g_NSSMRegStdErrFlush[];
+extern const wchar_t g_NSSMRegStdErrFlushAfter[];
 extern const wchar_t g_NSSMRegStdIOSharing[];
 extern const wchar_t g_NSSMRegStdIODisposition[];
 extern const wchar_t g_NSSMRegStdIOFlags[];
 extern const wchar_t g_NSSMRegStdIOCopyAndTruncate[];
+extern const wchar_t g_NSSMRegStdIOFlush[];
+extern const wchar_t g_NSSMRegStdIOFlushAfter[];
 extern const wchar_t g_NSSMRegHookShareOutputHandles[];
 extern const wchar_t g_NSSMRegRotate[];
 extern const wchar_t g_NSSMRegRotateOnline[];
 extern const wchar_t g_NSSMRegRotateSeconds[];
+extern const wchar_t g_NSSMRegRotateInterval[];
 extern const wchar_t g_NSSMRegRotateBytesLow[];
 extern const wchar_t g_NSSMRegRotateBytesHigh[];
+extern const wchar_t g_NSSMRegRotatePreallocate[];
+extern const wchar_t g_NSSMRegLogBufferMin[];
+extern const wchar_t g_NSSMRegLogBufferMax[];
+extern const wchar_t g_NSSMRegLogSpillMax[];
+extern const wchar_t g_NSSMRegLogBackpressure[];
+extern const wchar_t g_NSSMRegLogMapWindow[];
+extern const wchar_t g_NSSMRegLogWriteBuffers[];
+extern const wchar_t g_NSSMRegLogSyslog[];
+extern const wchar_t g_NSSMRegLogPipe[];
+extern const wchar_t g_NSSMRegLogSinkQueue[];
+extern const wchar_t g_NSSMRegLogRateLines[];
+extern const wchar_t g_NSSMRegLogRateBytes[];
+extern const wchar_t g_NSSMRegLogRateBurst[];
+extern const wchar_t g_NSSMRegLogInclude[];
+extern const wchar_t g_NSSMRegLogExclude[];
+extern const wchar_t g_NSSMRegLogCollapse[];
+extern const wchar_t g_NSSMRegLogTail[];
+extern const wchar_t g_NSSMRegLogTimeIndex[];
 extern const wchar_t g_NSSMRegRotateDelay[];
+extern const wchar_t g_NSSMRegRotateCompress[];
+extern const wchar_t g_NSSMRegRotateMaxFiles[];
+extern const wchar_t g_NSSMRegRotateMaxBytesLow[];
+extern const wchar_t g_NSSMRegRotateMaxBytesHigh[];
+extern const wchar_t g_NSSMRegRotateMaxAge[];
 extern const wchar_t g_NSSMRegTimeStampLog[];
+extern const wchar_t g_NSSMRegJsonLog[];
+extern const wchar_t g_NSSMRegUtf8Log[];
+extern const wchar_t g_NSSMRegMergeTags[];
+extern const wchar_t g_NSSMRegMergeSequence[];
 extern const wchar_t g_NSSMRegPriority[];
 extern const wchar_t g_NSSMRegAffinity[];
 extern const wchar_t g_NSSMRegNoConsole[];
@@ -0,0 +1,284 @@
+/***************************************
+
+	Log line filtering
+
+	Include and exclude patterns are compiled into one Aho-Corasick
+	automaton when the logger starts, so each line is scanned once however
+	many patterns there are.  The automaton is a full transition table
+	with the failure links already followed, so every byte costs one
+	lookup.  Bytes which appear in no pattern share a column to keep the
+	table small, and the match flags of the state moved to are kept in the
+	low bits of each entry.
+
+***************************************/
+
+#include "filter.h"
+#include "memorymanager.h"
+#include "utf8.h"
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+#include <string.h>
+#include <wchar.h>
+
+struct filter_pattern_t {
+	// Bytes to match, in the encoding of the output
+	const uint8_t* m_pBytes;
+	// UTF-8 copy of the pattern to free, or NULL
+	char* m_pConverted;
+	// Length of m_pBytes
+	uint32_t m_uLength;
+	// NSSM_FILTER_INCLUDE or NSSM_FILTER_EXCLUDE
+	uint32_t m_uFlag;
+};
+
+/* Count the non-empty strings in a double null terminated list. */
+static uint32_t count_patterns(const wchar_t* pList)
+{
+	uint32_t uCount = 0;
+	if (!pList) {
+		return 0;
+	}
+	for (; *pList; pList += wcslen(pList) + 1) {
+		++uCount;
+	}
+	return uCount;
+}
+
+/*
+  Add the patterns in a list to the array, in the output's encoding.
+  Returns the number added or -1 if a pattern couldn't be converted.
+*/
+static int add_patterns(filter_pattern_t* pPatterns, const wchar_t* pList,
+	uint32_t uFlag, uint32_t uCharsize)
+{
+	int iCount = 0;
+	if (!pList) {
+		return 0;
+	}
+	for (; *pList; pList += wcslen(pList) + 1) {
+		filter_pattern_t* pPattern = &pPatterns[iCount];
+		pPattern->m_uFlag = uFlag;
+		if (uCharsize == sizeof(wchar_t)) {
+			pPattern->m_pBytes = reinterpret_cast<const uint8_t*>(pList);
+			pPattern->m_uLength =
+				static_cast<uint32_t>(wcslen(pList) * sizeof(wchar_t));
+		} else {
+			if (to_utf8(pList, &pPattern->m_pConverted, &pPattern->m_uLength)) {
+				return -1;
+			}
+			pPattern->m_pBytes =
+				reinterpret_cast<const uint8_t*>(pPattern->m_pConverted);
+		}
+		++iCount;
+	}
+	return iCount;
+}
+
+/***************************************
+
+	Build the automaton
+
+	The patterns go into a trie first, with the match flags of each state
+	kept aside.  A breadth first walk then sets each state's failure link
+	to the longest proper suffix which is also in the trie, takes on the
+	flags of that state, and fills in the missing transitions from it.
+	States are numbered by their row offset in the table, so a lookup
+	needs no multiply.
+
+***************************************/
+
+static int build_automaton(log_filter_t* pFilter,
+	const filter_pattern_t* pPatterns, uint32_t uPatterns, uint32_t uBytes)
+{
+	uint32_t uStride = pFilter->m_uStride;
+	uint32_t uMaxStates = uBytes + 1;
+	uint32_t* pNext = static_cast<uint32_t*>(heap_calloc(
+		static_cast<uintptr_t>(uMaxStates) * uStride * sizeof(uint32_t)));
+	uint32_t* pWork = static_cast<uint32_t*>(
+		heap_alloc(static_cast<uintptr_t>(uMaxStates) * 2 * sizeof(uint32_t)));
+	uint8_t* pMatch = static_cast<uint8_t*>(heap_calloc(uMaxStates));
+	if (!pNext || !pWork || !pMatch) {
+		heap_free(pNext);
+		heap_free(pWork);
+		heap_free(pMatch);
+		return 1;
+	}
+	uint32_t* pFail = pWork;
+	uint32_t* pQueue = pWork + uMaxStates;
+
+	/* The trie.  Row 0 is the root, which is never anything's child. */
+	uint32_t uStates = 1;
+	for (uint32_t i = 0; i < uPatterns; i++) {
+		const filter_pattern_t* pPattern = &pPatterns[i];
+		uint32_t uRow = 0;
+		for (uint32_t j = 0; j < pPattern->m_uLength; j++) {
+			uint32_t* pEntry =
+				&pNext[uRow + pFilter->m_Classes[pPattern->m_pBytes[j]]];
+			if (!*pEntry) {
+				*pEntry = uStates++ * uStride;
+			}
+			uRow = *pEntry;
+		}
+		pMatch[uRow / uStride] |= static_cast<uint8_t>(pPattern->m_uFlag);
+	}
+
+	/* Failure links, shallowest states first. */
+	uint32_t uHead = 0;
+	uint32_t uTail = 0;
+	for (uint32_t c = 0; c < uStride; c++) {
+		if (pNext[c]) {
+			pFail[pNext[c] / uStride] = 0;
+			pQueue[uTail++] = pNext[c];
+		}
+	}
+	while (uHead < uTail) {
+		uint32_t uRow = pQueue[uHead++];
+		uint32_t uFail = pFail[uRow / uStride];
+		pMatch[uRow / uStride] |= pMatch[uFail / uStride];
+		for (uint32_t c = 0; c < uStride; c++) {
+			uint32_t uChild = pNext[uRow + c];
+			if (uChild) {
+				pFail[uChild / uStride] = pNext[uFail + c];
+				pQueue[uTail++] = uChild;
+			} else {
+				pNext[uRow + c] = pNext[uFail + c];
+			}
+		}
+	}
+
+	/* Tag each transition with the flags of the state it goes to. */
+	uint32_t uEntries = uStates * uStride;
+	for (uint32_t i = 0; i < uEntries; i++) {
+		pNext[i] |= pMatch[pNext[i] / uStride];
+	}
+
+	heap_free(pWork);
+	heap_free(pMatch);
+	pFilter->m_pNext = pNext;
+	pFilter->m_uStates = uStates;
+	return 0;
+}
+
+/***************************************
+
+	Compile include and exclude patterns for output of a given encoding
+
+	Each list is double null terminated, as read from the registry, and
+	either may be NULL.  Patterns match anywhere in a line and are case
+	sensitive.  uCharsize is 1 for output in UTF-8 or the ANSI code page,
+	which patterns are matched in as UTF-8, or 2 for UTF-16.
+	Returns NULL if there are no patterns or memory ran out.
+
+***************************************/
+
+log_filter_t* compile_filter(
+	const wchar_t* pInclude, const wchar_t* pExclude, uint32_t uCharsize)
+{
+	uint32_t uCount = count_patterns(pInclude) + count_patterns(pExclude);
+	if (!uCount) {
+		return NULL;
+	}
+
+	filter_pattern_t* pPatterns = static_cast<filter_pattern_t*>(
+		heap_calloc(uCount * sizeof(filter_pattern_t)));
+	log_filter_t* pFilter =
+		static_cast<log_filter_t*>(heap_calloc(sizeof(log_filter_t)));
+	if (!pPatterns || !pFilter) {
+		heap_free(pPatterns);
+		heap_free(pFilter);
+		return NULL;
+	}
+
+	int iIncluded =
+		add_patterns(pPatterns, pInclude, NSSM_FILTER_INCLUDE, uCharsize);
+	int iExcluded = (iIncluded < 0) ?
+		-1 :
+		add_patterns(pPatterns + iIncluded, pExclude, NSSM_FILTER_EXCLUDE,
+			uCharsize);
+
+	int iResult = 1;
+	if (iExcluded >= 0) {
+		/* Only bytes which appear in a pattern get a column of their own. */
+		uint32_t uBytes = 0;
+		uint32_t uClasses = 1;
+		for (uint32_t i = 0; i < uCount; i++) {
+			for (uint32_t j = 0; j < pPatterns[i].m_uLength; j++) {
+				uint16_t* pClass =
+					&pFilter->m_Classes[pPatterns[i].m_pBytes[j]];
+				if (!*pClass) {
+					*pClass = static_cast<uint16_t>(uClasses++);
+				}
+			}
+			uBytes += pPatterns[i].m_uLength;
+		}
+		pFilter->m_uStride = (uClasses + NSSM_FILTER_MATCH_MASK) &
+			~NSSM_FILTER_MATCH_MASK;
+		pFilter->m_bInclude = iIncluded > 0;
+		pFilter->m_uStop = NSSM_FILTER_EXCLUDE;
+		if (!iExcluded) {
+			pFilter->m_uStop |= NSSM_FILTER_INCLUDE;
+		}
+		iResult = build_automaton(pFilter, pPatterns, uCount, uBytes);
+	}
+
+	for (uint32_t i = 0; i < uCount; i++) {
+		heap_free(pPatterns[i].m_pConverted);
+	}
+	heap_free(pPatterns);
+	if (iResult) {
+		heap_free(pFilter);
+		return NULL;
+	}
+	return pFilter;
+}
+
+void free_filter(log_filter_t* pFilter)
+{
+	if (pFilter) {
+		heap_free(pFilter->m_pNext);
+		heap_free(pFilter);
+	}
+}
+
+/***************************************
+
+	Run the automaton over some text
+
+	uState is 0 at the start of a line.  The flags of any patterns found
+	are ORed into pMatched, and the scan stops early once they settle
+	whether the line is kept.  Returns the state to carry on from.
+
+***************************************/
+
+uint32_t scan_filter(const log_filter_t* pFilter, uint32_t uState,
+	const uint8_t* pInput, uint32_t uLength, uint32_t* pMatched)
+{
+	const uint32_t* pNext = pFilter->m_pNext;
+	const uint16_t* pClasses = pFilter->m_Classes;
+	uint32_t uStop = pFilter->m_uStop;
+	uint32_t uMatched = *pMatched;
+	for (uint32_t i = 0; i < uLength; i++) {
+		uint32_t uNext = pNext[uState + pClasses[pInput[i]]];
+		uState = uNext & ~NSSM_FILTER_MATCH_MASK;
+		uMatched |= uNext & NSSM_FILTER_MATCH_MASK;
+		if (uMatched & uStop) {
+			break;
+		}
+	}
+	*pMatched = uMatched;
+	return uState;
+}
+
+/* Returns true if a line with the given match flags is kept. */
+bool filter_keeps(const log_filter_t* pFilter, uint32_t uMatched)
+{
+	if (uMatched & NSSM_FILTER_EXCLUDE) {
+		return false;
+	}
+	return !pFilter->m_bInclude || (uMatched & NSSM_FILTER_INCLUDE);
+}
@@ -0,0 +1,39 @@
+/***************************************
+
+	Log line filtering
+
+***************************************/
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stdint.h>
+
+// Match flags carried in the low bits of each transition
+#define NSSM_FILTER_INCLUDE 1U
+#define NSSM_FILTER_EXCLUDE 2U
+#define NSSM_FILTER_MATCH_MASK 3U
+
+struct log_filter_t {
+	// Transitions, m_uStride per state, each the next row ORed with flags
+	uint32_t* m_pNext;
+	// Number of states
+	uint32_t m_uStates;
+	// Entries per state, a multiple of NSSM_FILTER_MATCH_MASK + 1
+	uint32_t m_uStride;
+	// Flags which settle the outcome, so the rest of a line can be skipped
+	uint32_t m_uStop;
+	// Column of each byte value in the transition table
+	uint16_t m_Classes[256];
+	// True if lines must match an include pattern to be kept
+	bool m_bInclude;
+};
+
+extern log_filter_t* compile_filter(
+	const wchar_t* pInclude, const wchar_t* pExclude, uint32_t uCharsize);
+extern void free_filter(log_filter_t* pFilter);
+extern uint32_t scan_filter(const log_filter_t* pFilter, uint32_t uState,
+	const uint8_t* pInput, uint32_t uLength, uint32_t* pMatched);
+extern bool filter_keeps(const log_filter_t* pFilter, uint32_t uMatched);
+
+#endif
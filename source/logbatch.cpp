@@ -0,0 +1,167 @@
+/***************************************
+
+	Batched log writes
+
+	Output is collected as a list of fragments, mostly pointing straight
+	into the ring buffers, and gathered into one write when the batch is
+	flushed.  Data which won't last that long, like timestamps and
+	converted text, is copied into the batch's scratch space first.
+
+***************************************/
+
+#include "logbatch.h"
+#include "memorymanager.h"
+
+#include <string.h>
+
+/***************************************
+
+	Write out all the fragments in the batch
+
+	Fragments are gathered into one buffer so the whole batch costs a single
+	WriteFile().  A batch of one fragment is written directly.  If the
+	batch has m_pWriteFragments the fragments are handed to that instead,
+	as writev() on POSIX takes them without the copy.  Windows has no
+	equivalent for log files, as WriteFileGather() only writes whole pages
+	to files opened without buffering, so the logger doesn't set it.
+	Returns the same as try_write().
+
+***************************************/
+
+int flush_batch(log_batch_t* pBatch, uint32_t* pWritten, int* pComplained)
+{
+	if (!pBatch->m_uCount) {
+		return 0;
+	}
+
+	int ret = 0;
+	uint32_t out;
+	int complained;
+	uint32_t i;
+
+	if ((pBatch->m_uCount > 1) && pBatch->m_pWriteFragments) {
+		out = 0;
+		complained = 0;
+		ret = pBatch->m_pWriteFragments(pBatch->m_pParam, pBatch->m_Fragments,
+			pBatch->m_uCount, pBatch->m_uBytes, &out, &complained);
+		*pWritten += out;
+		*pComplained |= complained;
+		pBatch->m_uCount = 0;
+		pBatch->m_uBytes = 0;
+		pBatch->m_uScratchUsed = 0;
+		return ret;
+	}
+
+	/* Make sure the gather buffer is big enough. */
+	if ((pBatch->m_uCount > 1) && (pBatch->m_uGatherSize < pBatch->m_uBytes)) {
+		heap_free(pBatch->m_pGather);
+		pBatch->m_pGather = static_cast<uint8_t*>(heap_alloc(pBatch->m_uBytes));
+		pBatch->m_uGatherSize = pBatch->m_pGather ? pBatch->m_uBytes : 0;
+	}
+
+	if ((pBatch->m_uCount > 1) && pBatch->m_pGather) {
+		uint8_t* pOutput = pBatch->m_pGather;
+		for (i = 0; i < pBatch->m_uCount; i++) {
+			memcpy(pOutput, pBatch->m_Fragments[i].m_pData,
+				pBatch->m_Fragments[i].m_uLength);
+			pOutput += pBatch->m_Fragments[i].m_uLength;
+		}
+		out = 0;
+		complained = 0;
+		ret = pBatch->m_pWrite(pBatch->m_pParam, pBatch->m_pGather,
+			pBatch->m_uBytes, &out, &complained);
+		*pWritten += out;
+		*pComplained |= complained;
+	} else {
+		/* One fragment, or no memory to gather into. */
+		for (i = 0; i < pBatch->m_uCount; i++) {
+			out = 0;
+			complained = 0;
+			ret = pBatch->m_pWrite(pBatch->m_pParam,
+				const_cast<void*>(pBatch->m_Fragments[i].m_pData),
+				pBatch->m_Fragments[i].m_uLength, &out, &complained);
+			*pWritten += out;
+			*pComplained |= complained;
+			if (ret < 0) {
+				break;
+			}
+		}
+	}
+
+	pBatch->m_uCount = 0;
+	pBatch->m_uBytes = 0;
+	pBatch->m_uScratchUsed = 0;
+	return ret;
+}
+
+/* Returns true if uLength more bytes won't fit in the batch. */
+static inline bool batch_full(const log_batch_t* pBatch, uint32_t uLength)
+{
+	return (pBatch->m_uCount == NSSM_LOG_BATCH_FRAGMENTS) ||
+		(pBatch->m_uCount &&
+			((pBatch->m_uBytes + uLength) > NSSM_LOG_BATCH_BYTES));
+}
+
+static inline void add_fragment(
+	log_batch_t* pBatch, const void* pData, uint32_t uLength)
+{
+	log_fragment_t* pFragment = &pBatch->m_Fragments[pBatch->m_uCount++];
+	pFragment->m_pData = pData;
+	pFragment->m_uLength = uLength;
+	pBatch->m_uBytes += uLength;
+}
+
+/***************************************
+
+	Add a fragment to the batch, flushing first if the batch is full
+
+	The data must stay valid until the batch is flushed.
+	Returns the same as flush_batch() if a flush was needed, 0 otherwise.
+
+***************************************/
+
+int batch_append(log_batch_t* pBatch, const void* pData, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained)
+{
+	if (!uLength) {
+		return 0;
+	}
+	int ret = 0;
+	if (batch_full(pBatch, uLength)) {
+		ret = flush_batch(pBatch, pWritten, pComplained);
+	}
+	add_fragment(pBatch, pData, uLength);
+	return ret;
+}
+
+/***************************************
+
+	Copy short lived data into the batch's scratch space and add it
+
+	Any flush happens before the copy is made, as a flush empties the
+	scratch space and the copy would be overwritten by the next one.
+	Returns -1 if the data is too big for the scratch space, otherwise the
+	same as batch_append().
+
+***************************************/
+
+int batch_copy(log_batch_t* pBatch, const void* pData, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained)
+{
+	if (uLength > NSSM_LOG_BATCH_SCRATCH) {
+		return -1;
+	}
+	if (!uLength) {
+		return 0;
+	}
+	int ret = 0;
+	if (batch_full(pBatch, uLength) ||
+		((pBatch->m_uScratchUsed + uLength) > NSSM_LOG_BATCH_SCRATCH)) {
+		ret = flush_batch(pBatch, pWritten, pComplained);
+	}
+	uint8_t* pCopy = pBatch->m_Scratch + pBatch->m_uScratchUsed;
+	memcpy(pCopy, pData, uLength);
+	pBatch->m_uScratchUsed += uLength;
+	add_fragment(pBatch, pCopy, uLength);
+	return ret;
+}
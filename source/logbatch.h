@@ -0,0 +1,68 @@
+/***************************************
+
+	Batched log writes
+
+***************************************/
+
+#ifndef __LOGBATCH_H__
+#define __LOGBATCH_H__
+
+#include <stdint.h>
+
+// Number of fragments gathered into a single write
+#define NSSM_LOG_BATCH_FRAGMENTS 512
+// Bytes set aside per batch for copies of short lived data like timestamps
+#define NSSM_LOG_BATCH_SCRATCH 16384
+// Batches are written once they hold this many bytes
+#define NSSM_LOG_BATCH_BYTES 262144
+
+// Writes out a flushed batch, returns as try_write() in nssm_io.cpp
+typedef int (*BatchWriteProc)(void* pParam, void* pData, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained);
+
+struct log_fragment_t {
+	// Pointer to the data to write
+	const void* m_pData;
+	// Length of the data in bytes
+	uint32_t m_uLength;
+};
+
+/*
+  Writes out a flushed batch's fragments as they are, as writev() can.
+  Returns as BatchWriteProc.
+*/
+typedef int (*BatchWriteFragmentsProc)(void* pParam,
+	const log_fragment_t* pFragments, uint32_t uCount, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained);
+
+struct log_batch_t {
+	// Fragments to write, in order
+	log_fragment_t m_Fragments[NSSM_LOG_BATCH_FRAGMENTS];
+	// Storage for fragments which would not outlive the batch otherwise
+	uint8_t m_Scratch[NSSM_LOG_BATCH_SCRATCH];
+	// Writes out the batch
+	BatchWriteProc m_pWrite;
+	// Writes out the fragments without gathering them, NULL if there's none
+	BatchWriteFragmentsProc m_pWriteFragments;
+	// Passed to m_pWrite
+	void* m_pParam;
+	// Buffer the fragments are gathered into for writing
+	uint8_t* m_pGather;
+	// Size of m_pGather in bytes
+	uint32_t m_uGatherSize;
+	// Number of fragments in the batch
+	uint32_t m_uCount;
+	// Total length of the fragments in bytes
+	uint32_t m_uBytes;
+	// Bytes of m_Scratch in use
+	uint32_t m_uScratchUsed;
+};
+
+extern int flush_batch(
+	log_batch_t* pBatch, uint32_t* pWritten, int* pComplained);
+extern int batch_append(log_batch_t* pBatch, const void* pData,
+	uint32_t uLength, uint32_t* pWritten, int* pComplained);
+extern int batch_copy(log_batch_t* pBatch, const void* pData,
+	uint32_t uLength, uint32_t* pWritten, int* pComplained);
+
+#endif
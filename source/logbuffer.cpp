@@ -0,0 +1,249 @@
+/***************************************
+
+	Ring buffers for logged output
+
+	Output read from a pipe goes into the free space after the unwritten
+	data and is written out from the head.  The buffer grows when a burst
+	fills it and shrinks again once the application has been quiet for a
+	while.  The same buffers hold spilled output and queued sink output.
+
+***************************************/
+
+#include "logbuffer.h"
+#include "memorymanager.h"
+
+#include <string.h>
+
+/***************************************
+
+	Allocate the ring buffer for data read from the pipe
+
+***************************************/
+
+int log_buffer_init(log_buffer_t* pBuffer, uint32_t uMin, uint32_t uMax)
+{
+	pBuffer->m_pData = static_cast<uint8_t*>(heap_alloc(uMin));
+	if (!pBuffer->m_pData) {
+		return 1;
+	}
+	pBuffer->m_uSize = uMin;
+	pBuffer->m_uMin = uMin;
+	pBuffer->m_uMax = uMax;
+	pBuffer->m_uHead = 0;
+	pBuffer->m_uUsed = 0;
+	pBuffer->m_uIdle = 0;
+	return 0;
+}
+
+/***************************************
+
+	Release the ring buffer
+
+***************************************/
+
+void log_buffer_free(log_buffer_t* pBuffer)
+{
+	if (pBuffer->m_pData) {
+		heap_free(pBuffer->m_pData);
+		pBuffer->m_pData = NULL;
+	}
+	pBuffer->m_uSize = 0;
+	pBuffer->m_uHead = 0;
+	pBuffer->m_uUsed = 0;
+}
+
+/***************************************
+
+	Return the largest contiguous free region after the unwritten data
+
+***************************************/
+
+uint32_t log_buffer_free_span(log_buffer_t* pBuffer, void** ppOutput)
+{
+	uint32_t uTail = pBuffer->m_uHead + pBuffer->m_uUsed;
+	if (uTail >= pBuffer->m_uSize) {
+		/* The data wraps, so the free space ends at the head. */
+		uTail -= pBuffer->m_uSize;
+		*ppOutput = pBuffer->m_pData + uTail;
+		return pBuffer->m_uHead - uTail;
+	}
+	*ppOutput = pBuffer->m_pData + uTail;
+	return pBuffer->m_uSize - uTail;
+}
+
+/***************************************
+
+	Return the largest contiguous region of unwritten data
+
+***************************************/
+
+uint32_t log_buffer_used_span(log_buffer_t* pBuffer, void** ppOutput)
+{
+	*ppOutput = pBuffer->m_pData + pBuffer->m_uHead;
+	uint32_t uSpan = pBuffer->m_uSize - pBuffer->m_uHead;
+	if (uSpan > pBuffer->m_uUsed) {
+		uSpan = pBuffer->m_uUsed;
+	}
+	return uSpan;
+}
+
+/* Discard bytes from the head of the unwritten data. */
+void log_buffer_consume(log_buffer_t* pBuffer, uint32_t uLength)
+{
+	pBuffer->m_uUsed -= uLength;
+	if (!pBuffer->m_uUsed && !pBuffer->m_bBusy) {
+		/* Empty, so start again at the beginning for the longest span. */
+		pBuffer->m_uHead = 0;
+		return;
+	}
+	pBuffer->m_uHead += uLength;
+	if (pBuffer->m_uHead >= pBuffer->m_uSize) {
+		pBuffer->m_uHead -= pBuffer->m_uSize;
+	}
+}
+
+/***************************************
+
+	Reallocate the ring buffer, keeping any unwritten data
+
+***************************************/
+
+int log_buffer_resize(log_buffer_t* pBuffer, uint32_t uSize)
+{
+	/* A read in flight is filling the free space. */
+	if ((uSize < pBuffer->m_uUsed) || pBuffer->m_bBusy) {
+		return 1;
+	}
+	uint8_t* pData = static_cast<uint8_t*>(heap_alloc(uSize));
+	if (!pData) {
+		return 2;
+	}
+
+	/* Unwrap the unwritten data to the start of the new buffer. */
+	void* pSpan;
+	uint32_t uSpan = log_buffer_used_span(pBuffer, &pSpan);
+	memcpy(pData, pSpan, uSpan);
+	if (uSpan < pBuffer->m_uUsed) {
+		memcpy(pData + uSpan, pBuffer->m_pData, pBuffer->m_uUsed - uSpan);
+	}
+
+	heap_free(pBuffer->m_pData);
+	pBuffer->m_pData = pData;
+	pBuffer->m_uSize = uSize;
+	pBuffer->m_uHead = 0;
+	return 0;
+}
+
+/***************************************
+
+	Double the size of the ring buffer, up to its maximum
+
+	Returns 0 if the buffer grew.
+
+***************************************/
+
+int log_buffer_grow(log_buffer_t* pBuffer)
+{
+	if (pBuffer->m_uSize >= pBuffer->m_uMax) {
+		return 1;
+	}
+	uint32_t uSize = pBuffer->m_uSize << 1U;
+	if ((uSize > pBuffer->m_uMax) || (uSize < pBuffer->m_uSize)) {
+		uSize = pBuffer->m_uMax;
+	}
+	return log_buffer_resize(pBuffer, uSize);
+}
+
+/***************************************
+
+	Grow the buffer after a drain which filled it, shrink it after the
+	application has been quiet for a while.
+
+***************************************/
+
+void log_buffer_adapt(log_buffer_t* pBuffer, uint32_t uDrained)
+{
+	uint32_t uSize;
+	if (uDrained >= pBuffer->m_uSize) {
+		pBuffer->m_uIdle = 0;
+		/* Not fatal if this fails, we just carry on at this size. */
+		log_buffer_grow(pBuffer);
+		return;
+	}
+
+	if ((uDrained >= (pBuffer->m_uSize >> 2U)) ||
+		(pBuffer->m_uSize <= pBuffer->m_uMin)) {
+		pBuffer->m_uIdle = 0;
+		return;
+	}
+	if (++pBuffer->m_uIdle < NSSM_LOG_BUFFER_IDLE) {
+		return;
+	}
+	pBuffer->m_uIdle = 0;
+	uSize = pBuffer->m_uSize >> 1U;
+	if (uSize < pBuffer->m_uMin) {
+		uSize = pBuffer->m_uMin;
+	}
+	log_buffer_resize(pBuffer, uSize);
+}
+
+/***************************************
+
+	Copy data to the end of the ring buffer, growing it if needed
+
+	Returns 0 on success, or 1 if the data won't fit and nothing was copied.
+
+***************************************/
+
+int log_buffer_put(log_buffer_t* pBuffer, const void* pData, uint32_t uLength)
+{
+	if (!pBuffer->m_pData) {
+		return 1;
+	}
+	while ((pBuffer->m_uSize - pBuffer->m_uUsed) < uLength) {
+		if (log_buffer_grow(pBuffer)) {
+			return 1;
+		}
+	}
+
+	const uint8_t* pInput = static_cast<const uint8_t*>(pData);
+	while (uLength) {
+		void* address;
+		uint32_t uFree = log_buffer_free_span(pBuffer, &address);
+		if (uFree > uLength) {
+			uFree = uLength;
+		}
+		memcpy(address, pInput, uFree);
+		log_buffer_commit(pBuffer, uFree);
+		pInput += uFree;
+		uLength -= uFree;
+	}
+	return 0;
+}
+
+/***************************************
+
+	Copy data from the start of the ring buffer without consuming it
+
+	Returns the number of bytes copied, at most uLength.
+
+***************************************/
+
+uint32_t log_buffer_peek(
+	log_buffer_t* pBuffer, void* pOutput, uint32_t uLength)
+{
+	if (uLength > pBuffer->m_uUsed) {
+		uLength = pBuffer->m_uUsed;
+	}
+	void* address;
+	uint32_t uSpan = log_buffer_used_span(pBuffer, &address);
+	if (uSpan > uLength) {
+		uSpan = uLength;
+	}
+	memcpy(pOutput, address, uSpan);
+	if (uSpan < uLength) {
+		memcpy(static_cast<uint8_t*>(pOutput) + uSpan, pBuffer->m_pData,
+			uLength - uSpan);
+	}
+	return uLength;
+}
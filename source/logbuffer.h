@@ -0,0 +1,53 @@
+/***************************************
+
+	Ring buffers for logged output
+
+***************************************/
+
+#ifndef __LOGBUFFER_H__
+#define __LOGBUFFER_H__
+
+#include <stdint.h>
+
+// Number of mostly empty drains before the log buffer is shrunk.
+#define NSSM_LOG_BUFFER_IDLE 64
+
+struct log_buffer_t {
+	// Pointer to the ring buffer memory
+	uint8_t* m_pData;
+	// Current size of the ring buffer in bytes
+	uint32_t m_uSize;
+	// Smallest size the ring buffer may shrink to
+	uint32_t m_uMin;
+	// Largest size the ring buffer may grow to
+	uint32_t m_uMax;
+	// Offset of the oldest byte not yet written out
+	uint32_t m_uHead;
+	// Number of bytes not yet written out
+	uint32_t m_uUsed;
+	// Number of consecutive drains which used little of the buffer
+	uint32_t m_uIdle;
+	// True while a read into the free space is in flight
+	bool m_bBusy;
+};
+
+extern int log_buffer_init(log_buffer_t* pBuffer, uint32_t uMin, uint32_t uMax);
+extern void log_buffer_free(log_buffer_t* pBuffer);
+extern uint32_t log_buffer_free_span(log_buffer_t* pBuffer, void** ppOutput);
+extern uint32_t log_buffer_used_span(log_buffer_t* pBuffer, void** ppOutput);
+extern void log_buffer_consume(log_buffer_t* pBuffer, uint32_t uLength);
+extern int log_buffer_resize(log_buffer_t* pBuffer, uint32_t uSize);
+extern int log_buffer_grow(log_buffer_t* pBuffer);
+extern void log_buffer_adapt(log_buffer_t* pBuffer, uint32_t uDrained);
+extern int log_buffer_put(
+	log_buffer_t* pBuffer, const void* pData, uint32_t uLength);
+extern uint32_t log_buffer_peek(
+	log_buffer_t* pBuffer, void* pOutput, uint32_t uLength);
+
+/* Mark bytes placed in the free region as unwritten data. */
+static inline void log_buffer_commit(log_buffer_t* pBuffer, uint32_t uLength)
+{
+	pBuffer->m_uUsed += uLength;
+}
+
+#endif
@@ -0,0 +1,269 @@
+/***************************************
+
+	Log line prefixes and JSON records
+
+	What goes around each line of output in the log file, the timestamp
+	prefix or the JSON record the line is escaped into, added to a batch.
+	The timestamp is kept formatted and only the digits which change are
+	rewritten, so nothing here allocates or formats a line from scratch.
+
+***************************************/
+
+#include "logline.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/***************************************
+
+	Store a zero padded decimal number in both copies of the timestamp
+
+***************************************/
+
+static inline void put_digits(log_timestamp_t* pTimestamp, uint32_t uOffset,
+	uint32_t uValue, uint32_t uDigits)
+{
+	while (uDigits) {
+		--uDigits;
+		char digit = static_cast<char>('0' + (uValue % 10U));
+		uValue /= 10U;
+		pTimestamp->m_UTF8[uOffset + uDigits] = digit;
+		pTimestamp->m_UTF16[uOffset + uDigits] = static_cast<utf16_t>(digit);
+	}
+}
+
+/***************************************
+
+	Bring the cached timestamp prefix up to date
+
+	The first call formats the whole prefix.  Later calls only rewrite the
+	fields which changed, which is usually just the milliseconds.  Offsets
+	match TIMESTAMP_FORMAT.
+
+***************************************/
+
+void update_timestamp(log_timestamp_t* pTimestamp, const SYSTEMTIME* pNow)
+{
+	if (!pTimestamp->m_bValid) {
+		snprintf(pTimestamp->m_UTF8, sizeof(pTimestamp->m_UTF8),
+			TIMESTAMP_FORMAT, pNow->wYear, pNow->wMonth, pNow->wDay,
+			pNow->wHour, pNow->wMinute, pNow->wSecond, pNow->wMilliseconds);
+		/* The prefix is plain ASCII. */
+		for (uint32_t i = 0; i < (TIMESTAMP_LEN + 1); i++) {
+			pTimestamp->m_UTF16[i] =
+				static_cast<utf16_t>(pTimestamp->m_UTF8[i]);
+		}
+		pTimestamp->m_Time = *pNow;
+		pTimestamp->m_bValid = true;
+		return;
+	}
+
+	SYSTEMTIME* pLast = &pTimestamp->m_Time;
+	if (pLast->wMilliseconds != pNow->wMilliseconds) {
+		put_digits(pTimestamp, 20, pNow->wMilliseconds, 3);
+	}
+	if (pLast->wSecond != pNow->wSecond) {
+		put_digits(pTimestamp, 17, pNow->wSecond, 2);
+	}
+	if (pLast->wMinute != pNow->wMinute) {
+		put_digits(pTimestamp, 14, pNow->wMinute, 2);
+	}
+	if (pLast->wHour != pNow->wHour) {
+		put_digits(pTimestamp, 11, pNow->wHour, 2);
+	}
+	if (pLast->wDay != pNow->wDay) {
+		put_digits(pTimestamp, 8, pNow->wDay, 2);
+	}
+	if (pLast->wMonth != pNow->wMonth) {
+		put_digits(pTimestamp, 5, pNow->wMonth, 2);
+	}
+	if (pLast->wYear != pNow->wYear) {
+		put_digits(pTimestamp, 0, pNow->wYear, 4);
+	}
+	*pLast = *pNow;
+}
+
+/***************************************
+
+	Add the timestamp prefix in the log's character size to the batch
+
+	No memory is allocated, the prefix is kept formatted in UTF-8 and UTF-16
+	by update_timestamp(), which the caller brings up to date first.
+
+***************************************/
+
+int batch_timestamp(log_batch_t* pBatch, const log_timestamp_t* pTimestamp,
+	uint32_t uCharsize, uint32_t* pWritten, int* pComplained)
+{
+	if (uCharsize == sizeof(char)) {
+		return batch_copy(pBatch, pTimestamp->m_UTF8, TIMESTAMP_LEN, pWritten,
+			pComplained);
+	}
+	return batch_copy(pBatch, pTimestamp->m_UTF16,
+		TIMESTAMP_LEN * sizeof(utf16_t), pWritten, pComplained);
+}
+
+/* Copy a string without its terminator, returns the number of bytes. */
+static inline uint32_t put_string(char* pOutput, const char* pInput)
+{
+	uint32_t uLength = static_cast<uint32_t>(strlen(pInput));
+	memcpy(pOutput, pInput, uLength);
+	return uLength;
+}
+
+/* Store a number in decimal, returns the number of digits. */
+static uint32_t put_decimal(char* pOutput, uint64_t uValue)
+{
+	char digits[20];
+	uint32_t uCount = 0;
+	do {
+		digits[uCount++] = static_cast<char>('0' + (uValue % 10U));
+		uValue /= 10U;
+	} while (uValue);
+	for (uint32_t i = 0; i < uCount; i++) {
+		pOutput[i] = digits[uCount - 1 - i];
+	}
+	return uCount;
+}
+
+/***************************************
+
+	Add the start of a JSON record to the batch
+
+	Everything up to the opening quote of the message, for example:
+
+	{"time":"2016-09-06T10:17:09.451Z","stream":"stdout","service":"Name",
+	"pid":1234,"message":"
+
+	The time is taken from the cached timestamp, which is UTC.  pService
+	is already escaped.  "seq" is added if pSequence isn't NULL.
+
+***************************************/
+
+int batch_json_open(log_batch_t* pBatch, const log_timestamp_t* pTimestamp,
+	const char* pStream, const char* pService, uint32_t uServiceLength,
+	uint32_t uPID, const uint64_t* pSequence, uint32_t* pWritten,
+	int* pComplained)
+{
+	/* Make the cached timestamp ISO 8601. */
+	char head[96];
+	uint32_t uLength = put_string(head, "{\"time\":\"");
+	memcpy(head + uLength, pTimestamp->m_UTF8, TIMESTAMP_DATETIME_LEN);
+	head[uLength + 10] = 'T';
+	uLength += TIMESTAMP_DATETIME_LEN;
+	uLength += put_string(head + uLength, "Z\",\"stream\":\"");
+	uLength += put_string(head + uLength, pStream);
+	uLength += put_string(head + uLength, "\",\"service\":\"");
+	int ret = batch_copy(pBatch, head, uLength, pWritten, pComplained);
+	if (ret < 0) {
+		return ret;
+	}
+	int append =
+		batch_append(pBatch, pService, uServiceLength, pWritten, pComplained);
+	if (append < 0) {
+		return append;
+	}
+
+	uLength = put_string(head, "\",\"pid\":");
+	uLength += put_decimal(head + uLength, uPID);
+	if (pSequence) {
+		uLength += put_string(head + uLength, ",\"seq\":");
+		uLength += put_decimal(head + uLength, *pSequence);
+	}
+	uLength += put_string(head + uLength, ",\"message\":\"");
+	int copy = batch_copy(pBatch, head, uLength, pWritten, pComplained);
+	if (copy) {
+		return copy;
+	}
+	return ret ? ret : append;
+}
+
+/***************************************
+
+	Add message text to the batch, escaped for a JSON string
+
+	UTF-8 text is added in place, split around characters which need
+	escaping.  UTF-16 text is converted a chunk at a time, with a high
+	surrogate at the end kept in *pSurrogate for the next call.
+
+***************************************/
+
+int batch_json_text(log_batch_t* pBatch, const uint8_t* pInput,
+	uint32_t uLength, uint32_t uCharsize, uint32_t* pSurrogate,
+	uint32_t* pWritten, int* pComplained)
+{
+	int ret = 0;
+	int append;
+	char escaped[NSSM_JSON_CHUNK];
+
+	if (uCharsize == sizeof(char)) {
+		while (uLength) {
+			uint32_t uPlain = json_plain_span(pInput, uLength);
+			append =
+				batch_append(pBatch, pInput, uPlain, pWritten, pComplained);
+			if (append) {
+				ret = append;
+				if (ret < 0) {
+					return ret;
+				}
+			}
+			pInput += uPlain;
+			uLength -= uPlain;
+
+			/* Escape a run of awkward characters in one go. */
+			uint32_t o = 0;
+			while (uLength && (json_plain_span(pInput, 1) == 0) &&
+				((o + NSSM_JSON_CHAR_MAX) <= sizeof(escaped))) {
+				o += json_put_char(*pInput, escaped + o);
+				++pInput;
+				--uLength;
+			}
+			append = batch_copy(pBatch, escaped, o, pWritten, pComplained);
+			if (append) {
+				ret = append;
+				if (ret < 0) {
+					return ret;
+				}
+			}
+		}
+		return ret;
+	}
+
+	const utf16_t* pText = reinterpret_cast<const utf16_t*>(pInput);
+	uint32_t uCount = uLength / sizeof(utf16_t);
+	do {
+		uint32_t uConsumed;
+		uint32_t o = json_escape_utf16(pText, uCount, escaped,
+			sizeof(escaped), pSurrogate, &uConsumed);
+		pText += uConsumed;
+		uCount -= uConsumed;
+		append = batch_copy(pBatch, escaped, o, pWritten, pComplained);
+		if (append) {
+			ret = append;
+			if (ret < 0) {
+				return ret;
+			}
+		}
+	} while (uCount);
+	return ret;
+}
+
+/* Add the end of a JSON record to the batch. */
+int batch_json_close(log_batch_t* pBatch, uint32_t* pSurrogate,
+	uint32_t* pWritten, int* pComplained)
+{
+	static const char g_JsonClose[] = "\"}\n";
+	int ret = 0;
+
+	/* A lone high surrogate at the end of the line. */
+	if (*pSurrogate) {
+		ret = batch_json_text(pBatch, NULL, 0, sizeof(utf16_t), pSurrogate,
+			pWritten, pComplained);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	int append = batch_append(pBatch, g_JsonClose, sizeof(g_JsonClose) - 1,
+		pWritten, pComplained);
+	return append ? append : ret;
+}
@@ -0,0 +1,56 @@
+/***************************************
+
+	Log line prefixes and JSON records
+
+***************************************/
+
+#ifndef __LOGLINE_H__
+#define __LOGLINE_H__
+
+#include "logbatch.h"
+#include "logtext.h"
+#include <stdint.h>
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+// Timestamp prefix for each line of logged output
+#define TIMESTAMP_FORMAT "%04u-%02u-%02u %02u:%02u:%02u.%03u: "
+#define TIMESTAMP_LEN 25
+
+// Length of the date and time at the start of TIMESTAMP_FORMAT
+#define TIMESTAMP_DATETIME_LEN 23
+
+// Bytes of escaped JSON produced per copy into a batch.
+#define NSSM_JSON_CHUNK 1024
+
+struct log_timestamp_t {
+	// Time the prefix was last formatted for
+	SYSTEMTIME m_Time;
+	// Formatted prefix as UTF-8
+	char m_UTF8[TIMESTAMP_LEN + 1];
+	// Formatted prefix as UTF-16
+	utf16_t m_UTF16[TIMESTAMP_LEN + 1];
+	// True once the prefix has been formatted in full
+	bool m_bValid;
+};
+
+extern void update_timestamp(
+	log_timestamp_t* pTimestamp, const SYSTEMTIME* pNow);
+extern int batch_timestamp(log_batch_t* pBatch,
+	const log_timestamp_t* pTimestamp, uint32_t uCharsize, uint32_t* pWritten,
+	int* pComplained);
+extern int batch_json_open(log_batch_t* pBatch,
+	const log_timestamp_t* pTimestamp, const char* pStream,
+	const char* pService, uint32_t uServiceLength, uint32_t uPID,
+	const uint64_t* pSequence, uint32_t* pWritten, int* pComplained);
+extern int batch_json_text(log_batch_t* pBatch, const uint8_t* pInput,
+	uint32_t uLength, uint32_t uCharsize, uint32_t* pSurrogate,
+	uint32_t* pWritten, int* pComplained);
+extern int batch_json_close(log_batch_t* pBatch, uint32_t* pSurrogate,
+	uint32_t* pWritten, int* pComplained);
+
+#endif
@@ -0,0 +1,104 @@
+/***************************************
+
+	Memory mapped log writes
+
+	Output is copied into a window of the log file mapped into memory.
+	When the window is full the next one along is mapped, which extends
+	the file to its end.  Cutting the file back to what was written is
+	left to the caller, as are the handles to the file.
+
+***************************************/
+
+#include "logmap.h"
+
+#include <string.h>
+
+/***************************************
+
+	Map the window starting at uOffset
+
+	uOffset must be a multiple of the window size.  Returns 0 on success,
+	or the error code with *ppFunction set to what failed.
+
+***************************************/
+
+unsigned long map_window(
+	log_map_t* pMap, uint64_t uOffset, const wchar_t** ppFunction)
+{
+	ULARGE_INTEGER end;
+	end.QuadPart = uOffset + pMap->m_uWindow;
+	pMap->m_hMapping = CreateFileMappingW(
+		pMap->m_hFile, NULL, PAGE_READWRITE, end.HighPart, end.LowPart, NULL);
+	if (!pMap->m_hMapping) {
+		*ppFunction = L"CreateFileMapping()";
+		return GetLastError();
+	}
+
+	ULARGE_INTEGER start;
+	start.QuadPart = uOffset;
+	pMap->m_pView = static_cast<uint8_t*>(MapViewOfFile(pMap->m_hMapping,
+		FILE_MAP_WRITE, start.HighPart, start.LowPart, pMap->m_uWindow));
+	if (!pMap->m_pView) {
+		unsigned long error = GetLastError();
+		*ppFunction = L"MapViewOfFile()";
+		CloseHandle(pMap->m_hMapping);
+		pMap->m_hMapping = NULL;
+		return error;
+	}
+	pMap->m_uOffset = uOffset;
+	pMap->m_uUsed = 0;
+	return 0;
+}
+
+void unmap_window(log_map_t* pMap)
+{
+	if (pMap->m_pView) {
+		UnmapViewOfFile(pMap->m_pView);
+		pMap->m_pView = NULL;
+	}
+	if (pMap->m_hMapping) {
+		CloseHandle(pMap->m_hMapping);
+		pMap->m_hMapping = NULL;
+	}
+}
+
+/***************************************
+
+	Copy output into the mapped window
+
+	The next window is mapped whenever the current one fills up.
+	*pCopied is set to the number of bytes copied, which is less than
+	uLength if a window couldn't be mapped.  Returns 0 on success, or the
+	error code with *ppFunction set to what failed, in which case no
+	window is mapped and m_uOffset and m_uUsed still say where the output
+	ends.
+
+***************************************/
+
+unsigned long map_copy(log_map_t* pMap, const void* pData, uint32_t uLength,
+	uint32_t* pCopied, const wchar_t** ppFunction)
+{
+	const uint8_t* pInput = static_cast<const uint8_t*>(pData);
+	uint32_t uCopied = 0;
+	unsigned long error = 0;
+	while (uCopied < uLength) {
+		if (pMap->m_uUsed == pMap->m_uWindow) {
+			uint64_t uNext = pMap->m_uOffset + pMap->m_uWindow;
+			unmap_window(pMap);
+			error = map_window(pMap, uNext, ppFunction);
+			if (error) {
+				break;
+			}
+		}
+		uint32_t uSpace = pMap->m_uWindow - pMap->m_uUsed;
+		uint32_t uCopy = uLength - uCopied;
+		if (uCopy > uSpace) {
+			uCopy = uSpace;
+		}
+		memcpy(pMap->m_pView + pMap->m_uUsed, pInput + uCopied, uCopy);
+		pMap->m_uUsed += uCopy;
+		uCopied += uCopy;
+	}
+	*pCopied = uCopied;
+	return error;
+}
@@ -0,0 +1,39 @@
+/***************************************
+
+	Memory mapped log writes
+
+***************************************/
+
+#ifndef __LOGMAP_H__
+#define __LOGMAP_H__
+
+#include <stdint.h>
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+struct log_map_t {
+	// Second handle to the log file, with the read access mapping needs
+	HANDLE m_hFile;
+	// Mapping of the log file up to the end of the current window
+	HANDLE m_hMapping;
+	// Current window, NULL if none is mapped
+	uint8_t* m_pView;
+	// Offset in the log file of the start of the current window
+	uint64_t m_uOffset;
+	// Size of a window in bytes, a multiple of the allocation granularity
+	uint32_t m_uWindow;
+	// Bytes of the current window written to
+	uint32_t m_uUsed;
+};
+
+extern unsigned long map_window(
+	log_map_t* pMap, uint64_t uOffset, const wchar_t** ppFunction);
+extern void unmap_window(log_map_t* pMap);
+extern unsigned long map_copy(log_map_t* pMap, const void* pData,
+	uint32_t uLength, uint32_t* pCopied, const wchar_t** ppFunction);
+
+#endif
@@ -0,0 +1,142 @@
+/***************************************
+
+	Log sinks, syslog framing and per-sink queues
+
+	What a sink is sent, as opposed to how it is sent.  Each sink has its
+	own queue, which only grows so far, after which output for it is
+	dropped and counted.  A syslog message is a header followed by one
+	line, and a pipe is sent the output as a stream.  Connecting and
+	sending are left to the caller.
+
+***************************************/
+
+#include "logsink.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+/* Copy at most uCount characters, always terminating the output. */
+static void copy_chars(wchar_t* pOutput, uint32_t uLength,
+	const wchar_t* pInput, size_t uCount)
+{
+	if (!uLength) {
+		return;
+	}
+	size_t i = 0;
+	while ((i < uCount) && pInput[i] && ((i + 1) < uLength)) {
+		pOutput[i] = pInput[i];
+		i++;
+	}
+	pOutput[i] = 0;
+}
+
+/***************************************
+
+	Split host[:port] or [address]:port into its parts
+
+	A bare IPv6 address, with more than one colon, is all host.  pPort is
+	left alone if no port was given.
+
+***************************************/
+
+void split_address(const wchar_t* pInput, wchar_t* pHost,
+	uint32_t uHostLength, wchar_t* pPort, uint32_t uPortLength)
+{
+	if (pInput[0] == L'[') {
+		const wchar_t* pEnd = wcschr(pInput, L']');
+		if (pEnd) {
+			copy_chars(pHost, uHostLength, pInput + 1,
+				static_cast<size_t>(pEnd - pInput - 1));
+			if (pEnd[1] == L':') {
+				copy_chars(pPort, uPortLength, pEnd + 2, wcslen(pEnd + 2));
+			}
+			return;
+		}
+	}
+
+	const wchar_t* pColon = wcschr(pInput, L':');
+	if (pColon && !wcschr(pColon + 1, L':')) {
+		copy_chars(
+			pHost, uHostLength, pInput, static_cast<size_t>(pColon - pInput));
+		copy_chars(pPort, uPortLength, pColon + 1, wcslen(pColon + 1));
+		return;
+	}
+	copy_chars(pHost, uHostLength, pInput, wcslen(pInput));
+}
+
+/***************************************
+
+	Build the syslog header at the start of the sink's send buffer
+
+	The user facility priority and the tag, for example "<14>Name: ".  The
+	server adds the time and host.  Tags are short enough to leave room
+	for a line.  Returns the length of the header.
+
+***************************************/
+
+uint32_t syslog_header(log_sink_t* pSink, uint32_t uPriority,
+	const utf16_t* pTag, uint32_t uTagLength)
+{
+	char* pHeader = reinterpret_cast<char*>(pSink->m_pSend);
+	snprintf(pHeader, 8, "<%u>", uPriority);
+	uint32_t uLength = static_cast<uint32_t>(strlen(pHeader));
+
+	uint32_t uSurrogate = 0;
+	uint32_t uConsumed;
+	uLength += utf16_to_utf8(pTag, uTagLength, pHeader + uLength,
+		NSSM_SYSLOG_MAX / 2, &uSurrogate, &uConsumed);
+	pHeader[uLength++] = ':';
+	pHeader[uLength++] = ' ';
+	pSink->m_uHeader = uLength;
+	return uLength;
+}
+
+/* Queue output for a sink, counting it as lost if it won't fit. */
+void queue_for_sink(log_sink_t* pSink, const void* pData, uint32_t uLength)
+{
+	if (log_buffer_put(&pSink->m_Queue, pData, uLength)) {
+		pSink->m_uLost += uLength;
+		pSink->m_uDropped += uLength;
+	}
+}
+
+/***************************************
+
+	Copy the next message for a sink out of its queue
+
+	A syslog message is the header followed by one line, without its line
+	ending, and a long line is split.  A pipe is sent as much as there is
+	room for.  m_uSending is set to the number of bytes of the queue used.
+
+	Returns the length of the message, which may be 0 for an empty line.
+
+***************************************/
+
+uint32_t next_sink_message(log_sink_t* pSink)
+{
+	if (pSink->m_uKind != NSSM_LOG_SINK_SYSLOG) {
+		pSink->m_uSending = log_buffer_peek(
+			&pSink->m_Queue, pSink->m_pSend, NSSM_LOG_SINK_SEND);
+		return pSink->m_uSending;
+	}
+
+	char* pLine = reinterpret_cast<char*>(pSink->m_pSend) + pSink->m_uHeader;
+	uint32_t uLength = log_buffer_peek(
+		&pSink->m_Queue, pLine, NSSM_SYSLOG_MAX - pSink->m_uHeader);
+	const char* pNewline =
+		static_cast<const char*>(memchr(pLine, '\n', uLength));
+	if (pNewline) {
+		uLength = static_cast<uint32_t>(pNewline - pLine);
+		pSink->m_uSending = uLength + 1;
+		if (uLength && (pLine[uLength - 1] == '\r')) {
+			uLength--;
+		}
+	} else {
+		pSink->m_uSending = uLength;
+	}
+	if (!uLength) {
+		return 0;
+	}
+	return pSink->m_uHeader + uLength;
+}
@@ -0,0 +1,76 @@
+/***************************************
+
+	Log sinks, syslog framing and per-sink queues
+
+***************************************/
+
+#ifndef __LOGSINK_H__
+#define __LOGSINK_H__
+
+#include "logbuffer.h"
+#include "logtext.h"
+#include <stdint.h>
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+// Consumers output is sent to as well as the log file
+#define NSSM_LOG_SINK_SYSLOG 0
+#define NSSM_LOG_SINK_PIPE 1
+#define NSSM_LOG_SINKS 2
+
+// Most bytes handed to a sink in one write, including any syslog header
+#define NSSM_LOG_SINK_SEND 65536
+
+// Longest syslog message sent, header included.
+#define NSSM_SYSLOG_MAX 2048
+
+// Syslog priorities for the user facility.
+#define NSSM_SYSLOG_WARNING 12
+#define NSSM_SYSLOG_INFO 14
+
+// Longest host name and port accepted for a socket sink.
+#define NSSM_HOST_LENGTH 256
+#define NSSM_PORT_LENGTH 16
+
+struct log_sink_t {
+	// Socket or pipe handle, NULL until connected
+	HANDLE m_hWrite;
+	// Write in progress to the sink
+	OVERLAPPED m_Overlapped;
+	// Output waiting to be sent
+	log_buffer_t m_Queue;
+	// Bytes lost since the sink last worked
+	uint64_t m_uLost;
+	// Bytes lost in total
+	uint64_t m_uDropped;
+	// Where to send output, from the service's settings
+	const wchar_t* m_pTarget;
+	// Data being sent, NULL for an unused sink
+	uint8_t* m_pSend;
+	// Bytes of m_Queue being sent
+	uint32_t m_uSending;
+	// Length of the syslog header at the start of m_pSend
+	uint32_t m_uHeader;
+	// GetTickCount() when to try to connect again
+	uint32_t m_uRetry;
+	// NSSM_LOG_SINK_* type of consumer
+	uint32_t m_uKind;
+	// True while a write is in flight
+	bool m_bWriting;
+	// True once a failure has been logged, until the sink works again
+	bool m_bComplained;
+};
+
+extern void split_address(const wchar_t* pInput, wchar_t* pHost,
+	uint32_t uHostLength, wchar_t* pPort, uint32_t uPortLength);
+extern uint32_t syslog_header(log_sink_t* pSink, uint32_t uPriority,
+	const utf16_t* pTag, uint32_t uTagLength);
+extern void queue_for_sink(
+	log_sink_t* pSink, const void* pData, uint32_t uLength);
+extern uint32_t next_sink_message(log_sink_t* pSink);
+
+#endif
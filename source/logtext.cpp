@@ -0,0 +1,703 @@
+/***************************************
+
+	Log text scanning and conversion
+
+	The loops which look at every byte of output, finding line endings,
+	escaping for JSON and converting between UTF-8 and UTF-16.  They use
+	SSE2, and AVX2 where there is some, on x64 and fall back to plain C
+	elsewhere.  They don't touch the logger so they can be timed and tested
+	on their own.
+
+***************************************/
+
+#include "logtext.h"
+
+#include <string.h>
+
+// SSE2 is always present on x64, AVX2 is checked for at runtime.
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#define NSSM_SCAN_SIMD
+#define NSSM_TARGET_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+#elif defined(__GNUC__) && defined(__x86_64__)
+#define NSSM_SCAN_SIMD
+#define NSSM_TARGET_AVX2 __attribute__((target("avx2")))
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(NSSM_SCAN_SIMD)
+
+/* Return the index of the lowest set bit, which must be one. */
+static inline uint32_t lowest_bit(uint32_t uMask)
+{
+#if defined(_MSC_VER)
+	unsigned long uBit;
+	_BitScanForward(&uBit, uMask);
+	return static_cast<uint32_t>(uBit);
+#else
+	return static_cast<uint32_t>(__builtin_ctz(uMask));
+#endif
+}
+
+/* Read a CPUID leaf, subleaf 0, into EAX, EBX, ECX and EDX. */
+static inline void read_cpuid(int* pRegisters, int iLeaf)
+{
+#if defined(_MSC_VER)
+	__cpuidex(pRegisters, iLeaf, 0);
+#else
+	unsigned int a, b, c, d;
+	__cpuid_count(iLeaf, 0, a, b, c, d);
+	pRegisters[0] = static_cast<int>(a);
+	pRegisters[1] = static_cast<int>(b);
+	pRegisters[2] = static_cast<int>(c);
+	pRegisters[3] = static_cast<int>(d);
+#endif
+}
+
+/* Read the register of state components the OS saves. */
+static inline uint64_t read_xcr0(void)
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t uLow, uHigh;
+	__asm__ __volatile__("xgetbv" : "=a"(uLow), "=d"(uHigh) : "c"(0));
+	return (static_cast<uint64_t>(uHigh) << 32) | uLow;
+#endif
+}
+#endif
+
+/***************************************
+
+	Find line endings, one character at a time
+
+	A newline is the byte 0x0A for 8 bit text or the bytes 0x0A 0x00 at an
+	even offset for UTF-16.  Each entry stored in pEnds is the offset of the
+	byte following a newline, uBase is added to each entry.  Returns the
+	number of entries stored, which stops at uMaxEnds.
+
+***************************************/
+
+static uint32_t scan_newlines_scalar(const uint8_t* pInput, uint32_t uLength,
+	uint32_t uCharsize, uint32_t* pEnds, uint32_t uMaxEnds, uint32_t uBase)
+{
+	uint32_t uCount = 0;
+	uint32_t i = 0;
+	if (uCharsize == sizeof(char)) {
+		while (uCount < uMaxEnds) {
+			const void* pFound = memchr(pInput + i, '\n', uLength - i);
+			if (!pFound) {
+				break;
+			}
+			i = static_cast<uint32_t>(
+					static_cast<const uint8_t*>(pFound) - pInput) +
+				1;
+			pEnds[uCount++] = uBase + i;
+		}
+		return uCount;
+	}
+
+	/* Only whole characters. */
+	uLength &= ~1U;
+	for (; (i < uLength) && (uCount < uMaxEnds); i += 2) {
+		if ((pInput[i] == '\n') && !pInput[i + 1]) {
+			pEnds[uCount++] = uBase + i + 2;
+		}
+	}
+	return uCount;
+}
+
+#if defined(NSSM_SCAN_SIMD)
+
+/***************************************
+
+	Find line endings 16 bytes at a time with SSE2
+
+***************************************/
+
+static uint32_t scan_newlines_sse2(const uint8_t* pInput, uint32_t uLength,
+	uint32_t uCharsize, uint32_t* pEnds, uint32_t uMaxEnds)
+{
+	uint32_t uCount = 0;
+	uint32_t i = 0;
+	const __m128i vNewline = (uCharsize == sizeof(char)) ?
+		_mm_set1_epi8('\n') :
+		_mm_set1_epi16('\n');
+	/* UTF-16 matches set two mask bits, keep the first. */
+	const uint32_t uKeep = (uCharsize == sizeof(char)) ? 0xFFFFU : 0x5555U;
+
+	for (; (i + 16) <= uLength; i += 16) {
+		__m128i vData =
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(pInput + i));
+		__m128i vMatch = (uCharsize == sizeof(char)) ?
+			_mm_cmpeq_epi8(vData, vNewline) :
+			_mm_cmpeq_epi16(vData, vNewline);
+		uint32_t uMask =
+			static_cast<uint32_t>(_mm_movemask_epi8(vMatch)) & uKeep;
+		while (uMask) {
+			pEnds[uCount++] = i + lowest_bit(uMask) + uCharsize;
+			if (uCount == uMaxEnds) {
+				return uCount;
+			}
+			uMask &= uMask - 1;
+		}
+	}
+
+	return uCount +
+		scan_newlines_scalar(pInput + i, uLength - i, uCharsize,
+			pEnds + uCount, uMaxEnds - uCount, i);
+}
+
+/***************************************
+
+	Find line endings 32 bytes at a time with AVX2
+
+***************************************/
+
+static NSSM_TARGET_AVX2 uint32_t scan_newlines_avx2(
+	const uint8_t* pInput, uint32_t uLength, uint32_t uCharsize,
+	uint32_t* pEnds, uint32_t uMaxEnds)
+{
+	uint32_t uCount = 0;
+	uint32_t i = 0;
+	const __m256i vNewline = (uCharsize == sizeof(char)) ?
+		_mm256_set1_epi8('\n') :
+		_mm256_set1_epi16('\n');
+	const uint32_t uKeep =
+		(uCharsize == sizeof(char)) ? 0xFFFFFFFFU : 0x55555555U;
+
+	for (; (i + 32) <= uLength; i += 32) {
+		__m256i vData =
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pInput + i));
+		__m256i vMatch = (uCharsize == sizeof(char)) ?
+			_mm256_cmpeq_epi8(vData, vNewline) :
+			_mm256_cmpeq_epi16(vData, vNewline);
+		uint32_t uMask =
+			static_cast<uint32_t>(_mm256_movemask_epi8(vMatch)) & uKeep;
+		while (uMask) {
+			pEnds[uCount++] = i + lowest_bit(uMask) + uCharsize;
+			if (uCount == uMaxEnds) {
+				return uCount;
+			}
+			uMask &= uMask - 1;
+		}
+	}
+
+	/* Finish off with SSE2, which will fall back to the scalar loop. */
+	uint32_t uTail = scan_newlines_sse2(pInput + i, uLength - i, uCharsize,
+		pEnds + uCount, uMaxEnds - uCount);
+	for (uint32_t j = 0; j < uTail; j++) {
+		pEnds[uCount + j] += i;
+	}
+	return uCount + uTail;
+}
+
+/***************************************
+
+	Check for AVX2 support by both the CPU and the operating system
+
+***************************************/
+
+static bool has_avx2(void)
+{
+	int registers[4];
+	read_cpuid(registers, 0);
+	if (registers[0] < 7) {
+		return false;
+	}
+
+	/* OSXSAVE and AVX, then check the OS saves the YMM registers. */
+	read_cpuid(registers, 1);
+	if ((registers[2] & ((1 << 27) | (1 << 28))) != ((1 << 27) | (1 << 28))) {
+		return false;
+	}
+	if ((read_xcr0() & 6) != 6) {
+		return false;
+	}
+
+	read_cpuid(registers, 7);
+	return (registers[1] & (1 << 5)) != 0;
+}
+#endif
+
+/* The scalar kernel on its own. */
+static uint32_t scan_newlines_generic(const uint8_t* pInput, uint32_t uLength,
+	uint32_t uCharsize, uint32_t* pEnds, uint32_t uMaxEnds)
+{
+	return scan_newlines_scalar(pInput, uLength, uCharsize, pEnds, uMaxEnds, 0);
+}
+
+/*
+  Return one of the NSSM_SCAN_KERNEL_* kernels, or NULL if it can't run on
+  this machine.  For comparing them, scan_newlines() picks the best.
+*/
+ScanNewlinesProc scan_newlines_kernel(uint32_t uKernel)
+{
+	switch (uKernel) {
+	case NSSM_SCAN_KERNEL_SCALAR:
+		return scan_newlines_generic;
+#if defined(NSSM_SCAN_SIMD)
+	case NSSM_SCAN_KERNEL_SSE2:
+		return scan_newlines_sse2;
+	case NSSM_SCAN_KERNEL_AVX2:
+		return has_avx2() ? scan_newlines_avx2 : NULL;
+#endif
+	}
+	return NULL;
+}
+
+/***************************************
+
+	Find the ends of the lines in a buffer
+
+	Shared by timestamping and online rotation.  The kernel is selected on
+	the first call.  Returns the number of entries stored in pEnds, each of
+	which is the offset just past a newline.
+
+***************************************/
+
+uint32_t scan_newlines(const void* pInput, uint32_t uLength,
+	uint32_t uCharsize, uint32_t* pEnds, uint32_t uMaxEnds)
+{
+	static ScanNewlinesProc s_pScan = NULL;
+	ScanNewlinesProc pScan = s_pScan;
+	if (!pScan) {
+#if defined(NSSM_SCAN_SIMD)
+		pScan = has_avx2() ? scan_newlines_avx2 : scan_newlines_sse2;
+#else
+		pScan = scan_newlines_generic;
+#endif
+		/* Every thread would choose the same, so a race is harmless. */
+		s_pScan = pScan;
+	}
+	return pScan(static_cast<const uint8_t*>(pInput), uLength, uCharsize,
+		pEnds, uMaxEnds);
+}
+
+/*
+  Returns the offset just past the last line ending, or 0 if there isn't
+  one.  Searches backwards so only the unfinished line is looked at.
+*/
+uint32_t find_last_newline(
+	const void* pInput, uint32_t uLength, uint32_t uCharsize)
+{
+	const uint8_t* pBytes = static_cast<const uint8_t*>(pInput);
+	if (uCharsize == sizeof(char)) {
+		while (uLength) {
+			if (pBytes[uLength - 1] == '\n') {
+				return uLength;
+			}
+			--uLength;
+		}
+		return 0;
+	}
+
+	/* Only whole characters. */
+	uLength &= ~1U;
+	while (uLength) {
+		if ((pBytes[uLength - 2] == '\n') && !pBytes[uLength - 1]) {
+			return uLength;
+		}
+		uLength -= 2;
+	}
+	return 0;
+}
+
+/* Count the line endings in a buffer. */
+uint64_t count_lines(
+	const void* pInput, uint32_t uLength, uint32_t uCharsize)
+{
+	const uint8_t* pBytes = static_cast<const uint8_t*>(pInput);
+	uint32_t ends[NSSM_NEWLINE_BATCH];
+	uint64_t uLines = 0;
+	uint32_t uFound;
+	do {
+		uFound = scan_newlines(
+			pBytes, uLength, uCharsize, ends, NSSM_NEWLINE_BATCH);
+		uLines += uFound;
+		if (uFound) {
+			pBytes += ends[uFound - 1];
+			uLength -= ends[uFound - 1];
+		}
+	} while (uFound == NSSM_NEWLINE_BATCH);
+	return uLines;
+}
+
+
+/***************************************
+
+	Find how much of a UTF-8 message can go into a JSON string as it is
+
+	Returns the length of the leading run of bytes which are not control
+	characters, quotes or backslashes.  Bytes of multibyte characters are
+	all 0x80 or above so they never need escaping.
+
+***************************************/
+
+uint32_t json_plain_span(const uint8_t* pInput, uint32_t uLength)
+{
+	uint32_t i = 0;
+#if defined(NSSM_SCAN_SIMD)
+	const __m128i vControl = _mm_set1_epi8(0x1F);
+	const __m128i vQuote = _mm_set1_epi8('"');
+	const __m128i vBackslash = _mm_set1_epi8('\\');
+	for (; (i + 16) <= uLength; i += 16) {
+		__m128i vData =
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(pInput + i));
+		/* Unsigned x <= 0x1F when max(x, 0x1F) == 0x1F. */
+		__m128i vMatch = _mm_or_si128(
+			_mm_cmpeq_epi8(_mm_max_epu8(vData, vControl), vControl),
+			_mm_or_si128(_mm_cmpeq_epi8(vData, vQuote),
+				_mm_cmpeq_epi8(vData, vBackslash)));
+		uint32_t uMask = static_cast<uint32_t>(_mm_movemask_epi8(vMatch));
+		if (uMask) {
+			return i + lowest_bit(uMask);
+		}
+	}
+#endif
+	for (; i < uLength; i++) {
+		uint8_t c = pInput[i];
+		if ((c < 0x20) || (c == '"') || (c == '\\')) {
+			break;
+		}
+	}
+	return i;
+}
+
+/* Store a character as UTF-8, returns the number of bytes stored. */
+static inline uint32_t put_utf8(uint32_t c, char* pOutput)
+{
+	if (c < 0x80) {
+		pOutput[0] = static_cast<char>(c);
+		return 1;
+	}
+	if (c < 0x800) {
+		pOutput[0] = static_cast<char>(0xC0 | (c >> 6));
+		pOutput[1] = static_cast<char>(0x80 | (c & 0x3F));
+		return 2;
+	}
+	if (c < 0x10000) {
+		pOutput[0] = static_cast<char>(0xE0 | (c >> 12));
+		pOutput[1] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+		pOutput[2] = static_cast<char>(0x80 | (c & 0x3F));
+		return 3;
+	}
+	pOutput[0] = static_cast<char>(0xF0 | (c >> 18));
+	pOutput[1] = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+	pOutput[2] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+	pOutput[3] = static_cast<char>(0x80 | (c & 0x3F));
+	return 4;
+}
+
+/*
+  Store a character escaped for a JSON string as UTF-8.
+  Returns the number of bytes stored, at most NSSM_JSON_CHAR_MAX.
+*/
+uint32_t json_put_char(uint32_t c, char* pOutput)
+{
+	static const char g_Hex[] = "0123456789abcdef";
+	if (c >= 0x80) {
+		return put_utf8(c, pOutput);
+	}
+	if ((c >= 0x20) && (c != '"') && (c != '\\')) {
+		pOutput[0] = static_cast<char>(c);
+		return 1;
+	}
+
+	pOutput[0] = '\\';
+	switch (c) {
+	case '"':
+	case '\\':
+		pOutput[1] = static_cast<char>(c);
+		return 2;
+	case '\b':
+		pOutput[1] = 'b';
+		return 2;
+	case '\f':
+		pOutput[1] = 'f';
+		return 2;
+	case '\n':
+		pOutput[1] = 'n';
+		return 2;
+	case '\r':
+		pOutput[1] = 'r';
+		return 2;
+	case '\t':
+		pOutput[1] = 't';
+		return 2;
+	}
+	pOutput[1] = 'u';
+	pOutput[2] = '0';
+	pOutput[3] = '0';
+	pOutput[4] = g_Hex[c >> 4];
+	pOutput[5] = g_Hex[c & 15];
+	return 6;
+}
+
+/***************************************
+
+	Convert UTF-16 to escaped UTF-8 for a JSON string
+
+	Runs of plain ASCII are narrowed 8 characters at a time.  A high
+	surrogate at the end of the input is kept in pSurrogate until the next
+	call, unpaired surrogates become U+FFFD.  Call with no input to flush
+	a waiting surrogate.
+
+	Stops when the input is used up or the output might not have room for
+	another character.  pConsumed is set to the number of characters used.
+	Returns the number of bytes stored.
+
+***************************************/
+
+uint32_t json_escape_utf16(const utf16_t* pInput, uint32_t uCount,
+	char* pOutput, uint32_t uOutputSize, uint32_t* pSurrogate,
+	uint32_t* pConsumed)
+{
+	uint32_t i = 0;
+	uint32_t o = 0;
+
+	if (!uCount && *pSurrogate && (uOutputSize >= NSSM_JSON_CHAR_MAX)) {
+		o = json_put_char(0xFFFD, pOutput);
+		*pSurrogate = 0;
+	}
+
+	while ((i < uCount) && ((o + NSSM_JSON_CHAR_MAX) <= uOutputSize)) {
+#if defined(NSSM_SCAN_SIMD)
+		if (!*pSurrogate) {
+			const __m128i vSpace = _mm_set1_epi16(0x20);
+			const __m128i vDelete = _mm_set1_epi16(0x7F);
+			const __m128i vQuote = _mm_set1_epi16('"');
+			const __m128i vBackslash = _mm_set1_epi16('\\');
+			while (((i + 8) <= uCount) && ((o + 8) <= uOutputSize)) {
+				__m128i vData = _mm_loadu_si128(
+					reinterpret_cast<const __m128i*>(pInput + i));
+				/* Signed compares, so 0x8000 and up are below a space. */
+				__m128i vMatch = _mm_or_si128(
+					_mm_or_si128(_mm_cmplt_epi16(vData, vSpace),
+						_mm_cmpgt_epi16(vData, vDelete)),
+					_mm_or_si128(_mm_cmpeq_epi16(vData, vQuote),
+						_mm_cmpeq_epi16(vData, vBackslash)));
+				if (_mm_movemask_epi8(vMatch)) {
+					break;
+				}
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(pOutput + o),
+					_mm_packus_epi16(vData, vData));
+				i += 8;
+				o += 8;
+			}
+			if ((i >= uCount) || ((o + NSSM_JSON_CHAR_MAX) > uOutputSize)) {
+				break;
+			}
+		}
+#endif
+		uint32_t c = static_cast<uint32_t>(pInput[i]);
+		if (*pSurrogate) {
+			if ((c >= 0xDC00) && (c <= 0xDFFF)) {
+				c = 0x10000 + ((*pSurrogate - 0xD800) << 10) + (c - 0xDC00);
+				i++;
+			} else {
+				/* Leave this character for the next time round. */
+				c = 0xFFFD;
+			}
+			*pSurrogate = 0;
+		} else {
+			i++;
+			if ((c >= 0xD800) && (c <= 0xDBFF)) {
+				*pSurrogate = c;
+				continue;
+			}
+			if ((c >= 0xDC00) && (c <= 0xDFFF)) {
+				c = 0xFFFD;
+			}
+		}
+		o += json_put_char(c, pOutput + o);
+	}
+	*pConsumed = i;
+	return o;
+}
+
+/***************************************
+
+	Convert UTF-16 to UTF-8
+
+	Runs of ASCII are narrowed 8 characters at a time.  Surrogates are
+	dealt with as by json_escape_utf16(), a high surrogate at the end of the
+	input waits in pSurrogate for the rest of its pair.
+
+	Stops when the input is used up or the output might not have room for
+	another character.  pConsumed is set to the number of characters used.
+	Returns the number of bytes stored.
+
+***************************************/
+
+uint32_t utf16_to_utf8(const utf16_t* pInput, uint32_t uCount,
+	char* pOutput, uint32_t uOutputSize, uint32_t* pSurrogate,
+	uint32_t* pConsumed)
+{
+	uint32_t i = 0;
+	uint32_t o = 0;
+
+	while ((i < uCount) && ((o + NSSM_UTF8_CHAR_MAX) <= uOutputSize)) {
+#if defined(NSSM_SCAN_SIMD)
+		if (!*pSurrogate) {
+			const __m128i vHigh = _mm_set1_epi16(static_cast<short>(0xFF80));
+			const __m128i vZero = _mm_setzero_si128();
+			while (((i + 8) <= uCount) && ((o + 8) <= uOutputSize)) {
+				__m128i vData = _mm_loadu_si128(
+					reinterpret_cast<const __m128i*>(pInput + i));
+				__m128i vAscii =
+					_mm_cmpeq_epi16(_mm_and_si128(vData, vHigh), vZero);
+				if (_mm_movemask_epi8(vAscii) != 0xFFFF) {
+					break;
+				}
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(pOutput + o),
+					_mm_packus_epi16(vData, vData));
+				i += 8;
+				o += 8;
+			}
+			if ((i >= uCount) || ((o + NSSM_UTF8_CHAR_MAX) > uOutputSize)) {
+				break;
+			}
+		}
+#endif
+		uint32_t c = static_cast<uint32_t>(pInput[i]);
+		if (*pSurrogate) {
+			if ((c >= 0xDC00) && (c <= 0xDFFF)) {
+				c = 0x10000 + ((*pSurrogate - 0xD800) << 10) + (c - 0xDC00);
+				i++;
+			} else {
+				/* Leave this character for the next time round. */
+				c = 0xFFFD;
+			}
+			*pSurrogate = 0;
+		} else {
+			i++;
+			if ((c >= 0xD800) && (c <= 0xDBFF)) {
+				*pSurrogate = c;
+				continue;
+			}
+			if ((c >= 0xDC00) && (c <= 0xDFFF)) {
+				c = 0xFFFD;
+			}
+		}
+		o += put_utf8(c, pOutput + o);
+	}
+	*pConsumed = i;
+	return o;
+}
+
+/* Store the bytes of an unfinished UTF-8 sequence as Latin-1. */
+static inline uint32_t put_latin1(uint32_t uPending, utf16_t* pOutput)
+{
+	uint32_t uCount = uPending >> 24U;
+	for (uint32_t i = 0; i < uCount; i++) {
+		pOutput[i] = static_cast<utf16_t>((uPending >> (i * 8U)) & 0xFFU);
+	}
+	return uCount;
+}
+
+/***************************************
+
+	Convert 8 bit text to UTF-16
+
+	The text is taken to be UTF-8, but bytes which aren't part of a valid
+	sequence are kept as Latin-1 rather than lost.  Runs of ASCII are
+	widened 16 characters at a time.  A sequence left unfinished at the end
+	of the input waits in pPending, which holds its bytes and, in the top
+	byte, how many there are.  Call with no input to flush it.
+
+	Stops when the input is used up or the output might not have room for
+	another character.  pConsumed is set to the number of bytes used.
+	Returns the number of characters stored.
+
+***************************************/
+
+uint32_t utf8_to_utf16(const uint8_t* pInput, uint32_t uLength,
+	utf16_t* pOutput, uint32_t uOutputCount, uint32_t* pPending,
+	uint32_t* pConsumed)
+{
+	uint32_t i = 0;
+	uint32_t o = 0;
+
+	if (!uLength && *pPending && (uOutputCount >= NSSM_UTF16_CHAR_MAX)) {
+		o = put_latin1(*pPending, pOutput);
+		*pPending = 0;
+	}
+
+	while ((i < uLength) && ((o + NSSM_UTF16_CHAR_MAX) <= uOutputCount)) {
+#if defined(NSSM_SCAN_SIMD)
+		if (!*pPending) {
+			const __m128i vZero = _mm_setzero_si128();
+			while (((i + 16) <= uLength) && ((o + 16) <= uOutputCount)) {
+				__m128i vData = _mm_loadu_si128(
+					reinterpret_cast<const __m128i*>(pInput + i));
+				if (_mm_movemask_epi8(vData)) {
+					break;
+				}
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pOutput + o),
+					_mm_unpacklo_epi8(vData, vZero));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pOutput + o + 8),
+					_mm_unpackhi_epi8(vData, vZero));
+				i += 16;
+				o += 16;
+			}
+			if ((i >= uLength) ||
+				((o + NSSM_UTF16_CHAR_MAX) > uOutputCount)) {
+				break;
+			}
+		}
+#endif
+		uint32_t c = pInput[i];
+		uint32_t uCount = *pPending >> 24U;
+		if (uCount) {
+			if ((c & 0xC0U) != 0x80U) {
+				/* Broken off, leave this byte for the next time round. */
+				o += put_latin1(*pPending, pOutput + o);
+				*pPending = 0;
+				continue;
+			}
+			i++;
+			uint32_t uBytes = *pPending & 0xFFFFFFU;
+			uint32_t uLead = uBytes & 0xFFU;
+			uint32_t uNeeded = (uLead >= 0xF0U) ? 4 : (uLead >= 0xE0U) ? 3 : 2;
+			if ((uCount + 1) < uNeeded) {
+				*pPending =
+					uBytes | (c << (uCount * 8U)) | ((uCount + 1) << 24U);
+				continue;
+			}
+
+			/* Put the character together and check it is sane. */
+			uint32_t uChar = uLead & (0x7FU >> uNeeded);
+			for (uint32_t j = 1; j < uCount; j++) {
+				uChar = (uChar << 6U) | ((uBytes >> (j * 8U)) & 0x3FU);
+			}
+			uChar = (uChar << 6U) | (c & 0x3FU);
+			static const uint32_t g_Smallest[5] = {0, 0, 0x80, 0x800, 0x10000};
+			*pPending = 0;
+			if ((uChar < g_Smallest[uNeeded]) || (uChar > 0x10FFFF) ||
+				((uChar >= 0xD800) && (uChar <= 0xDFFF))) {
+				o += put_latin1(uBytes | (uCount << 24U), pOutput + o);
+				pOutput[o++] = static_cast<utf16_t>(c);
+			} else if (uChar >= 0x10000) {
+				uChar -= 0x10000;
+				pOutput[o++] = static_cast<utf16_t>(0xD800 + (uChar >> 10));
+				pOutput[o++] = static_cast<utf16_t>(0xDC00 + (uChar & 0x3FF));
+			} else {
+				pOutput[o++] = static_cast<utf16_t>(uChar);
+			}
+			continue;
+		}
+
+		i++;
+		if ((c >= 0xC2U) && (c <= 0xF4U)) {
+			*pPending = c | (1U << 24U);
+		} else {
+			pOutput[o++] = static_cast<utf16_t>(c);
+		}
+	}
+	*pConsumed = i;
+	return o;
+}
+
@@ -0,0 +1,71 @@
+/***************************************
+
+	Log text scanning and conversion
+
+***************************************/
+
+#ifndef __LOGTEXT_H__
+#define __LOGTEXT_H__
+
+#include <stdint.h>
+#include <wchar.h>
+
+// Number of line endings to find per call to scan_newlines().
+#define NSSM_NEWLINE_BATCH 64
+
+// Most bytes one character can take up once escaped for JSON, as \u001f.
+#define NSSM_JSON_CHAR_MAX 6
+
+// Most bytes one character can take up in UTF-8.
+#define NSSM_UTF8_CHAR_MAX 4
+
+// Most UTF-16 characters stored for one byte of UTF-8, which is four for
+// a bad four byte sequence kept as Latin-1.
+#define NSSM_UTF16_CHAR_MAX 4
+
+// Newline scanning kernels for scan_newlines_kernel()
+#define NSSM_SCAN_KERNEL_SCALAR 0
+#define NSSM_SCAN_KERNEL_SSE2 1
+#define NSSM_SCAN_KERNEL_AVX2 2
+
+// A UTF-16 code unit, which is a wchar_t on Windows
+#if WCHAR_MAX <= 0xFFFF
+typedef wchar_t utf16_t;
+#else
+typedef uint16_t utf16_t;
+#endif
+
+typedef uint32_t (*ScanNewlinesProc)(const uint8_t* pInput, uint32_t uLength,
+	uint32_t uCharsize, uint32_t* pEnds, uint32_t uMaxEnds);
+
+extern ScanNewlinesProc scan_newlines_kernel(uint32_t uKernel);
+extern uint32_t scan_newlines(const void* pInput, uint32_t uLength,
+	uint32_t uCharsize, uint32_t* pEnds, uint32_t uMaxEnds);
+extern uint32_t find_last_newline(
+	const void* pInput, uint32_t uLength, uint32_t uCharsize);
+extern uint64_t count_lines(
+	const void* pInput, uint32_t uLength, uint32_t uCharsize);
+extern uint32_t json_plain_span(const uint8_t* pInput, uint32_t uLength);
+extern uint32_t json_put_char(uint32_t c, char* pOutput);
+extern uint32_t json_escape_utf16(const utf16_t* pInput, uint32_t uCount,
+	char* pOutput, uint32_t uOutputSize, uint32_t* pSurrogate,
+	uint32_t* pConsumed);
+extern uint32_t utf16_to_utf8(const utf16_t* pInput, uint32_t uCount,
+	char* pOutput, uint32_t uOutputSize, uint32_t* pSurrogate,
+	uint32_t* pConsumed);
+extern uint32_t utf8_to_utf16(const uint8_t* pInput, uint32_t uLength,
+	utf16_t* pOutput, uint32_t uOutputCount, uint32_t* pPending,
+	uint32_t* pConsumed);
+
+/* Return the offset just past the first newline or 0 if there isn't one. */
+static inline uint32_t find_newline(
+	const void* pInput, uint32_t uLength, uint32_t uCharsize)
+{
+	uint32_t uEnd;
+	if (!scan_newlines(pInput, uLength, uCharsize, &uEnd, 1)) {
+		return 0;
+	}
+	return uEnd;
+}
+
+#endif
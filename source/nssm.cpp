@@ -21,6 +21,8 @@
 #include "messages.h"
 #include "registry.h"
 #include "service.h"
+#include "tail.h"
+#include "timeindex.h"
 #include "utf8.h"
 
 #include <tchar.h>
@@ -477,7 +479,8 @@ int _tmain(int iArgc, wchar_t** argv)
 		/*
 		  Valid commands are:
 		  start, stop, pause, continue, install, edit, get, set, reset, unset,
-		  remove status, statuscode, rotate, list, processes, version
+		  remove status, statuscode, rotate, list, processes, tail, logs,
+		  version
 		*/
 		if (is_version(argv[1])) {
 			wprintf(L"%s %s %s %s\n", g_NSSM, g_NSSMVersion,
@@ -547,6 +550,10 @@ int _tmain(int iArgc, wchar_t** argv)
 			nssm_exit(list_nssm_services(iArgc - 2, argv + 2));
 		if (str_equiv(argv[1], L"processes"))
 			nssm_exit(service_process_tree(iArgc - 2, argv + 2));
+		if (str_equiv(argv[1], L"tail"))
+			nssm_exit(tail_service(iArgc - 2, argv + 2));
+		if (str_equiv(argv[1], L"logs"))
+			nssm_exit(show_logs(iArgc - 2, argv + 2));
 		if (str_equiv(argv[1], L"remove")) {
 			if (!g_bIsAdmin) {
 				nssm_exit(elevate(
@@ -5,13 +5,18 @@
 ***************************************/
 
 #include "nssm_io.h"
+#include "compress.h"
 #include "constants.h"
 #include "event.h"
+#include "filter.h"
+#include "logtext.h"
 #include "memorymanager.h"
 #include "messages.h"
 #include "nssm.h"
 #include "registry.h"
 #include "service.h"
+#include "tail.h"
+#include "timeindex.h"
 #include "utf8.h"
 
 #ifndef WIN32_LEAN_AND_MEAN
@@ -21,6 +26,8 @@
 #include <Windows.h>
 
 #include <Shlwapi.h>
+#include <WS2tcpip.h>
+#include <WinSock2.h>
 #include <wchar.h>
 
 #include <strsafe.h>
@@ -28,8 +35,71 @@
 #define COMPLAINED_READ (1 << 0)
 #define COMPLAINED_WRITE (1 << 1)
 #define COMPLAINED_ROTATE (1 << 2)
-#define TIMESTAMP_FORMAT "%04u-%02u-%02u %02u:%02u:%02u.%03u: "
-#define TIMESTAMP_LEN 25
+#define COMPLAINED_FLUSH (1 << 3)
+#define COMPLAINED_PREALLOCATE (1 << 4)
+#define COMPLAINED_MAP (1 << 5)
+#define COMPLAINED_ASYNC (1 << 6)
+
+// Bytes of converted text produced per copy into a batch.
+#define NSSM_TRANSCODE_CHUNK 1024
+
+// Most threads doing background work for the loggers.
+#define NSSM_LOG_WORKERS 3
+
+// Most workers running bulk jobs at once.
+#define NSSM_LOG_BULK_WORKERS 2
+
+// Milliseconds to wait before retrying to hand a rotation back to the I/O
+// thread.
+#define NSSM_LOG_ROTATE_POLL 10
+
+// Milliseconds to wait before retrying a failed rotation, doubled on each
+// failure up to NSSM_LOG_ROTATE_RETRY_MAX.
+#define NSSM_LOG_ROTATE_RETRY_MIN 1000
+#define NSSM_LOG_ROTATE_RETRY_MAX 300000
+
+// Size in bytes of the buffer used to copy a log file which is still open.
+#define NSSM_LOG_COPY_SIZE 65536
+
+// Size in bytes the spill buffer starts at.
+#define NSSM_LOG_SPILL_MIN 65536
+
+// Milliseconds between attempts to write out spilled output.
+#define NSSM_LOG_SPILL_RETRY 1000
+
+// Size in bytes a sink's queue starts at.
+#define NSSM_LOG_SINK_QUEUE_MIN 65536
+
+// Milliseconds to wait before trying to reach a sink again.
+#define NSSM_LOG_SINK_RETRY 1000
+
+// Milliseconds to keep sending queued output once the application's pipes
+// have closed.
+#define NSSM_LOG_SINK_LINGER 2000
+
+// Port syslog messages are sent to if none is given.
+#define NSSM_SYSLOG_PORT L"514"
+
+// Longest time in milliseconds before the wall clock is checked again for a
+// timed rotation, in case it was changed.
+#define NSSM_ROTATE_CLOCK_CHECK 3600000
+
+// FILETIME units in a second and a millisecond.
+#define NSSM_FILETIME_SECOND 10000000ULL
+#define NSSM_FILETIME_MILLISECOND 10000ULL
+
+// Thousandths of a token in a whole rate limit token, and the tokens in a
+// bucket with no limit.
+#define NSSM_RATE_TOKEN 1000
+#define NSSM_RATE_UNLIMITED (INT64_MAX / 2)
+
+// Milliseconds between suppressed output lines while output is over the
+// rate limit.
+#define NSSM_LOG_RATE_REPORT 10000
+
+// 64 bit FNV-1a offset basis and prime, for hashing lines to spot repeats.
+#define NSSM_LINE_HASH_BASIS 14695981039346656037ULL
+#define NSSM_LINE_HASH_PRIME 1099511628211ULL
 
 static int dup_handle(HANDLE hSource, HANDLE* pDestHandle,
 	const wchar_t* pSourceDescription, const wchar_t* pDestDescription,
@@ -56,180 +126,965 @@ static int dup_handle(HANDLE hSource, HANDLE* pDestHandle,
 		pDestDescription, DUPLICATE_SAME_ACCESS);
 }
 
+/***************************************
+
+	Background workers shared by all loggers
+
+	Slow file operations are queued here so the logging threads can keep
+	reading from their pipes.  Threads are started on demand, up to
+	NSSM_LOG_WORKERS, and wait for more work once the queue is empty.
+
+	Bulk jobs, like compression, may take a long time and are limited to
+	NSSM_LOG_BULK_WORKERS at once, so there is always a thread free to
+	finish a rotation promptly.  Urgent jobs are run first.
+
+***************************************/
+
+static CRITICAL_SECTION g_LogWorkerLock;
+static HANDLE g_hLogWorkerSemaphore;
+static log_job_t* g_pUrgentJobHead;
+static log_job_t* g_pUrgentJobTail;
+static log_job_t* g_pBulkJobHead;
+static log_job_t* g_pBulkJobTail;
+static uint32_t g_uLogJobs;
+static uint32_t g_uLogWorkers;
+static uint32_t g_uLogWorkersIdle;
+static uint32_t g_uBulkJobsRunning;
+static bool g_bLogWorkersReady;
+
+// Protects the indexes of rotated files
+static CRITICAL_SECTION g_LogIndexLock;
+
+/* Call with g_LogWorkerLock held. */
+static log_job_t* next_log_job(void)
+{
+	log_job_t* pJob = g_pUrgentJobHead;
+	if (pJob) {
+		g_pUrgentJobHead = pJob->m_pNext;
+		if (!g_pUrgentJobHead) {
+			g_pUrgentJobTail = NULL;
+		}
+	} else {
+		pJob = g_pBulkJobHead;
+		if (!pJob || (g_uBulkJobsRunning >= NSSM_LOG_BULK_WORKERS)) {
+			return NULL;
+		}
+		g_pBulkJobHead = pJob->m_pNext;
+		if (!g_pBulkJobHead) {
+			g_pBulkJobTail = NULL;
+		}
+		g_uBulkJobsRunning++;
+	}
+	g_uLogJobs--;
+	return pJob;
+}
+
+static unsigned long WINAPI log_worker(void* /* pParam */)
+{
+	EnterCriticalSection(&g_LogWorkerLock);
+	while (true) {
+		log_job_t* pJob = next_log_job();
+		if (!pJob) {
+			/* Wakeups may outnumber jobs, which is harmless. */
+			g_uLogWorkersIdle++;
+			LeaveCriticalSection(&g_LogWorkerLock);
+			WaitForSingleObject(g_hLogWorkerSemaphore, INFINITE);
+			EnterCriticalSection(&g_LogWorkerLock);
+			g_uLogWorkersIdle--;
+			continue;
+		}
+		LeaveCriticalSection(&g_LogWorkerLock);
+
+		/* The job may free itself so don't touch it afterwards. */
+		bool bBulk = pJob->m_bBulk;
+		pJob->m_pProc(pJob->m_pParam);
+
+		EnterCriticalSection(&g_LogWorkerLock);
+		if (bBulk) {
+			g_uBulkJobsRunning--;
+		}
+	}
+	return 0;
+}
+
 /*
-  read_handle:  read from application
-  pipe_handle:  stdout of application
-  write_handle: to file
+  Called from the main thread before any logging threads are created.
+  Returns 0 if jobs can be queued.
 */
-static HANDLE create_logging_thread(wchar_t* pServiceName, wchar_t* path,
-	uint32_t sharing, uint32_t disposition, uint32_t flags,
-	HANDLE* read_handle_ptr, HANDLE* pipe_handle_ptr, HANDLE* write_handle_ptr,
-	uint32_t rotate_bytes_low, uint32_t rotate_bytes_high,
-	uint32_t rotate_delay, uint32_t* tid_ptr, uint32_t* rotate_online,
-	bool timestamp_log, bool copy_and_truncate)
+static int init_log_workers(void)
 {
-	*tid_ptr = 0;
+	if (g_bLogWorkersReady) {
+		return 0;
+	}
+	g_hLogWorkerSemaphore = CreateSemaphoreW(NULL, 0, 0x7FFFFFFF, NULL);
+	if (!g_hLogWorkerSemaphore) {
+		return 1;
+	}
+	InitializeCriticalSection(&g_LogWorkerLock);
+	InitializeCriticalSection(&g_LogIndexLock);
+	g_bLogWorkersReady = true;
+	return 0;
+}
 
-	/* Pipe between application's stdout/stderr and our logging handle. */
-	if (read_handle_ptr && !*read_handle_ptr) {
-		if (pipe_handle_ptr && !*pipe_handle_ptr) {
-			if (CreatePipe(read_handle_ptr, pipe_handle_ptr, 0, 0)) {
-				SetHandleInformation(
-					*pipe_handle_ptr, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+/*
+  Queue a job for the background workers.
+  Returns 0 on success or nonzero if the caller must run the job itself.
+*/
+static int queue_log_job(
+	log_job_t* pJob, LogJobProc pProc, void* pParam, bool bBulk)
+{
+	if (!g_bLogWorkersReady) {
+		return 1;
+	}
+
+	pJob->m_pNext = NULL;
+	pJob->m_pProc = pProc;
+	pJob->m_pParam = pParam;
+	pJob->m_bBulk = bBulk;
+
+	EnterCriticalSection(&g_LogWorkerLock);
+	log_job_t** ppHead = bBulk ? &g_pBulkJobHead : &g_pUrgentJobHead;
+	log_job_t** ppTail = bBulk ? &g_pBulkJobTail : &g_pUrgentJobTail;
+	log_job_t* pOldTail = *ppTail;
+	if (pOldTail) {
+		pOldTail->m_pNext = pJob;
+	} else {
+		*ppHead = pJob;
+	}
+	*ppTail = pJob;
+	g_uLogJobs++;
+
+	/* Start another worker if all the others are busy. */
+	if ((g_uLogJobs > g_uLogWorkersIdle) &&
+		(g_uLogWorkers < NSSM_LOG_WORKERS)) {
+		HANDLE hThread = CreateThread(NULL, 0, log_worker, NULL, 0, NULL);
+		if (hThread) {
+			CloseHandle(hThread);
+			g_uLogWorkers++;
+		} else if (!g_uLogWorkers) {
+			/* Nobody to run it, so take it back. */
+			log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_CREATETHREAD_FAILED,
+				error_string(GetLastError()), NULL);
+			if (pOldTail) {
+				pOldTail->m_pNext = NULL;
 			} else {
-				log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_CREATEPIPE_FAILED,
-					pServiceName, path, error_string(GetLastError()), NULL);
-				return NULL;
+				*ppHead = NULL;
 			}
+			*ppTail = pOldTail;
+			g_uLogJobs--;
+			LeaveCriticalSection(&g_LogWorkerLock);
+			return 2;
 		}
 	}
+	LeaveCriticalSection(&g_LogWorkerLock);
 
-	logger_t* pLogger = static_cast<logger_t*>(heap_calloc(sizeof(logger_t)));
-	if (!pLogger) {
-		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY, L"logger",
-			L"create_logging_thread()", NULL);
-		return NULL;
-	}
+	ReleaseSemaphore(g_hLogWorkerSemaphore, 1, NULL);
+	return 0;
+}
 
-	ULARGE_INTEGER size;
-	size.LowPart = rotate_bytes_low;
-	size.HighPart = rotate_bytes_high;
+/***************************************
 
-	pLogger->m_pServiceName = pServiceName;
-	pLogger->m_pPath = path;
-	pLogger->m_uSharing = sharing;
-	pLogger->m_uDisposition = disposition;
-	pLogger->m_uFlags = flags;
-	pLogger->m_hRead = *read_handle_ptr;
-	pLogger->m_hWrite = *write_handle_ptr;
-	pLogger->m_uSize = size.QuadPart;
-	pLogger->m_pThreadID = tid_ptr;
-	pLogger->m_bTimestampLog = timestamp_log;
-	pLogger->m_uLineLength = 0;
-	pLogger->m_pRotateOnline = rotate_online;
-	pLogger->m_uRotateDelay = rotate_delay;
-	pLogger->m_bCopyAndTruncate = copy_and_truncate;
+	Logging I/O thread
+
+	A single thread, running log_and_rotate(), reads the output of every
+	logged application.  The read end of each pipe is associated with one
+	I/O completion port, with the logger as the key, and the thread acts on
+	each overlapped read as it completes.  The number of threads therefore
+	stays the same however many streams are logged.  Writes to the log
+	files are quick enough to be done in line, while rotations and
+	compression go to the background workers.
+
+	A logger has at most one read in flight per pipe, one write in flight
+	per sink, and one rotation and one flush which a worker will post back
+	when done.  It is only touched by the I/O thread otherwise, so it needs
+	no locking of its own.
+
+	There is no epoll version of the thread, as NSSM only runs on Windows.
+	What it does with each completed read, the ring buffer, batching and
+	line formatting, is built and timed on Linux by the bench instead.
+
+***************************************/
+
+static HANDLE g_hLogPort;
+static unsigned long g_uLogThreadID;
+
+// Loggers with output waiting for disk space, only used by the I/O thread.
+static logger_t* g_pSpillingLoggers;
+// GetTickCount() when spilled output was last retried.
+static uint32_t g_uSpillRetried;
+// Loggers with sinks to reconnect or finish, only used by the I/O thread.
+static logger_t* g_pWaitingLoggers;
+// GetTickCount() when waiting sinks were last retried.
+static uint32_t g_uSinksRetried;
+// Loggers waiting for a timed flush, only used by the I/O thread.
+static logger_t* g_pFlushingLoggers;
+// Loggers with repeated lines waiting to be counted in the log file
+static logger_t* g_pRepeatingLoggers;
+
+/*
+  Called from the main thread before any loggers are created.
+  Returns 0 if the I/O thread is running.
+*/
+static int init_log_io(void)
+{
+	if (g_hLogPort) {
+		return 0;
+	}
+
+	/* Rotations are done in line if the workers are unavailable. */
+	init_log_workers();
 
+	HANDLE hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (!hPort) {
+		log_event(EVENTLOG_ERROR_TYPE,
+			NSSM_EVENT_CREATEIOCOMPLETIONPORT_FAILED,
+			error_string(GetLastError()), NULL);
+		return 1;
+	}
 	HANDLE hThread = CreateThread(
-		NULL, 0, log_and_rotate, pLogger, 0, (DWORD*)pLogger->m_pThreadID);
+		NULL, 0, log_and_rotate, hPort, 0, &g_uLogThreadID);
 	if (!hThread) {
 		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_CREATETHREAD_FAILED,
 			error_string(GetLastError()), NULL);
-		heap_free(pLogger);
+		CloseHandle(hPort);
+		return 2;
+	}
+	CloseHandle(hThread);
+	g_hLogPort = hPort;
+	return 0;
+}
+
+/***************************************
+
+	Create a pipe for the application's output
+
+	Anonymous pipes can't be read with overlapped I/O, so a uniquely named
+	pipe is used instead.  Only the read end is opened for overlapped I/O;
+	the write end, which the application inherits, behaves as the write end
+	of an anonymous pipe would.
+
+	Returns 0 on success, with the last error set on failure.
+
+***************************************/
+
+static int create_log_pipe(HANDLE* pRead, HANDLE* pWrite, uint32_t uSize,
+	const wchar_t** ppFunction)
+{
+	static volatile LONG g_lPipeSerial;
+
+	wchar_t name[64];
+	StringCchPrintfW(name, RTL_NUMBER_OF(name), L"\\\\.\\pipe\\nssm-%lu-%ld",
+		GetCurrentProcessId(), InterlockedIncrement(&g_lPipeSerial));
+
+	*ppFunction = L"CreateNamedPipe()";
+	HANDLE hRead = CreateNamedPipeW(name,
+		PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED |
+			FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 0, uSize, 0,
+		NULL);
+	if (hRead == INVALID_HANDLE_VALUE) {
+		return 1;
+	}
+
+	*ppFunction = L"CreateFile()";
+	HANDLE hWrite = CreateFileW(
+		name, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (hWrite == INVALID_HANDLE_VALUE) {
+		unsigned long error = GetLastError();
+		CloseHandle(hRead);
+		SetLastError(error);
+		return 2;
 	}
 
-	return hThread;
+	SetHandleInformation(hWrite, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+	*pRead = hRead;
+	*pWrite = hWrite;
+	return 0;
 }
 
-static inline uint32_t guess_charsize(void* pBuffer, uint32_t uBufferSize)
+static int init_sinks(logger_t* pLogger, nssm_service_t* pNSSMService);
+static void free_sinks(logger_t* pLogger);
+static void start_map(logger_t* pLogger);
+static void stop_map(logger_t* pLogger);
+static uint32_t map_write(
+	logger_t* pLogger, const void* pData, uint32_t uLength);
+static void start_async(logger_t* pLogger);
+static void stop_async(logger_t* pLogger);
+static void flush_rotated(logger_t* pLogger, HANDLE hFile);
+static bool async_write(
+	logger_t* pLogger, const void* pData, uint32_t uLength);
+static int write_batch(void* pParam, void* pData, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained);
+
+/* Release a logger which was never handed to the I/O thread. */
+static void discard_logger(logger_t* pLogger)
 {
-	if (IsTextUnicode(pBuffer, static_cast<int>(uBufferSize), NULL)) {
-		return static_cast<uint32_t>(sizeof(wchar_t));
+	close_handle(&pLogger->m_hFinished);
+	for (uint32_t i = 0; i < pLogger->m_uSources; i++) {
+		log_buffer_free(&pLogger->m_Sources[i].m_Buffer);
 	}
-	return static_cast<uint32_t>(sizeof(char));
+	free_sinks(pLogger);
+	free_filter(pLogger->m_pFilters[0]);
+	free_filter(pLogger->m_pFilters[1]);
+	close_time_index(pLogger->m_pTimeIndex);
+	stop_map(pLogger);
+	stop_async(pLogger);
+	heap_free(pLogger->m_pJsonService);
+	heap_free(pLogger);
+}
+
+/*
+  Escape the service name once for JSON output, as it is written on
+  every line.  Returns 0 on success.
+*/
+static int escape_json_service(logger_t* pLogger, const wchar_t* pName)
+{
+	uint32_t uCount = static_cast<uint32_t>(wcslen(pName));
+	uint32_t uSize = (uCount + 1) * NSSM_JSON_CHAR_MAX;
+	pLogger->m_pJsonService = static_cast<char*>(heap_alloc(uSize));
+	if (!pLogger->m_pJsonService) {
+		return 1;
+	}
+	uint32_t uSurrogate = 0;
+	uint32_t uConsumed;
+	uint32_t uLength = json_escape_utf16(
+		pName, uCount, pLogger->m_pJsonService, uSize, &uSurrogate, &uConsumed);
+	if (uSurrogate) {
+		uLength += json_escape_utf16(L"", 0, pLogger->m_pJsonService + uLength,
+			uSize - uLength, &uSurrogate, &uConsumed);
+	}
+	pLogger->m_uJsonServiceLength = uLength;
+	return 0;
+}
+
+/* Returns the current local time in FILETIME units. */
+static uint64_t local_filetime(void)
+{
+	FILETIME now;
+	FILETIME local;
+	GetSystemTimeAsFileTime(&now);
+	FileTimeToLocalFileTime(&now, &local);
+	ULARGE_INTEGER l;
+	l.LowPart = local.dwLowDateTime;
+	l.HighPart = local.dwHighDateTime;
+	return l.QuadPart;
+}
+
+/* Arrange for the tick count to say when to look at the clock again. */
+static void check_clock_in(logger_t* pLogger, uint64_t uNow)
+{
+	uint64_t uWait = (pLogger->m_uRotateBoundary - uNow) /
+		NSSM_FILETIME_MILLISECOND;
+	if (uWait > NSSM_ROTATE_CLOCK_CHECK) {
+		uWait = NSSM_ROTATE_CLOCK_CHECK;
+	}
+	pLogger->m_uRotateDue = GetTickCount() + static_cast<uint32_t>(uWait);
 }
 
 /***************************************
 
-	Write out the UTF16 Byte Order Mark
+	Work out when the next timed rotation is due
+
+	Boundaries are multiples of AppRotateInterval since the FILETIME epoch
+	in local time, so an interval of an hour or a day lines up with the
+	hour or local midnight.  The deadline is kept as a tick count, which is
+	cheap to check on every read, and the clock itself is only looked at
+	when the tick count says the boundary has passed.
 
 ***************************************/
 
-static inline void write_bom(logger_t* pLogger, uint32_t* pOutput)
+static void schedule_rotation(logger_t* pLogger)
 {
-	wchar_t bom = L'\ufeff';
-	if (!WriteFile(pLogger->m_hWrite, &bom, sizeof(bom),
-			reinterpret_cast<DWORD*>(pOutput), NULL)) {
-		log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_SOMEBODY_SET_UP_US_THE_BOM,
-			pLogger->m_pServiceName, pLogger->m_pPath,
-			error_string(GetLastError()), NULL);
+	if (!pLogger->m_uRotateInterval) {
+		return;
 	}
+	uint64_t uInterval = pLogger->m_uRotateInterval * NSSM_FILETIME_SECOND;
+	uint64_t uNow = local_filetime();
+	pLogger->m_uRotateBoundary = (uNow / uInterval + 1) * uInterval;
+	check_clock_in(pLogger, uNow);
 }
 
-void close_handle(HANDLE* pHandle, HANDLE* pSaved)
+/* Returns true once the boundary for a timed rotation has passed. */
+static bool rotation_due(logger_t* pLogger)
 {
-	if (pSaved) {
-		*pSaved = INVALID_HANDLE_VALUE;
+	if (!pLogger->m_uRotateInterval ||
+		(static_cast<int32_t>(GetTickCount() - pLogger->m_uRotateDue) < 0)) {
+		return false;
 	}
-	if (!pHandle) {
+
+	/* The clock may have been changed since the deadline was set. */
+	uint64_t uNow = local_filetime();
+	if (uNow >= pLogger->m_uRotateBoundary) {
+		return true;
+	}
+	check_clock_in(pLogger, uNow);
+	return false;
+}
+
+/***************************************
+
+	Reserve disk space for the log file up to the rotation size
+
+	Only the allocation grows, not the end of the file, so readers still
+	see just what has been written.  Appends then fill space which is
+	already there instead of finding more clusters as they go, which keeps
+	the file in one piece on a busy volume.  The space left over is given
+	back by trim_log_file() when the file is rotated or closed.
+
+***************************************/
+
+static void preallocate_log_file(logger_t* pLogger)
+{
+	if (!pLogger->m_bPreallocate || !pLogger->m_uSize || !pLogger->m_hWrite) {
 		return;
 	}
-	if (!*pHandle) {
+
+	/* A smaller allocation would cut the file short. */
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(pLogger->m_hWrite, &size) ||
+		(static_cast<uint64_t>(size.QuadPart) >= pLogger->m_uSize)) {
 		return;
 	}
-	CloseHandle(*pHandle);
-	// Save the closed handle
-	if (pSaved) {
-		*pSaved = *pHandle;
+
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = static_cast<LONGLONG>(pLogger->m_uSize);
+	if (SetFileInformationByHandle(
+			pLogger->m_hWrite, FileAllocationInfo, &info, sizeof(info))) {
+		return;
 	}
-	*pHandle = NULL;
-}
 
-void close_handle(HANDLE* hHandle)
-{
-	close_handle(hHandle, NULL);
+	if (!(pLogger->m_iComplained & COMPLAINED_PREALLOCATE)) {
+		wchar_t bytes[32];
+		StringCchPrintfW(bytes, RTL_NUMBER_OF(bytes), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uSize));
+		log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_PREALLOCATE_FAILED,
+			pLogger->m_pServiceName, pLogger->m_pPath, bytes,
+			error_string(GetLastError()), NULL);
+	}
+	pLogger->m_iComplained |= COMPLAINED_PREALLOCATE;
 }
 
-/* Get path, share mode, creation disposition and flags for a stream. */
-int get_createfile_parameters(HKEY hKey, const wchar_t* pPrefix, wchar_t* pPath,
-	uint32_t* pSharing, uint32_t uDefaultSharing, uint32_t* pDisposition,
-	uint32_t uDefaultDisposition, uint32_t* pFlags, uint32_t uDefaultFlags,
-	bool* pCopyAndTruncate)
+/* Give back space reserved past the end of the file before closing it. */
+static void trim_log_file(logger_t* pLogger, HANDLE hFile)
 {
-	wchar_t value[NSSM_STDIO_LENGTH];
-
-	/* Path. */
-	if (StringCchPrintfW(value, RTL_NUMBER_OF(value), L"%s", pPrefix) < 0) {
-		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY, pPrefix,
-			L"get_createfile_parameters()", NULL);
-		return 1;
+	if (!pLogger->m_bPreallocate || !hFile) {
+		return;
 	}
-	switch (expand_parameter(hKey, value, pPath, PATH_LENGTH, true, false)) {
-	case 0:
-		if (!pPath[0]) {
-			return 0;
-		}
-		break; /* OK. */
-	default:
-		return 2; /* Error. */
+
+	FILE_ALLOCATION_INFO info;
+	if (GetFileSizeEx(hFile, &info.AllocationSize)) {
+		SetFileInformationByHandle(
+			hFile, FileAllocationInfo, &info, sizeof(info));
 	}
+}
 
-	/* ShareMode. */
-	if (StringCchPrintfW(value, RTL_NUMBER_OF(value), L"%s%s", pPrefix,
-			g_NSSMRegStdIOSharing) < 0) {
-		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
-			g_NSSMRegStdIOSharing, L"get_createfile_parameters()", NULL);
-		return 3;
+/***************************************
+
+	Log rate limiting
+
+	Two token buckets, one for lines and one for bytes, are topped up at
+	AppLogRateLines and AppLogRateBytes per second and hold
+	AppLogRateBurst milliseconds worth when full.  Tokens are kept in
+	thousandths so the top up is a multiply by the milliseconds elapsed,
+	and only done when the tick count has changed.
+
+	A line is let through if there is a whole line token and the byte
+	bucket isn't in debt.  Its bytes are taken as it is written, so a long
+	line can leave the byte bucket in debt, which holds back the lines
+	after it until it is paid off.
+
+***************************************/
+
+/* Returns the tokens in a bucket after uElapsed milliseconds. */
+static inline int64_t refill_bucket(
+	int64_t iTokens, uint32_t uRate, uint32_t uElapsed, uint32_t uBurst)
+{
+	if (!uRate) {
+		return NSSM_RATE_UNLIMITED;
 	}
-	switch (get_number(hKey, value, pSharing, false)) {
-	case 0:
-		*pSharing = uDefaultSharing;
-		break; /* Missing. */
-	case 1:
-		break; /* Found. */
-	case -2:
-		return 4; /* Error. */
+	int64_t iFull = static_cast<int64_t>(uRate) * uBurst;
+	if (uElapsed >= uBurst) {
+		return iFull;
 	}
+	iTokens += static_cast<int64_t>(uRate) * uElapsed;
+	return (iTokens < iFull) ? iTokens : iFull;
+}
 
-	/* CreationDisposition. */
-	if (StringCchPrintfW(value, RTL_NUMBER_OF(value), L"%s%s", pPrefix,
-			g_NSSMRegStdIODisposition) < 0) {
-		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
-			g_NSSMRegStdIODisposition, L"get_createfile_parameters()", NULL);
-		return 5;
+/* Set up the buckets, full. */
+static void start_rate(
+	log_rate_t* pRate, uint32_t uLines, uint32_t uBytes, uint32_t uBurst)
+{
+	pRate->m_uLines = uLines;
+	pRate->m_uBytes = uBytes;
+	pRate->m_uBurst = uBurst;
+	pRate->m_uRefilled = GetTickCount();
+	pRate->m_iLines = refill_bucket(0, uLines, uBurst, uBurst);
+	pRate->m_iBytes = refill_bucket(0, uBytes, uBurst, uBurst);
+}
+
+/* Returns true, taking a line token, if a new line may be written. */
+static inline bool rate_admit(log_rate_t* pRate)
+{
+	uint32_t uNow = GetTickCount();
+	if (uNow != pRate->m_uRefilled) {
+		uint32_t uElapsed = uNow - pRate->m_uRefilled;
+		pRate->m_uRefilled = uNow;
+		pRate->m_iLines = refill_bucket(
+			pRate->m_iLines, pRate->m_uLines, uElapsed, pRate->m_uBurst);
+		pRate->m_iBytes = refill_bucket(
+			pRate->m_iBytes, pRate->m_uBytes, uElapsed, pRate->m_uBurst);
 	}
-	switch (get_number(hKey, value, pDisposition, false)) {
-	case 0:
-		*pDisposition = uDefaultDisposition;
-		break; /* Missing. */
-	case 1:
-		break; /* Found. */
-	case -2:
-		return 6; /* Error. */
+	if ((pRate->m_iLines < NSSM_RATE_TOKEN) || (pRate->m_iBytes <= 0)) {
+		return false;
 	}
+	pRate->m_iLines -= NSSM_RATE_TOKEN;
+	return true;
+}
 
-	/* Flags. */
-	if (StringCchPrintfW(value, RTL_NUMBER_OF(value), L"%s%s", pPrefix,
+/*
+  read_handle:  read from application
+  pipe_handle:  stdout of application
+  write_handle: to file
+  merge_read_handle, merge_pipe_handle: stderr of application if it is to
+	be merged into the same file, otherwise NULL
+
+  Returns an event which is signalled once the logger has finished,
+  or NULL on failure.
+*/
+static HANDLE create_logging_thread(nssm_service_t* pNSSMService,
+	wchar_t* path, uint32_t sharing, uint32_t disposition, uint32_t flags,
+	HANDLE* read_handle_ptr, HANDLE* pipe_handle_ptr, HANDLE* write_handle_ptr,
+	HANDLE* merge_read_handle_ptr, HANDLE* merge_pipe_handle_ptr,
+	uint32_t rotate_bytes_low, uint32_t rotate_bytes_high,
+	uint32_t rotate_delay, uint32_t* tid_ptr, uint32_t* rotate_online,
+	bool timestamp_log, bool copy_and_truncate, log_index_t* pIndex)
+{
+	*tid_ptr = 0;
+
+	if (init_log_io()) {
+		return NULL;
+	}
+
+	HANDLE* ReadHandles[NSSM_LOG_SOURCES] = {
+		read_handle_ptr, merge_read_handle_ptr};
+	HANDLE* PipeHandles[NSSM_LOG_SOURCES] = {
+		pipe_handle_ptr, merge_pipe_handle_ptr};
+	uint32_t uSources = merge_read_handle_ptr ? 2U : 1U;
+	uint32_t i;
+
+	/* Pipe between application's stdout/stderr and our logging handle. */
+	for (i = 0; i < uSources; i++) {
+		if (ReadHandles[i] && !*ReadHandles[i]) {
+			if (PipeHandles[i] && !*PipeHandles[i]) {
+				const wchar_t* pFunction;
+				if (create_log_pipe(ReadHandles[i], PipeHandles[i],
+						pNSSMService->m_uLogBufferMin, &pFunction)) {
+					log_event(EVENTLOG_ERROR_TYPE,
+						NSSM_EVENT_CREATENAMEDPIPE_FAILED,
+						pNSSMService->m_Name, path, pFunction,
+						error_string(GetLastError()), NULL);
+					return NULL;
+				}
+			}
+		}
+	}
+
+	logger_t* pLogger = static_cast<logger_t*>(heap_calloc(sizeof(logger_t)));
+	if (!pLogger) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY, L"logger",
+			L"create_logging_thread()", NULL);
+		return NULL;
+	}
+	pLogger->m_Batch.m_pWrite = write_batch;
+	pLogger->m_Batch.m_pParam = pLogger;
+
+	/* A merged logger always reads stdout first. */
+	static const char* const g_Tags[NSSM_LOG_SOURCES] = {"[out] ", "[err] "};
+	static const char* const g_Streams[NSSM_LOG_SOURCES] = {
+		"stdout", "stderr"};
+	uint32_t uFirst =
+		(read_handle_ptr == &pNSSMService->m_hStderrOutputPipe) ? 1U : 0U;
+	for (i = 0; i < uSources; i++) {
+		log_source_t* pSource = &pLogger->m_Sources[i];
+		if (log_buffer_init(&pSource->m_Buffer,
+				pNSSMService->m_uLogBufferMin,
+				pNSSMService->m_uLogBufferMax)) {
+			log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+				L"log buffer", L"create_logging_thread()", NULL);
+			discard_logger(pLogger);
+			return NULL;
+		}
+		pLogger->m_uSources = i + 1;
+		pSource->m_hRead = *ReadHandles[i];
+		pSource->m_pTag = g_Tags[uFirst + i];
+		pSource->m_pStream = g_Streams[uFirst + i];
+	}
+
+	if (pNSSMService->m_bJsonLog &&
+		escape_json_service(pLogger, pNSSMService->m_Name)) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+			L"service name", L"create_logging_thread()", NULL);
+		discard_logger(pLogger);
+		return NULL;
+	}
+
+	if (init_sinks(pLogger, pNSSMService)) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+			L"log sink", L"create_logging_thread()", NULL);
+		discard_logger(pLogger);
+		return NULL;
+	}
+
+	/* The output's encoding isn't known yet so compile for both. */
+	if (pNSSMService->m_pLogInclude || pNSSMService->m_pLogExclude) {
+		for (i = 0; i < 2; i++) {
+			pLogger->m_pFilters[i] = compile_filter(pNSSMService->m_pLogInclude,
+				pNSSMService->m_pLogExclude, i + 1);
+			if (!pLogger->m_pFilters[i]) {
+				log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+					L"log filter", L"create_logging_thread()", NULL);
+				discard_logger(pLogger);
+				return NULL;
+			}
+		}
+		pLogger->m_bFilter = true;
+	}
+
+	/*
+	  The tail outlives the logger so that output from before a restart
+	  can still be read.  Not having one isn't worth failing over.
+	*/
+	if (pNSSMService->m_uLogTail) {
+		log_tail_t* pTail = pNSSMService->m_pTails[uFirst];
+		if (!pTail) {
+			pTail = create_tail(pNSSMService->m_uLogTail);
+			if (!pTail) {
+				log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+					L"log tail", L"create_logging_thread()", NULL);
+			}
+			pNSSMService->m_pTails[uFirst] = pTail;
+		}
+		if (pTail && !start_tail_server(pNSSMService)) {
+			pLogger->m_pTail = pTail;
+		}
+	}
+
+	/* The logger and the service each close their own handle. */
+	HANDLE hFinished = NULL;
+	pLogger->m_hFinished = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (!pLogger->m_hFinished ||
+		!DuplicateHandle(GetCurrentProcess(), pLogger->m_hFinished,
+			GetCurrentProcess(), &hFinished, 0, FALSE,
+			DUPLICATE_SAME_ACCESS)) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_CREATEEVENT_FAILED,
+			error_string(GetLastError()), NULL);
+		discard_logger(pLogger);
+		return NULL;
+	}
+
+	ULARGE_INTEGER size;
+	size.LowPart = rotate_bytes_low;
+	size.HighPart = rotate_bytes_high;
+
+	pLogger->m_pServiceName = pNSSMService->m_Name;
+	pLogger->m_pPath = path;
+	/* The file is renamed while still open when it is rotated. */
+	pLogger->m_uSharing = sharing | FILE_SHARE_DELETE;
+	pLogger->m_uDisposition = disposition;
+	pLogger->m_uFlags = flags;
+	pLogger->m_hWrite = *write_handle_ptr;
+	pLogger->m_uSize = size.QuadPart;
+	pLogger->m_bTimestampLog = timestamp_log;
+	pLogger->m_bJsonLog = pNSSMService->m_bJsonLog;
+	pLogger->m_bUtf8Log = pNSSMService->m_bUtf8Log;
+	if (pNSSMService->m_uLogRateLines || pNSSMService->m_uLogRateBytes) {
+		pLogger->m_bRateLimit = true;
+		start_rate(&pLogger->m_Rate, pNSSMService->m_uLogRateLines,
+			pNSSMService->m_uLogRateBytes, pNSSMService->m_uLogRateBurst);
+	}
+	pLogger->m_uCollapse = pNSSMService->m_uLogCollapse;
+	pLogger->m_uSpillMax = pNSSMService->m_uLogSpillMax;
+	pLogger->m_uBackpressure = pNSSMService->m_uLogBackpressure;
+	/*
+	  A logger for stderr alone takes stderr's policy.  A merged logger
+	  starts with stdout and writes stdout's file, so it takes stdout's.
+	*/
+	if (uFirst) {
+		pLogger->m_uFlushPolicy = pNSSMService->m_uStderrFlush;
+		pLogger->m_uFlushAfter = pNSSMService->m_uStderrFlushAfter;
+	} else {
+		pLogger->m_uFlushPolicy = pNSSMService->m_uStdoutFlush;
+		pLogger->m_uFlushAfter = pNSSMService->m_uStdoutFlushAfter;
+	}
+	if (!pLogger->m_uFlushAfter) {
+		if (pLogger->m_uFlushPolicy == NSSM_LOG_FLUSH_INTERVAL) {
+			pLogger->m_uFlushAfter = NSSM_LOG_FLUSH_MILLISECONDS;
+		} else if (pLogger->m_uFlushPolicy == NSSM_LOG_FLUSH_BYTES) {
+			pLogger->m_uFlushAfter = NSSM_LOG_FLUSH_BYTE_COUNT;
+		}
+	}
+	pLogger->m_pPID = &pNSSMService->m_uPID;
+	if (uSources > 1) {
+		pLogger->m_bMergeTags = pNSSMService->m_bMergeTags;
+		pLogger->m_bMergeSequence = pNSSMService->m_bMergeSequence;
+	}
+	pLogger->m_pRotateOnline = rotate_online;
+	pLogger->m_uRotateDelay = rotate_delay;
+	if (pNSSMService->m_bRotateFiles &&
+		(*rotate_online != NSSM_ROTATE_OFFLINE)) {
+		pLogger->m_uRotateInterval = pNSSMService->m_uRotateInterval;
+	}
+	pLogger->m_bCopyAndTruncate = copy_and_truncate;
+	pLogger->m_pIndex = pIndex;
+	if (pNSSMService->m_bRotateFiles &&
+		(*rotate_online != NSSM_ROTATE_OFFLINE)) {
+		pLogger->m_bPreallocate = pNSSMService->m_bRotatePreallocate;
+	}
+
+	/* Find initial file size. */
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(pLogger->m_hWrite, &info)) {
+		pLogger->m_uSize = 0LL;
+	} else {
+		ULARGE_INTEGER l;
+		l.HighPart = info.nFileSizeHigh;
+		l.LowPart = info.nFileSizeLow;
+		pLogger->m_uFileSize = l.QuadPart;
+	}
+	schedule_rotation(pLogger);
+	preallocate_log_file(pLogger);
+	if (pNSSMService->m_uLogMapWindow) {
+		SYSTEM_INFO system_info;
+		GetSystemInfo(&system_info);
+		uint32_t uGranularity = system_info.dwAllocationGranularity;
+		pLogger->m_Map.m_uWindow =
+			(pNSSMService->m_uLogMapWindow + uGranularity - 1) /
+			uGranularity * uGranularity;
+		start_map(pLogger);
+	}
+	pLogger->m_Async.m_uBuffers = pNSSMService->m_uLogWriteBuffers;
+	start_async(pLogger);
+	if (pNSSMService->m_uLogTimeIndex) {
+		pLogger->m_pTimeIndex = open_time_index(pNSSMService->m_Name, path,
+			pLogger->m_uFileSize, pNSSMService->m_uLogTimeIndex);
+	}
+
+	/*
+	  The first reads are issued by the I/O thread itself, as reads are
+	  cancelled if the thread which issued them exits.
+	*/
+	ULONG_PTR uKey = reinterpret_cast<ULONG_PTR>(pLogger);
+	bool bAssociated = true;
+	for (i = 0; i < uSources; i++) {
+		if (!CreateIoCompletionPort(
+				pLogger->m_Sources[i].m_hRead, g_hLogPort, uKey, 0)) {
+			bAssociated = false;
+			break;
+		}
+	}
+	if (!bAssociated ||
+		!PostQueuedCompletionStatus(g_hLogPort, 0, uKey,
+			&pLogger->m_Sources[0].m_Overlapped)) {
+		log_event(EVENTLOG_ERROR_TYPE,
+			NSSM_EVENT_CREATEIOCOMPLETIONPORT_FAILED,
+			error_string(GetLastError()), NULL);
+		CloseHandle(hFinished);
+		discard_logger(pLogger);
+		return NULL;
+	}
+
+	*tid_ptr = g_uLogThreadID;
+	return hFinished;
+}
+
+static inline uint32_t guess_charsize(void* pBuffer, uint32_t uBufferSize)
+{
+	if (IsTextUnicode(pBuffer, static_cast<int>(uBufferSize), NULL)) {
+		return static_cast<uint32_t>(sizeof(wchar_t));
+	}
+	return static_cast<uint32_t>(sizeof(char));
+}
+
+/***************************************
+
+	Check a chunk of output for a change of encoding
+
+	The encoding is guessed from the first output, then every chunk is
+	checked for a switch between 8 bit text and UTF-16.  8 bit text has no
+	zero bytes while UTF-16 nearly always has some, if only in its line
+	endings, so looking for one is cheap and IsTextUnicode() is only asked
+	when the answer might have changed.  A switch is taken to happen at the
+	start of a line.
+
+	Returns the number of bytes at the start of the chunk which are in the
+	source's current encoding.  A chunk which is all in the other encoding
+	switches the source over and counts as all in its encoding.
+
+***************************************/
+
+static uint32_t check_encoding(
+	log_source_t* pSource, const uint8_t* pInput, uint32_t uLength)
+{
+	if (!pSource->m_uCharsize) {
+		pSource->m_uCharsize = guess_charsize(const_cast<uint8_t*>(pInput),
+			uLength);
+		return uLength;
+	}
+
+	const uint8_t* pZero =
+		static_cast<const uint8_t*>(memchr(pInput, 0, uLength));
+	uint32_t uStart;
+	if (pSource->m_uCharsize == sizeof(char)) {
+		if (!pZero) {
+			return uLength;
+		}
+		/* UTF-16 starts after the last 8 bit line before the zero. */
+		uStart = find_last_newline(pInput,
+			static_cast<uint32_t>(pZero - pInput), sizeof(char));
+	} else {
+		if (pZero) {
+			/* 8 bit text starts after the last UTF-16 line. */
+			uStart = find_last_newline(pInput, uLength, sizeof(wchar_t));
+			if ((uStart == uLength) ||
+				memchr(pInput + uStart, 0, uLength - uStart)) {
+				return uLength;
+			}
+		} else {
+			uStart = 0;
+		}
+	}
+
+	bool bUnicode = IsTextUnicode(const_cast<uint8_t*>(pInput + uStart),
+						static_cast<int>(uLength - uStart), NULL) != 0;
+	if (bUnicode == (pSource->m_uCharsize == sizeof(wchar_t))) {
+		return uLength;
+	}
+	if (!uStart) {
+		pSource->m_uCharsize = bUnicode ? sizeof(wchar_t) : sizeof(char);
+		return uLength;
+	}
+	return uStart;
+}
+
+/***************************************
+
+	Write out the UTF16 Byte Order Mark
+
+	It goes into the mapped window or out as an overlapped write if the
+	output after it will, so that the output isn't written over it.
+
+***************************************/
+
+static inline void write_bom(logger_t* pLogger, uint32_t* pOutput)
+{
+	wchar_t bom = L'\ufeff';
+	uint32_t uDone = 0;
+	if (pLogger->m_Map.m_hFile) {
+		uDone = map_write(pLogger, &bom, sizeof(bom));
+	} else if (pLogger->m_Async.m_hFile && !pLogger->m_Async.m_bFailed &&
+		async_write(pLogger, &bom, sizeof(bom))) {
+		uDone = sizeof(bom);
+	}
+	*pOutput = uDone;
+	if (uDone == sizeof(bom)) {
+		return;
+	}
+
+	DWORD out = 0;
+	if (!WriteFile(pLogger->m_hWrite,
+			reinterpret_cast<uint8_t*>(&bom) + uDone, sizeof(bom) - uDone,
+			&out, NULL)) {
+		log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_SOMEBODY_SET_UP_US_THE_BOM,
+			pLogger->m_pServiceName, pLogger->m_pPath,
+			error_string(GetLastError()), NULL);
+	}
+	*pOutput += out;
+}
+
+void close_handle(HANDLE* pHandle, HANDLE* pSaved)
+{
+	if (pSaved) {
+		*pSaved = INVALID_HANDLE_VALUE;
+	}
+	if (!pHandle) {
+		return;
+	}
+	if (!*pHandle) {
+		return;
+	}
+	CloseHandle(*pHandle);
+	// Save the closed handle
+	if (pSaved) {
+		*pSaved = *pHandle;
+	}
+	*pHandle = NULL;
+}
+
+void close_handle(HANDLE* hHandle)
+{
+	close_handle(hHandle, NULL);
+}
+
+/* Get path, share mode, creation disposition and flags for a stream. */
+int get_createfile_parameters(HKEY hKey, const wchar_t* pPrefix, wchar_t* pPath,
+	uint32_t* pSharing, uint32_t uDefaultSharing, uint32_t* pDisposition,
+	uint32_t uDefaultDisposition, uint32_t* pFlags, uint32_t uDefaultFlags,
+	bool* pCopyAndTruncate)
+{
+	wchar_t value[NSSM_STDIO_LENGTH];
+
+	/* Path. */
+	if (StringCchPrintfW(value, RTL_NUMBER_OF(value), L"%s", pPrefix) < 0) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY, pPrefix,
+			L"get_createfile_parameters()", NULL);
+		return 1;
+	}
+	switch (expand_parameter(hKey, value, pPath, PATH_LENGTH, true, false)) {
+	case 0:
+		if (!pPath[0]) {
+			return 0;
+		}
+		break; /* OK. */
+	default:
+		return 2; /* Error. */
+	}
+
+	/* ShareMode. */
+	if (StringCchPrintfW(value, RTL_NUMBER_OF(value), L"%s%s", pPrefix,
+			g_NSSMRegStdIOSharing) < 0) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+			g_NSSMRegStdIOSharing, L"get_createfile_parameters()", NULL);
+		return 3;
+	}
+	switch (get_number(hKey, value, pSharing, false)) {
+	case 0:
+		*pSharing = uDefaultSharing;
+		break; /* Missing. */
+	case 1:
+		break; /* Found. */
+	case -2:
+		return 4; /* Error. */
+	}
+
+	/* CreationDisposition. */
+	if (StringCchPrintfW(value, RTL_NUMBER_OF(value), L"%s%s", pPrefix,
+			g_NSSMRegStdIODisposition) < 0) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+			g_NSSMRegStdIODisposition, L"get_createfile_parameters()", NULL);
+		return 5;
+	}
+	switch (get_number(hKey, value, pDisposition, false)) {
+	case 0:
+		*pDisposition = uDefaultDisposition;
+		break; /* Missing. */
+	case 1:
+		break; /* Found. */
+	case -2:
+		return 6; /* Error. */
+	}
+
+	/* Flags. */
+	if (StringCchPrintfW(value, RTL_NUMBER_OF(value), L"%s%s", pPrefix,
 			g_NSSMRegStdIOFlags) < 0) {
 		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
 			g_NSSMRegStdIOFlags, L"get_createfile_parameters()", NULL);
@@ -348,28 +1203,607 @@ static void rotated_filename(const wchar_t* pPath, wchar_t* pRotated,
 	StringCchPrintfW(pRotated, uRotatedLength, L"%s%s", buffer, extension);
 }
 
-void rotate_file(const wchar_t* pServiceName, const wchar_t* pPath,
-	uint32_t uSeconds, uint32_t uDelay, uint32_t uLow, uint32_t uHigh,
-	bool bCopyAndTruncate)
-{
-	uint32_t error;
+/***************************************
 
-	/* Now. */
-	SYSTEMTIME st;
-	GetSystemTime(&st);
+	Index of rotated files
 
-	BY_HANDLE_FILE_INFORMATION info;
+	Each output file which is rotated has an index of the files rotated
+	from it, oldest first.  If retention limits are configured the index
+	is filled by a single directory scan the first time it's needed and is
+	then kept up to date as files are rotated, compressed and deleted, so
+	enforcing the limits never has to look at the directory again.
 
-	/* Try to open the file to check if it exists and to get attributes. */
-	HANDLE file = CreateFileW(pPath, 0,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-	if (file != INVALID_HANDLE_VALUE) {
-		/* Get file attributes. */
-		if (!GetFileInformationByHandle(file, &info)) {
-			/* Reuse current time for rotation timestamp. */
-			uSeconds = uLow = uHigh = 0;
-			SystemTimeToFileTime(&st, &info.ftLastWriteTime);
+	Indexes are never freed since a service may restart its application
+	any number of times.  All of them are protected by g_LogIndexLock.
+
+***************************************/
+
+struct log_segment_t {
+	// Next newest rotated file
+	log_segment_t* m_pNext;
+	// Pathname, with room to append .gz
+	wchar_t* m_pPath;
+	// Time of rotation as a FILETIME
+	uint64_t m_uTime;
+	// Size of the file in bytes
+	uint64_t m_uSize;
+};
+
+struct log_index_t {
+	// Next index
+	log_index_t* m_pNext;
+	// Rotated files, oldest first
+	log_segment_t* m_pSegments;
+	// Name of the service being logged
+	wchar_t* m_pServiceName;
+	// Pathname of the file being rotated
+	wchar_t* m_pPath;
+	// Total size of the rotated files in bytes
+	uint64_t m_uTotalSize;
+	// Most bytes to keep, 0 for no limit
+	uint64_t m_uMaxBytes;
+	// Number of rotated files
+	uint32_t m_uCount;
+	// Most files to keep, 0 for no limit
+	uint32_t m_uMaxFiles;
+	// Oldest file to keep in seconds, 0 for no limit
+	uint32_t m_uMaxAge;
+	// gzip level for compressing rotated files, 0 for none
+	uint32_t m_uCompress;
+	// Queue entry for removing files beyond the limits
+	log_job_t m_Prune;
+	// True if m_Prune is queued or running
+	bool m_bPruneQueued;
+	// True if retention limits are set and the index is being kept
+	bool m_bTracking;
+};
+
+static log_index_t* g_pLogIndexes;
+
+/* Convert a SYSTEMTIME to 100 nanosecond intervals. */
+static uint64_t system_time_ticks(const SYSTEMTIME* pSystemTime)
+{
+	FILETIME ft;
+	if (!SystemTimeToFileTime(pSystemTime, &ft)) {
+		return 0;
+	}
+	ULARGE_INTEGER uTicks;
+	uTicks.LowPart = ft.dwLowDateTime;
+	uTicks.HighPart = ft.dwHighDateTime;
+	return uTicks.QuadPart;
+}
+
+/*
+  Parse the timestamp which rotated_filename() puts in a name.
+  Returns the number of characters parsed, 0 if it isn't one.
+*/
+uint32_t parse_rotated_time(const wchar_t* pInput, uint64_t* pTime)
+{
+	/* -YYYYMMDDTHHMMSS.mmm, the dash was matched already. */
+	static const wchar_t g_Format[] = L"########T######.###";
+	uint32_t uLength = static_cast<uint32_t>(RTL_NUMBER_OF(g_Format) - 1);
+	uint32_t i;
+	for (i = 0; i < uLength; i++) {
+		if (g_Format[i] == L'#') {
+			if ((pInput[i] < L'0') || (pInput[i] > L'9')) {
+				return 0;
+			}
+		} else if (pInput[i] != g_Format[i]) {
+			return 0;
+		}
+	}
+
+	/* Start and end of each field. */
+	static const uint8_t g_Fields[7][2] = {
+		{0, 4}, {4, 6}, {6, 8}, {9, 11}, {11, 13}, {13, 15}, {16, 19}};
+	uint32_t Digits[7];
+	for (i = 0; i < 7; i++) {
+		uint32_t uValue = 0;
+		for (uint32_t j = g_Fields[i][0]; j < g_Fields[i][1]; j++) {
+			uValue = uValue * 10 + static_cast<uint32_t>(pInput[j] - L'0');
+		}
+		Digits[i] = uValue;
+	}
+	SYSTEMTIME st;
+	st.wYear = static_cast<WORD>(Digits[0]);
+	st.wMonth = static_cast<WORD>(Digits[1]);
+	st.wDayOfWeek = 0;
+	st.wDay = static_cast<WORD>(Digits[2]);
+	st.wHour = static_cast<WORD>(Digits[3]);
+	st.wMinute = static_cast<WORD>(Digits[4]);
+	st.wSecond = static_cast<WORD>(Digits[5]);
+	st.wMilliseconds = static_cast<WORD>(Digits[6]);
+	*pTime = system_time_ticks(&st);
+	return *pTime ? uLength : 0;
+}
+
+/* Call with g_LogIndexLock held. */
+static void insert_log_segment(log_index_t* pIndex, log_segment_t* pSegment)
+{
+	/* New files are almost always the newest, so search from the end. */
+	log_segment_t** ppNext = &pIndex->m_pSegments;
+	log_segment_t** ppInsert = ppNext;
+	while (*ppNext) {
+		if ((*ppNext)->m_uTime <= pSegment->m_uTime) {
+			ppInsert = &(*ppNext)->m_pNext;
+		}
+		ppNext = &(*ppNext)->m_pNext;
+	}
+	pSegment->m_pNext = *ppInsert;
+	*ppInsert = pSegment;
+	pIndex->m_uCount++;
+	pIndex->m_uTotalSize += pSegment->m_uSize;
+}
+
+static log_segment_t* alloc_log_segment(
+	const wchar_t* pPath, uint64_t uTime, uint64_t uSize)
+{
+	/* Leave room for .gz to be appended. */
+	uintptr_t uLength = wcslen(pPath) + 4;
+	log_segment_t* pSegment = static_cast<log_segment_t*>(
+		heap_alloc(sizeof(log_segment_t) + uLength * sizeof(wchar_t)));
+	if (!pSegment) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+			L"log segment", L"alloc_log_segment()", NULL);
+		return NULL;
+	}
+	pSegment->m_pNext = NULL;
+	pSegment->m_pPath = reinterpret_cast<wchar_t*>(pSegment + 1);
+	StringCchCopyW(pSegment->m_pPath, uLength, pPath);
+	pSegment->m_uTime = uTime;
+	pSegment->m_uSize = uSize;
+	return pSegment;
+}
+
+/*
+  Find the files rotated from the index's path with one directory scan.
+  Called from the main thread before the index is shared.
+*/
+static void scan_log_index(log_index_t* pIndex)
+{
+	wchar_t pattern[PATH_LENGTH];
+	StringCchCopyW(pattern, RTL_NUMBER_OF(pattern), pIndex->m_pPath);
+	wchar_t* pExtension = PathFindExtensionW(pattern);
+	wchar_t extension[PATH_LENGTH];
+	StringCchCopyW(extension, RTL_NUMBER_OF(extension), pExtension);
+	*pExtension = 0;
+	uintptr_t uPrefixLength = wcslen(PathFindFileNameW(pattern));
+	uintptr_t uDirectoryLength =
+		static_cast<uintptr_t>(PathFindFileNameW(pattern) - pattern);
+	StringCchCatW(pattern, RTL_NUMBER_OF(pattern), L"-*");
+
+	WIN32_FIND_DATAW data;
+	HANDLE hFind = FindFirstFileW(pattern, &data);
+	if (hFind == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	wchar_t path[PATH_LENGTH];
+	uintptr_t uExtensionLength = wcslen(extension);
+	do {
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			continue;
+		}
+
+		/* Name-YYYYMMDDTHHMMSS.mmm.ext or the same with .gz appended. */
+		if (wcslen(data.cFileName) <= uPrefixLength) {
+			continue;
+		}
+		uint64_t uTime;
+		const wchar_t* pSuffix = data.cFileName + uPrefixLength + 1;
+		uint32_t uParsed = parse_rotated_time(pSuffix, &uTime);
+		if (!uParsed) {
+			continue;
+		}
+		pSuffix += uParsed;
+		if (_wcsnicmp(pSuffix, extension, uExtensionLength)) {
+			continue;
+		}
+		pSuffix += uExtensionLength;
+		if (*pSuffix && _wcsicmp(pSuffix, L".gz")) {
+			continue;
+		}
+
+		StringCchCopyW(path, RTL_NUMBER_OF(path), pIndex->m_pPath);
+		path[uDirectoryLength] = 0;
+		StringCchCatW(path, RTL_NUMBER_OF(path), data.cFileName);
+		ULARGE_INTEGER uSize;
+		uSize.LowPart = data.nFileSizeLow;
+		uSize.HighPart = data.nFileSizeHigh;
+		log_segment_t* pSegment =
+			alloc_log_segment(path, uTime, uSize.QuadPart);
+		if (pSegment) {
+			EnterCriticalSection(&g_LogIndexLock);
+			insert_log_segment(pIndex, pSegment);
+			LeaveCriticalSection(&g_LogIndexLock);
+		}
+	} while (FindNextFileW(hFind, &data));
+	FindClose(hFind);
+}
+
+/*
+  Unlink the oldest file if it's beyond any of the limits.
+  Call with g_LogIndexLock held.
+*/
+static log_segment_t* next_expired_segment(log_index_t* pIndex, uint64_t uNow)
+{
+	log_segment_t* pSegment = pIndex->m_pSegments;
+	if (!pSegment) {
+		return NULL;
+	}
+	bool bExpired = false;
+	if (pIndex->m_uMaxFiles && (pIndex->m_uCount > pIndex->m_uMaxFiles)) {
+		bExpired = true;
+	} else if (pIndex->m_uMaxBytes &&
+		(pIndex->m_uTotalSize > pIndex->m_uMaxBytes)) {
+		bExpired = true;
+	} else if (pIndex->m_uMaxAge &&
+		((pSegment->m_uTime + pIndex->m_uMaxAge * 10000000ULL) < uNow)) {
+		bExpired = true;
+	}
+	if (!bExpired) {
+		return NULL;
+	}
+	pIndex->m_pSegments = pSegment->m_pNext;
+	pIndex->m_uCount--;
+	pIndex->m_uTotalSize -= pSegment->m_uSize;
+	return pSegment;
+}
+
+/* Delete rotated files until the index is within its limits. */
+static void prune_log_index(void* pParam)
+{
+	log_index_t* pIndex = static_cast<log_index_t*>(pParam);
+
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	ULARGE_INTEGER uNow;
+	uNow.LowPart = ft.dwLowDateTime;
+	uNow.HighPart = ft.dwHighDateTime;
+
+	EnterCriticalSection(&g_LogIndexLock);
+	log_segment_t* pSegment;
+	while ((pSegment = next_expired_segment(pIndex, uNow.QuadPart)) != NULL) {
+		LeaveCriticalSection(&g_LogIndexLock);
+		if (DeleteFileW(pSegment->m_pPath)) {
+			log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_RETENTION_DELETED,
+				pIndex->m_pServiceName, pIndex->m_pPath, pSegment->m_pPath,
+				NULL);
+		} else {
+			unsigned long error = GetLastError();
+			if (error != ERROR_FILE_NOT_FOUND) {
+				log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_RETENTION_FAILED,
+					pIndex->m_pServiceName, pIndex->m_pPath,
+					pSegment->m_pPath, error_string(error), NULL);
+			}
+		}
+		delete_time_index(pSegment->m_pPath);
+		heap_free(pSegment);
+		EnterCriticalSection(&g_LogIndexLock);
+	}
+	pIndex->m_bPruneQueued = false;
+	LeaveCriticalSection(&g_LogIndexLock);
+}
+
+/* Have the workers delete any files beyond the limits. */
+static void request_prune(log_index_t* pIndex)
+{
+	EnterCriticalSection(&g_LogIndexLock);
+	if (pIndex->m_bPruneQueued) {
+		LeaveCriticalSection(&g_LogIndexLock);
+		return;
+	}
+	pIndex->m_bPruneQueued = true;
+	LeaveCriticalSection(&g_LogIndexLock);
+
+	if (queue_log_job(&pIndex->m_Prune, prune_log_index, pIndex, false)) {
+		prune_log_index(pIndex);
+	}
+}
+
+/***************************************
+
+	Find or create the index for a service's output file
+
+	Called from the main thread.  Returns NULL if there's nothing for
+	the index to do or it couldn't be created.
+
+***************************************/
+
+static log_index_t* get_log_index(
+	nssm_service_t* pNSSMService, const wchar_t* pPath)
+{
+	if (init_log_workers()) {
+		return NULL;
+	}
+
+	ULARGE_INTEGER uMaxBytes;
+	uMaxBytes.LowPart = pNSSMService->m_uRotateMaxBytesLow;
+	uMaxBytes.HighPart = pNSSMService->m_uRotateMaxBytesHigh;
+	bool bTracking = pNSSMService->m_uRotateMaxFiles || uMaxBytes.QuadPart ||
+		pNSSMService->m_uRotateMaxAge;
+	if (!bTracking && !pNSSMService->m_uRotateCompress) {
+		return NULL;
+	}
+
+	EnterCriticalSection(&g_LogIndexLock);
+	log_index_t* pIndex = g_pLogIndexes;
+	while (pIndex && !str_equiv(pIndex->m_pPath, pPath)) {
+		pIndex = pIndex->m_pNext;
+	}
+	LeaveCriticalSection(&g_LogIndexLock);
+
+	if (!pIndex) {
+		uintptr_t uServiceNameLength = wcslen(pNSSMService->m_Name) + 1;
+		uintptr_t uPathLength = wcslen(pPath) + 1;
+		pIndex = static_cast<log_index_t*>(heap_calloc(sizeof(log_index_t) +
+			(uServiceNameLength + uPathLength) * sizeof(wchar_t)));
+		if (!pIndex) {
+			log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+				L"log index", L"get_log_index()", NULL);
+			return NULL;
+		}
+		pIndex->m_pServiceName = reinterpret_cast<wchar_t*>(pIndex + 1);
+		pIndex->m_pPath = pIndex->m_pServiceName + uServiceNameLength;
+		memcpy(pIndex->m_pServiceName, pNSSMService->m_Name,
+			uServiceNameLength * sizeof(wchar_t));
+		memcpy(pIndex->m_pPath, pPath, uPathLength * sizeof(wchar_t));
+
+		EnterCriticalSection(&g_LogIndexLock);
+		pIndex->m_pNext = g_pLogIndexes;
+		g_pLogIndexes = pIndex;
+		LeaveCriticalSection(&g_LogIndexLock);
+	}
+
+	/*
+	  Forget what was known if the limits were turned off since, as the
+	  directory will have to be scanned again if they're turned back on.
+	*/
+	EnterCriticalSection(&g_LogIndexLock);
+	bool bScan = bTracking && !pIndex->m_bTracking;
+	log_segment_t* pForget = NULL;
+	if (bScan) {
+		pForget = pIndex->m_pSegments;
+		pIndex->m_pSegments = NULL;
+		pIndex->m_uCount = 0;
+		pIndex->m_uTotalSize = 0;
+	}
+	pIndex->m_uMaxFiles = pNSSMService->m_uRotateMaxFiles;
+	pIndex->m_uMaxBytes = uMaxBytes.QuadPart;
+	pIndex->m_uMaxAge = pNSSMService->m_uRotateMaxAge;
+	pIndex->m_uCompress = pNSSMService->m_uRotateCompress;
+	pIndex->m_bTracking = bTracking;
+	LeaveCriticalSection(&g_LogIndexLock);
+
+	while (pForget) {
+		log_segment_t* pNext = pForget->m_pNext;
+		heap_free(pForget);
+		pForget = pNext;
+	}
+	if (bScan) {
+		scan_log_index(pIndex);
+	}
+	if (bTracking) {
+		request_prune(pIndex);
+	}
+	return pIndex;
+}
+
+/* Record a newly rotated file and delete any which are now beyond limits. */
+static void add_log_segment(log_index_t* pIndex, const wchar_t* pPath,
+	const SYSTEMTIME* pTime, uint64_t uSize)
+{
+	if (!pIndex || !pIndex->m_bTracking) {
+		return;
+	}
+	log_segment_t* pSegment =
+		alloc_log_segment(pPath, system_time_ticks(pTime), uSize);
+	if (!pSegment) {
+		return;
+	}
+	EnterCriticalSection(&g_LogIndexLock);
+	insert_log_segment(pIndex, pSegment);
+	LeaveCriticalSection(&g_LogIndexLock);
+	request_prune(pIndex);
+}
+
+/*
+  Update a file in the index after it was compressed.
+  Returns false if the file is no longer in the index because it was
+  deleted to keep within the limits in the meantime.
+*/
+static bool compressed_log_segment(
+	log_index_t* pIndex, const wchar_t* pPath, uint64_t uSize)
+{
+	if (!pIndex->m_bTracking) {
+		return true;
+	}
+	bool bFound = false;
+	EnterCriticalSection(&g_LogIndexLock);
+	for (log_segment_t* pSegment = pIndex->m_pSegments; pSegment;
+		 pSegment = pSegment->m_pNext) {
+		if (!str_equiv(pSegment->m_pPath, pPath)) {
+			continue;
+		}
+		uintptr_t uLength = wcslen(pSegment->m_pPath) + 4;
+		StringCchCatW(pSegment->m_pPath, uLength, L".gz");
+		pIndex->m_uTotalSize -= pSegment->m_uSize;
+		pIndex->m_uTotalSize += uSize;
+		pSegment->m_uSize = uSize;
+		bFound = true;
+		break;
+	}
+	LeaveCriticalSection(&g_LogIndexLock);
+	return bFound;
+}
+
+/***************************************
+
+	Compress a rotated log file into a .gz file alongside it, then delete
+	the original.  Run by a background worker.
+
+***************************************/
+
+struct log_compress_t {
+	// Queue entry for the background workers
+	log_job_t m_Job;
+	// Index the rotated file belongs to
+	log_index_t* m_pIndex;
+	// Pathname of the rotated file
+	const wchar_t* m_pPath;
+};
+
+static void compress_rotated(void* pParam)
+{
+	log_compress_t* pCompress = static_cast<log_compress_t*>(pParam);
+	const wchar_t* pServiceName = pCompress->m_pIndex->m_pServiceName;
+	wchar_t compressed[PATH_LENGTH];
+	StringCchPrintfW(compressed, RTL_NUMBER_OF(compressed), L"%s.gz",
+		pCompress->m_pPath);
+
+	FILETIME created, exited, kernel_before, user_before;
+	GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel_before,
+		&user_before);
+
+	uint64_t uInput = 0;
+	uint64_t uOutput = 0;
+	int ret = gzip_file(pCompress->m_pPath, compressed,
+		pCompress->m_pIndex->m_uCompress, &uInput, &uOutput);
+	if (ret) {
+		unsigned long error = GetLastError();
+		const wchar_t* pFunction;
+		const wchar_t* pFile = pCompress->m_pPath;
+		switch (ret) {
+		case 1:
+			pFunction = L"CreateFile()";
+			break;
+		case 2:
+			pFunction = L"CreateFile()";
+			pFile = compressed;
+			break;
+		case 3:
+			pFunction = L"HeapAlloc()";
+			break;
+		case 4:
+			pFunction = L"ReadFile()";
+			break;
+		default:
+			pFunction = L"WriteFile()";
+			pFile = compressed;
+		}
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_COMPRESS_FILE_FAILED,
+			pServiceName, pCompress->m_pPath, pFunction, pFile,
+			error_string(error), NULL);
+		heap_free(pCompress);
+		return;
+	}
+
+	FILETIME kernel_after, user_after;
+	GetThreadTimes(
+		GetCurrentThread(), &created, &exited, &kernel_after, &user_after);
+	ULARGE_INTEGER before;
+	ULARGE_INTEGER after;
+	before.LowPart = kernel_before.dwLowDateTime;
+	before.HighPart = kernel_before.dwHighDateTime;
+	after.LowPart = kernel_after.dwLowDateTime;
+	after.HighPart = kernel_after.dwHighDateTime;
+	uint64_t uCPUTime = after.QuadPart - before.QuadPart;
+	before.LowPart = user_before.dwLowDateTime;
+	before.HighPart = user_before.dwHighDateTime;
+	after.LowPart = user_after.dwLowDateTime;
+	after.HighPart = user_after.dwHighDateTime;
+	uCPUTime += after.QuadPart - before.QuadPart;
+
+	/* Compressed size as a percentage of the original, to one place. */
+	uint64_t uPermille = uInput ? (uOutput * 1000U) / uInput : 1000U;
+
+	wchar_t input_size[32];
+	wchar_t output_size[32];
+	wchar_t ratio[32];
+	wchar_t cpu_time[32];
+	StringCchPrintfW(
+		input_size, RTL_NUMBER_OF(input_size), L"%llu", uInput);
+	StringCchPrintfW(
+		output_size, RTL_NUMBER_OF(output_size), L"%llu", uOutput);
+	StringCchPrintfW(ratio, RTL_NUMBER_OF(ratio), L"%llu.%llu",
+		uPermille / 10U, uPermille % 10U);
+	StringCchPrintfW(cpu_time, RTL_NUMBER_OF(cpu_time), L"%llu",
+		uCPUTime / 10000U);
+	log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_COMPRESSED,
+		pServiceName, pCompress->m_pPath, compressed, input_size,
+		output_size, ratio, cpu_time, NULL);
+
+	/*
+	  If the file was deleted to keep within the retention limits while it
+	  was being compressed, the compressed copy has to go too.
+	*/
+	if (!compressed_log_segment(pCompress->m_pIndex, pCompress->m_pPath,
+			uOutput)) {
+		DeleteFileW(compressed);
+	}
+
+	if (!DeleteFileW(pCompress->m_pPath) &&
+		(GetLastError() != ERROR_FILE_NOT_FOUND)) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_COMPRESS_FILE_FAILED,
+			pServiceName, pCompress->m_pPath, L"DeleteFile()",
+			pCompress->m_pPath, error_string(GetLastError()), NULL);
+	}
+	/* Offsets in the index mean nothing in the compressed file. */
+	delete_time_index(pCompress->m_pPath);
+	heap_free(pCompress);
+}
+
+/*
+  Hand a rotated file to the background workers for compression.  It is
+  left as it is if compression is disabled or no worker can take it.
+*/
+static void queue_compression(log_index_t* pIndex, const wchar_t* pPath)
+{
+	if (!pIndex || !pIndex->m_uCompress) {
+		return;
+	}
+
+	/* Copy the path as the job outlives the caller. */
+	uintptr_t uPathLength = wcslen(pPath) + 1;
+	log_compress_t* pCompress = static_cast<log_compress_t*>(heap_alloc(
+		sizeof(log_compress_t) + uPathLength * sizeof(wchar_t)));
+	if (!pCompress) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+			L"compression job", L"queue_compression()", NULL);
+		return;
+	}
+	wchar_t* pPathCopy = reinterpret_cast<wchar_t*>(pCompress + 1);
+	memcpy(pPathCopy, pPath, uPathLength * sizeof(wchar_t));
+	pCompress->m_pIndex = pIndex;
+	pCompress->m_pPath = pPathCopy;
+
+	if (queue_log_job(&pCompress->m_Job, compress_rotated, pCompress, true)) {
+		heap_free(pCompress);
+	}
+}
+
+void rotate_file(const wchar_t* pServiceName, const wchar_t* pPath,
+	uint32_t uSeconds, uint32_t uDelay, uint32_t uLow, uint32_t uHigh,
+	bool bCopyAndTruncate, log_index_t* pIndex)
+{
+	uint32_t error;
+
+	/* Now. */
+	SYSTEMTIME st;
+	GetSystemTime(&st);
+
+	BY_HANDLE_FILE_INFORMATION info;
+	memset(&info, 0, sizeof(info));
+
+	/* Try to open the file to check if it exists and to get attributes. */
+	HANDLE file = CreateFileW(pPath, 0,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file != INVALID_HANDLE_VALUE) {
+		/* Get file attributes. */
+		if (!GetFileInformationByHandle(file, &info)) {
+			/* Reuse current time for rotation timestamp. */
+			uSeconds = uLow = uHigh = 0;
+			SystemTimeToFileTime(&st, &info.ftLastWriteTime);
 		}
 
 		CloseHandle(file);
@@ -442,6 +1876,12 @@ void rotate_file(const wchar_t* pServiceName, const wchar_t* pPath,
 	if (ok) {
 		log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_ROTATED, pServiceName,
 			pPath, rotated, NULL);
+		move_time_index(pPath, rotated);
+		ULARGE_INTEGER uSize;
+		uSize.LowPart = info.nFileSizeLow;
+		uSize.HighPart = info.nFileSizeHigh;
+		add_log_segment(pIndex, rotated, &st, uSize.QuadPart);
+		queue_compression(pIndex, rotated);
 		return;
 	}
 	error = GetLastError();
@@ -481,36 +1921,59 @@ int get_output_handles(nssm_service_t* pNSSMService, STARTUPINFOW* pStartupInfo)
 
 	/* stdout */
 	if (pNSSMService->m_StdoutPathname[0]) {
-		if (pNSSMService->m_bRotateFiles)
+		log_index_t* pStdoutIndex = NULL;
+		if (pNSSMService->m_bRotateFiles) {
+			pStdoutIndex =
+				get_log_index(pNSSMService, pNSSMService->m_StdoutPathname);
 			rotate_file(pNSSMService->m_Name, pNSSMService->m_StdoutPathname,
 				pNSSMService->m_uRotateSeconds, pNSSMService->m_uRotateBytesLow,
 				pNSSMService->m_uRotateBytesHigh, pNSSMService->m_uRotateDelay,
-				pNSSMService->m_bStdoutCopyAndTruncate);
+				pNSSMService->m_bStdoutCopyAndTruncate, pStdoutIndex);
+		}
+		uint32_t uSharing = pNSSMService->m_uStdoutSharing;
+		if (pNSSMService->m_bUseStdoutPipe) {
+			uSharing |= FILE_SHARE_DELETE;
+		}
 		HANDLE stdout_handle = write_to_file(pNSSMService->m_StdoutPathname,
-			pNSSMService->m_uStdoutSharing, 0,
-			pNSSMService->m_uStdoutDisposition, pNSSMService->m_uStdoutFlags);
+			uSharing, 0, pNSSMService->m_uStdoutDisposition,
+			pNSSMService->m_uStdoutFlags);
 		if (stdout_handle == INVALID_HANDLE_VALUE)
 			return 4;
 		pNSSMService->m_hStdoutInputPipe = NULL;
 
 		if (pNSSMService->m_bUseStdoutPipe) {
 			pNSSMService->m_hStdoutOutputPipe = pStartupInfo->hStdOutput = NULL;
+
+			/* Read stderr through its own pipe if it goes to the same file. */
+			HANDLE* pMergeRead = NULL;
+			HANDLE* pMergePipe = NULL;
+			if (pNSSMService->m_StderrPathname[0] &&
+				str_equiv(pNSSMService->m_StderrPathname,
+					pNSSMService->m_StdoutPathname)) {
+				pNSSMService->m_hStderrOutputPipe = NULL;
+				pNSSMService->m_hStderrInputPipe = NULL;
+				pMergeRead = &pNSSMService->m_hStderrOutputPipe;
+				pMergePipe = &pNSSMService->m_hStderrInputPipe;
+			}
+
 			pNSSMService->m_hStdoutThread = create_logging_thread(
-				pNSSMService->m_Name, pNSSMService->m_StdoutPathname,
+				pNSSMService, pNSSMService->m_StdoutPathname,
 				pNSSMService->m_uStdoutSharing,
 				pNSSMService->m_uStdoutDisposition,
 				pNSSMService->m_uStdoutFlags,
 				&pNSSMService->m_hStdoutOutputPipe,
-				&pNSSMService->m_hStdoutInputPipe, &stdout_handle,
-				pNSSMService->m_uRotateBytesLow,
+				&pNSSMService->m_hStdoutInputPipe, &stdout_handle, pMergeRead,
+				pMergePipe, pNSSMService->m_uRotateBytesLow,
 				pNSSMService->m_uRotateBytesHigh, pNSSMService->m_uRotateDelay,
 				&pNSSMService->m_uStdoutTID,
 				&pNSSMService->m_uRotateStdoutOnline,
 				pNSSMService->m_bTimestampLog,
-				pNSSMService->m_bStdoutCopyAndTruncate);
+				pNSSMService->m_bStdoutCopyAndTruncate, pStdoutIndex);
 			if (!pNSSMService->m_hStdoutThread) {
-				CloseHandle(pNSSMService->m_hStdoutOutputPipe);
-				CloseHandle(pNSSMService->m_hStdoutInputPipe);
+				close_handle(&pNSSMService->m_hStdoutOutputPipe);
+				close_handle(&pNSSMService->m_hStdoutInputPipe);
+				close_handle(&pNSSMService->m_hStderrOutputPipe);
+				close_handle(&pNSSMService->m_hStderrInputPipe);
 			}
 		} else {
 			pNSSMService->m_hStdoutThread = NULL;
@@ -544,24 +2007,34 @@ int get_output_handles(nssm_service_t* pNSSMService, STARTUPINFOW* pStartupInfo)
 			pNSSMService->m_uStderrFlags = pNSSMService->m_uStdoutFlags;
 			pNSSMService->m_uRotateStderrOnline = NSSM_ROTATE_OFFLINE;
 
-			/* Two handles to the same file will create a race. */
-			/* XXX: Here we assume that either both or neither handle must be a
-			 * pipe. */
-			if (dup_handle(pNSSMService->m_hStdoutInputPipe,
+			/*
+			  Two handles to the same file will create a race.  If stdout is
+			  logged through a pipe stderr already has its own pipe to the
+			  same logger, otherwise share the stdout handle.
+			*/
+			if (!pNSSMService->m_hStderrInputPipe &&
+				dup_handle(pNSSMService->m_hStdoutInputPipe,
 					&pNSSMService->m_hStderrInputPipe, L"stdout", L"stderr"))
 				return 6;
 		} else {
-			if (pNSSMService->m_bRotateFiles)
+			log_index_t* pStderrIndex = NULL;
+			if (pNSSMService->m_bRotateFiles) {
+				pStderrIndex =
+					get_log_index(pNSSMService, pNSSMService->m_StderrPathname);
 				rotate_file(pNSSMService->m_Name,
 					pNSSMService->m_StderrPathname,
 					pNSSMService->m_uRotateSeconds,
 					pNSSMService->m_uRotateBytesLow,
 					pNSSMService->m_uRotateBytesHigh,
 					pNSSMService->m_uRotateDelay,
-					pNSSMService->m_bStderrCopyAndTruncate);
+					pNSSMService->m_bStderrCopyAndTruncate, pStderrIndex);
+			}
+			uint32_t uSharing = pNSSMService->m_uStderrSharing;
+			if (pNSSMService->m_bUseStderrPipe) {
+				uSharing |= FILE_SHARE_DELETE;
+			}
 			HANDLE stderr_handle = write_to_file(pNSSMService->m_StderrPathname,
-				pNSSMService->m_uStderrSharing, 0,
-				pNSSMService->m_uStderrDisposition,
+				uSharing, 0, pNSSMService->m_uStderrDisposition,
 				pNSSMService->m_uStderrFlags);
 			if (stderr_handle == INVALID_HANDLE_VALUE) {
 				return 7;
@@ -572,18 +2045,18 @@ int get_output_handles(nssm_service_t* pNSSMService, STARTUPINFOW* pStartupInfo)
 				pNSSMService->m_hStderrOutputPipe = pStartupInfo->hStdError =
 					NULL;
 				pNSSMService->m_hStderrThread = create_logging_thread(
-					pNSSMService->m_Name, pNSSMService->m_StderrPathname,
+					pNSSMService, pNSSMService->m_StderrPathname,
 					pNSSMService->m_uStderrSharing,
 					pNSSMService->m_uStderrDisposition,
 					pNSSMService->m_uStderrFlags,
 					&pNSSMService->m_hStderrOutputPipe,
-					&pNSSMService->m_hStderrInputPipe, &stderr_handle,
-					pNSSMService->m_uRotateBytesLow,
+					&pNSSMService->m_hStderrInputPipe, &stderr_handle, NULL,
+					NULL, pNSSMService->m_uRotateBytesLow,
 					pNSSMService->m_uRotateBytesHigh,
 					pNSSMService->m_uRotateDelay, &pNSSMService->m_uStderrTID,
 					&pNSSMService->m_uRotateStderrOnline,
 					pNSSMService->m_bTimestampLog,
-					pNSSMService->m_bStderrCopyAndTruncate);
+					pNSSMService->m_bStderrCopyAndTruncate, pStderrIndex);
 				if (!pNSSMService->m_hStderrThread) {
 					CloseHandle(pNSSMService->m_hStderrOutputPipe);
 					CloseHandle(pNSSMService->m_hStderrInputPipe);
@@ -642,415 +2115,3574 @@ int use_output_handles(nssm_service_t* pNSSMService, STARTUPINFOW* pStartupInfo)
 			}
 			return 2;
 		}
-		pStartupInfo->dwFlags |= STARTF_USESTDHANDLES;
+		pStartupInfo->dwFlags |= STARTF_USESTDHANDLES;
+	}
+
+	return 0;
+}
+
+void close_output_handles(STARTUPINFOW* pStartupInfo)
+{
+	if (pStartupInfo->hStdInput) {
+		CloseHandle(pStartupInfo->hStdInput);
+	}
+	if (pStartupInfo->hStdOutput) {
+		CloseHandle(pStartupInfo->hStdOutput);
+	}
+	if (pStartupInfo->hStdError) {
+		CloseHandle(pStartupInfo->hStdError);
+	}
+}
+
+void cleanup_loggers(nssm_service_t* pNSSMService)
+{
+	uint32_t interval = NSSM_CLEANUP_LOGGERS_DEADLINE;
+
+	/*
+	  Close write ends of the data pipes so the loggers can finish reading.
+	  Both go first as a merged logger reads stdout and stderr.
+	*/
+	close_handle(&pNSSMService->m_hStdoutInputPipe);
+	close_handle(&pNSSMService->m_hStderrInputPipe);
+
+	/* Await the loggers then close the read ends. */
+	if (pNSSMService->m_hStdoutThread) {
+		WaitForSingleObject(pNSSMService->m_hStdoutThread, interval);
+		close_handle(&pNSSMService->m_hStdoutThread);
+	}
+	if (pNSSMService->m_hStderrThread) {
+		WaitForSingleObject(pNSSMService->m_hStderrThread, interval);
+		close_handle(&pNSSMService->m_hStderrThread);
+	}
+	close_handle(&pNSSMService->m_hStdoutOutputPipe);
+	close_handle(&pNSSMService->m_hStderrOutputPipe);
+}
+
+/*
+  Decide what to do about a failed read.
+  Returns:  1 if the read should be retried.
+		   -1 if the pipe can't be read any more.
+*/
+static int read_failed(
+	logger_t* pLogger, log_source_t* pSource, unsigned long error)
+{
+	int ret = -1;
+	switch (error) {
+	/* Other end closed the pipe. */
+	case ERROR_BROKEN_PIPE:
+	/* Our end was closed by cleanup_loggers(). */
+	case ERROR_OPERATION_ABORTED:
+	case ERROR_INVALID_HANDLE:
+		break;
+
+	/* Couldn't lock the buffer. */
+	case ERROR_NOT_ENOUGH_QUOTA:
+		if (++pSource->m_uReadRetries < 5) {
+			return 1;
+		}
+		break;
+	}
+
+	/* Ignore the error if we've been requested to exit anyway. */
+	if (*pLogger->m_pRotateOnline != NSSM_ROTATE_ONLINE) {
+		return ret;
+	}
+	if (!(pLogger->m_iComplained & COMPLAINED_READ)) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_READFILE_FAILED,
+			pLogger->m_pServiceName, pLogger->m_pPath, error_string(error),
+			NULL);
+	}
+	pLogger->m_iComplained |= COMPLAINED_READ;
+	return ret;
+}
+
+/***************************************
+
+	Issue an overlapped read into the free part of the ring buffer
+
+	The result is picked up by log_and_rotate() when the read completes.
+	Returns 0 if a read is in flight, 1 if the buffer is full or -1 if the
+	pipe can't be read any more.
+
+***************************************/
+
+static int issue_read(
+	logger_t* pLogger, log_source_t* pSource, void* address, uint32_t uSize)
+{
+	while (true) {
+		memset(&pSource->m_Overlapped, 0, sizeof(pSource->m_Overlapped));
+		if (ReadFile(pSource->m_hRead, address, uSize, NULL,
+				&pSource->m_Overlapped)) {
+			break;
+		}
+		unsigned long error = GetLastError();
+		if (error == ERROR_IO_PENDING) {
+			break;
+		}
+		if (read_failed(pLogger, pSource, error) < 0) {
+			pSource->m_bClosed = true;
+			return -1;
+		}
+	}
+	pSource->m_bReading = true;
+	return 0;
+}
+
+static int start_read(logger_t* pLogger, log_source_t* pSource)
+{
+	void* address;
+	uint32_t uFree = log_buffer_free_span(&pSource->m_Buffer, &address);
+	if (!uFree) {
+		return 1;
+	}
+	int ret = issue_read(pLogger, pSource, address, uFree);
+	pSource->m_Buffer.m_bBusy = !ret;
+	return ret;
+}
+
+/* Count output dropped from a pipe and arrange for it to be noted. */
+static void record_drop(logger_t* pLogger, log_source_t* pSource,
+	uint64_t uLines, uint32_t uBytes)
+{
+	if (!pSource->m_bDropPending) {
+		pSource->m_bDropPending = true;
+		/* Newest output goes after what is already buffered. */
+		pSource->m_uDropMark = 0;
+		if (pLogger->m_uBackpressure == NSSM_LOG_BACKPRESSURE_DROP_NEWEST) {
+			pSource->m_uDropMark = pSource->m_Buffer.m_uUsed;
+		}
+	}
+	pSource->m_uDroppedLines += uLines;
+	pSource->m_uDroppedBytes += uBytes;
+	pLogger->m_uLinesDropped += uLines;
+	pLogger->m_uBytesDropped += uBytes;
+}
+
+/***************************************
+
+	Make room in a full buffer by dropping the oldest output
+
+	Whole lines are dropped from the start of the buffer until at least
+	half of it is free.  If there is no line ending in the rest the whole
+	buffer goes, along with the rest of the line when it arrives.
+
+***************************************/
+
+static void drop_oldest(logger_t* pLogger, log_source_t* pSource)
+{
+	log_buffer_t* pBuffer = &pSource->m_Buffer;
+	void* address;
+	uint32_t in = log_buffer_used_span(pBuffer, &address);
+	if (!pSource->m_uCharsize) {
+		pSource->m_uCharsize = guess_charsize(address, in);
+	}
+	uint32_t uCharsize = pSource->m_uCharsize;
+
+	/* Offset in the data to start looking for a line ending. */
+	uint32_t uStart = (pBuffer->m_uUsed >> 1U) & ~(uCharsize - 1);
+	uint32_t uDrop = 0;
+	uint64_t uLines = 0;
+	if (uStart < in) {
+		uint32_t i = find_newline(
+			static_cast<uint8_t*>(address) + uStart, in - uStart, uCharsize);
+		if (i) {
+			uDrop = uStart + i;
+		}
+	}
+	if (!uDrop && (in < pBuffer->m_uUsed)) {
+		/* Carry on in the part which wrapped around. */
+		uint32_t uWrapped = (uStart > in) ? uStart - in : 0;
+		uint32_t i = find_newline(pBuffer->m_pData + uWrapped,
+			pBuffer->m_uUsed - in - uWrapped, uCharsize);
+		if (i) {
+			uDrop = in + uWrapped + i;
+			uLines = count_lines(address, in, uCharsize);
+			address = pBuffer->m_pData;
+			in = uWrapped + i;
+		}
+	}
+	if (!uDrop) {
+		/* Everything, including the unfinished line at the end. */
+		uDrop = pBuffer->m_uUsed;
+		pSource->m_bSkipLine = true;
+		uLines = count_lines(address, in, uCharsize) + 1;
+		if (in < uDrop) {
+			uLines += count_lines(pBuffer->m_pData, uDrop - in, uCharsize);
+		}
+	} else {
+		if (in > uDrop) {
+			in = uDrop;
+		}
+		uLines += count_lines(address, in, uCharsize);
+	}
+
+	record_drop(pLogger, pSource, uLines, uDrop);
+	log_buffer_consume(pBuffer, uDrop);
+}
+
+/*
+  Read from a pipe into the discard buffer, for output which is to be
+  dropped.  Returns the same as start_read().
+*/
+static int start_discard(logger_t* pLogger, log_source_t* pSource)
+{
+	if (!pLogger->m_pDiscard) {
+		pLogger->m_pDiscard =
+			static_cast<uint8_t*>(heap_alloc(NSSM_LOG_DISCARD_SIZE));
+		if (!pLogger->m_pDiscard) {
+			return 1;
+		}
+	}
+	int ret = issue_read(
+		pLogger, pSource, pLogger->m_pDiscard, NSSM_LOG_DISCARD_SIZE);
+	pSource->m_bDiscarding = !ret;
+	return ret;
+}
+
+/*
+  A read into the discard buffer finished.  Count what was dropped and
+  make sure the next thing kept starts on a new line.
+*/
+static void discard_read(
+	logger_t* pLogger, log_source_t* pSource, uint32_t uBytes)
+{
+	uint32_t uCharsize = pSource->m_uCharsize;
+	if (!uCharsize) {
+		uCharsize = guess_charsize(pLogger->m_pDiscard, uBytes);
+	}
+	record_drop(pLogger, pSource,
+		count_lines(pLogger->m_pDiscard, uBytes, uCharsize), uBytes);
+	pSource->m_bSkipLine = true;
+}
+
+/***************************************
+
+	Deal with a pipe whose buffer is full and can't grow
+
+	Blocking leaves the pipe unread so the application waits.  Otherwise
+	the oldest output in the buffer or the newest output from the pipe is
+	dropped.  Returns the same as start_read().
+
+***************************************/
+
+static int relieve_pressure(logger_t* pLogger, log_source_t* pSource)
+{
+	switch (pLogger->m_uBackpressure) {
+	case NSSM_LOG_BACKPRESSURE_DROP_OLDEST:
+		drop_oldest(pLogger, pSource);
+		return start_read(pLogger, pSource);
+	case NSSM_LOG_BACKPRESSURE_DROP_NEWEST:
+		return start_discard(pLogger, pSource);
+	}
+	return 1;
+}
+
+/***************************************
+
+	Add what a read put in the free part of the ring buffer to the data
+
+	After output was dropped, the rest of the line it ended part way
+	through is dropped too.
+
+***************************************/
+
+static void commit_read(
+	logger_t* pLogger, log_source_t* pSource, uint32_t uBytes)
+{
+	log_buffer_t* pBuffer = &pSource->m_Buffer;
+	if (pSource->m_bSkipLine && uBytes) {
+		/* The read started at the tail, which can't have moved. */
+		void* address;
+		log_buffer_free_span(pBuffer, &address);
+		uint8_t* pData = static_cast<uint8_t*>(address);
+		if (!pSource->m_uCharsize) {
+			pSource->m_uCharsize = guess_charsize(pData, uBytes);
+		}
+		uint32_t i = find_newline(pData, uBytes, pSource->m_uCharsize);
+		uint32_t uSkip = i ? i : uBytes;
+		record_drop(pLogger, pSource, 0, uSkip);
+		uBytes -= uSkip;
+		memmove(pData, pData + uSkip, uBytes);
+		if (i) {
+			pSource->m_bSkipLine = false;
+		}
+	}
+	if (uBytes && !pBuffer->m_uUsed) {
+		pSource->m_uArrival = pLogger->m_uArrivals++;
+	}
+	log_buffer_commit(pBuffer, uBytes);
+}
+
+/*
+  Read again straight away if the application has written more, so a burst
+  of output is gathered up and written to the file in large chunks.
+  Returns true if another read is in flight.
+*/
+static bool read_more(logger_t* pLogger, log_source_t* pSource)
+{
+	DWORD uAvailable;
+	if (!PeekNamedPipe(pSource->m_hRead, NULL, 0, NULL, &uAvailable, NULL) ||
+		!uAvailable) {
+		return false;
+	}
+	return !start_read(pLogger, pSource);
+}
+
+/***************************************
+
+	Hold output in memory while the log disk is full
+
+	The data is copied to the end of the spill buffer, which grows up to
+	AppLogSpillMax.  If there isn't room the data is dropped and counted
+	rather than making the application wait.  The first spill since the
+	disk filled up is logged and puts the logger on the list of loggers for
+	the I/O thread to retry.
+
+***************************************/
+
+static void spill_output(logger_t* pLogger, const void* pData,
+	uint32_t uLength, unsigned long error)
+{
+	log_buffer_t* pSpill = &pLogger->m_Spill;
+	if (!pSpill->m_pData) {
+		uint32_t uMin = NSSM_LOG_SPILL_MIN;
+		if (uMin > pLogger->m_uSpillMax) {
+			uMin = pLogger->m_uSpillMax;
+		}
+		/* Not fatal, the output is counted as dropped. */
+		log_buffer_init(pSpill, uMin, pLogger->m_uSpillMax);
+	}
+	if (!log_buffer_put(pSpill, pData, uLength)) {
+		pLogger->m_uSpilled += uLength;
+	} else {
+		pLogger->m_uSpillDropped += uLength;
+	}
+
+	if (!pLogger->m_bSpilling) {
+		pLogger->m_bSpilling = true;
+		pLogger->m_pNextSpilling = g_pSpillingLoggers;
+		g_pSpillingLoggers = pLogger;
+		log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_LOG_SPILLING,
+			pLogger->m_pServiceName, pLogger->m_pPath, error_string(error),
+			NULL);
+	}
+}
+
+/* Returns true if a write failed because the log disk has no space. */
+static inline bool disk_full(unsigned long error)
+{
+	return (error == ERROR_DISK_FULL) || (error == ERROR_NOT_ENOUGH_QUOTA);
+}
+
+/***************************************
+
+	Write out spilled output, oldest first
+
+	pWritten is increased by the number of bytes written.
+	Returns 0 once nothing is left in the spill buffer.
+
+***************************************/
+
+static int replay_spill(logger_t* pLogger, uint32_t* pWritten)
+{
+	log_buffer_t* pSpill = &pLogger->m_Spill;
+	while (pSpill->m_uUsed) {
+		void* address;
+		uint32_t in = log_buffer_used_span(pSpill, &address);
+		DWORD out = 0;
+		bool bWritten =
+			WriteFile(pLogger->m_hWrite, address, in, &out, NULL) != 0;
+		log_buffer_consume(pSpill, out);
+		*pWritten += out;
+		if (!bWritten) {
+			if (disk_full(GetLastError())) {
+				return 1;
+			}
+			/* Lost like any other failed write, but carry on. */
+			log_buffer_consume(pSpill, in - out);
+		}
+	}
+
+	log_buffer_free(pSpill);
+	if (pLogger->m_bSpilling &&
+		(pLogger->m_uSpilled || pLogger->m_uSpillDropped)) {
+		wchar_t spilled[32];
+		wchar_t dropped[32];
+		StringCchPrintfW(spilled, RTL_NUMBER_OF(spilled), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uSpilled));
+		StringCchPrintfW(dropped, RTL_NUMBER_OF(dropped), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uSpillDropped));
+		log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_LOG_SPILL_REPLAYED,
+			pLogger->m_pServiceName, pLogger->m_pPath, spilled, dropped, NULL);
+		pLogger->m_uSpilled = 0;
+		pLogger->m_uSpillDropped = 0;
+	}
+	/* Taken off the list by retry_spills(). */
+	return 0;
+}
+
+/*
+  Remove a logger from the list of loggers with spilled output.
+  Only called from the I/O thread.
+*/
+static void unlink_spilling(logger_t* pLogger)
+{
+	if (!pLogger->m_bSpilling) {
+		return;
+	}
+	logger_t** ppLink = &g_pSpillingLoggers;
+	while (*ppLink) {
+		if (*ppLink == pLogger) {
+			*ppLink = pLogger->m_pNextSpilling;
+			break;
+		}
+		ppLink = &(*ppLink)->m_pNextSpilling;
+	}
+	pLogger->m_pNextSpilling = NULL;
+	pLogger->m_bSpilling = false;
+}
+
+/***************************************
+
+	Try to write out spilled output for every logger which has some
+
+	Called by the I/O thread every NSSM_LOG_SPILL_RETRY milliseconds, so
+	a logger whose application has gone quiet still catches up.
+
+***************************************/
+
+static void retry_spills(void)
+{
+	g_uSpillRetried = GetTickCount();
+	logger_t* pLogger = g_pSpillingLoggers;
+	while (pLogger) {
+		logger_t* pNext = pLogger->m_pNextSpilling;
+		/*
+		  Size rotations are held off while spilling.  Overlapped writes
+		  which failed for lack of space are still to be spilled ahead.
+		*/
+		if (!pLogger->m_bRotating && !pLogger->m_Async.m_bDiskFull) {
+			uint32_t out = 0;
+			int ret = replay_spill(pLogger, &out);
+			pLogger->m_uFileSize += out;
+			if (!ret) {
+				unlink_spilling(pLogger);
+			}
+		}
+		pLogger = pNext;
+	}
+}
+
+/***************************************
+
+	Log sinks
+
+	Output written to the log file can also be sent to a syslog server
+	over UDP and to a named pipe read by a local log collector.  Each sink
+	has its own queue, which grows up to AppLogSinkQueue, and at most one
+	write in flight.  A sink which is slow or can't be reached only fills
+	its own queue, after which its output is dropped and counted, so the
+	log file and the application never wait for it.
+
+	Sinks are sent what is written to the log file, converted to UTF-8 if
+	the file is UTF-16.  Syslog messages are sent one line per datagram,
+	framed by logsink.cpp, which also keeps the queues.
+
+***************************************/
+
+/* Returns 0 once Winsock is ready for use, with the last error set if not. */
+static int init_winsock(void)
+{
+	static bool g_bWinsockReady;
+	if (!g_bWinsockReady) {
+		WSADATA data;
+		int iResult = WSAStartup(MAKEWORD(2, 2), &data);
+		if (iResult) {
+			SetLastError(static_cast<unsigned long>(iResult));
+			return 1;
+		}
+		g_bWinsockReady = true;
+	}
+	return 0;
+}
+
+/* Close a socket without changing the last error. */
+static void close_socket(SOCKET hSocket)
+{
+	int iError = WSAGetLastError();
+	closesocket(hSocket);
+	WSASetLastError(iError);
+}
+
+/***************************************
+
+	Create a UDP socket connected to a syslog server
+
+	The host name is looked up each time, so a server which moves is found
+	again.  Connecting a datagram socket only sets where sends go.
+
+	Returns the socket as a handle, or NULL with the last error set.
+
+***************************************/
+
+static HANDLE connect_syslog(
+	const wchar_t* pTarget, const wchar_t** ppFunction)
+{
+	*ppFunction = L"WSAStartup()";
+	if (init_winsock()) {
+		return NULL;
+	}
+
+	wchar_t host[NSSM_HOST_LENGTH];
+	wchar_t port[NSSM_PORT_LENGTH];
+	StringCchCopyW(port, RTL_NUMBER_OF(port), NSSM_SYSLOG_PORT);
+	split_address(
+		pTarget, host, RTL_NUMBER_OF(host), port, RTL_NUMBER_OF(port));
+
+	ADDRINFOW hints;
+	ZeroMemory(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	ADDRINFOW* pAddresses;
+	int iResult = GetAddrInfoW(host, port, &hints, &pAddresses);
+	if (iResult) {
+		*ppFunction = L"GetAddrInfoW()";
+		WSASetLastError(iResult);
+		return NULL;
+	}
+
+	SOCKET hSocket = INVALID_SOCKET;
+	for (ADDRINFOW* p = pAddresses; p; p = p->ai_next) {
+		hSocket = WSASocketW(p->ai_family, p->ai_socktype, p->ai_protocol,
+			NULL, 0, WSA_FLAG_OVERLAPPED);
+		if (hSocket == INVALID_SOCKET) {
+			*ppFunction = L"WSASocketW()";
+			continue;
+		}
+		if (!connect(hSocket, p->ai_addr, static_cast<int>(p->ai_addrlen))) {
+			break;
+		}
+		*ppFunction = L"connect()";
+		close_socket(hSocket);
+		hSocket = INVALID_SOCKET;
+	}
+	FreeAddrInfoW(pAddresses);
+
+	if (hSocket == INVALID_SOCKET) {
+		return NULL;
+	}
+	return reinterpret_cast<HANDLE>(hSocket);
+}
+
+/* Close the connection to a sink, if there is one. */
+static void close_sink(log_sink_t* pSink)
+{
+	if (!pSink->m_hWrite) {
+		return;
+	}
+	if (pSink->m_uKind == NSSM_LOG_SINK_SYSLOG) {
+		close_socket(reinterpret_cast<SOCKET>(pSink->m_hWrite));
+	} else {
+		CloseHandle(pSink->m_hWrite);
+	}
+	pSink->m_hWrite = NULL;
+}
+
+/***************************************
+
+	Deal with a sink which couldn't be reached or written to
+
+	The connection is closed and tried again after NSSM_LOG_SINK_RETRY
+	milliseconds.  Output stays queued until then, so a collector which
+	restarts gets what was sent while it was away, up to the size of the
+	queue.  Only the first failure is logged until the sink works again.
+
+***************************************/
+
+static void sink_failed(logger_t* pLogger, log_sink_t* pSink,
+	const wchar_t* pFunction, unsigned long error)
+{
+	if (!pSink->m_bComplained) {
+		pSink->m_bComplained = true;
+		log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_LOG_SINK_FAILED,
+			pLogger->m_pServiceName, pSink->m_pTarget, pFunction,
+			error_string(error), NULL);
+	}
+	close_sink(pSink);
+	pSink->m_uRetry = GetTickCount() + NSSM_LOG_SINK_RETRY;
+}
+
+/* Connect to a sink.  Returns 0 on success. */
+static int connect_sink(logger_t* pLogger, log_sink_t* pSink)
+{
+	const wchar_t* pFunction;
+	HANDLE hWrite;
+	if (pSink->m_uKind == NSSM_LOG_SINK_SYSLOG) {
+		hWrite = connect_syslog(pSink->m_pTarget, &pFunction);
+	} else {
+		pFunction = L"CreateFileW()";
+		hWrite = CreateFileW(pSink->m_pTarget, GENERIC_WRITE, 0, NULL,
+			OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+		if (hWrite == INVALID_HANDLE_VALUE) {
+			hWrite = NULL;
+		}
+	}
+	if (!hWrite) {
+		sink_failed(pLogger, pSink, pFunction, GetLastError());
+		return 1;
+	}
+
+	pSink->m_hWrite = hWrite;
+	if (!CreateIoCompletionPort(
+			hWrite, g_hLogPort, reinterpret_cast<ULONG_PTR>(pLogger), 0)) {
+		sink_failed(pLogger, pSink, L"CreateIoCompletionPort()",
+			GetLastError());
+		return 2;
+	}
+	return 0;
+}
+
+/***************************************
+
+	Start sending queued output to a sink
+
+	Connects first if the sink isn't connected and it is time to try
+	again.  Does nothing while a write is in flight.
+
+***************************************/
+
+static void pump_sink(logger_t* pLogger, log_sink_t* pSink)
+{
+	if (pSink->m_bWriting || !pSink->m_Queue.m_uUsed) {
+		return;
+	}
+	if (!pSink->m_hWrite) {
+		if (static_cast<int32_t>(GetTickCount() - pSink->m_uRetry) < 0) {
+			return;
+		}
+		if (connect_sink(pLogger, pSink)) {
+			return;
+		}
+	}
+
+	uint32_t uLength = 0;
+	while (pSink->m_Queue.m_uUsed) {
+		uLength = next_sink_message(pSink);
+		if (uLength) {
+			break;
+		}
+		/* Don't send empty syslog messages. */
+		log_buffer_consume(&pSink->m_Queue, pSink->m_uSending);
+		pSink->m_uSending = 0;
+	}
+	if (!uLength) {
+		return;
+	}
+
+	ZeroMemory(&pSink->m_Overlapped, sizeof(pSink->m_Overlapped));
+	if (pSink->m_uKind == NSSM_LOG_SINK_SYSLOG) {
+		WSABUF buffer;
+		buffer.len = uLength;
+		buffer.buf = reinterpret_cast<char*>(pSink->m_pSend);
+		if (WSASend(reinterpret_cast<SOCKET>(pSink->m_hWrite), &buffer, 1,
+				NULL, 0, &pSink->m_Overlapped, NULL) &&
+			(WSAGetLastError() != WSA_IO_PENDING)) {
+			sink_failed(pLogger, pSink, L"WSASend()", WSAGetLastError());
+			return;
+		}
+	} else if (!WriteFile(pSink->m_hWrite, pSink->m_pSend, uLength, NULL,
+				   &pSink->m_Overlapped) &&
+		(GetLastError() != ERROR_IO_PENDING)) {
+		sink_failed(pLogger, pSink, L"WriteFile()", GetLastError());
+		return;
+	}
+	/* The completion is queued even if the write finished already. */
+	pSink->m_bWriting = true;
+}
+
+/***************************************
+
+	Act on a write to a sink finishing
+
+	What was sent is taken off the queue.  If the write failed it stays
+	there to be sent again once the sink has been reconnected.
+
+***************************************/
+
+static void sink_written(
+	logger_t* pLogger, log_sink_t* pSink, unsigned long error)
+{
+	pSink->m_bWriting = false;
+	if (error) {
+		sink_failed(pLogger, pSink,
+			(pSink->m_uKind == NSSM_LOG_SINK_SYSLOG) ? L"WSASend()" :
+													   L"WriteFile()",
+			error);
+		return;
+	}
+
+	log_buffer_consume(&pSink->m_Queue, pSink->m_uSending);
+	pSink->m_uSending = 0;
+	if (pSink->m_bComplained) {
+		pSink->m_bComplained = false;
+		wchar_t lost[32];
+		StringCchPrintfW(lost, RTL_NUMBER_OF(lost), L"%llu",
+			static_cast<unsigned long long>(pSink->m_uLost));
+		log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_LOG_SINK_RESUMED,
+			pLogger->m_pServiceName, pSink->m_pTarget, lost, NULL);
+		pSink->m_uLost = 0;
+	}
+}
+
+/*
+  Queue UTF-8 output for every sink, counting it as lost where it won't fit,
+  and keep it for nssm tail.
+*/
+static void queue_for_sinks(
+	logger_t* pLogger, const void* pData, uint32_t uLength)
+{
+	if (pLogger->m_pTail) {
+		tail_put(pLogger->m_pTail, pData, uLength);
+	}
+	for (uint32_t i = 0; i < NSSM_LOG_SINKS; i++) {
+		if (pLogger->m_Sinks[i].m_pSend) {
+			queue_for_sink(&pLogger->m_Sinks[i], pData, uLength);
+		}
+	}
+}
+
+/***************************************
+
+	Hand output written to the log file to the sinks and the tail
+
+	Called for everything written to the log file except the byte order
+	mark, whether the write worked or not.
+
+***************************************/
+
+static void sink_output(logger_t* pLogger, const void* pData, uint32_t uLength)
+{
+	if (!pLogger->m_bSinks && !pLogger->m_pTail) {
+		return;
+	}
+
+	if (pLogger->m_uCharsize != 2) {
+		queue_for_sinks(pLogger, pData, uLength);
+	} else {
+		char buffer[NSSM_TRANSCODE_CHUNK * NSSM_UTF8_CHAR_MAX];
+		const wchar_t* pInput = static_cast<const wchar_t*>(pData);
+		uint32_t uCount = uLength / sizeof(wchar_t);
+		while (uCount) {
+			uint32_t uConsumed;
+			uint32_t uOutput = utf16_to_utf8(pInput, uCount, buffer,
+				sizeof(buffer), &pLogger->m_uSinkSurrogate, &uConsumed);
+			queue_for_sinks(pLogger, buffer, uOutput);
+			pInput += uConsumed;
+			uCount -= uConsumed;
+		}
+	}
+
+	if (!pLogger->m_bSinks) {
+		return;
+	}
+	for (uint32_t i = 0; i < NSSM_LOG_SINKS; i++) {
+		if (pLogger->m_Sinks[i].m_pSend) {
+			pump_sink(pLogger, &pLogger->m_Sinks[i]);
+		}
+	}
+}
+
+/*
+  Remove a logger from the list of loggers with waiting sinks.
+  Only called from the I/O thread.
+*/
+static void unlink_waiting(logger_t* pLogger)
+{
+	if (!pLogger->m_bWaiting) {
+		return;
+	}
+	logger_t** ppLink = &g_pWaitingLoggers;
+	while (*ppLink) {
+		if (*ppLink == pLogger) {
+			*ppLink = pLogger->m_pNextWaiting;
+			break;
+		}
+		ppLink = &(*ppLink)->m_pNextWaiting;
+	}
+	pLogger->m_pNextWaiting = NULL;
+	pLogger->m_bWaiting = false;
+}
+
+/***************************************
+
+	Keep the sinks going
+
+	A logger is kept on the list of loggers with waiting sinks while a
+	sink has output queued but isn't connected, so the I/O thread wakes
+	up to connect it again.
+
+	bFinishing is true once the application's pipes have closed.  The
+	sinks are given NSSM_LOG_SINK_LINGER milliseconds to send what is left,
+	after which it is dropped and writes still in flight are cancelled.
+
+	Returns true once no sink has anything left to do.
+
+***************************************/
+
+static bool pump_sinks(logger_t* pLogger, bool bFinishing)
+{
+	bool bIdle = true;
+	bool bWaiting = false;
+	uint32_t i;
+	for (i = 0; i < NSSM_LOG_SINKS; i++) {
+		log_sink_t* pSink = &pLogger->m_Sinks[i];
+		if (!pSink->m_pSend) {
+			continue;
+		}
+		pump_sink(pLogger, pSink);
+		if (pSink->m_bWriting) {
+			bIdle = false;
+		} else if (pSink->m_Queue.m_uUsed) {
+			bIdle = false;
+			bWaiting = true;
+		}
+	}
+
+	if (bFinishing && !bIdle) {
+		uint32_t uNow = GetTickCount();
+		if (!pLogger->m_bLingering) {
+			pLogger->m_bLingering = true;
+			pLogger->m_uLingerStarted = uNow;
+		} else if ((uNow - pLogger->m_uLingerStarted) >= NSSM_LOG_SINK_LINGER) {
+			bIdle = true;
+			for (i = 0; i < NSSM_LOG_SINKS; i++) {
+				log_sink_t* pSink = &pLogger->m_Sinks[i];
+				pSink->m_uDropped += pSink->m_Queue.m_uUsed;
+				log_buffer_consume(&pSink->m_Queue, pSink->m_Queue.m_uUsed);
+				pSink->m_uSending = 0;
+				if (pSink->m_bWriting) {
+					CancelIo(pSink->m_hWrite);
+					bIdle = false;
+				}
+			}
+		}
+		/* Wake up when it is time to give up. */
+		bWaiting = !bIdle;
+	}
+
+	if (bWaiting && !pLogger->m_bWaiting) {
+		pLogger->m_bWaiting = true;
+		pLogger->m_pNextWaiting = g_pWaitingLoggers;
+		g_pWaitingLoggers = pLogger;
+	} else if (!bWaiting) {
+		unlink_waiting(pLogger);
+	}
+	return bIdle;
+}
+
+/***************************************
+
+	Set up the sinks configured for the service
+
+	The syslog header is built once: the user facility, at warning
+	priority for stderr and informational otherwise, and the service name
+	as the tag.  The server adds the time and host.
+
+	Returns 0 on success.
+
+***************************************/
+
+static int init_sinks(logger_t* pLogger, nssm_service_t* pNSSMService)
+{
+	const wchar_t* Targets[NSSM_LOG_SINKS] = {
+		pNSSMService->m_LogSyslog, pNSSMService->m_LogPipe};
+	uint32_t uQueue = pNSSMService->m_uLogSinkQueue;
+	uint32_t uMin = NSSM_LOG_SINK_QUEUE_MIN;
+	if (uMin > uQueue) {
+		uMin = uQueue;
+	}
+
+	for (uint32_t i = 0; i < NSSM_LOG_SINKS; i++) {
+		if (!Targets[i][0]) {
+			continue;
+		}
+		log_sink_t* pSink = &pLogger->m_Sinks[i];
+		pSink->m_uKind = i;
+		pSink->m_pTarget = Targets[i];
+		pSink->m_pSend = static_cast<uint8_t*>(heap_alloc(NSSM_LOG_SINK_SEND));
+		if (!pSink->m_pSend || log_buffer_init(&pSink->m_Queue, uMin, uQueue)) {
+			return 1;
+		}
+		pLogger->m_bSinks = true;
+	}
+
+	log_sink_t* pSyslog = &pLogger->m_Sinks[NSSM_LOG_SINK_SYSLOG];
+	if (pSyslog->m_pSend) {
+		uint32_t uPriority = NSSM_SYSLOG_INFO;
+		if ((pLogger->m_uSources == 1) &&
+			!strcmp(pLogger->m_Sources[0].m_pStream, "stderr")) {
+			uPriority = NSSM_SYSLOG_WARNING;
+		}
+		syslog_header(pSyslog, uPriority, pNSSMService->m_Name,
+			static_cast<uint32_t>(wcslen(pNSSMService->m_Name)));
+	}
+	return 0;
+}
+
+/* Close and free the sinks, logging how much output they lost. */
+static void free_sinks(logger_t* pLogger)
+{
+	for (uint32_t i = 0; i < NSSM_LOG_SINKS; i++) {
+		log_sink_t* pSink = &pLogger->m_Sinks[i];
+		if (pSink->m_uDropped) {
+			wchar_t dropped[32];
+			StringCchPrintfW(dropped, RTL_NUMBER_OF(dropped), L"%llu",
+				static_cast<unsigned long long>(pSink->m_uDropped));
+			log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_LOG_SINK_DROPPED,
+				pLogger->m_pServiceName, pSink->m_pTarget, dropped, NULL);
+		}
+		close_sink(pSink);
+		log_buffer_free(&pSink->m_Queue);
+		heap_free(pSink->m_pSend);
+		pSink->m_pSend = NULL;
+	}
+}
+
+/***************************************
+
+	Memory mapped writer
+
+	With AppLogMapWindow set, output is copied straight into a window of
+	the log file mapped into memory, instead of costing a call to
+	WriteFile() each time.  Mapping a window extends the file to the end of
+	the window, so the file is cut back to what was written when the
+	mapping is given up, before a rotation and when logging ends.  The
+	bytes written are the same either way once the file is closed.  If a
+	window can't be mapped the logger goes back to WriteFile() for good.
+
+	Until then the file runs on to the end of the window with zeros, which
+	readers see, and which are left behind if NSSM is killed.  Writing the
+	real length anywhere else would cost the system call per write that
+	the mapping saves, so the output is taken to end where the zeros at
+	the end of the file start.  nssm logs stops there, and the zeros are
+	cut off before a file left like that is mapped again.
+
+***************************************/
+
+/***************************************
+
+	Find the end of the output in a log file
+
+	Returns uSize less any zeros at the end of the file, rounded up to a
+	whole character so the last character of a UTF-16 file isn't cut in
+	half.  Output which really ends with NUL characters loses them.
+	hFile must have read access and its file pointer is moved.
+
+***************************************/
+
+uint64_t log_output_end(HANDLE hFile, uint64_t uSize)
+{
+	uint8_t buffer[4096];
+	uint32_t uCharsize = 1;
+	wchar_t bom = 0;
+	DWORD uRead = 0;
+	LARGE_INTEGER offset;
+	offset.QuadPart = 0;
+	if (SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN) &&
+		ReadFile(hFile, &bom, sizeof(bom), &uRead, NULL) &&
+		(uRead == sizeof(bom)) && (bom == L'\ufeff')) {
+		uCharsize = sizeof(wchar_t);
+	}
+
+	uint64_t uEnd = uSize;
+	while (uEnd) {
+		uint32_t uWant = sizeof(buffer);
+		if (uEnd < uWant) {
+			uWant = static_cast<uint32_t>(uEnd);
+		}
+		offset.QuadPart = static_cast<LONGLONG>(uEnd - uWant);
+		if (!SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN) ||
+			!ReadFile(hFile, buffer, uWant, &uRead, NULL) ||
+			(uRead != uWant)) {
+			return uSize;
+		}
+		uint32_t i = uWant;
+		while (i && !buffer[i - 1]) {
+			i--;
+		}
+		uEnd -= uWant - i;
+		if (i) {
+			break;
+		}
+	}
+
+	uEnd += (uCharsize - uEnd % uCharsize) % uCharsize;
+	return (uEnd < uSize) ? uEnd : uSize;
+}
+
+static void map_failed(
+	logger_t* pLogger, const wchar_t* pFunction, unsigned long error)
+{
+	if (!(pLogger->m_iComplained & COMPLAINED_MAP)) {
+		log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_LOG_MAP_FAILED,
+			pLogger->m_pServiceName, pLogger->m_pPath, pFunction,
+			error_string(error), NULL);
+	}
+	pLogger->m_iComplained |= COMPLAINED_MAP;
+	pLogger->m_Map.m_uWindow = 0;
+}
+
+/*
+  Give up the mapping and cut the file back to what was written.
+  The logger's own handle is left at the end of the file for WriteFile().
+*/
+static void stop_map(logger_t* pLogger)
+{
+	log_map_t* pMap = &pLogger->m_Map;
+	if (!pMap->m_hFile) {
+		return;
+	}
+
+	LARGE_INTEGER end;
+	end.QuadPart = static_cast<LONGLONG>(pMap->m_uOffset + pMap->m_uUsed);
+	unmap_window(pMap);
+	if (SetFilePointerEx(pMap->m_hFile, end, NULL, FILE_BEGIN)) {
+		SetEndOfFile(pMap->m_hFile);
+	}
+	close_handle(&pMap->m_hFile);
+
+	if (pLogger->m_hWrite) {
+		LARGE_INTEGER zero;
+		zero.QuadPart = 0;
+		SetFilePointerEx(pLogger->m_hWrite, zero, NULL, FILE_END);
+	}
+}
+
+/*
+  Map the window holding the end of the log file, if the logger writes
+  through a mapping.  The logger's handle only has write access, so the
+  file is opened again for the mapping.  Padding left by a window which
+  was never unmapped is cut off first.
+*/
+static void start_map(logger_t* pLogger)
+{
+	log_map_t* pMap = &pLogger->m_Map;
+	if (!pMap->m_uWindow || !pLogger->m_hWrite) {
+		return;
+	}
+
+	pMap->m_hFile = ReOpenFile(pLogger->m_hWrite,
+		FILE_READ_DATA | FILE_WRITE_DATA, pLogger->m_uSharing, 0);
+	if (pMap->m_hFile == INVALID_HANDLE_VALUE) {
+		pMap->m_hFile = NULL;
+		map_failed(pLogger, L"ReOpenFile()", GetLastError());
+		return;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(pMap->m_hFile, &size)) {
+		map_failed(pLogger, L"GetFileSizeEx()", GetLastError());
+		close_handle(&pMap->m_hFile);
+		return;
+	}
+	uint64_t uEnd = log_output_end(
+		pMap->m_hFile, static_cast<uint64_t>(size.QuadPart));
+	if (uEnd < static_cast<uint64_t>(size.QuadPart)) {
+		size.QuadPart = static_cast<LONGLONG>(uEnd);
+		if (SetFilePointerEx(pMap->m_hFile, size, NULL, FILE_BEGIN)) {
+			SetEndOfFile(pMap->m_hFile);
+		}
+		pLogger->m_uFileSize = uEnd;
+	}
+	uint64_t uStart = uEnd - uEnd % pMap->m_uWindow;
+	const wchar_t* pFunction;
+	unsigned long error = map_window(pMap, uStart, &pFunction);
+	if (error) {
+		map_failed(pLogger, pFunction, error);
+		close_handle(&pMap->m_hFile);
+		return;
+	}
+	pMap->m_uUsed = static_cast<uint32_t>(uEnd - uStart);
+}
+
+/*
+  Copy output into the mapped window.  Returns the number of bytes
+  copied, which is less than uLength if the mapping had to be given up.
+*/
+static uint32_t map_write(
+	logger_t* pLogger, const void* pData, uint32_t uLength)
+{
+	uint32_t uCopied;
+	const wchar_t* pFunction;
+	unsigned long error =
+		map_copy(&pLogger->m_Map, pData, uLength, &uCopied, &pFunction);
+	if (error) {
+		map_failed(pLogger, pFunction, error);
+		stop_map(pLogger);
+	}
+	return uCopied;
+}
+
+/***************************************
+
+	Overlapped writer
+
+	With AppLogWriteBuffers set, output is copied into one of that many
+	buffers and written with overlapped I/O through a second handle to the
+	log file, so the I/O thread goes back to reading while the write is
+	committed.  Each write is made at its own offset and its completion
+	comes back to the I/O thread through the completion port.  If every
+	buffer is in flight the next write is made in line, through the
+	logger's own handle, exactly as if overlapped writes weren't used.
+	Rotation waits for the writes in flight.  If an overlapped write fails
+	it is made again in line and the logger goes back to synchronous
+	writes for good.
+
+	A write which fails for lack of disk space is spilled instead, if
+	AppLogSpillMax allows.  New output is spilled until the writes in
+	flight have finished.  Then the logger's handle is put back to where
+	the failed write went, and that write and every one after it are
+	spilled in order, ahead of the new output.  A finished write is kept
+	while any write before it is in flight so that it can be.  Output
+	written in line in between needs more space than the failed write, so
+	it has been spilled already.
+
+***************************************/
+
+static inline void seek_log_file(logger_t* pLogger, uint64_t uOffset)
+{
+	LARGE_INTEGER position;
+	position.QuadPart = static_cast<LONGLONG>(uOffset);
+	SetFilePointerEx(pLogger->m_hWrite, position, NULL, FILE_BEGIN);
+}
+
+/* Returns the offset in the log file a write goes at. */
+static inline uint64_t write_offset(const log_write_t* pWrite)
+{
+	ULARGE_INTEGER offset;
+	offset.LowPart = pWrite->m_Overlapped.Offset;
+	offset.HighPart = pWrite->m_Overlapped.OffsetHigh;
+	return offset.QuadPart;
+}
+
+/* Leave the logger's handle at the end of the output and stop for good. */
+static void async_failed(
+	logger_t* pLogger, const wchar_t* pFunction, unsigned long error)
+{
+	log_async_t* pAsync = &pLogger->m_Async;
+	if (!(pLogger->m_iComplained & COMPLAINED_ASYNC)) {
+		log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_LOG_ASYNC_FAILED,
+			pLogger->m_pServiceName, pLogger->m_pPath, pFunction,
+			error_string(error), NULL);
+	}
+	pLogger->m_iComplained |= COMPLAINED_ASYNC;
+	if (!pAsync->m_bInLine) {
+		seek_log_file(pLogger, pAsync->m_uOffset);
+		pAsync->m_bInLine = true;
+	}
+	pAsync->m_bFailed = true;
+}
+
+/*
+  Open the log file again for overlapped writes, if the logger uses them
+  and isn't writing through a mapping.
+*/
+static void start_async(logger_t* pLogger)
+{
+	log_async_t* pAsync = &pLogger->m_Async;
+	if (!pAsync->m_uBuffers || pAsync->m_bFailed || !pLogger->m_hWrite ||
+		pLogger->m_Map.m_hFile) {
+		return;
+	}
+
+	pAsync->m_hFile = ReOpenFile(pLogger->m_hWrite, FILE_WRITE_DATA,
+		pLogger->m_uSharing, FILE_FLAG_OVERLAPPED);
+	if (pAsync->m_hFile == INVALID_HANDLE_VALUE) {
+		pAsync->m_hFile = NULL;
+		async_failed(pLogger, L"ReOpenFile()", GetLastError());
+		return;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(pAsync->m_hFile, &size)) {
+		async_failed(pLogger, L"GetFileSizeEx()", GetLastError());
+		close_handle(&pAsync->m_hFile);
+		return;
+	}
+	if (!CreateIoCompletionPort(pAsync->m_hFile, g_hLogPort,
+			reinterpret_cast<ULONG_PTR>(pLogger), 0)) {
+		async_failed(pLogger, L"CreateIoCompletionPort()", GetLastError());
+		close_handle(&pAsync->m_hFile);
+		return;
+	}
+	pAsync->m_uOffset = static_cast<uint64_t>(size.QuadPart);
+	pAsync->m_bInLine = false;
+	/* Writes to the last file are nothing to do with this one. */
+	for (uint32_t i = 0; i < pAsync->m_uBuffers; i++) {
+		ZeroMemory(&pAsync->m_Writes[i].m_Overlapped,
+			sizeof(pAsync->m_Writes[i].m_Overlapped));
+		pAsync->m_Writes[i].m_uLength = 0;
+	}
+}
+
+/*
+  Close the overlapped handle once nothing is in flight, leaving the
+  logger's own handle at the end of the output.
+*/
+static void stop_async(logger_t* pLogger)
+{
+	log_async_t* pAsync = &pLogger->m_Async;
+	if (!pAsync->m_hFile) {
+		return;
+	}
+	if (!pAsync->m_bInLine) {
+		seek_log_file(pLogger, pAsync->m_uOffset);
+	}
+	close_handle(&pAsync->m_hFile);
+}
+
+/*
+  Start an overlapped write of a copy of the output.  Returns false if the
+  output must be written in line instead, in which case the logger's
+  handle has been left where it goes.
+*/
+static bool async_write(
+	logger_t* pLogger, const void* pData, uint32_t uLength)
+{
+	log_async_t* pAsync = &pLogger->m_Async;
+	if (pAsync->m_bInLine) {
+		LARGE_INTEGER zero;
+		LARGE_INTEGER position;
+		zero.QuadPart = 0;
+		if (!SetFilePointerEx(
+				pLogger->m_hWrite, zero, &position, FILE_CURRENT)) {
+			async_failed(pLogger, L"SetFilePointerEx()", GetLastError());
+			return false;
+		}
+		pAsync->m_uOffset = static_cast<uint64_t>(position.QuadPart);
+		pAsync->m_bInLine = false;
+	}
+
+	/* Finished writes after the oldest one in flight are kept. */
+	uint64_t uOldest = pAsync->m_uOffset;
+	uint32_t i;
+	for (i = 0; i < pAsync->m_uBuffers; i++) {
+		log_write_t* pBusy = &pAsync->m_Writes[i];
+		if (pBusy->m_bBusy && (write_offset(pBusy) < uOldest)) {
+			uOldest = write_offset(pBusy);
+		}
+	}
+	log_write_t* pWrite = NULL;
+	for (i = 0; i < pAsync->m_uBuffers; i++) {
+		log_write_t* pFree = &pAsync->m_Writes[i];
+		if (!pFree->m_bBusy &&
+			(write_offset(pFree) + pFree->m_uLength <= uOldest)) {
+			pWrite = pFree;
+			break;
+		}
+	}
+	if (pWrite && (pWrite->m_uSize < uLength)) {
+		heap_free(pWrite->m_pData);
+		pWrite->m_pData = static_cast<uint8_t*>(heap_alloc(uLength));
+		pWrite->m_uSize = pWrite->m_pData ? uLength : 0;
+		if (!pWrite->m_pData) {
+			pWrite = NULL;
+		}
+	}
+	if (!pWrite) {
+		seek_log_file(pLogger, pAsync->m_uOffset);
+		pAsync->m_bInLine = true;
+		return false;
+	}
+
+	memcpy(pWrite->m_pData, pData, uLength);
+	ULARGE_INTEGER offset;
+	offset.QuadPart = pAsync->m_uOffset;
+	ZeroMemory(&pWrite->m_Overlapped, sizeof(pWrite->m_Overlapped));
+	pWrite->m_Overlapped.Offset = offset.LowPart;
+	pWrite->m_Overlapped.OffsetHigh = offset.HighPart;
+	pWrite->m_uLength = uLength;
+	if (!WriteFile(pAsync->m_hFile, pWrite->m_pData, uLength, NULL,
+			&pWrite->m_Overlapped)) {
+		unsigned long error = GetLastError();
+		if (error != ERROR_IO_PENDING) {
+			async_failed(pLogger, L"WriteFile()", error);
+			return false;
+		}
+	}
+
+	/* The completion is queued even if the write finished already. */
+	pWrite->m_bBusy = true;
+	pAsync->m_uInFlight++;
+	pAsync->m_uOffset += uLength;
+	return true;
+}
+
+/*
+  Spill the writes from the first one which failed for lack of disk space
+  on, ahead of whatever was spilled while they were in flight, and put the
+  logger's handle back to where they go.
+*/
+static void spill_writes(logger_t* pLogger)
+{
+	log_async_t* pAsync = &pLogger->m_Async;
+	log_buffer_t spilled = pLogger->m_Spill;
+	ZeroMemory(&pLogger->m_Spill, sizeof(pLogger->m_Spill));
+
+	uint64_t uOffset = pAsync->m_uSpillOffset;
+	seek_log_file(pLogger, uOffset);
+	pAsync->m_bInLine = true;
+	for (;;) {
+		log_write_t* pWrite = NULL;
+		for (uint32_t i = 0; i < pAsync->m_uBuffers; i++) {
+			if (pAsync->m_Writes[i].m_uLength &&
+				(write_offset(&pAsync->m_Writes[i]) == uOffset)) {
+				pWrite = &pAsync->m_Writes[i];
+				break;
+			}
+		}
+		if (!pWrite) {
+			break;
+		}
+		spill_output(pLogger, pWrite->m_pData, pWrite->m_uLength,
+			pAsync->m_uSpillError);
+		/* It will be counted again when it is written. */
+		pLogger->m_uFileSize -= pWrite->m_uLength;
+		uOffset += pWrite->m_uLength;
+		pWrite->m_uLength = 0;
+	}
+
+	/* Already counted as spilled. */
+	while (spilled.m_uUsed) {
+		void* address;
+		uint32_t uSpan = log_buffer_used_span(&spilled, &address);
+		if (log_buffer_put(&pLogger->m_Spill, address, uSpan)) {
+			pLogger->m_uSpilled -= uSpan;
+			pLogger->m_uSpillDropped += uSpan;
+		}
+		log_buffer_consume(&spilled, uSpan);
+	}
+	log_buffer_free(&spilled);
+	pAsync->m_bDiskFull = false;
+}
+
+/*
+  Handle the completion of an overlapped write.  A failed write is made
+  again through the logger's own handle, which is put back afterwards,
+  unless it failed for lack of disk space and can be spilled.
+  Output only counts towards the next flush once it has reached the file.
+*/
+static void async_written(logger_t* pLogger, log_write_t* pWrite,
+	unsigned long error, uint32_t uBytes)
+{
+	log_async_t* pAsync = &pLogger->m_Async;
+	uint64_t uOffset = write_offset(pWrite);
+	pWrite->m_bBusy = false;
+	pAsync->m_uInFlight--;
+
+	bool bWritten = !error && (uBytes == pWrite->m_uLength);
+	if (!bWritten && disk_full(error) && pLogger->m_uSpillMax) {
+		if (!pAsync->m_bDiskFull) {
+			async_failed(pLogger, L"WriteFile()", error);
+			pAsync->m_bDiskFull = true;
+			pAsync->m_uSpillOffset = uOffset;
+			pAsync->m_uSpillError = error;
+		} else if (uOffset < pAsync->m_uSpillOffset) {
+			pAsync->m_uSpillOffset = uOffset;
+		}
+	} else if (pAsync->m_bDiskFull && (uOffset >= pAsync->m_uSpillOffset)) {
+		/* Written or not, it is spilled after the write which failed. */
+	} else if (bWritten) {
+		pLogger->m_uFlushDirty += uBytes;
+	} else {
+		if (!error) {
+			error = ERROR_WRITE_FAULT;
+		}
+		async_failed(pLogger, L"WriteFile()", error);
+
+		LARGE_INTEGER zero;
+		LARGE_INTEGER position;
+		zero.QuadPart = 0;
+		bool bSaved = SetFilePointerEx(
+			pLogger->m_hWrite, zero, &position, FILE_CURRENT) != 0;
+		OVERLAPPED overlapped;
+		ZeroMemory(&overlapped, sizeof(overlapped));
+		overlapped.Offset = pWrite->m_Overlapped.Offset;
+		overlapped.OffsetHigh = pWrite->m_Overlapped.OffsetHigh;
+		DWORD out = 0;
+		if (!WriteFile(pLogger->m_hWrite, pWrite->m_pData, pWrite->m_uLength,
+				&out, &overlapped)) {
+			if (!(pLogger->m_iComplained & COMPLAINED_WRITE)) {
+				log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_WRITEFILE_FAILED,
+					pLogger->m_pServiceName, pLogger->m_pPath,
+					error_string(GetLastError()), NULL);
+			}
+			pLogger->m_iComplained |= COMPLAINED_WRITE;
+		}
+		pLogger->m_uFlushDirty += out;
+		if (bSaved) {
+			SetFilePointerEx(pLogger->m_hWrite, position, NULL, FILE_BEGIN);
+		}
+	}
+
+	if (!pAsync->m_uInFlight && pAsync->m_bDiskFull) {
+		spill_writes(pLogger);
+	}
+	if (!pAsync->m_uInFlight && pAsync->m_bFailed) {
+		stop_async(pLogger);
+	}
+}
+
+/*
+  Returns the overlapped write a completion is for, or NULL if it isn't
+  for one.
+*/
+static log_write_t* find_write(logger_t* pLogger, OVERLAPPED* pOverlapped)
+{
+	log_async_t* pAsync = &pLogger->m_Async;
+	for (uint32_t i = 0; i < pAsync->m_uBuffers; i++) {
+		if (pOverlapped == &pAsync->m_Writes[i].m_Overlapped) {
+			return &pAsync->m_Writes[i];
+		}
+	}
+	return NULL;
+}
+
+/***************************************
+
+	Write to the log file
+
+	If the disk is full the output is spilled to memory and reported as
+	dealt with, to be written later in order.  Output which arrives while
+	there is spilled output goes behind it.  pWritten is set to the number
+	of bytes written, counting any spilled output written first.
+
+	Otherwise tries multiple times to write to the file.
+	Returns:  0 on success.
+			  1 on non-fatal error.
+			 -1 on fatal error.
+
+***************************************/
+
+static int try_write(logger_t* pLogger, void* pBuffer, uint32_t uBufferSize,
+	uint32_t* pWritten, int* pComplained)
+{
+	int ret = 1;
+	unsigned long error;
+	/* Spilled or mapped output written before calling WriteFile(). */
+	uint32_t uBefore = 0;
+
+	*pWritten = 0;
+	sink_output(pLogger, pBuffer, uBufferSize);
+	/* Overlapped writes which failed for lack of space go first. */
+	if (pLogger->m_Async.m_bDiskFull) {
+		spill_output(pLogger, pBuffer, uBufferSize,
+			pLogger->m_Async.m_uSpillError);
+		return 0;
+	}
+	if (pLogger->m_bSpilling) {
+		if (replay_spill(pLogger, &uBefore)) {
+			spill_output(pLogger, pBuffer, uBufferSize, ERROR_DISK_FULL);
+			*pWritten = uBefore;
+			pLogger->m_uFlushDirty += uBefore;
+			return 0;
+		}
+		unlink_spilling(pLogger);
+	}
+
+	log_map_t* pMap = &pLogger->m_Map;
+	log_async_t* pAsync = &pLogger->m_Async;
+	if (pMap->m_hFile) {
+		if (pLogger->m_pTimeIndex) {
+			time_index_write(pLogger->m_pTimeIndex, NULL,
+				pMap->m_uOffset + pMap->m_uUsed, uBufferSize);
+		}
+		uint32_t uMapped = map_write(pLogger, pBuffer, uBufferSize);
+		uBefore += uMapped;
+		if (uMapped == uBufferSize) {
+			*pWritten = uBefore;
+			pLogger->m_uFlushDirty += uBefore;
+			return 0;
+		}
+		/* The rest goes through WriteFile() after all. */
+		pBuffer = static_cast<uint8_t*>(pBuffer) + uMapped;
+		uBufferSize -= uMapped;
+	} else if (pAsync->m_hFile && !pAsync->m_bFailed &&
+		async_write(pLogger, pBuffer, uBufferSize)) {
+		if (pLogger->m_pTimeIndex) {
+			time_index_write(pLogger->m_pTimeIndex, NULL,
+				pAsync->m_uOffset - uBufferSize, uBufferSize);
+		}
+		/* The write counts towards the next flush once it finishes. */
+		*pWritten = uBefore + uBufferSize;
+		pLogger->m_uFlushDirty += uBefore;
+		return 0;
+	} else if (pLogger->m_pTimeIndex) {
+		time_index_write(
+			pLogger->m_pTimeIndex, pLogger->m_hWrite, 0, uBufferSize);
+	}
+
+	for (int tries = 0; tries < 5; tries++) {
+		DWORD out = 0;
+		if (WriteFile(pLogger->m_hWrite, pBuffer, uBufferSize, &out, NULL)) {
+			*pWritten = uBefore + out;
+			pLogger->m_uFlushDirty += *pWritten;
+			return 0;
+		}
+
+		error = GetLastError();
+		if (error == ERROR_IO_PENDING) {
+			/* Operation was successful pending flush to disk. */
+			*pWritten = uBefore + out;
+			pLogger->m_uFlushDirty += *pWritten;
+			return 0;
+		}
+
+		/* Never make the application wait for disk space. */
+		if (disk_full(error) && pLogger->m_uSpillMax) {
+			*pWritten = uBefore + out;
+			pLogger->m_uFlushDirty += *pWritten;
+			spill_output(pLogger, static_cast<uint8_t*>(pBuffer) + out,
+				uBufferSize - out, error);
+			return 0;
+		}
+
+		switch (error) {
+		/* Other end closed the pipe. */
+		case ERROR_BROKEN_PIPE:
+			ret = -1;
+			goto complain_write;
+
+		/*
+		  Out of disk space or quota with spilling turned off.  Waiting
+		  for space would hold up every log on the I/O thread, and trying
+		  again straight away won't find any, so the output is lost.
+		*/
+		case ERROR_NOT_ENOUGH_QUOTA:
+		case ERROR_DISK_FULL:
+			ret = 1;
+			goto complain_write;
+
+		default:
+			/* We'll lose this line but try to read and write subsequent ones.
+			 */
+			ret = 1;
+		}
+	}
+
+complain_write:
+	*pWritten = uBefore;
+	pLogger->m_uFlushDirty += uBefore;
+	if (!(*pComplained & COMPLAINED_WRITE))
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_WRITEFILE_FAILED,
+			pLogger->m_pServiceName, pLogger->m_pPath, error_string(error),
+			NULL);
+	*pComplained |= COMPLAINED_WRITE;
+	return ret;
+}
+
+/***************************************
+
+	Batch calls for a logger, see logbatch.cpp
+
+***************************************/
+
+static int write_batch(void* pParam, void* pData, uint32_t uLength,
+	uint32_t* pWritten, int* pComplained)
+{
+	return try_write(static_cast<logger_t*>(pParam), pData, uLength,
+		pWritten, pComplained);
+}
+
+static inline int flush_batch(
+	logger_t* pLogger, uint32_t* pWritten, int* pComplained)
+{
+	return flush_batch(&pLogger->m_Batch, pWritten, pComplained);
+}
+
+static inline int batch_append(logger_t* pLogger, const void* pData,
+	uint32_t uLength, uint32_t* pWritten, int* pComplained)
+{
+	return batch_append(
+		&pLogger->m_Batch, pData, uLength, pWritten, pComplained);
+}
+
+static inline int batch_copy(logger_t* pLogger, const void* pData,
+	uint32_t uLength, uint32_t* pWritten, int* pComplained)
+{
+	return batch_copy(&pLogger->m_Batch, pData, uLength, pWritten,
+		pComplained);
+}
+
+/***************************************
+
+	Line prefixes and JSON records for a logger, see logline.cpp
+
+***************************************/
+
+/* Add the timestamp prefix as of now in the given character size. */
+static inline int batch_timestamp(
+	logger_t* pLogger, uint32_t uCharsize, uint32_t* pWritten, int* pComplained)
+{
+	SYSTEMTIME now;
+	GetSystemTime(&now);
+	update_timestamp(&pLogger->m_Timestamp, &now);
+	return batch_timestamp(&pLogger->m_Batch, &pLogger->m_Timestamp,
+		uCharsize, pWritten, pComplained);
+}
+
+/*
+  Add the start of a JSON record as of now.  Merged pipes also get "seq"
+  if AppMergeSequence is set.
+*/
+static int batch_json_open(logger_t* pLogger, log_source_t* pSource,
+	uint32_t* pWritten, int* pComplained)
+{
+	SYSTEMTIME now;
+	GetSystemTime(&now);
+	update_timestamp(&pLogger->m_Timestamp, &now);
+
+	const uint64_t* pSequence = NULL;
+	if (pLogger->m_uSources > 1) {
+		pLogger->m_uSequence++;
+		if (pLogger->m_bMergeSequence) {
+			pSequence = &pLogger->m_uSequence;
+		}
+	}
+	return batch_json_open(&pLogger->m_Batch, &pLogger->m_Timestamp,
+		pSource->m_pStream, pLogger->m_pJsonService,
+		pLogger->m_uJsonServiceLength, *pLogger->m_pPID, pSequence, pWritten,
+		pComplained);
+}
+
+static inline int batch_json_text(logger_t* pLogger, log_source_t* pSource,
+	const uint8_t* pInput, uint32_t uLength, uint32_t uCharsize,
+	uint32_t* pWritten, int* pComplained)
+{
+	return batch_json_text(&pLogger->m_Batch, pInput, uLength, uCharsize,
+		&pSource->m_uSurrogate, pWritten, pComplained);
+}
+
+static inline int batch_json_close(logger_t* pLogger, log_source_t* pSource,
+	uint32_t* pWritten, int* pComplained)
+{
+	return batch_json_close(
+		&pLogger->m_Batch, &pSource->m_uSurrogate, pWritten, pComplained);
+}
+
+/***************************************
+
+	Add the prefix for a new line to the batch
+
+	That is the timestamp, if requested, followed for merged pipes by the
+	line's sequence number and the tag of the pipe it came from, if those
+	were requested.
+
+***************************************/
+
+static int batch_prefix(logger_t* pLogger, log_source_t* pSource,
+	uint32_t uCharsize, uint32_t* pWritten, int* pComplained)
+{
+	int ret = 0;
+	if (pLogger->m_bTimestampLog) {
+		ret = batch_timestamp(pLogger, uCharsize, pWritten, pComplained);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	if (pLogger->m_uSources < 2) {
+		return ret;
+	}
+
+	pLogger->m_uSequence++;
+	char sequence[24];
+	sequence[0] = 0;
+	if (pLogger->m_bMergeSequence) {
+		snprintf(sequence, sizeof(sequence), "%llu ",
+			static_cast<unsigned long long>(pLogger->m_uSequence));
+	}
+	char prefix[32];
+	snprintf(prefix, sizeof(prefix), "%s%s", sequence,
+		pLogger->m_bMergeTags ? pSource->m_pTag : "");
+	uint32_t uLength = static_cast<uint32_t>(strlen(prefix));
+	if (!uLength) {
+		return ret;
+	}
+
+	int copy;
+	if (uCharsize == sizeof(char)) {
+		copy = batch_copy(pLogger, prefix, uLength, pWritten, pComplained);
+	} else {
+		/* The prefix is plain ASCII. */
+		wchar_t wide[32];
+		for (uint32_t i = 0; i < uLength; i++) {
+			wide[i] = static_cast<wchar_t>(prefix[i]);
+		}
+		copy = batch_copy(pLogger, wide, uLength * sizeof(wchar_t), pWritten,
+			pComplained);
+	}
+	return copy ? copy : ret;
+}
+
+/***************************************
+
+	Add text to the batch in the log file's encoding
+
+	Used when the text read isn't in the log file's encoding, which is when
+	AppUtf8Log is set or the application changed encoding part way through.
+	The text is converted a chunk at a time.
+
+***************************************/
+
+static int batch_transcode(logger_t* pLogger, log_source_t* pSource,
+	const uint8_t* pInput, uint32_t uLength, uint32_t uCharsize,
+	uint32_t* pWritten, int* pComplained)
+{
+	int ret = 0;
+	uint8_t converted[NSSM_TRANSCODE_CHUNK];
+
+	do {
+		uint32_t uConsumed;
+		uint32_t uBytes;
+		if (uCharsize == sizeof(wchar_t)) {
+			uBytes = utf16_to_utf8(reinterpret_cast<const wchar_t*>(pInput),
+				uLength / sizeof(wchar_t), reinterpret_cast<char*>(converted),
+				sizeof(converted), &pSource->m_uSurrogate, &uConsumed);
+			uConsumed *= sizeof(wchar_t);
+		} else {
+			uBytes = utf8_to_utf16(pInput, uLength,
+						 reinterpret_cast<wchar_t*>(converted),
+						 sizeof(converted) / sizeof(wchar_t),
+						 &pSource->m_uPending, &uConsumed) *
+				sizeof(wchar_t);
+		}
+		pInput += uConsumed;
+		uLength -= uConsumed;
+		int copy =
+			batch_copy(pLogger, converted, uBytes, pWritten, pComplained);
+		if (copy) {
+			ret = copy;
+			if (ret < 0) {
+				return ret;
+			}
+		}
+	} while (uLength >= uCharsize);
+	return ret;
+}
+
+/***************************************
+
+	Add one line, or the start or rest of one, to the batch
+
+	bComplete is true if the data ends with a newline.  The line gets a
+	prefix if nothing of it has been added yet.  For JSON the newline is
+	replaced by the end of the record, along with any carriage return.
+
+***************************************/
+
+static int batch_line(logger_t* pLogger, log_source_t* pSource,
+	const uint8_t* pLine, uint32_t uLength, bool bComplete, uint32_t uCharsize,
+	uint32_t* pWritten, int* pComplained)
+{
+	int ret = 0;
+	int append;
+	bool bStarted = pSource->m_uLineLength != 0;
+	pSource->m_uLineLength = bComplete ? 0 : pSource->m_uLineLength + uLength;
+
+	if (!pLogger->m_bJsonLog) {
+		if (!bStarted) {
+			ret = batch_prefix(pLogger, pSource, pLogger->m_uCharsize,
+				pWritten, pComplained);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+		if (uCharsize != pLogger->m_uCharsize) {
+			append = batch_transcode(pLogger, pSource, pLine, uLength,
+				uCharsize, pWritten, pComplained);
+		} else {
+			append =
+				batch_append(pLogger, pLine, uLength, pWritten, pComplained);
+		}
+		return append ? append : ret;
+	}
+
+	if (!bStarted) {
+		ret = batch_json_open(pLogger, pSource, pWritten, pComplained);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	if (bComplete) {
+		/* Drop the newline and a carriage return before it. */
+		uLength -= uCharsize;
+		if ((uLength >= uCharsize) && (pLine[uLength - uCharsize] == '\r') &&
+			((uCharsize == sizeof(char)) || !pLine[uLength - 1])) {
+			uLength -= uCharsize;
+		}
+	}
+	append = batch_json_text(
+		pLogger, pSource, pLine, uLength, uCharsize, pWritten, pComplained);
+	if (append) {
+		ret = append;
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	if (bComplete) {
+		append = batch_json_close(pLogger, pSource, pWritten, pComplained);
+		if (append) {
+			ret = append;
+		}
+	}
+	return ret;
+}
+
+/***************************************
+
+	Add a line saying how much output was suppressed to the batch
+
+	The batch is written first, as the line is kept in the source until
+	the batch it is in has been written.  A line left unfinished, which
+	can only happen when the pipe closes, is ended first.
+
+***************************************/
+
+static int batch_suppressed(logger_t* pLogger, log_source_t* pSource,
+	uint32_t* pWritten, int* pComplained)
+{
+	int ret = flush_batch(pLogger, pWritten, pComplained);
+	if (ret < 0) {
+		return ret;
+	}
+
+	int line;
+	if (pSource->m_uLineLength) {
+		static const uint8_t g_Newline[] = "\n";
+		line = batch_line(pLogger, pSource, g_Newline, 1, true,
+			sizeof(char), pWritten, pComplained);
+		if (line) {
+			ret = line;
+			if (ret < 0) {
+				return ret;
+			}
+		}
+	}
+
+	snprintf(pSource->m_Suppressed, sizeof(pSource->m_Suppressed),
+		NSSM_LOG_SUPPRESSED_FORMAT,
+		static_cast<unsigned long long>(pSource->m_uSuppressedLines),
+		static_cast<unsigned long long>(pSource->m_uSuppressedBytes));
+	pSource->m_uSuppressedLines = 0;
+	pSource->m_uSuppressedBytes = 0;
+	line = batch_line(pLogger, pSource,
+		reinterpret_cast<const uint8_t*>(pSource->m_Suppressed),
+		static_cast<uint32_t>(strlen(pSource->m_Suppressed)), true,
+		sizeof(char), pWritten, pComplained);
+	return line ? line : ret;
+}
+
+/***************************************
+
+	Add a line saying how many times the last line repeated to the batch
+
+	Works like batch_suppressed(), for repeats collapsed by AppLogCollapse.
+
+***************************************/
+
+static int batch_repeated(logger_t* pLogger, log_source_t* pSource,
+	uint32_t* pWritten, int* pComplained)
+{
+	int ret = flush_batch(pLogger, pWritten, pComplained);
+	if (ret < 0) {
+		return ret;
+	}
+
+	int line;
+	if (pSource->m_uLineLength) {
+		static const uint8_t g_Newline[] = "\n";
+		line = batch_line(pLogger, pSource, g_Newline, 1, true,
+			sizeof(char), pWritten, pComplained);
+		if (line) {
+			ret = line;
+			if (ret < 0) {
+				return ret;
+			}
+		}
+	}
+
+	snprintf(pSource->m_Repeated, sizeof(pSource->m_Repeated),
+		NSSM_LOG_REPEATED_FORMAT,
+		static_cast<unsigned long long>(pSource->m_uRepeats));
+	pSource->m_uRepeats = 0;
+	line = batch_line(pLogger, pSource,
+		reinterpret_cast<const uint8_t*>(pSource->m_Repeated),
+		static_cast<uint32_t>(strlen(pSource->m_Repeated)), true,
+		sizeof(char), pWritten, pComplained);
+	return line ? line : ret;
+}
+
+/***************************************
+
+	Add a line to the batch if it is within the rate limit
+
+	The decision is made at the start of the line and the rest of it goes
+	the same way.  Suppressed lines are counted and a line saying how many
+	there were goes before the next line let through, or after
+	NSSM_LOG_RATE_REPORT milliseconds if output stays over the limit.
+
+***************************************/
+
+static int limit_line(logger_t* pLogger, log_source_t* pSource,
+	const uint8_t* pLine, uint32_t uLength, bool bComplete, uint32_t uCharsize,
+	uint32_t* pWritten, int* pComplained)
+{
+	if (!pLogger->m_bRateLimit) {
+		return batch_line(pLogger, pSource, pLine, uLength, bComplete,
+			uCharsize, pWritten, pComplained);
+	}
+
+	int ret = 0;
+	bool bStart = !pSource->m_uLineLength && !pSource->m_bSuppressing;
+	if (bStart) {
+		bool bAdmit = rate_admit(&pLogger->m_Rate);
+		if (pSource->m_uSuppressedLines &&
+			(bAdmit ||
+				((GetTickCount() - pSource->m_uSuppressStarted) >=
+					NSSM_LOG_RATE_REPORT))) {
+			ret = batch_suppressed(pLogger, pSource, pWritten, pComplained);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+		pSource->m_bSuppressing = !bAdmit;
+	}
+
+	if (pSource->m_bSuppressing) {
+		if (bStart) {
+			if (!pSource->m_uSuppressedLines) {
+				pSource->m_uSuppressStarted = GetTickCount();
+			}
+			pSource->m_uSuppressedLines++;
+			pLogger->m_uLinesSuppressed++;
+		}
+		pSource->m_uSuppressedBytes += uLength;
+		pLogger->m_uBytesSuppressed += uLength;
+		if (bComplete) {
+			pSource->m_bSuppressing = false;
+		}
+		return ret;
+	}
+
+	pLogger->m_Rate.m_iBytes -=
+		static_cast<int64_t>(uLength) * NSSM_RATE_TOKEN;
+	int line = batch_line(pLogger, pSource, pLine, uLength, bComplete,
+		uCharsize, pWritten, pComplained);
+	return line ? line : ret;
+}
+
+static inline uint64_t hash_bytes(
+	uint64_t uHash, const uint8_t* pInput, uint32_t uLength)
+{
+	for (uint32_t i = 0; i < uLength; i++) {
+		uHash ^= pInput[i];
+		uHash *= NSSM_LINE_HASH_PRIME;
+	}
+	return uHash;
+}
+
+/*
+  Returns the hash of a line, given as much of it as has been read, and
+  sets pLineLength to the number of bytes hashed.  A line which wrapped
+  around the end of the ring buffer is hashed in both parts.
+*/
+static uint64_t hash_line(log_source_t* pSource, const uint8_t* pLine,
+	uint32_t uLength, bool bComplete, uint32_t uCharsize,
+	uint64_t* pLineLength)
+{
+	uint64_t uHash = hash_bytes(NSSM_LINE_HASH_BASIS, pLine, uLength);
+	*pLineLength = uLength;
+	if (bComplete) {
+		return uHash;
+	}
+
+	log_buffer_t* pBuffer = &pSource->m_Buffer;
+	uint32_t uWrapped = pBuffer->m_uHead + pBuffer->m_uUsed;
+	if ((pLine + uLength == pBuffer->m_pData + pBuffer->m_uSize) &&
+		(uWrapped > pBuffer->m_uSize)) {
+		uWrapped -= pBuffer->m_uSize;
+		uint32_t uEnd = find_newline(pBuffer->m_pData, uWrapped, uCharsize);
+		if (!uEnd) {
+			uEnd = uWrapped;
+		}
+		uHash = hash_bytes(uHash, pBuffer->m_pData, uEnd);
+		*pLineLength += uEnd;
+	}
+	return uHash;
+}
+
+/***************************************
+
+	Add a line to the batch unless it repeats the last one
+
+	Each line's hash and length are compared with the last line let
+	through from the same pipe.  Repeats are counted instead of written,
+	and a line saying how many there were goes before the next different
+	line, or after AppLogCollapse milliseconds if no different line comes.
+	As with the filter, the decision is made at the start of the line on
+	as much of it as is in the buffer.  Lines let through go on to the rate
+	limit, so repeats don't use it up.
+
+***************************************/
+
+static int collapse_line(logger_t* pLogger, log_source_t* pSource,
+	const uint8_t* pLine, uint32_t uLength, bool bComplete, uint32_t uCharsize,
+	uint32_t* pWritten, int* pComplained)
+{
+	if (!pLogger->m_uCollapse) {
+		return limit_line(pLogger, pSource, pLine, uLength, bComplete,
+			uCharsize, pWritten, pComplained);
+	}
+
+	int ret = 0;
+	if (!pSource->m_bRepeating && !pSource->m_bRepeatPassed) {
+		uint64_t uLineLength;
+		uint64_t uHash = hash_line(
+			pSource, pLine, uLength, bComplete, uCharsize, &uLineLength);
+		if (pSource->m_bHasLast && (uHash == pSource->m_uLastHash) &&
+			(uLineLength == pSource->m_uLastLength)) {
+			if (!pSource->m_uRepeats) {
+				pSource->m_uRepeatStarted = GetTickCount();
+			}
+			pSource->m_uRepeats++;
+			pSource->m_bRepeating = true;
+			pLogger->m_uLinesCollapsed++;
+		} else {
+			if (pSource->m_uRepeats) {
+				ret = batch_repeated(
+					pLogger, pSource, pWritten, pComplained);
+				if (ret < 0) {
+					return ret;
+				}
+			}
+			pSource->m_uLastHash = uHash;
+			pSource->m_uLastLength = uLineLength;
+			pSource->m_bHasLast = true;
+			pSource->m_bRepeatPassed = true;
+		}
+	}
+
+	if (pSource->m_bRepeating) {
+		pLogger->m_uBytesCollapsed += uLength;
+		pSource->m_bRepeating = !bComplete;
+		return ret;
+	}
+	pSource->m_bRepeatPassed = !bComplete;
+
+	int line = limit_line(pLogger, pSource, pLine, uLength, bComplete,
+		uCharsize, pWritten, pComplained);
+	return line ? line : ret;
+}
+
+/*
+  Returns true if the filter keeps a line, given as much of it as has been
+  read.  A line which wrapped around the end of the ring buffer is looked
+  at in both parts.
+*/
+static bool filter_keeps_line(logger_t* pLogger, log_source_t* pSource,
+	const uint8_t* pLine, uint32_t uLength, bool bComplete, uint32_t uCharsize)
+{
+	const log_filter_t* pFilter =
+		pLogger->m_pFilters[(uCharsize == sizeof(wchar_t)) ? 1 : 0];
+	uint32_t uMatched = 0;
+	uint32_t uState = scan_filter(pFilter, 0, pLine, uLength, &uMatched);
+	if (bComplete || (uMatched & pFilter->m_uStop)) {
+		return filter_keeps(pFilter, uMatched);
+	}
+
+	log_buffer_t* pBuffer = &pSource->m_Buffer;
+	uint32_t uWrapped = pBuffer->m_uHead + pBuffer->m_uUsed;
+	if ((pLine + uLength == pBuffer->m_pData + pBuffer->m_uSize) &&
+		(uWrapped > pBuffer->m_uSize)) {
+		uWrapped -= pBuffer->m_uSize;
+		uint32_t uEnd = find_newline(pBuffer->m_pData, uWrapped, uCharsize);
+		scan_filter(pFilter, uState, pBuffer->m_pData,
+			uEnd ? uEnd : uWrapped, &uMatched);
+	}
+	return filter_keeps(pFilter, uMatched);
+}
+
+/***************************************
+
+	Add a line to the batch unless the filter drops it
+
+	The decision is made at the start of the line and the rest of it goes
+	the same way.  Only whole lines are written out of the ring buffer
+	while filtering, so the whole line is usually there to look at.  A line
+	too long for the buffer is judged on the part which fitted.  Lines let
+	through go on to be collapsed and rate limited, so dropped lines don't
+	break a run of repeats or use up the rate limit.
+
+***************************************/
+
+static int filter_line(logger_t* pLogger, log_source_t* pSource,
+	const uint8_t* pLine, uint32_t uLength, bool bComplete, uint32_t uCharsize,
+	uint32_t* pWritten, int* pComplained)
+{
+	if (pLogger->m_bFilter) {
+		if (!pSource->m_bFiltered && !pSource->m_bFilterPassed) {
+			if (filter_keeps_line(
+					pLogger, pSource, pLine, uLength, bComplete, uCharsize)) {
+				pSource->m_bFilterPassed = true;
+			} else {
+				pSource->m_bFiltered = true;
+				pLogger->m_uLinesFiltered++;
+			}
+		}
+		if (pSource->m_bFiltered) {
+			pLogger->m_uBytesFiltered += uLength;
+			pSource->m_bFiltered = !bComplete;
+			return 0;
+		}
+		pSource->m_bFilterPassed = !bComplete;
+	}
+
+	return collapse_line(pLogger, pSource, pLine, uLength, bComplete,
+		uCharsize, pWritten, pComplained);
+}
+
+/***************************************
+
+	Write data, prefixing each line if requested
+
+	Prefixes and lines for the whole buffer are gathered into batches so
+	a buffer full of short lines costs a handful of writes.  A line which
+	isn't finished by the end of the buffer is remembered in m_uLineLength
+	so the next buffer doesn't get another prefix.  In JSON mode each line
+	is written as a record instead.
+
+***************************************/
+
+static int write_with_timestamp(logger_t* pLogger, log_source_t* pSource,
+	void* pBuffer, uint32_t uBufferSize, uint32_t* pWritten,
+	int* pComplained, uint32_t uCharsize)
+{
+	if (!pLogger->m_bTimestampLog && !pLogger->m_bJsonLog &&
+		!pLogger->m_bMergeTags && !pLogger->m_bMergeSequence &&
+		!pLogger->m_bRateLimit && !pLogger->m_bFilter &&
+		!pLogger->m_uCollapse && (uCharsize == pLogger->m_uCharsize)) {
+		return try_write(pLogger, pBuffer, uBufferSize, pWritten, pComplained);
+	}
+
+	const uint8_t* pInput = static_cast<const uint8_t*>(pBuffer);
+	uint32_t ends[NSSM_NEWLINE_BATCH];
+	uint32_t offset = 0;
+	int ret;
+
+	/* Find the line endings a batch at a time. */
+	while (offset < uBufferSize) {
+		uint32_t uFound = scan_newlines(pInput + offset, uBufferSize - offset,
+			uCharsize, ends, NSSM_NEWLINE_BATCH);
+		uint32_t uBase = offset;
+		for (uint32_t i = 0; i < uFound; i++) {
+			uint32_t uEnd = uBase + ends[i];
+			ret = filter_line(pLogger, pSource, pInput + offset,
+				uEnd - offset, true, uCharsize, pWritten, pComplained);
+			offset = uEnd;
+			if (ret < 0) {
+				return ret;
+			}
+		}
+		if (uFound < NSSM_NEWLINE_BATCH) {
+			break;
+		}
+	}
+
+	/* Partial line, which will be finished by the next read. */
+	if (offset < uBufferSize) {
+		ret = filter_line(pLogger, pSource, pInput + offset,
+			uBufferSize - offset, false, uCharsize, pWritten, pComplained);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return flush_batch(pLogger, pWritten, pComplained);
+}
+
+/*
+  Returns true if a rotation handed to the workers has not been posted back
+  to the I/O thread yet.
+*/
+static inline bool rotation_pending(logger_t* pLogger)
+{
+	return pLogger->m_bRotating && !pLogger->m_Rotation.m_bFinished;
+}
+
+/***************************************
+
+	Copy a log file which is still open for writing
+
+	CopyFile() can't share the file with the handle writing to it, so the
+	copy is made by hand.  A partial copy is deleted.
+	Returns 0 on success or the error code, with pFunction set to the name
+	of the function which failed.
+
+***************************************/
+
+static unsigned long copy_log_file(
+	const wchar_t* pPath, const wchar_t* pDest, const wchar_t** ppFunction)
+{
+	*ppFunction = L"CreateFile()";
+	HANDLE hInput = CreateFileW(pPath, FILE_READ_DATA,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hInput == INVALID_HANDLE_VALUE) {
+		return GetLastError();
+	}
+	HANDLE hOutput = CreateFileW(
+		pDest, FILE_WRITE_DATA, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+	if (hOutput == INVALID_HANDLE_VALUE) {
+		unsigned long error = GetLastError();
+		CloseHandle(hInput);
+		return error;
+	}
+
+	unsigned long error = 0;
+	uint8_t* pBuffer = static_cast<uint8_t*>(heap_alloc(NSSM_LOG_COPY_SIZE));
+	if (!pBuffer) {
+		*ppFunction = L"HeapAlloc()";
+		error = ERROR_OUTOFMEMORY;
+	}
+	while (!error) {
+		unsigned long uRead;
+		if (!ReadFile(hInput, pBuffer, NSSM_LOG_COPY_SIZE, &uRead, 0)) {
+			*ppFunction = L"ReadFile()";
+			error = GetLastError();
+			break;
+		}
+		if (!uRead) {
+			break;
+		}
+		unsigned long uWritten;
+		if (!WriteFile(hOutput, pBuffer, uRead, &uWritten, 0)) {
+			*ppFunction = L"WriteFile()";
+			error = GetLastError();
+		}
+	}
+
+	heap_free(pBuffer);
+	CloseHandle(hInput);
+	CloseHandle(hOutput);
+	if (error) {
+		DeleteFileW(pDest);
+	}
+	return error;
+}
+
+/***************************************
+
+	Copy the old log file aside then truncate it
+
+	Run by a background worker, or by the I/O thread itself if no worker
+	could be started.  The I/O thread holds back writes until the worker
+	posts the logger back to it.  The file is truncated through the handle
+	the logger writes with, so the handle is never given up.
+
+***************************************/
+
+static void copy_and_truncate(void* pParam)
+{
+	logger_t* pLogger = static_cast<logger_t*>(pParam);
+	log_rotation_t* pRotation = &pLogger->m_Rotation;
+
+	FlushFileBuffers(pRotation->m_hFile);
+	pRotation->m_uError = copy_log_file(
+		pLogger->m_pPath, pRotation->m_Rotated, &pRotation->m_pFunction);
+	if (pRotation->m_uError) {
+		return;
+	}
+
+	Sleep(pLogger->m_uRotateDelay);
+	SetFilePointer(pRotation->m_hFile, 0, 0, FILE_BEGIN);
+	if (!SetEndOfFile(pRotation->m_hFile)) {
+		pRotation->m_pFunction = L"SetEndOfFile()";
+		pRotation->m_uError = GetLastError();
+		/* Don't keep the same output twice. */
+		DeleteFileW(pRotation->m_Rotated);
+		SetFilePointer(pRotation->m_hFile, 0, 0, FILE_END);
+	}
+}
+
+/* Run by a background worker, then hand the logger back to the I/O thread. */
+static void rotate_in_background(void* pParam)
+{
+	logger_t* pLogger = static_cast<logger_t*>(pParam);
+	copy_and_truncate(pLogger);
+
+	/* The logger may be freed as soon as this is posted. */
+	ULONG_PTR uKey = reinterpret_cast<ULONG_PTR>(pLogger);
+	OVERLAPPED* pOverlapped = &pLogger->m_Rotation.m_Overlapped;
+	while (!PostQueuedCompletionStatus(g_hLogPort, 0, uKey, pOverlapped)) {
+		Sleep(NSSM_LOG_ROTATE_POLL);
+	}
+}
+
+/***************************************
+
+	Rename the old log file and swap in a new one
+
+	The old file is shared for deletion so it can be renamed while still
+	open.  The new file is opened under the old name before the old handle
+	is closed, so there is always a handle to write to.  If the new file
+	can't be opened the old one is renamed back and written to as before.
+	Returns 0 on success or the error code.
+
+***************************************/
+
+static unsigned long rename_log_file(logger_t* pLogger)
+{
+	log_rotation_t* pRotation = &pLogger->m_Rotation;
+	pRotation->m_pFunction = L"MoveFile()";
+	bool bRenamed = MoveFileW(pLogger->m_pPath, pRotation->m_Rotated) != 0;
+	if (!bRenamed) {
+		unsigned long error = GetLastError();
+		/* Someone else moved the file away, so just start a new one. */
+		if (error != ERROR_FILE_NOT_FOUND) {
+			return error;
+		}
+	}
+
+	HANDLE hFile = CreateFileW(pLogger->m_pPath, FILE_WRITE_DATA,
+		pLogger->m_uSharing, 0, pLogger->m_uDisposition, pLogger->m_uFlags, 0);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		unsigned long error = GetLastError();
+		pRotation->m_pFunction = L"CreateFile()";
+		/*
+		  If this fails too the output carries on going to the renamed
+		  file and the next attempt starts a new one.
+		*/
+		if (bRenamed) {
+			MoveFileW(pRotation->m_Rotated, pLogger->m_pPath);
+		}
+		return error;
+	}
+	static LARGE_INTEGER offset = {0};
+	if (SetFilePointerEx(hFile, offset, 0, FILE_END)) {
+		SetEndOfFile(hFile);
+	}
+
+	pLogger->m_hWrite = hFile;
+	trim_log_file(pLogger, pRotation->m_hFile);
+
+	/* Output already in the old file is owed a flush under its policy. */
+	if (pLogger->m_uFlushPolicy && pLogger->m_uFlushDirty) {
+		flush_rotated(pLogger, pRotation->m_hFile);
+		pRotation->m_hFile = NULL;
+	} else {
+		close_handle(&pRotation->m_hFile);
+	}
+	return bRenamed ? 0 : ERROR_FILE_NOT_FOUND;
+}
+
+/***************************************
+
+	Report the outcome of a rotation
+
+	The logger gets its handle back if the rotation didn't replace it.  A
+	failed rotation is tried again later, waiting twice as long each time.
+
+***************************************/
+
+static void finish_rotation(logger_t* pLogger)
+{
+	log_rotation_t* pRotation = &pLogger->m_Rotation;
+	pLogger->m_bRotating = false;
+	pLogger->m_uRotations++;
+	pLogger->m_uRotateTime += GetTickCount() - pRotation->m_uStarted;
+	if (pRotation->m_hFile) {
+		pLogger->m_hWrite = pRotation->m_hFile;
+		pRotation->m_hFile = NULL;
+	}
+
+	unsigned long error = pRotation->m_uError;
+	if (!error) {
+		log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_ROTATED,
+			pLogger->m_pServiceName, pLogger->m_pPath, pRotation->m_Rotated,
+			NULL);
+		rotate_time_index(
+			pLogger->m_pTimeIndex, pLogger->m_pPath, pRotation->m_Rotated);
+		add_log_segment(pLogger->m_pIndex, pRotation->m_Rotated,
+			&pRotation->m_Time, pLogger->m_uFileSize);
+		queue_compression(pLogger->m_pIndex, pRotation->m_Rotated);
+		pLogger->m_uFileSize = 0LL;
+		pLogger->m_uRotateBackoff = 0;
+		preallocate_log_file(pLogger);
+	} else if (error == ERROR_FILE_NOT_FOUND) {
+		/* The old file went away, so there is nothing to keep. */
+		rotate_time_index(pLogger->m_pTimeIndex, pLogger->m_pPath, NULL);
+		pLogger->m_uFileSize = 0LL;
+		pLogger->m_uRotateBackoff = 0;
+		preallocate_log_file(pLogger);
+	} else {
+		if (!(pLogger->m_iComplained & COMPLAINED_ROTATE)) {
+			log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_ROTATE_FILE_FAILED,
+				pLogger->m_pServiceName, pLogger->m_pPath,
+				pRotation->m_pFunction, pRotation->m_Rotated,
+				error_string(error), NULL);
+		}
+		pLogger->m_iComplained |= COMPLAINED_ROTATE;
+		uint32_t uBackoff = pLogger->m_uRotateBackoff * 2;
+		if (uBackoff < NSSM_LOG_ROTATE_RETRY_MIN) {
+			uBackoff = NSSM_LOG_ROTATE_RETRY_MIN;
+		} else if (uBackoff > NSSM_LOG_ROTATE_RETRY_MAX) {
+			uBackoff = NSSM_LOG_ROTATE_RETRY_MAX;
+		}
+		pLogger->m_uRotateBackoff = uBackoff;
+		pLogger->m_uRotateRetry = GetTickCount() + uBackoff;
+	}
+	start_map(pLogger);
+	start_async(pLogger);
+}
+
+/*
+  Returns true if a failed rotation should not be tried again yet.
+*/
+static inline bool rotation_backing_off(logger_t* pLogger)
+{
+	return pLogger->m_uRotateBackoff &&
+		(static_cast<int32_t>(GetTickCount() - pLogger->m_uRotateRetry) < 0);
+}
+
+/***************************************
+
+	Rotate the log file
+
+	Renaming is quick so it is done in place.  Copying can take a long time
+	for a large file so it is handed to a background worker and the I/O
+	thread carries on reading from the pipe.  m_bRotating is left set until
+	the copy is done and finish_rotation() has been called.
+
+***************************************/
+
+static void start_rotation(logger_t* pLogger)
+{
+	log_rotation_t* pRotation = &pLogger->m_Rotation;
+	/* Writes are held back until the last one in flight has finished. */
+	if (pLogger->m_Async.m_uInFlight) {
+		pRotation->m_bFinished = false;
+		pLogger->m_bRotating = true;
+		pLogger->m_Async.m_bRotateWaiting = true;
+		return;
+	}
+	/*
+	  A rename hands the old file's last flush to the flusher, which takes
+	  one at a time.
+	*/
+	if (pLogger->m_bFlushing && !pLogger->m_bCopyAndTruncate) {
+		pRotation->m_bFinished = false;
+		pLogger->m_bRotating = true;
+		pLogger->m_Flush.m_bRotateWaiting = true;
+		return;
+	}
+	*pLogger->m_pRotateOnline = NSSM_ROTATE_ONLINE;
+	/* The old file must end where its output does before it is let go. */
+	stop_map(pLogger);
+	stop_async(pLogger);
+	GetSystemTime(&pRotation->m_Time);
+	rotated_filename(pLogger->m_pPath, pRotation->m_Rotated,
+		RTL_NUMBER_OF(pRotation->m_Rotated), &pRotation->m_Time);
+	pRotation->m_uStarted = GetTickCount();
+
+	/* Writes are held back until finish_rotation() hands this back. */
+	pRotation->m_hFile = pLogger->m_hWrite;
+	pLogger->m_hWrite = NULL;
+
+	if (pLogger->m_bCopyAndTruncate) {
+		pRotation->m_bFinished = false;
+		pLogger->m_bRotating = true;
+		if (!queue_log_job(
+				&pRotation->m_Job, rotate_in_background, pLogger, false)) {
+			return;
+		}
+		pLogger->m_bRotating = false;
+		copy_and_truncate(pLogger);
+	} else {
+		pRotation->m_uError = rename_log_file(pLogger);
+	}
+
+	/* Done in place, so the pipe was not read for the duration. */
+	finish_rotation(pLogger);
+	pLogger->m_uStalls++;
+	pLogger->m_uStallTime += GetTickCount() - pRotation->m_uStarted;
+}
+
+/* Start a rotation which was waiting for writes or a flush to finish. */
+static void resume_rotation(logger_t* pLogger)
+{
+	log_async_t* pAsync = &pLogger->m_Async;
+	log_flush_t* pFlush = &pLogger->m_Flush;
+	if (!pAsync->m_bRotateWaiting && !pFlush->m_bRotateWaiting) {
+		return;
+	}
+	if (pAsync->m_uInFlight || pLogger->m_bFlushing) {
+		return;
+	}
+	pAsync->m_bRotateWaiting = false;
+	pFlush->m_bRotateWaiting = false;
+	pLogger->m_bRotating = false;
+	start_rotation(pLogger);
+}
+
+/***************************************
+
+	Flush the log file to disk
+
+	FlushFileBuffers() waits for the disk so it is handed to a background
+	worker and the I/O thread carries on writing.  Whatever is written
+	while a flush is in flight is left for the next one, so a burst of
+	writes costs one flush rather than one each.  The worker flushes a
+	duplicate of the log file handle, which a rotation can't close under
+	it, or the old file's own handle once a rotation has renamed it.
+
+***************************************/
+
+static void flush_log_file(void* pParam)
+{
+	logger_t* pLogger = static_cast<logger_t*>(pParam);
+	log_flush_t* pFlush = &pLogger->m_Flush;
+	pFlush->m_uError = 0;
+	if (!FlushFileBuffers(pFlush->m_hFile)) {
+		pFlush->m_pFunction = L"FlushFileBuffers()";
+		pFlush->m_uError = GetLastError();
+	}
+}
+
+/* Run by a background worker, then hand the logger back to the I/O thread. */
+static void flush_in_background(void* pParam)
+{
+	logger_t* pLogger = static_cast<logger_t*>(pParam);
+	flush_log_file(pLogger);
+
+	/* The logger may be freed as soon as this is posted. */
+	ULONG_PTR uKey = reinterpret_cast<ULONG_PTR>(pLogger);
+	OVERLAPPED* pOverlapped = &pLogger->m_Flush.m_Overlapped;
+	while (!PostQueuedCompletionStatus(g_hLogPort, 0, uKey, pOverlapped)) {
+		Sleep(NSSM_LOG_ROTATE_POLL);
+	}
+}
+
+static void finish_flush(logger_t* pLogger)
+{
+	log_flush_t* pFlush = &pLogger->m_Flush;
+	pLogger->m_bFlushing = false;
+	pLogger->m_uFlushTime += GetTickCount() - pFlush->m_uStarted;
+	close_handle(&pFlush->m_hFile);
+
+	if (!pFlush->m_uError) {
+		pLogger->m_uFlushes++;
+		return;
+	}
+	if (!(pLogger->m_iComplained & COMPLAINED_FLUSH)) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_LOG_FLUSH_FAILED,
+			pLogger->m_pServiceName, pLogger->m_pPath, pFlush->m_pFunction,
+			error_string(pFlush->m_uError), NULL);
+	}
+	pLogger->m_iComplained |= COMPLAINED_FLUSH;
+}
+
+/*
+  Remove a logger from the list of loggers with timed flushes.
+  Only called from the I/O thread.
+*/
+static void unlink_flush_timer(logger_t* pLogger)
+{
+	if (!pLogger->m_bFlushTimed) {
+		return;
+	}
+	logger_t** ppLink = &g_pFlushingLoggers;
+	while (*ppLink) {
+		if (*ppLink == pLogger) {
+			*ppLink = pLogger->m_pNextFlushing;
+			break;
+		}
+		ppLink = &(*ppLink)->m_pNextFlushing;
+	}
+	pLogger->m_pNextFlushing = NULL;
+	pLogger->m_bFlushTimed = false;
+}
+
+/* Flush hFile on a background worker, or in line if none can be had. */
+static void queue_flush(logger_t* pLogger, HANDLE hFile)
+{
+	log_flush_t* pFlush = &pLogger->m_Flush;
+	pFlush->m_hFile = hFile;
+	pLogger->m_bFlushing = true;
+	if (!queue_log_job(&pFlush->m_Job, flush_in_background, pLogger, false)) {
+		return;
+	}
+	flush_log_file(pLogger);
+	finish_flush(pLogger);
+}
+
+static void start_flush(logger_t* pLogger)
+{
+	log_flush_t* pFlush = &pLogger->m_Flush;
+	unlink_flush_timer(pLogger);
+	pLogger->m_uFlushedBytes += pLogger->m_uFlushDirty;
+	pLogger->m_uFlushDirty = 0;
+	pFlush->m_uStarted = GetTickCount();
+
+	/*
+	  FlushFileBuffers() may not see pages still dirty in a mapped view,
+	  and the view can be unmapped under a worker, so write them out here.
+	*/
+	if (pLogger->m_Map.m_pView &&
+		!FlushViewOfFile(pLogger->m_Map.m_pView, pLogger->m_Map.m_uUsed)) {
+		pFlush->m_pFunction = L"FlushViewOfFile()";
+		pFlush->m_uError = GetLastError();
+		finish_flush(pLogger);
+		return;
+	}
+
+	if (!DuplicateHandle(GetCurrentProcess(), pLogger->m_hWrite,
+			GetCurrentProcess(), &pFlush->m_hFile, 0, FALSE,
+			DUPLICATE_SAME_ACCESS)) {
+		pFlush->m_hFile = NULL;
+		pFlush->m_pFunction = L"DuplicateHandle()";
+		pFlush->m_uError = GetLastError();
+		finish_flush(pLogger);
+		return;
+	}
+
+	queue_flush(pLogger, pFlush->m_hFile);
+}
+
+/*
+  Hand the old log file's last flush to the flusher after a rename.  The
+  flusher takes over the rotation's handle to it, and finish_flush()
+  closes it.  start_rotation() waited for any flush in flight.
+*/
+static void flush_rotated(logger_t* pLogger, HANDLE hFile)
+{
+	unlink_flush_timer(pLogger);
+	pLogger->m_uFlushedBytes += pLogger->m_uFlushDirty;
+	pLogger->m_uFlushDirty = 0;
+	pLogger->m_Flush.m_uStarted = GetTickCount();
+	queue_flush(pLogger, hFile);
+}
+
+/***************************************
+
+	Flush the log file if its policy calls for it
+
+	Called after every round of writes.  Nothing is started while a flush
+	or rotation is in progress, and what is written meanwhile waits for
+	the next call.  A timed flush is due AppStdoutFlushAfter milliseconds
+	after the first write it covers, and is started by the I/O thread.
+	bFinishing flushes whatever is left whatever the policy.
+
+***************************************/
+
+static void check_flush(logger_t* pLogger, bool bFinishing)
+{
+	if (!pLogger->m_uFlushPolicy || !pLogger->m_uFlushDirty ||
+		pLogger->m_bFlushing || pLogger->m_bRotating || !pLogger->m_hWrite) {
+		return;
+	}
+
+	if (bFinishing) {
+		start_flush(pLogger);
+		return;
+	}
+
+	switch (pLogger->m_uFlushPolicy) {
+	case NSSM_LOG_FLUSH_INTERVAL:
+		if (!pLogger->m_bFlushTimed) {
+			pLogger->m_uFlushDue = GetTickCount() + pLogger->m_uFlushAfter;
+			pLogger->m_pNextFlushing = g_pFlushingLoggers;
+			g_pFlushingLoggers = pLogger;
+			pLogger->m_bFlushTimed = true;
+		}
+		break;
+
+	case NSSM_LOG_FLUSH_BYTES:
+		if (pLogger->m_uFlushDirty >= pLogger->m_uFlushAfter) {
+			start_flush(pLogger);
+		}
+		break;
+
+	case NSSM_LOG_FLUSH_LINE:
+		start_flush(pLogger);
+		break;
+	}
+}
+
+/*
+  Start the timed flushes which are due.
+  Returns the milliseconds until the next one, or INFINITE if there is none.
+*/
+static uint32_t run_flush_timers(void)
+{
+	uint32_t uNow = GetTickCount();
+	uint32_t uWait = INFINITE;
+	logger_t* pLogger = g_pFlushingLoggers;
+	while (pLogger) {
+		logger_t* pNext = pLogger->m_pNextFlushing;
+		int32_t iLeft = static_cast<int32_t>(pLogger->m_uFlushDue - uNow);
+		if (iLeft > 0) {
+			if (static_cast<uint32_t>(iLeft) < uWait) {
+				uWait = static_cast<uint32_t>(iLeft);
+			}
+		} else if (pLogger->m_bRotating || !pLogger->m_hWrite) {
+			/* Set again by check_flush() once the rotation is done. */
+			unlink_flush_timer(pLogger);
+		} else {
+			start_flush(pLogger);
+		}
+		pLogger = pNext;
+	}
+	return uWait;
+}
+
+/***************************************
+
+	Count repeats in the log file when no different line comes
+
+	A logger with repeats waiting is kept on a list and the I/O thread
+	writes the repeated line for each pipe AppLogCollapse milliseconds
+	after the first repeat it counts.  While a rotation is in progress the
+	logger is taken off the list and put back on by check_repeats() once
+	the rotation is done.
+
+***************************************/
+
+static void unlink_repeat_timer(logger_t* pLogger)
+{
+	if (!pLogger->m_bRepeatTimed) {
+		return;
+	}
+	logger_t** ppLink = &g_pRepeatingLoggers;
+	while (*ppLink) {
+		if (*ppLink == pLogger) {
+			*ppLink = pLogger->m_pNextRepeating;
+			break;
+		}
+		ppLink = &(*ppLink)->m_pNextRepeating;
+	}
+	pLogger->m_pNextRepeating = NULL;
+	pLogger->m_bRepeatTimed = false;
+}
+
+/* Put the logger on the list if any pipe has repeats waiting. */
+static void check_repeats(logger_t* pLogger)
+{
+	if (!pLogger->m_uCollapse || pLogger->m_bRepeatTimed ||
+		pLogger->m_bFailed || pLogger->m_bRotating) {
+		return;
+	}
+	for (uint32_t i = 0; i < pLogger->m_uSources; i++) {
+		if (pLogger->m_Sources[i].m_uRepeats) {
+			pLogger->m_pNextRepeating = g_pRepeatingLoggers;
+			g_pRepeatingLoggers = pLogger;
+			pLogger->m_bRepeatTimed = true;
+			return;
+		}
+	}
+}
+
+/*
+  Write the repeated line for each pipe whose repeats are due.  Returns
+  the milliseconds until the next one is due, or INFINITE if none are
+  waiting any more.
+*/
+static uint32_t write_repeats(logger_t* pLogger, uint32_t uNow)
+{
+	uint32_t uWait = INFINITE;
+	for (uint32_t i = 0; i < pLogger->m_uSources; i++) {
+		log_source_t* pSource = &pLogger->m_Sources[i];
+		if (!pSource->m_uRepeats) {
+			continue;
+		}
+		int32_t iLeft = static_cast<int32_t>(
+			pSource->m_uRepeatStarted + pLogger->m_uCollapse - uNow);
+		if (iLeft > 0) {
+			if (static_cast<uint32_t>(iLeft) < uWait) {
+				uWait = static_cast<uint32_t>(iLeft);
+			}
+			continue;
+		}
+
+		uint32_t out = 0;
+		int ret =
+			batch_repeated(pLogger, pSource, &out, &pLogger->m_iComplained);
+		if (ret >= 0) {
+			ret = flush_batch(pLogger, &out, &pLogger->m_iComplained);
+		}
+		pLogger->m_uFileSize += out;
+		if (ret < 0) {
+			pLogger->m_bFailed = true;
+			return INFINITE;
+		}
+	}
+	return uWait;
+}
+
+static uint32_t run_repeat_timers(void)
+{
+	uint32_t uNow = GetTickCount();
+	uint32_t uWait = INFINITE;
+	logger_t* pLogger = g_pRepeatingLoggers;
+	while (pLogger) {
+		logger_t* pNext = pLogger->m_pNextRepeating;
+		uint32_t uLeft = INFINITE;
+		if (!pLogger->m_bRotating && pLogger->m_hWrite &&
+			!pLogger->m_bFailed) {
+			uLeft = write_repeats(pLogger, uNow);
+		}
+		if (uLeft == INFINITE) {
+			/* Put back by check_repeats() if there are more. */
+			unlink_repeat_timer(pLogger);
+		} else if (uLeft < uWait) {
+			uWait = uLeft;
+		}
+		pLogger = pNext;
+	}
+	return uWait;
+}
+
+/***************************************
+
+	Write a chunk of data from the ring buffer to the log file, rotating the
+	file first if it has hit the size threshold or a rotation was requested.
+
+	pConsumed is set to the number of bytes dealt with, which is less than
+	in if writes are being held back for a rotation or the output changes
+	encoding part way through.
+	Returns 0 on success or the exit code for the logging thread.
+
+***************************************/
+
+static int write_chunk(logger_t* pLogger, log_source_t* pSource,
+	void* address, uint32_t in, uint32_t* pConsumed)
+{
+	uint32_t out;
+	int ret;
+
+	/* Leave anything after a change of encoding for the next call. */
+	in = check_encoding(pSource, static_cast<uint8_t*>(address), in);
+	uint32_t uCharsize = pSource->m_uCharsize;
+	if (!pLogger->m_uCharsize) {
+		pLogger->m_uCharsize = (pLogger->m_bJsonLog || pLogger->m_bUtf8Log) ?
+			sizeof(char) :
+			uCharsize;
+	}
+
+	*pConsumed = in;
+	bool bRotate = *pLogger->m_pRotateOnline == NSSM_ROTATE_ONLINE_ASAP ||
+		pLogger->m_uRotateBackoff ||
+		(pLogger->m_uSize && (pLogger->m_uFileSize + in) >= pLogger->m_uSize);
+	bool bTimed = !bRotate && rotation_due(pLogger);
+
+	/* Give a failed rotation time before trying it again. */
+	if (bRotate && rotation_backing_off(pLogger)) {
+		bRotate = false;
+	}
+
+	/* Nothing to rotate, so just wait for the next boundary. */
+	if (bTimed && !pLogger->m_uFileSize) {
+		bTimed = false;
+		schedule_rotation(pLogger);
+	}
+
+	/* No point rotating while the disk is full. */
+	if (!pLogger->m_bSpilling && (bRotate || bTimed)) {
+		/*
+		  Look for newline.  A timed rotation at the start of a line
+		  happens before it.
+		*/
+		bool bLineStart = bTimed && !pSource->m_uLineLength;
+		uint32_t i = 0;
+		if (!bLineStart) {
+			i = find_newline(address, in, uCharsize);
+		}
+		if (i || bLineStart) {
+			/* Write up to the newline, finishing the current line. */
+			out = 0;
+			ret = i ? write_with_timestamp(pLogger, pSource, address, i, &out,
+						  &pLogger->m_iComplained, uCharsize) :
+					  0;
+			if (ret < 0) {
+				return 3;
+			}
+			pLogger->m_uFileSize += out;
+			if (bTimed) {
+				schedule_rotation(pLogger);
+			}
+
+			/* Rotate. */
+			start_rotation(pLogger);
+			if (pLogger->m_bRotating) {
+				*pConsumed = i;
+				return 0;
+			}
+
+			/* Resume writing after the newline. */
+			address = static_cast<char*>(address) + i;
+			in -= i;
+		}
+	}
+
+	/* Write a BOM to a new UTF-16 file. */
+	if (!pLogger->m_uFileSize && (pLogger->m_uCharsize == sizeof(wchar_t))) {
+		out = 0;
+		write_bom(pLogger, &out);
+		pLogger->m_uFileSize += out;
 	}
 
+	/* Write the data, if any. */
+	if (!in) {
+		return 0;
+	}
+
+	out = 0;
+	ret = write_with_timestamp(pLogger, pSource, address, in, &out,
+		&pLogger->m_iComplained, uCharsize);
+	pLogger->m_uFileSize += out;
+	if (ret < 0) {
+		return 3;
+	}
 	return 0;
 }
 
-void close_output_handles(STARTUPINFOW* pStartupInfo)
+/***************************************
+
+	Write a line saying how much output was dropped
+
+	A line left unfinished by the drop is ended first.  The line is written
+	in the log's character size and gets the usual prefix or record.
+	Returns 0 on success or the exit code for the logging thread.
+
+***************************************/
+
+static int write_drop_marker(logger_t* pLogger, log_source_t* pSource)
 {
-	if (pStartupInfo->hStdInput) {
-		CloseHandle(pStartupInfo->hStdInput);
-	}
-	if (pStartupInfo->hStdOutput) {
-		CloseHandle(pStartupInfo->hStdOutput);
+	uint32_t consumed;
+	int ret;
+
+	if (!pSource->m_uCharsize) {
+		void* address;
+		uint32_t in = log_buffer_used_span(&pSource->m_Buffer, &address);
+		pSource->m_uCharsize =
+			in ? guess_charsize(address, in) : sizeof(char);
 	}
-	if (pStartupInfo->hStdError) {
-		CloseHandle(pStartupInfo->hStdError);
+	uint32_t uCharsize = pSource->m_uCharsize;
+
+	if (pSource->m_uLineLength) {
+		/* The first byte is also a newline in 8 bit text. */
+		static const wchar_t g_Newline[] = L"\n";
+		ret = write_chunk(pLogger, pSource,
+			const_cast<wchar_t*>(g_Newline), uCharsize, &consumed);
+		if (ret || pLogger->m_bRotating) {
+			return ret;
+		}
 	}
-}
 
-void cleanup_loggers(nssm_service_t* pNSSMService)
-{
-	uint32_t interval = NSSM_CLEANUP_LOGGERS_DEADLINE;
-	HANDLE thread_handle = INVALID_HANDLE_VALUE;
+	/* Whatever the filter made of the line before, this one is kept. */
+	pSource->m_bFiltered = false;
+	pSource->m_bFilterPassed = true;
 
-	close_handle(&pNSSMService->m_hStdoutThread, &thread_handle);
-	/* Close write end of the data pipe so logging thread can finalise read. */
-	close_handle(&pNSSMService->m_hStdoutInputPipe);
-	/* Await logging thread then close read end. */
-	if (thread_handle != INVALID_HANDLE_VALUE) {
-		WaitForSingleObject(thread_handle, interval);
+	char text[96];
+	snprintf(text, sizeof(text), NSSM_LOG_DROPPED_FORMAT,
+		static_cast<unsigned long long>(pSource->m_uDroppedLines),
+		static_cast<unsigned long long>(pSource->m_uDroppedBytes));
+	uint32_t uLength = static_cast<uint32_t>(strlen(text));
+	void* pText = text;
+	wchar_t wide[96];
+	if (uCharsize == sizeof(wchar_t)) {
+		for (uint32_t i = 0; i < uLength; i++) {
+			wide[i] = static_cast<wchar_t>(text[i]);
+		}
+		pText = wide;
+		uLength *= sizeof(wchar_t);
 	}
-	close_handle(&pNSSMService->m_hStdoutOutputPipe);
 
-	thread_handle = INVALID_HANDLE_VALUE;
-	close_handle(&pNSSMService->m_hStderrThread, &thread_handle);
-	close_handle(&pNSSMService->m_hStderrInputPipe);
-	if (thread_handle != INVALID_HANDLE_VALUE) {
-		WaitForSingleObject(thread_handle, interval);
+	ret = write_chunk(pLogger, pSource, pText, uLength, &consumed);
+
+	/* A timed rotation may go first, leaving the line for the new file. */
+	if (!ret && !consumed) {
+		return 0;
 	}
-	close_handle(&pNSSMService->m_hStderrOutputPipe);
+	pSource->m_bDropPending = false;
+	pSource->m_uDroppedLines = 0;
+	pSource->m_uDroppedBytes = 0;
+	return ret;
 }
 
 /*
-  Try multiple times to read from a file.
-  Returns:  0 on success.
-			1 on non-fatal error.
-		   -1 on fatal error.
+  Returns the number of bytes waiting in the ring buffer up to the end of
+  the last whole line.
 */
-static int try_read(logger_t* pLogger, void* pBuffer, uint32_t uBufferSize,
-	uint32_t* pReadIn, int* pComplained)
+static uint32_t complete_lines(log_buffer_t* pBuffer, uint32_t uCharsize)
 {
-	uint32_t error;
-	int ret = 1;
-	for (int tries = 0; tries < 5; tries++) {
-		if (ReadFile(pLogger->m_hRead, pBuffer, uBufferSize,
-				reinterpret_cast<DWORD*>(pReadIn), NULL)) {
-			return 0;
-		}
+	uint32_t uFirst = pBuffer->m_uSize - pBuffer->m_uHead;
+	const uint8_t* pHead = pBuffer->m_pData + pBuffer->m_uHead;
+	if (uFirst >= pBuffer->m_uUsed) {
+		return find_last_newline(pHead, pBuffer->m_uUsed, uCharsize);
+	}
 
-		error = GetLastError();
-		switch (error) {
-		/* Other end closed the pipe. */
-		case ERROR_BROKEN_PIPE:
-			ret = -1;
-			goto complain_read;
+	/* Look in the part which wrapped around to the start first. */
+	uint32_t uEnd = find_last_newline(
+		pBuffer->m_pData, pBuffer->m_uUsed - uFirst, uCharsize);
+	if (uEnd) {
+		return uFirst + uEnd;
+	}
+	return find_last_newline(pHead, uFirst, uCharsize);
+}
 
-		/* Couldn't lock the buffer. */
-		case ERROR_NOT_ENOUGH_QUOTA:
-			Sleep(2000U + static_cast<uint32_t>(tries) * 3000U);
-			ret = 1;
-			continue;
+/***************************************
 
-		/* Write was cancelled by the other end. */
-		case ERROR_OPERATION_ABORTED:
-			ret = 1;
-			goto complain_read;
+	Write out what is waiting in one pipe's ring buffer
 
-		default:
-			ret = -1;
+	When pipes are merged only whole lines are written, so a line from one
+	pipe can't end up in the middle of a line from the other.  The same goes
+	when filtering or collapsing repeats, so they see whole lines.  An
+	unfinished line is kept until the rest of it arrives, unless the pipe
+	has closed or the line won't fit in the buffer.
+
+	The buffer is resized afterwards according to how much of it was used.
+	Returns 0 on success or the exit code for the logging thread.
+
+***************************************/
+
+static int drain_source(logger_t* pLogger, log_source_t* pSource)
+{
+	log_buffer_t* pBuffer = &pSource->m_Buffer;
+	void* address;
+	uint32_t in;
+	uint32_t consumed;
+	uint32_t drained = 0;
+	int ret;
+
+	uint32_t uWritable = pBuffer->m_uUsed;
+	if (((pLogger->m_uSources > 1) || pLogger->m_bFilter ||
+			pLogger->m_uCollapse) &&
+		!pSource->m_bClosed && uWritable) {
+		if (!pSource->m_uCharsize) {
+			in = log_buffer_used_span(pBuffer, &address);
+			pSource->m_uCharsize = guess_charsize(address, in);
+		}
+		uWritable = complete_lines(pBuffer, pSource->m_uCharsize);
+		if (!uWritable && (pBuffer->m_uUsed == pBuffer->m_uSize) &&
+			log_buffer_grow(pBuffer)) {
+			uWritable = pBuffer->m_uUsed;
+		}
+		/* The rest of the line before dropped output isn't coming. */
+		if (pSource->m_bDropPending && (uWritable < pSource->m_uDropMark)) {
+			uWritable = pSource->m_uDropMark;
 		}
 	}
 
-complain_read:
-	/* Ignore the error if we've been requested to exit anyway. */
-	if (*pLogger->m_pRotateOnline != NSSM_ROTATE_ONLINE) {
-		return ret;
-	}
-	if (!(*pComplained & COMPLAINED_READ)) {
-		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_READFILE_FAILED,
-			pLogger->m_pServiceName, pLogger->m_pPath, error_string(error),
-			NULL);
+	while (true) {
+		if (pSource->m_bDropPending && !pSource->m_uDropMark) {
+			ret = write_drop_marker(pLogger, pSource);
+			if (ret) {
+				return ret;
+			}
+			if (pLogger->m_bRotating) {
+				return 0;
+			}
+		}
+		if (!uWritable) {
+			break;
+		}
+		in = log_buffer_used_span(pBuffer, &address);
+		if (!in) {
+			break;
+		}
+		if (in > uWritable) {
+			in = uWritable;
+		}
+		if (pSource->m_bDropPending && (in > pSource->m_uDropMark)) {
+			in = pSource->m_uDropMark;
+		}
+		ret = write_chunk(pLogger, pSource, address, in, &consumed);
+		log_buffer_consume(pBuffer, consumed);
+		drained += consumed;
+		uWritable -= consumed;
+		if (pSource->m_bDropPending) {
+			pSource->m_uDropMark -= consumed;
+		}
+		if (ret) {
+			return ret;
+		}
+		/* Keep the rest until the rotation is done. */
+		if (pLogger->m_bRotating) {
+			return 0;
+		}
 	}
-	*pComplained |= COMPLAINED_READ;
-	return ret;
+	log_buffer_adapt(pBuffer, drained);
+	return 0;
 }
 
-/*
-  Try multiple times to write to a file.
-  Returns:  0 on success.
-			1 on non-fatal error.
-		   -1 on fatal error.
-*/
-static int try_write(logger_t* pLogger, void* pBuffer, uint32_t uBufferSize,
-	uint32_t* pWritten, int* pComplained)
+/***************************************
+
+	Write out everything waiting in the ring buffers
+
+	Merged pipes are written in the order their data arrived.
+	Returns 0 on success or the exit code for the logging thread.
+
+***************************************/
+
+static int drain_buffer(logger_t* pLogger)
 {
-	int ret = 1;
-	unsigned long error;
-	for (int tries = 0; tries < 5; tries++) {
-		if (WriteFile(pLogger->m_hWrite, pBuffer, uBufferSize,
-				reinterpret_cast<DWORD*>(pWritten), NULL)) {
+	int ret;
+
+	/* Nothing can be written until the rotation has finished. */
+	if (pLogger->m_bRotating) {
+		if (rotation_pending(pLogger)) {
 			return 0;
 		}
+		finish_rotation(pLogger);
+	}
 
-		error = GetLastError();
-		if (error == ERROR_IO_PENDING) {
-			/* Operation was successful pending flush to disk. */
-			return 0;
+	/* A JSON record for a line the application never finished. */
+	if (pLogger->m_bJsonLog) {
+		for (uint32_t i = 0; i < pLogger->m_uSources; i++) {
+			log_source_t* pSource = &pLogger->m_Sources[i];
+			if (!pSource->m_bClosed || pSource->m_Buffer.m_uUsed ||
+				!pSource->m_uLineLength) {
+				continue;
+			}
+			pSource->m_uLineLength = 0;
+			uint32_t out = 0;
+			ret = batch_json_close(
+				pLogger, pSource, &out, &pLogger->m_iComplained);
+			if (ret >= 0) {
+				ret = flush_batch(pLogger, &out, &pLogger->m_iComplained);
+			}
+			pLogger->m_uFileSize += out;
+			if (ret < 0) {
+				return 3;
+			}
 		}
+	}
 
-		switch (error) {
-		/* Other end closed the pipe. */
-		case ERROR_BROKEN_PIPE:
-			ret = -1;
-			goto complain_write;
+	/* Output suppressed since the last line the application wrote. */
+	if (pLogger->m_bRateLimit) {
+		for (uint32_t i = 0; i < pLogger->m_uSources; i++) {
+			log_source_t* pSource = &pLogger->m_Sources[i];
+			if (!pSource->m_bClosed || pSource->m_Buffer.m_uUsed ||
+				!pSource->m_uSuppressedLines) {
+				continue;
+			}
+			uint32_t out = 0;
+			ret = batch_suppressed(
+				pLogger, pSource, &out, &pLogger->m_iComplained);
+			if (ret >= 0) {
+				ret = flush_batch(pLogger, &out, &pLogger->m_iComplained);
+			}
+			pLogger->m_uFileSize += out;
+			if (ret < 0) {
+				return 3;
+			}
+		}
+	}
 
-		/* Couldn't lock the buffer. */
-		case ERROR_NOT_ENOUGH_QUOTA:
-		/* Out of disk space. */
-		case ERROR_DISK_FULL:
-			Sleep(2000U + static_cast<uint32_t>(tries) * 3000U);
-			ret = 1;
-			continue;
+	/* Repeats of the last line the application wrote. */
+	if (pLogger->m_uCollapse) {
+		for (uint32_t i = 0; i < pLogger->m_uSources; i++) {
+			log_source_t* pSource = &pLogger->m_Sources[i];
+			if (!pSource->m_bClosed || pSource->m_Buffer.m_uUsed ||
+				!pSource->m_uRepeats) {
+				continue;
+			}
+			uint32_t out = 0;
+			ret = batch_repeated(
+				pLogger, pSource, &out, &pLogger->m_iComplained);
+			if (ret >= 0) {
+				ret = flush_batch(pLogger, &out, &pLogger->m_iComplained);
+			}
+			pLogger->m_uFileSize += out;
+			if (ret < 0) {
+				return 3;
+			}
+		}
+	}
 
-		default:
-			/* We'll lose this line but try to read and write subsequent ones.
-			 */
-			ret = 1;
+	log_source_t* Order[NSSM_LOG_SOURCES];
+	uint32_t uCount = 0;
+	for (uint32_t i = 0; i < pLogger->m_uSources; i++) {
+		log_source_t* pSource = &pLogger->m_Sources[i];
+		if (!pSource->m_Buffer.m_uUsed && !pSource->m_bDropPending) {
+			continue;
+		}
+		uint32_t j = uCount++;
+		while (j && (static_cast<int32_t>(Order[j - 1]->m_uArrival -
+						 pSource->m_uArrival) > 0)) {
+			Order[j] = Order[j - 1];
+			--j;
 		}
+		Order[j] = pSource;
 	}
 
-complain_write:
-	if (!(*pComplained & COMPLAINED_WRITE))
-		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_WRITEFILE_FAILED,
-			pLogger->m_pServiceName, pLogger->m_pPath, error_string(error),
-			NULL);
-	*pComplained |= COMPLAINED_WRITE;
-	return ret;
+	for (uint32_t i = 0; i < uCount; i++) {
+		ret = drain_source(pLogger, Order[i]);
+		if (ret) {
+			return ret;
+		}
+		if (pLogger->m_bRotating) {
+			return 0;
+		}
+	}
+	return 0;
 }
 
-/* Note that the timestamp is created in UTF-8. */
-static inline int write_timestamp(
-	logger_t* pLogger, uint32_t uCharsize, uint32_t* pWritten, int* pComplained)
+/***************************************
+
+	Release a logger and everything it owns
+
+***************************************/
+
+static void free_logger(logger_t* pLogger)
 {
-	char timestamp[TIMESTAMP_LEN + 1];
+	if (pLogger->m_uRotations) {
+		wchar_t rotations[16];
+		wchar_t rotate_time[16];
+		wchar_t stalls[16];
+		wchar_t stall_time[16];
+		StringCchPrintfW(rotations, RTL_NUMBER_OF(rotations), L"%lu",
+			pLogger->m_uRotations);
+		StringCchPrintfW(rotate_time, RTL_NUMBER_OF(rotate_time), L"%lu",
+			pLogger->m_uRotateTime);
+		StringCchPrintfW(
+			stalls, RTL_NUMBER_OF(stalls), L"%lu", pLogger->m_uStalls);
+		StringCchPrintfW(stall_time, RTL_NUMBER_OF(stall_time), L"%lu",
+			pLogger->m_uStallTime);
+		log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_ROTATE_STATISTICS,
+			pLogger->m_pServiceName, pLogger->m_pPath, rotations, rotate_time,
+			stalls, stall_time, NULL);
+	}
 
-	SYSTEMTIME now;
-	GetSystemTime(&now);
-	snprintf(timestamp, RTL_NUMBER_OF(timestamp), TIMESTAMP_FORMAT, now.wYear,
-		now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond,
-		now.wMilliseconds);
+	if (pLogger->m_uFlushes) {
+		wchar_t flushes[16];
+		wchar_t flush_time[16];
+		wchar_t bytes[32];
+		StringCchPrintfW(flushes, RTL_NUMBER_OF(flushes), L"%lu",
+			pLogger->m_uFlushes);
+		StringCchPrintfW(flush_time, RTL_NUMBER_OF(flush_time), L"%lu",
+			pLogger->m_uFlushTime);
+		StringCchPrintfW(bytes, RTL_NUMBER_OF(bytes), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uFlushedBytes));
+		log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_FLUSH_STATISTICS,
+			pLogger->m_pServiceName, pLogger->m_pPath, flushes, flush_time,
+			bytes, NULL);
+	}
 
-	if (uCharsize == sizeof(char)) {
-		return try_write(
-			pLogger, timestamp, TIMESTAMP_LEN, pWritten, pComplained);
+	if (pLogger->m_uBytesDropped) {
+		wchar_t lines[32];
+		wchar_t bytes[32];
+		StringCchPrintfW(lines, RTL_NUMBER_OF(lines), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uLinesDropped));
+		StringCchPrintfW(bytes, RTL_NUMBER_OF(bytes), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uBytesDropped));
+		log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_LOG_DROPPED,
+			pLogger->m_pServiceName, pLogger->m_pPath, lines, bytes, NULL);
 	}
-	wchar_t* utf16;
-	uint32_t utf16len;
-	if (to_utf16(timestamp, &utf16, &utf16len)) {
-		return -1;
+
+	if (pLogger->m_uLinesSuppressed) {
+		wchar_t lines[32];
+		wchar_t bytes[32];
+		StringCchPrintfW(lines, RTL_NUMBER_OF(lines), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uLinesSuppressed));
+		StringCchPrintfW(bytes, RTL_NUMBER_OF(bytes), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uBytesSuppressed));
+		log_event(EVENTLOG_WARNING_TYPE, NSSM_EVENT_LOG_SUPPRESSED,
+			pLogger->m_pServiceName, pLogger->m_pPath, lines, bytes, NULL);
 	}
-	int ret = try_write(
-		pLogger, utf16, utf16len * sizeof(wchar_t), pWritten, pComplained);
-	heap_free(utf16);
-	return ret;
+
+	if (pLogger->m_uLinesFiltered) {
+		wchar_t lines[32];
+		wchar_t bytes[32];
+		StringCchPrintfW(lines, RTL_NUMBER_OF(lines), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uLinesFiltered));
+		StringCchPrintfW(bytes, RTL_NUMBER_OF(bytes), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uBytesFiltered));
+		log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_LOG_FILTERED,
+			pLogger->m_pServiceName, pLogger->m_pPath, lines, bytes, NULL);
+	}
+
+	if (pLogger->m_uLinesCollapsed) {
+		wchar_t lines[32];
+		wchar_t bytes[32];
+		StringCchPrintfW(lines, RTL_NUMBER_OF(lines), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uLinesCollapsed));
+		StringCchPrintfW(bytes, RTL_NUMBER_OF(bytes), L"%llu",
+			static_cast<unsigned long long>(pLogger->m_uBytesCollapsed));
+		log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_LOG_COLLAPSED,
+			pLogger->m_pServiceName, pLogger->m_pPath, lines, bytes, NULL);
+	}
+
+	/* Last chance for output held while the disk was full. */
+	if (pLogger->m_bSpilling) {
+		uint32_t out = 0;
+		if (replay_spill(pLogger, &out)) {
+			wchar_t lost[32];
+			StringCchPrintfW(lost, RTL_NUMBER_OF(lost), L"%llu",
+				static_cast<unsigned long long>(pLogger->m_Spill.m_uUsed));
+			log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_LOG_SPILL_LOST,
+				pLogger->m_pServiceName, pLogger->m_pPath, lost, NULL);
+		}
+		unlink_spilling(pLogger);
+	}
+	log_buffer_free(&pLogger->m_Spill);
+
+	unlink_waiting(pLogger);
+	unlink_flush_timer(pLogger);
+	unlink_repeat_timer(pLogger);
+	free_sinks(pLogger);
+
+	/* The read ends of the pipes belong to the service. */
+	stop_map(pLogger);
+	stop_async(pLogger);
+	trim_log_file(pLogger, pLogger->m_hWrite);
+	close_handle(&pLogger->m_hWrite);
+	close_handle(&pLogger->m_Rotation.m_hFile);
+	for (uint32_t i = 0; i < pLogger->m_uSources; i++) {
+		log_buffer_free(&pLogger->m_Sources[i].m_Buffer);
+	}
+	for (uint32_t i = 0; i < NSSM_LOG_WRITE_BUFFERS_MAX; i++) {
+		heap_free(pLogger->m_Async.m_Writes[i].m_pData);
+	}
+	heap_free(pLogger->m_Batch.m_pGather);
+	heap_free(pLogger->m_pJsonService);
+	heap_free(pLogger->m_pDiscard);
+	free_filter(pLogger->m_pFilters[0]);
+	free_filter(pLogger->m_pFilters[1]);
+	close_time_index(pLogger->m_pTimeIndex);
+	SetEvent(pLogger->m_hFinished);
+	CloseHandle(pLogger->m_hFinished);
+	heap_free(pLogger);
 }
 
-static int write_with_timestamp(logger_t* pLogger, void* pBuffer,
-	uint32_t uBufferSize, uint32_t* pWritten, int* pComplained,
-	uint32_t uCharsize)
+/***************************************
+
+	Write out what has been read and start the next read
+
+	While a rotation is in progress writes are held back and the buffer
+	grows to hold what the application writes in the meantime.  If it is
+	full nothing more is read until the rotation is done, which counts as
+	a stall.
+
+	Returns true once the logger has nothing left to do.
+
+***************************************/
+
+static bool pump_logger(logger_t* pLogger)
 {
-	if (pLogger->m_bTimestampLog) {
-		uint32_t log_out;
-		int log_complained;
-		uint32_t timestamp_out = 0;
-		int timestamp_complained;
-		if (!pLogger->m_uLineLength) {
-			write_timestamp(
-				pLogger, uCharsize, &timestamp_out, &timestamp_complained);
-			pLogger->m_uLineLength += timestamp_out;
-			*pWritten += timestamp_out;
-			*pComplained |= timestamp_complained;
+	if (!pLogger->m_bFailed && drain_buffer(pLogger)) {
+		pLogger->m_bFailed = true;
+	}
+
+	bool bStalled = false;
+	bool bDone = !rotation_pending(pLogger);
+	for (uint32_t i = 0; i < pLogger->m_uSources; i++) {
+		log_source_t* pSource = &pLogger->m_Sources[i];
+
+		/*
+		  Nothing more can be written, but keep reading so the application
+		  doesn't block on a full pipe.
+		*/
+		if (pLogger->m_bFailed) {
+			log_buffer_consume(&pSource->m_Buffer, pSource->m_Buffer.m_uUsed);
 		}
 
-		uint32_t i;
-		void* line = pBuffer;
-		uint32_t offset = 0;
-		int ret;
-		for (i = 0; i < uBufferSize; i++) {
-			if (static_cast<const char*>(pBuffer)[i] == '\n') {
-				ret = try_write(
-					pLogger, line, i - offset + 1, &log_out, &log_complained);
-				line = (void*)((char*)line + i - offset + 1);
-				pLogger->m_uLineLength = 0LL;
-				*pWritten += log_out;
-				*pComplained |= log_complained;
-				offset = i + 1;
-				if (offset < uBufferSize) {
-					write_timestamp(pLogger, uCharsize, &timestamp_out,
-						&timestamp_complained);
-					pLogger->m_uLineLength += timestamp_out;
-					*pWritten += timestamp_out;
-					*pComplained |= timestamp_complained;
-				}
+		if (!pSource->m_bClosed && !pSource->m_bReading) {
+			int ret = start_read(pLogger, pSource);
+			if ((ret > 0) && !log_buffer_grow(&pSource->m_Buffer)) {
+				ret = start_read(pLogger, pSource);
+			}
+			if (ret > 0) {
+				ret = relieve_pressure(pLogger, pSource);
+			}
+			if (ret > 0) {
+				bStalled = true;
 			}
 		}
-
-		if (offset < uBufferSize) {
-			ret = try_write(
-				pLogger, line, uBufferSize - offset, &log_out, &log_complained);
-			*pWritten += log_out;
-			*pComplained |= log_complained;
+		if (!pSource->m_bClosed || pSource->m_bReading) {
+			bDone = false;
 		}
+	}
+	if (!pump_sinks(pLogger, bDone)) {
+		bDone = false;
+	}
+	if (pLogger->m_Async.m_uInFlight) {
+		bDone = false;
+	}
+	check_repeats(pLogger);
 
-		return ret;
-	} else {
-		return try_write(pLogger, pBuffer, uBufferSize, pWritten, pComplained);
+	/* The last of the output is flushed before the logger goes. */
+	check_flush(pLogger, bDone);
+	if (pLogger->m_bFlushing) {
+		bDone = false;
+	}
+
+	if (bStalled) {
+		if (!pLogger->m_bStalled) {
+			pLogger->m_bStalled = true;
+			pLogger->m_uStallStarted = GetTickCount();
+		}
+	} else if (pLogger->m_bStalled) {
+		pLogger->m_bStalled = false;
+		pLogger->m_uStalls++;
+		pLogger->m_uStallTime += GetTickCount() - pLogger->m_uStallStarted;
 	}
+	return bDone;
 }
 
 /***************************************
 
-	Wrapper to be called in a new thread for logging.
+	Give every logger with waiting sinks another go
 
-	Called by CreateThread
+	Called by the I/O thread every NSSM_LOG_SINK_RETRY milliseconds, to
+	reconnect sinks which couldn't be reached and to finish loggers whose
+	sinks have lingered long enough.
 
 ***************************************/
 
-unsigned long WINAPI log_and_rotate(void* pParam)
+static void retry_sinks(void)
 {
-	logger_t* pLogger = static_cast<logger_t*>(pParam);
-	if (!pLogger) {
-		return 1;
+	g_uSinksRetried = GetTickCount();
+	logger_t* pLogger = g_pWaitingLoggers;
+	while (pLogger) {
+		logger_t* pNext = pLogger->m_pNextWaiting;
+		if (pump_logger(pLogger)) {
+			free_logger(pLogger);
+		}
+		pLogger = pNext;
 	}
+}
 
-	uint64_t size;
-	BY_HANDLE_FILE_INFORMATION info;
+/***************************************
 
-	/* Find initial file size. */
-	if (!GetFileInformationByHandle(pLogger->m_hWrite, &info)) {
-		pLogger->m_uSize = 0LL;
-	} else {
-		ULARGE_INTEGER l;
-		l.HighPart = info.nFileSizeHigh;
-		l.LowPart = info.nFileSizeLow;
-		size = l.QuadPart;
-	}
+	The logging I/O thread, serving every logger
 
-	char buffer[1024];
-	void* address;
-	uint32_t in, out;
-	unsigned long charsize = 0;
-	unsigned long error;
-	int ret;
-	int complained = 0;
+	Called by CreateThread with the completion port as its parameter.
+	Each completion is a read finishing, a write to a sink finishing, a
+	rotation or flush posted back by a background worker, or the request
+	from create_logging_thread() to start reading.  While any logger has
+	output spilled to memory or a sink to reconnect the thread also wakes
+	up regularly to retry, and it wakes up for timed flushes when due.
 
-	while (true) {
-		/* Read data from the pipe. */
-		address = &buffer;
-		ret = try_read(pLogger, address, sizeof(buffer), &in, &complained);
-		if (ret < 0) {
-			close_handle(&pLogger->m_hRead);
-			close_handle(&pLogger->m_hWrite);
-			heap_free(pLogger);
-			return 2;
-		} else if (ret)
-			continue;
+***************************************/
 
-		if (*pLogger->m_pRotateOnline == NSSM_ROTATE_ONLINE_ASAP ||
-			(pLogger->m_uSize && (size + in) >= pLogger->m_uSize)) {
-			/* Look for newline. */
-			unsigned long i;
-			for (i = 0; i < in; i++) {
-				if (buffer[i] == '\n') {
-					if (!charsize) {
-						charsize = guess_charsize(address, in);
-					}
-					i += charsize;
-
-					/* Write up to the newline. */
-					ret = try_write(pLogger, address, i, &out, &complained);
-					if (ret < 0) {
-						close_handle(&pLogger->m_hRead);
-						close_handle(&pLogger->m_hWrite);
-						heap_free(pLogger);
-						return 3;
-					}
-					size += out;
-
-					/* Rotate. */
-					*pLogger->m_pRotateOnline = NSSM_ROTATE_ONLINE;
-					wchar_t rotated[PATH_LENGTH];
-					rotated_filename(
-						pLogger->m_pPath, rotated, RTL_NUMBER_OF(rotated), 0);
-
-					/*
-					  Ideally we'd try the rename first then close the handle
-					  but MoveFile() will fail if the handle is still open so we
-					  must risk losing everything.
-					*/
-					if (pLogger->m_bCopyAndTruncate) {
-						FlushFileBuffers(pLogger->m_hWrite);
-					}
-					close_handle(&pLogger->m_hWrite);
-					bool ok = true;
-					wchar_t* function;
-					if (pLogger->m_bCopyAndTruncate) {
-						function = L"CopyFile()";
-						if (CopyFileW(pLogger->m_pPath, rotated, TRUE)) {
-							HANDLE file = write_to_file(pLogger->m_pPath,
-								NSSM_STDOUT_SHARING, 0, NSSM_STDOUT_DISPOSITION,
-								NSSM_STDOUT_FLAGS);
-							Sleep(pLogger->m_uRotateDelay);
-							SetFilePointer(file, 0, 0, FILE_BEGIN);
-							SetEndOfFile(file);
-							CloseHandle(file);
-						} else {
-							ok = false;
-						}
-					} else {
-						function = L"MoveFile()";
-						if (!MoveFileW(pLogger->m_pPath, rotated)) {
-							ok = false;
-						}
-					}
-					if (ok) {
-						log_event(EVENTLOG_INFORMATION_TYPE, NSSM_EVENT_ROTATED,
-							pLogger->m_pServiceName, pLogger->m_pPath, rotated,
-							NULL);
-						size = 0LL;
-					} else {
-						error = GetLastError();
-						if (error != ERROR_FILE_NOT_FOUND) {
-							if (!(complained & COMPLAINED_ROTATE))
-								log_event(EVENTLOG_ERROR_TYPE,
-									NSSM_EVENT_ROTATE_FILE_FAILED,
-									pLogger->m_pServiceName, pLogger->m_pPath,
-									function, rotated, error_string(error),
-									NULL);
-							complained |= COMPLAINED_ROTATE;
-							/* We can at least try to re-open the existing file.
-							 */
-							pLogger->m_uDisposition = OPEN_ALWAYS;
-						}
-					}
-
-					/* Reopen. */
-					pLogger->m_hWrite =
-						write_to_file(pLogger->m_pPath, pLogger->m_uSharing, 0,
-							pLogger->m_uDisposition, pLogger->m_uFlags);
-					if (pLogger->m_hWrite == INVALID_HANDLE_VALUE) {
-						error = GetLastError();
-						log_event(EVENTLOG_ERROR_TYPE,
-							NSSM_EVENT_CREATEFILE_FAILED, pLogger->m_pPath,
-							error_string(error), NULL);
-						/* Oh dear.  Now we can't log anything further. */
-						close_handle(&pLogger->m_hRead);
-						close_handle(&pLogger->m_hWrite);
-						heap_free(pLogger);
-						return 4;
-					}
-
-					/* Resume writing after the newline. */
-					address = (void*)((char*)address + i);
-					in -= i;
-				}
+unsigned long WINAPI log_and_rotate(void* pParam)
+{
+	HANDLE hPort = static_cast<HANDLE>(pParam);
+	if (!hPort) {
+		return 1;
+	}
+
+	while (true) {
+		DWORD uBytes = 0;
+		ULONG_PTR uKey = 0;
+		OVERLAPPED* pOverlapped = NULL;
+		unsigned long error = 0;
+		uint32_t uTimeout = INFINITE;
+		if (g_pSpillingLoggers) {
+			uint32_t uElapsed = GetTickCount() - g_uSpillRetried;
+			if (uElapsed >= NSSM_LOG_SPILL_RETRY) {
+				retry_spills();
+				uElapsed = 0;
+			}
+			if (g_pSpillingLoggers) {
+				uTimeout = NSSM_LOG_SPILL_RETRY - uElapsed;
+			}
+		}
+		if (g_pWaitingLoggers) {
+			uint32_t uElapsed = GetTickCount() - g_uSinksRetried;
+			if (uElapsed >= NSSM_LOG_SINK_RETRY) {
+				retry_sinks();
+				uElapsed = 0;
+			}
+			if (g_pWaitingLoggers &&
+				((NSSM_LOG_SINK_RETRY - uElapsed) < uTimeout)) {
+				uTimeout = NSSM_LOG_SINK_RETRY - uElapsed;
+			}
+		}
+		if (g_pFlushingLoggers) {
+			uint32_t uWait = run_flush_timers();
+			if (uWait < uTimeout) {
+				uTimeout = uWait;
+			}
+		}
+		if (g_pRepeatingLoggers) {
+			uint32_t uWait = run_repeat_timers();
+			if (uWait < uTimeout) {
+				uTimeout = uWait;
+			}
+		}
+		if (!GetQueuedCompletionStatus(
+				hPort, &uBytes, &uKey, &pOverlapped, uTimeout)) {
+			error = GetLastError();
+			/* Nothing was dequeued. */
+			if (!pOverlapped) {
+				continue;
 			}
 		}
 
-		if (!size || pLogger->m_bTimestampLog) {
-			if (!charsize) {
-				charsize = guess_charsize(address, in);
+		logger_t* pLogger = reinterpret_cast<logger_t*>(uKey);
+		log_source_t* pSource = NULL;
+		log_sink_t* pSink = NULL;
+		log_write_t* pWrite = find_write(pLogger, pOverlapped);
+		uint32_t i;
+		for (i = 0; i < pLogger->m_uSources; i++) {
+			if (pOverlapped == &pLogger->m_Sources[i].m_Overlapped) {
+				pSource = &pLogger->m_Sources[i];
 			}
 		}
-		if (!size) {
-			/* Write a BOM to the new file. */
-			if (charsize == sizeof(wchar_t)) {
-				write_bom(pLogger, &out);
+		for (i = 0; i < NSSM_LOG_SINKS; i++) {
+			if (pOverlapped == &pLogger->m_Sinks[i].m_Overlapped) {
+				pSink = &pLogger->m_Sinks[i];
 			}
-			size += (__int64)out;
 		}
 
-		/* Write the data, if any. */
-		if (!in) {
-			continue;
+		if (pOverlapped == &pLogger->m_Rotation.m_Overlapped) {
+			pLogger->m_Rotation.m_bFinished = true;
+		} else if (pOverlapped == &pLogger->m_Flush.m_Overlapped) {
+			finish_flush(pLogger);
+			resume_rotation(pLogger);
+		} else if (pWrite && pWrite->m_bBusy) {
+			async_written(pLogger, pWrite, error, uBytes);
+			resume_rotation(pLogger);
+		} else if (pSink && pSink->m_bWriting) {
+			sink_written(pLogger, pSink, error);
+		} else if (pSource && pSource->m_bReading) {
+			bool bDiscarding = pSource->m_bDiscarding;
+			pSource->m_bReading = false;
+			pSource->m_bDiscarding = false;
+			pSource->m_Buffer.m_bBusy = false;
+			if (error) {
+				if (read_failed(pLogger, pSource, error) < 0) {
+					pSource->m_bClosed = true;
+				}
+			} else if (bDiscarding) {
+				pSource->m_uReadRetries = 0;
+				discard_read(pLogger, pSource, uBytes);
+			} else {
+				pSource->m_uReadRetries = 0;
+				commit_read(pLogger, pSource, uBytes);
+				if (read_more(pLogger, pSource)) {
+					continue;
+				}
+			}
 		}
 
-		ret = write_with_timestamp(
-			pLogger, address, in, &out, &complained, charsize);
-		size += out;
-		if (ret < 0) {
-			close_handle(&pLogger->m_hRead);
-			close_handle(&pLogger->m_hWrite);
-			heap_free(pLogger);
-			return 3;
+		if (pump_logger(pLogger)) {
+			free_logger(pLogger);
 		}
 	}
 
-	close_handle(&pLogger->m_hRead);
-	close_handle(&pLogger->m_hWrite);
-	heap_free(pLogger);
 	return 0;
 }
@@ -7,6 +7,12 @@
 #ifndef __NSSM_IO_H__
 #define __NSSM_IO_H__
 
+#include "constants.h"
+#include "logbatch.h"
+#include "logbuffer.h"
+#include "logline.h"
+#include "logmap.h"
+#include "logsink.h"
 #include <stdint.h>
 
 #ifndef WIN32_LEAN_AND_MEAN
@@ -28,42 +34,394 @@
 #define NSSM_STDERR_DISPOSITION OPEN_ALWAYS
 #define NSSM_STDERR_FLAGS FILE_ATTRIBUTE_NORMAL
 
+// Most pipes merged into one log file, for stdout and stderr
+#define NSSM_LOG_SOURCES 2
+
+// Line written in place of output dropped because the log buffer was full
+#define NSSM_LOG_DROPPED_FORMAT \
+	"NSSM: %llu lines (%llu bytes) of output dropped\n"
+
+// Line written in place of output over the rate limit
+#define NSSM_LOG_SUPPRESSED_FORMAT \
+	"NSSM: %llu lines (%llu bytes) of output suppressed by rate limit\n"
+
+// Line written in place of repeats of the line before
+#define NSSM_LOG_REPEATED_FORMAT \
+	"NSSM: last line of output repeated %llu times\n"
+
+// Size in bytes of the buffer output is read into to be dropped
+#define NSSM_LOG_DISCARD_SIZE 65536
+
 struct nssm_service_t;
+struct log_index_t;
+struct log_filter_t;
+struct log_tail_t;
+struct time_index_t;
+
+// Work handed to the background log worker threads
+typedef void (*LogJobProc)(void* pParam);
+
+struct log_job_t {
+	// Next job in the queue
+	log_job_t* m_pNext;
+	// Function to call
+	LogJobProc m_pProc;
+	// Parameter to pass to m_pProc
+	void* m_pParam;
+	// True if the job may take a long time
+	bool m_bBulk;
+};
+
+struct log_rotation_t {
+	// Queue entry for the background rotator
+	log_job_t m_Job;
+	// Posted to the I/O thread when the rotator has finished
+	OVERLAPPED m_Overlapped;
+	// Handle to the log file while the rotator has it
+	HANDLE m_hFile;
+	// Name of the function which failed, for error reporting
+	const wchar_t* m_pFunction;
+	// Time of the rotation, as used in m_Rotated
+	SYSTEMTIME m_Time;
+	// GetTickCount() when the rotation started
+	uint32_t m_uStarted;
+	// Error code from the rotation, 0 on success
+	uint32_t m_uError;
+	// Pathname the old log file is rotated to
+	wchar_t m_Rotated[PATH_LENGTH];
+	// True once the rotator has posted the logger back to the I/O thread
+	bool m_bFinished;
+};
+
+struct log_flush_t {
+	// Queue entry for the background flusher
+	log_job_t m_Job;
+	// Posted to the I/O thread when the flusher has finished
+	OVERLAPPED m_Overlapped;
+	// Duplicate of the log file handle, so rotation can't pull it away
+	HANDLE m_hFile;
+	// Name of the function which failed, for error reporting
+	const wchar_t* m_pFunction;
+	// GetTickCount() when the flush started
+	uint32_t m_uStarted;
+	// Error code from FlushFileBuffers(), 0 on success
+	uint32_t m_uError;
+	// True while a rotation waits for the flush in flight to finish
+	bool m_bRotateWaiting;
+};
+
+struct log_write_t {
+	// Passed to WriteFile(), holding the offset the data goes at
+	OVERLAPPED m_Overlapped;
+	// Copy of the data being written
+	uint8_t* m_pData;
+	// Size of m_pData in bytes
+	uint32_t m_uSize;
+	// Bytes being written
+	uint32_t m_uLength;
+	// True while the write is in flight
+	bool m_bBusy;
+};
+
+struct log_async_t {
+	// Second handle to the log file, opened for overlapped writes
+	HANDLE m_hFile;
+	// Offset in the log file the next write goes at
+	uint64_t m_uOffset;
+	// Entries of m_Writes which may be used, 0 to write synchronously
+	uint32_t m_uBuffers;
+	// Number of writes in flight
+	uint32_t m_uInFlight;
+	// Writes which may be in flight at once
+	log_write_t m_Writes[NSSM_LOG_WRITE_BUFFERS_MAX];
+	// True while a rotation waits for the writes in flight to finish
+	bool m_bRotateWaiting;
+	// True if the last write went through the logger's own handle, whose
+	// file pointer then marks the end of the output instead of m_uOffset
+	bool m_bInLine;
+	// True once overlapped writes have been given up for good
+	bool m_bFailed;
+	// True from a write failing for lack of disk space until the writes
+	// from m_uSpillOffset on have been spilled, once none are in flight
+	bool m_bDiskFull;
+	// Offset of the first write which failed for lack of disk space
+	uint64_t m_uSpillOffset;
+	// Why that write failed
+	unsigned long m_uSpillError;
+};
+
+struct log_rate_t {
+	// Line tokens in thousandths, topped up by m_uLines every millisecond
+	int64_t m_iLines;
+	// Byte tokens in thousandths, negative while a long line is paid off
+	int64_t m_iBytes;
+	// Lines per second, 0 for no limit
+	uint32_t m_uLines;
+	// Bytes per second, 0 for no limit
+	uint32_t m_uBytes;
+	// Milliseconds of tokens the buckets hold when full
+	uint32_t m_uBurst;
+	// GetTickCount() when the buckets were last topped up
+	uint32_t m_uRefilled;
+};
+
+struct log_source_t {
+	// Handle for reading from the pipe
+	HANDLE m_hRead;
+	// Read in progress on the pipe
+	OVERLAPPED m_Overlapped;
+	// Data read from the pipe waiting to be written out
+	log_buffer_t m_Buffer;
+	// Length of a timestamp line
+	uint64_t m_uLineLength;
+	// Tag written before each line of merged output
+	const char* m_pTag;
+	// Name of the stream for JSON output
+	const char* m_pStream;
+	// Order in which the oldest data in m_Buffer arrived
+	uint32_t m_uArrival;
+	// UTF-16 high surrogate waiting for the rest of its pair, or 0
+	uint32_t m_uSurrogate;
+	// Unfinished UTF-8 sequence waiting to be converted to UTF-16, or 0
+	uint32_t m_uPending;
+	// Size of a character read from the pipe, 0 if not known yet
+	uint32_t m_uCharsize;
+	// Number of failed reads retried in a row
+	uint32_t m_uReadRetries;
+	// Lines dropped since the last dropped output line
+	uint64_t m_uDroppedLines;
+	// Bytes dropped since the last dropped output line
+	uint64_t m_uDroppedBytes;
+	// Bytes of m_Buffer to write before the dropped output line
+	uint32_t m_uDropMark;
+	// Lines over the rate limit since the last suppressed output line
+	uint64_t m_uSuppressedLines;
+	// Bytes over the rate limit since the last suppressed output line
+	uint64_t m_uSuppressedBytes;
+	// GetTickCount() when output was first suppressed since the last line
+	uint32_t m_uSuppressStarted;
+	// Suppressed output line, kept until the batch is written
+	char m_Suppressed[128];
+	// Hash of the last line let through when collapsing repeats
+	uint64_t m_uLastHash;
+	// Length in bytes of the last line let through
+	uint64_t m_uLastLength;
+	// Repeats of the last line since it or the last repeated line
+	uint64_t m_uRepeats;
+	// GetTickCount() when the first of m_uRepeats was read
+	uint32_t m_uRepeatStarted;
+	// Repeated line, kept until the batch is written
+	char m_Repeated[64];
+	// True while a read is in flight
+	bool m_bReading;
+	// True if the read in flight is to be dropped
+	bool m_bDiscarding;
+	// True once the pipe can't be read any more
+	bool m_bClosed;
+	// True if a dropped output line is waiting to be written
+	bool m_bDropPending;
+	// True to drop what is read up to the next newline
+	bool m_bSkipLine;
+	// True while the line being read is over the rate limit
+	bool m_bSuppressing;
+	// True while the line being read is dropped by the filter
+	bool m_bFiltered;
+	// True while the line being read has been let through by the filter
+	bool m_bFilterPassed;
+	// True once a line has been let through, so m_uLastHash is set
+	bool m_bHasLast;
+	// True while the line being read repeats the last one and is dropped
+	bool m_bRepeating;
+	// True while the line being read is different and let through
+	bool m_bRepeatPassed;
+};
 
 struct logger_t {
 	// Max size of the log file before starting a new one
 	uint64_t m_uSize;
-	// Length of a timestamp line
-	uint64_t m_uLineLength;
+	// Number of bytes in the current log file
+	uint64_t m_uFileSize;
+	// Local time of the next timed rotation, in FILETIME units
+	uint64_t m_uRotateBoundary;
+	// Number of lines written from merged pipes
+	uint64_t m_uSequence;
+	// Bytes held in m_Spill since the disk filled up
+	uint64_t m_uSpilled;
+	// Bytes lost since the disk filled up because m_Spill was full
+	uint64_t m_uSpillDropped;
+	// Lines dropped because the buffer was full
+	uint64_t m_uLinesDropped;
+	// Bytes dropped because the buffer was full
+	uint64_t m_uBytesDropped;
+	// Lines suppressed by the rate limit
+	uint64_t m_uLinesSuppressed;
+	// Bytes suppressed by the rate limit
+	uint64_t m_uBytesSuppressed;
+	// Lines dropped by the filter
+	uint64_t m_uLinesFiltered;
+	// Bytes dropped by the filter
+	uint64_t m_uBytesFiltered;
+	// Lines collapsed because they repeated the line before
+	uint64_t m_uLinesCollapsed;
+	// Bytes collapsed because they repeated the line before
+	uint64_t m_uBytesCollapsed;
+	// Bytes written since the last flush started
+	uint64_t m_uFlushDirty;
+	// Bytes covered by flushes
+	uint64_t m_uFlushedBytes;
 
 	// Name of the service being logged
 	const wchar_t* m_pServiceName;
 	// Pathname to the log file
 	const wchar_t* m_pPath;
 
-	// Handle for reading from a file
-	HANDLE m_hRead;
 	// Handle for writing to the log file
 	HANDLE m_hWrite;
+	// Event signalled once the logger has finished
+	HANDLE m_hFinished;
 
-	// Pointer to the monitored thread ID
-	uint32_t* m_pThreadID;
 	// Pointer to the log file rotation state
 	uint32_t* m_pRotateOnline;
+	// Pointer to the PID of the application
+	const uint32_t* m_pPID;
+	// Service name escaped for JSON output, NULL if not needed
+	char* m_pJsonService;
+	// Buffer for reads which will be dropped, NULL until needed
+	uint8_t* m_pDiscard;
+	// AppLogInclude and AppLogExclude compiled for 8 and 16 bit output
+	log_filter_t* m_pFilters[2];
+	// Ring of recent output for nssm tail, owned by the service, or NULL
+	log_tail_t* m_pTail;
+	// Times and offsets of writes to the log file, NULL if not wanted
+	time_index_t* m_pTimeIndex;
+
+	// Pipes written to the log file
+	log_source_t m_Sources[NSSM_LOG_SOURCES];
+	// Cached timestamp prefix
+	log_timestamp_t m_Timestamp;
+	// Timestamps and lines waiting to be written together
+	log_batch_t m_Batch;
+	// Rotation in progress on a worker thread
+	log_rotation_t m_Rotation;
+	// Flush in progress on a worker thread
+	log_flush_t m_Flush;
+	// Mapped window written to instead of calling WriteFile()
+	log_map_t m_Map;
+	// Overlapped writes to the log file
+	log_async_t m_Async;
+	// Output waiting for the log disk to have space again
+	log_buffer_t m_Spill;
+	// Token buckets for AppLogRateLines and AppLogRateBytes
+	log_rate_t m_Rate;
+	// Next logger with output in m_Spill
+	logger_t* m_pNextSpilling;
+	// Syslog and named pipe consumers
+	log_sink_t m_Sinks[NSSM_LOG_SINKS];
+	// Next logger with a sink waiting to connect or finish
+	logger_t* m_pNextWaiting;
+	// Next logger waiting for its timed flush
+	logger_t* m_pNextFlushing;
+	// Next logger with repeats waiting to be counted in the log
+	logger_t* m_pNextRepeating;
+	// Index of rotated files, NULL if not needed
+	log_index_t* m_pIndex;
 
 	// Delay in milliseconds for file rotation
 	uint32_t m_uRotateDelay;
+	// Seconds between timed rotations, 0 for none
+	uint32_t m_uRotateInterval;
+	// Milliseconds before repeats of a line are counted, 0 for no collapsing
+	uint32_t m_uCollapse;
+	// GetTickCount() when to check the clock against m_uRotateBoundary
+	uint32_t m_uRotateDue;
+	// Milliseconds to wait after a failed rotation, 0 if the last one worked
+	uint32_t m_uRotateBackoff;
+	// GetTickCount() when a failed rotation may be tried again
+	uint32_t m_uRotateRetry;
 	// File sharing flags for CreateFileW()
 	uint32_t m_uSharing;
 	// File disposition flags for CreateFileW()
 	uint32_t m_uDisposition;
 	// File flags for CreateFileW()
 	uint32_t m_uFlags;
+	// Size of a character in the log file, 0 if not known yet
+	uint32_t m_uCharsize;
+	// Number of entries in m_Sources in use
+	uint32_t m_uSources;
+	// Number of times data arrived, for ordering merged pipes
+	uint32_t m_uArrivals;
+	// Length of m_pJsonService in bytes
+	uint32_t m_uJsonServiceLength;
+	// UTF-16 high surrogate held back from the sinks, or 0
+	uint32_t m_uSinkSurrogate;
+	// Largest size of m_Spill in bytes, 0 to wait for the disk instead
+	uint32_t m_uSpillMax;
+	// NSSM_LOG_BACKPRESSURE_* policy for a full buffer
+	uint32_t m_uBackpressure;
+	// NSSM_LOG_FLUSH_* policy for the log file
+	uint32_t m_uFlushPolicy;
+	// Milliseconds or bytes between flushes
+	uint32_t m_uFlushAfter;
+	// GetTickCount() when the timed flush is due
+	uint32_t m_uFlushDue;
+	// COMPLAINED_* flags for errors already logged
+	int m_iComplained;
+
+	// Number of times the log file was rotated
+	uint32_t m_uRotations;
+	// Milliseconds writes were held back by rotations
+	uint32_t m_uRotateTime;
+	// Number of times the pipe went unread because of a rotation
+	uint32_t m_uStalls;
+	// Milliseconds the pipe went unread because of rotations
+	uint32_t m_uStallTime;
+	// GetTickCount() when the current stall started
+	uint32_t m_uStallStarted;
+	// GetTickCount() when the pipes closed with output left for the sinks
+	uint32_t m_uLingerStarted;
+	// Number of times the log file was flushed
+	uint32_t m_uFlushes;
+	// Milliseconds spent flushing the log file
+	uint32_t m_uFlushTime;
 
 	// True if timestamps should be created
 	bool m_bTimestampLog;
+	// True if each line is written as a JSON object
+	bool m_bJsonLog;
+	// True if the log file is written in UTF-8 whatever is read
+	bool m_bUtf8Log;
+	// True if lines over AppLogRateLines or AppLogRateBytes are suppressed
+	bool m_bRateLimit;
+	// True if lines are filtered by AppLogInclude and AppLogExclude
+	bool m_bFilter;
 	// True if files should be copied and trucated
 	bool m_bCopyAndTruncate;
+	// True if disk space is reserved for the file up to m_uSize
+	bool m_bPreallocate;
+	// True while m_Rotation is being worked on
+	bool m_bRotating;
+	// True if merged lines should be tagged with the pipe they came from
+	bool m_bMergeTags;
+	// True if merged lines should be numbered
+	bool m_bMergeSequence;
+	// True once the log file can't be written any more
+	bool m_bFailed;
+	// True while reads are held off because the buffer is full
+	bool m_bStalled;
+	// True while the logger is on the list of loggers with spilled output
+	bool m_bSpilling;
+	// True if output is sent to any of m_Sinks
+	bool m_bSinks;
+	// True while the logger is on the list of loggers with waiting sinks
+	bool m_bWaiting;
+	// True once the pipes closed with output left for the sinks
+	bool m_bLingering;
+	// True while m_Flush is being worked on
+	bool m_bFlushing;
+	// True while the logger is on the list of loggers with timed flushes
+	bool m_bFlushTimed;
+	// True while the logger is on the list of loggers with repeats
+	bool m_bRepeatTimed;
 };
 
 extern void close_handle(HANDLE* pHandle, HANDLE* pSaved);
@@ -80,7 +438,9 @@ extern HANDLE write_to_file(const wchar_t* pPath, uint32_t uSharing,
 	SECURITY_ATTRIBUTES* pAttributes, uint32_t uDisposition, uint32_t uFlags);
 extern void rotate_file(const wchar_t* pServiceName, const wchar_t* pPath,
 	uint32_t uSeconds, uint32_t uDelay, uint32_t uLow, uint32_t uHigh,
-	bool bCopyAndTruncate);
+	bool bCopyAndTruncate, log_index_t* pIndex);
+extern uint32_t parse_rotated_time(const wchar_t* pInput, uint64_t* pTime);
+extern uint64_t log_output_end(HANDLE hFile, uint64_t uSize);
 extern int get_output_handles(
 	nssm_service_t* pNSSMService, STARTUPINFOW* pStartupInfo);
 extern int use_output_handles(
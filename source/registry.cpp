@@ -359,6 +359,22 @@ int create_parameters(nssm_service_t* pNSSMService, bool bEditing)
 			delete_createfile_parameter(
 				hKey, g_NSSMRegStdOut, g_NSSMRegStdIOCopyAndTruncate);
 		}
+
+		if (pNSSMService->m_uStdoutFlush != NSSM_LOG_FLUSH_NEVER) {
+			set_createfile_parameter(hKey, g_NSSMRegStdOut, g_NSSMRegStdIOFlush,
+				pNSSMService->m_uStdoutFlush);
+		} else if (bEditing) {
+			delete_createfile_parameter(
+				hKey, g_NSSMRegStdOut, g_NSSMRegStdIOFlush);
+		}
+
+		if (pNSSMService->m_uStdoutFlushAfter) {
+			set_createfile_parameter(hKey, g_NSSMRegStdOut,
+				g_NSSMRegStdIOFlushAfter, pNSSMService->m_uStdoutFlushAfter);
+		} else if (bEditing) {
+			delete_createfile_parameter(
+				hKey, g_NSSMRegStdOut, g_NSSMRegStdIOFlushAfter);
+		}
 	}
 
 	if (pNSSMService->m_StderrPathname[0] || bEditing) {
@@ -400,6 +416,22 @@ int create_parameters(nssm_service_t* pNSSMService, bool bEditing)
 			delete_createfile_parameter(
 				hKey, g_NSSMRegStdErr, g_NSSMRegStdIOCopyAndTruncate);
 		}
+
+		if (pNSSMService->m_uStderrFlush != NSSM_LOG_FLUSH_NEVER) {
+			set_createfile_parameter(hKey, g_NSSMRegStdErr, g_NSSMRegStdIOFlush,
+				pNSSMService->m_uStderrFlush);
+		} else if (bEditing) {
+			delete_createfile_parameter(
+				hKey, g_NSSMRegStdErr, g_NSSMRegStdIOFlush);
+		}
+
+		if (pNSSMService->m_uStderrFlushAfter) {
+			set_createfile_parameter(hKey, g_NSSMRegStdErr,
+				g_NSSMRegStdIOFlushAfter, pNSSMService->m_uStderrFlushAfter);
+		} else if (bEditing) {
+			delete_createfile_parameter(
+				hKey, g_NSSMRegStdErr, g_NSSMRegStdIOFlushAfter);
+		}
 	}
 
 	if (pNSSMService->m_bTimestampLog) {
@@ -408,6 +440,30 @@ int create_parameters(nssm_service_t* pNSSMService, bool bEditing)
 		RegDeleteValueW(hKey, g_NSSMRegTimeStampLog);
 	}
 
+	if (pNSSMService->m_bJsonLog) {
+		set_number(hKey, g_NSSMRegJsonLog, 1);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegJsonLog);
+	}
+
+	if (pNSSMService->m_bUtf8Log) {
+		set_number(hKey, g_NSSMRegUtf8Log, 1);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegUtf8Log);
+	}
+
+	if (pNSSMService->m_bMergeTags) {
+		set_number(hKey, g_NSSMRegMergeTags, 1);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegMergeTags);
+	}
+
+	if (pNSSMService->m_bMergeSequence) {
+		set_number(hKey, g_NSSMRegMergeSequence, 1);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegMergeSequence);
+	}
+
 	if (pNSSMService->m_bHookShareOutputHandles) {
 		set_number(hKey, g_NSSMRegHookShareOutputHandles, 1);
 	} else if (bEditing) {
@@ -426,6 +482,12 @@ int create_parameters(nssm_service_t* pNSSMService, bool bEditing)
 		RegDeleteValueW(hKey, g_NSSMRegRotateOnline);
 	}
 
+	if (pNSSMService->m_bRotatePreallocate) {
+		set_number(hKey, g_NSSMRegRotatePreallocate, 1);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegRotatePreallocate);
+	}
+
 	if (pNSSMService->m_uRotateSeconds) {
 		set_number(
 			hKey, g_NSSMRegRotateSeconds, pNSSMService->m_uRotateSeconds);
@@ -433,6 +495,13 @@ int create_parameters(nssm_service_t* pNSSMService, bool bEditing)
 		RegDeleteValueW(hKey, g_NSSMRegRotateSeconds);
 	}
 
+	if (pNSSMService->m_uRotateInterval) {
+		set_number(
+			hKey, g_NSSMRegRotateInterval, pNSSMService->m_uRotateInterval);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegRotateInterval);
+	}
+
 	if (pNSSMService->m_uRotateBytesLow) {
 		set_number(
 			hKey, g_NSSMRegRotateBytesLow, pNSSMService->m_uRotateBytesLow);
@@ -447,12 +516,138 @@ int create_parameters(nssm_service_t* pNSSMService, bool bEditing)
 		RegDeleteValueW(hKey, g_NSSMRegRotateBytesHigh);
 	}
 
+	if (pNSSMService->m_uLogBufferMin != NSSM_LOG_BUFFER_MIN) {
+		set_number(hKey, g_NSSMRegLogBufferMin, pNSSMService->m_uLogBufferMin);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogBufferMin);
+	}
+
+	if (pNSSMService->m_uLogBufferMax != NSSM_LOG_BUFFER_MAX) {
+		set_number(hKey, g_NSSMRegLogBufferMax, pNSSMService->m_uLogBufferMax);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogBufferMax);
+	}
+
+	if (pNSSMService->m_uLogSpillMax != NSSM_LOG_SPILL_MAX) {
+		set_number(hKey, g_NSSMRegLogSpillMax, pNSSMService->m_uLogSpillMax);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogSpillMax);
+	}
+
+	if (pNSSMService->m_uLogBackpressure != NSSM_LOG_BACKPRESSURE_BLOCK) {
+		set_number(hKey, g_NSSMRegLogBackpressure,
+			pNSSMService->m_uLogBackpressure);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogBackpressure);
+	}
+
+	if (pNSSMService->m_uLogMapWindow) {
+		set_number(hKey, g_NSSMRegLogMapWindow, pNSSMService->m_uLogMapWindow);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogMapWindow);
+	}
+
+	if (pNSSMService->m_uLogWriteBuffers) {
+		set_number(
+			hKey, g_NSSMRegLogWriteBuffers, pNSSMService->m_uLogWriteBuffers);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogWriteBuffers);
+	}
+
+	if (pNSSMService->m_LogSyslog[0]) {
+		set_string(hKey, g_NSSMRegLogSyslog, pNSSMService->m_LogSyslog);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogSyslog);
+	}
+
+	if (pNSSMService->m_LogPipe[0]) {
+		set_string(hKey, g_NSSMRegLogPipe, pNSSMService->m_LogPipe);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogPipe);
+	}
+
+	if (pNSSMService->m_uLogSinkQueue != NSSM_LOG_SINK_QUEUE) {
+		set_number(hKey, g_NSSMRegLogSinkQueue, pNSSMService->m_uLogSinkQueue);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogSinkQueue);
+	}
+
+	if (pNSSMService->m_uLogRateLines) {
+		set_number(hKey, g_NSSMRegLogRateLines, pNSSMService->m_uLogRateLines);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogRateLines);
+	}
+
+	if (pNSSMService->m_uLogRateBytes) {
+		set_number(hKey, g_NSSMRegLogRateBytes, pNSSMService->m_uLogRateBytes);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogRateBytes);
+	}
+
+	if (pNSSMService->m_uLogRateBurst != NSSM_LOG_RATE_BURST) {
+		set_number(hKey, g_NSSMRegLogRateBurst, pNSSMService->m_uLogRateBurst);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogRateBurst);
+	}
+
+	if (pNSSMService->m_uLogTail != NSSM_LOG_TAIL) {
+		set_number(hKey, g_NSSMRegLogTail, pNSSMService->m_uLogTail);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogTail);
+	}
+
+	if (pNSSMService->m_uLogTimeIndex) {
+		set_number(hKey, g_NSSMRegLogTimeIndex, pNSSMService->m_uLogTimeIndex);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogTimeIndex);
+	}
+
+	if (pNSSMService->m_uLogCollapse) {
+		set_number(hKey, g_NSSMRegLogCollapse, pNSSMService->m_uLogCollapse);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogCollapse);
+	}
+
 	if (pNSSMService->m_uRotateDelay != NSSM_ROTATE_DELAY) {
 		set_number(hKey, g_NSSMRegRotateDelay, pNSSMService->m_uRotateDelay);
 	} else if (bEditing) {
 		RegDeleteValueW(hKey, g_NSSMRegRotateDelay);
 	}
 
+	if (pNSSMService->m_uRotateCompress) {
+		set_number(
+			hKey, g_NSSMRegRotateCompress, pNSSMService->m_uRotateCompress);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegRotateCompress);
+	}
+
+	if (pNSSMService->m_uRotateMaxFiles) {
+		set_number(
+			hKey, g_NSSMRegRotateMaxFiles, pNSSMService->m_uRotateMaxFiles);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegRotateMaxFiles);
+	}
+
+	if (pNSSMService->m_uRotateMaxBytesLow) {
+		set_number(hKey, g_NSSMRegRotateMaxBytesLow,
+			pNSSMService->m_uRotateMaxBytesLow);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegRotateMaxBytesLow);
+	}
+
+	if (pNSSMService->m_uRotateMaxBytesHigh) {
+		set_number(hKey, g_NSSMRegRotateMaxBytesHigh,
+			pNSSMService->m_uRotateMaxBytesHigh);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegRotateMaxBytesHigh);
+	}
+
+	if (pNSSMService->m_uRotateMaxAge) {
+		set_number(hKey, g_NSSMRegRotateMaxAge, pNSSMService->m_uRotateMaxAge);
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegRotateMaxAge);
+	}
+
 	if (pNSSMService->m_bDontSpawnConsole) {
 		set_number(hKey, g_NSSMRegNoConsole, 1);
 	} else if (bEditing) {
@@ -487,6 +682,31 @@ int create_parameters(nssm_service_t* pNSSMService, bool bEditing)
 		RegDeleteValueW(hKey, g_NSSMRegEnvExtra);
 	}
 
+	// Log filter
+	if (pNSSMService->m_pLogInclude) {
+		if (RegSetValueExW(hKey, g_NSSMRegLogInclude, 0, REG_MULTI_SZ,
+				reinterpret_cast<const BYTE*>(pNSSMService->m_pLogInclude),
+				static_cast<DWORD>(pNSSMService->m_uLogIncludeLength *
+					sizeof(wchar_t))) != ERROR_SUCCESS) {
+			log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_SETVALUE_FAILED,
+				g_NSSMRegLogInclude, error_string(GetLastError()), NULL);
+		}
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogInclude);
+	}
+
+	if (pNSSMService->m_pLogExclude) {
+		if (RegSetValueExW(hKey, g_NSSMRegLogExclude, 0, REG_MULTI_SZ,
+				reinterpret_cast<const BYTE*>(pNSSMService->m_pLogExclude),
+				static_cast<DWORD>(pNSSMService->m_uLogExcludeLength *
+					sizeof(wchar_t))) != ERROR_SUCCESS) {
+			log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_SETVALUE_FAILED,
+				g_NSSMRegLogExclude, error_string(GetLastError()), NULL);
+		}
+	} else if (bEditing) {
+		RegDeleteValueW(hKey, g_NSSMRegLogExclude);
+	}
+
 	// Close registry.
 	RegCloseKey(hKey);
 
@@ -614,6 +834,81 @@ int get_environment(const wchar_t* pServiceName, HKEY hKey,
 	return 0;
 }
 
+/***************************************
+
+	Get a list of strings from the registry
+
+	The list is double null terminated and its length counts both nulls.
+	A missing or empty value gives a NULL list.
+
+***************************************/
+
+int get_string_list(HKEY hKey, const wchar_t* pValueName, wchar_t** ppList,
+	uintptr_t* pListLength)
+{
+	// Previously initialised?
+	if (*ppList) {
+		heap_free(*ppList);
+		*ppList = NULL;
+	}
+	*pListLength = 0;
+
+	DWORD uType = REG_MULTI_SZ;
+	DWORD uSize;
+	LONG iResult = RegQueryValueExW(hKey, pValueName, 0, &uType, NULL, &uSize);
+	if (iResult != ERROR_SUCCESS) {
+		if (iResult == ERROR_FILE_NOT_FOUND) {
+			return 0;
+		}
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_QUERYVALUE_FAILED, pValueName,
+			error_string(static_cast<uint32_t>(iResult)), NULL);
+		return 1;
+	}
+	if (uType != REG_MULTI_SZ) {
+		return 2;
+	}
+
+	// Room for the nulls in case the value is missing them.
+	uintptr_t uLength = (uSize / sizeof(wchar_t)) + 2;
+	wchar_t* pList =
+		static_cast<wchar_t*>(heap_calloc(uLength * sizeof(wchar_t)));
+	if (!pList) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY, pValueName,
+			L"get_string_list()", NULL);
+		return 3;
+	}
+
+	iResult = RegQueryValueExW(
+		hKey, pValueName, 0, &uType, reinterpret_cast<BYTE*>(pList), &uSize);
+	if (iResult != ERROR_SUCCESS) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_QUERYVALUE_FAILED, pValueName,
+			error_string(static_cast<uint32_t>(iResult)), NULL);
+		heap_free(pList);
+		return 4;
+	}
+
+	// Skip any empty strings so the list doesn't end early.
+	uintptr_t uOut = 0;
+	uintptr_t uEnd = uSize / sizeof(wchar_t);
+	for (uintptr_t i = 0; i < uEnd; i++) {
+		if (pList[i] || (uOut && pList[uOut - 1])) {
+			pList[uOut++] = pList[i];
+		}
+	}
+	if (!uOut) {
+		heap_free(pList);
+		return 0;
+	}
+	if (pList[uOut - 1]) {
+		pList[uOut++] = 0;
+	}
+	pList[uOut++] = 0;
+
+	*ppList = pList;
+	*pListLength = uOut;
+	return 0;
+}
+
 /***************************************
 
 	Get a string from the registry, with or without expansion
@@ -1332,6 +1627,26 @@ int get_io_parameters(nssm_service_t* pNSSMService, HKEY hKey)
 		return 3;
 	}
 
+	/* When to flush the log files. */
+	if ((get_number(hKey, g_NSSMRegStdOutFlush, &pNSSMService->m_uStdoutFlush,
+			 false) != 1) ||
+		(pNSSMService->m_uStdoutFlush > NSSM_LOG_FLUSH_LINE)) {
+		pNSSMService->m_uStdoutFlush = NSSM_LOG_FLUSH_NEVER;
+	}
+	if (get_number(hKey, g_NSSMRegStdOutFlushAfter,
+			&pNSSMService->m_uStdoutFlushAfter, false) != 1) {
+		pNSSMService->m_uStdoutFlushAfter = 0;
+	}
+	if ((get_number(hKey, g_NSSMRegStdErrFlush, &pNSSMService->m_uStderrFlush,
+			 false) != 1) ||
+		(pNSSMService->m_uStderrFlush > NSSM_LOG_FLUSH_LINE)) {
+		pNSSMService->m_uStderrFlush = NSSM_LOG_FLUSH_NEVER;
+	}
+	if (get_number(hKey, g_NSSMRegStdErrFlushAfter,
+			&pNSSMService->m_uStderrFlushAfter, false) != 1) {
+		pNSSMService->m_uStderrFlushAfter = 0;
+	}
+
 	return 0;
 }
 
@@ -1496,6 +1811,14 @@ int get_parameters(
 			pNSSMService->m_uRotateStderrOnline = NSSM_ROTATE_OFFLINE;
 	}
 
+	uint32_t uPreallocate;
+	if (get_number(hKey, g_NSSMRegRotatePreallocate, &uPreallocate, false) ==
+		1) {
+		pNSSMService->m_bRotatePreallocate = uPreallocate != 0;
+	} else {
+		pNSSMService->m_bRotatePreallocate = false;
+	}
+
 	// Log timestamping requires a logging thread.
 	uint32_t uTimestampLog;
 	if (get_number(hKey, g_NSSMRegTimeStampLog, &uTimestampLog, false) == 1) {
@@ -1508,15 +1831,107 @@ int get_parameters(
 		pNSSMService->m_bTimestampLog = false;
 	}
 
+	// So does JSON output.
+	uint32_t uJsonLog;
+	if (get_number(hKey, g_NSSMRegJsonLog, &uJsonLog, false) == 1) {
+		pNSSMService->m_bJsonLog = uJsonLog != 0;
+	} else {
+		pNSSMService->m_bJsonLog = false;
+	}
+
+	// And so does converting output to UTF-8.
+	uint32_t uUtf8Log;
+	if (get_number(hKey, g_NSSMRegUtf8Log, &uUtf8Log, false) == 1) {
+		pNSSMService->m_bUtf8Log = uUtf8Log != 0;
+	} else {
+		pNSSMService->m_bUtf8Log = false;
+	}
+
+	// Tagging and numbering merged output also need a logging thread.
+	uint32_t uMergeTags;
+	if (get_number(hKey, g_NSSMRegMergeTags, &uMergeTags, false) == 1) {
+		pNSSMService->m_bMergeTags = uMergeTags != 0;
+	} else {
+		pNSSMService->m_bMergeTags = false;
+	}
+	uint32_t uMergeSequence;
+	if (get_number(hKey, g_NSSMRegMergeSequence, &uMergeSequence, false) ==
+		1) {
+		pNSSMService->m_bMergeSequence = uMergeSequence != 0;
+	} else {
+		pNSSMService->m_bMergeSequence = false;
+	}
+
+	// As does sending output to syslog or a named pipe.
+	if (get_string(hKey, g_NSSMRegLogSyslog, pNSSMService->m_LogSyslog,
+			sizeof(pNSSMService->m_LogSyslog), false, false, false)) {
+		pNSSMService->m_LogSyslog[0] = 0;
+	}
+	if (get_string(hKey, g_NSSMRegLogPipe, pNSSMService->m_LogPipe,
+			sizeof(pNSSMService->m_LogPipe), false, false, false)) {
+		pNSSMService->m_LogPipe[0] = 0;
+	}
+
+	// And so does limiting the rate of output.
+	if (get_number(hKey, g_NSSMRegLogRateLines,
+			&pNSSMService->m_uLogRateLines, false) != 1) {
+		pNSSMService->m_uLogRateLines = 0;
+	}
+	if (get_number(hKey, g_NSSMRegLogRateBytes,
+			&pNSSMService->m_uLogRateBytes, false) != 1) {
+		pNSSMService->m_uLogRateBytes = 0;
+	}
+	if ((get_number(hKey, g_NSSMRegLogRateBurst,
+			 &pNSSMService->m_uLogRateBurst, false) != 1) ||
+		!pNSSMService->m_uLogRateBurst) {
+		pNSSMService->m_uLogRateBurst = NSSM_LOG_RATE_BURST;
+	}
+	if (pNSSMService->m_uLogRateBurst > NSSM_LOG_RATE_BURST_MAX) {
+		pNSSMService->m_uLogRateBurst = NSSM_LOG_RATE_BURST_MAX;
+	}
+
+	// Keeping recent output in memory doesn't need interception itself.
+	if (get_number(hKey, g_NSSMRegLogTail,
+			&pNSSMService->m_uLogTail, false) != 1) {
+		pNSSMService->m_uLogTail = NSSM_LOG_TAIL;
+	}
+	if (pNSSMService->m_uLogTail > NSSM_LOG_TAIL_MAX) {
+		pNSSMService->m_uLogTail = NSSM_LOG_TAIL_MAX;
+	}
+
+	// But filtering it does, as do indexing it by time and collapsing it.
+	get_string_list(hKey, g_NSSMRegLogInclude, &pNSSMService->m_pLogInclude,
+		&pNSSMService->m_uLogIncludeLength);
+	get_string_list(hKey, g_NSSMRegLogExclude, &pNSSMService->m_pLogExclude,
+		&pNSSMService->m_uLogExcludeLength);
+	if (get_number(hKey, g_NSSMRegLogTimeIndex,
+			&pNSSMService->m_uLogTimeIndex, false) != 1) {
+		pNSSMService->m_uLogTimeIndex = 0;
+	}
+	if (get_number(hKey, g_NSSMRegLogCollapse,
+			&pNSSMService->m_uLogCollapse, false) != 1) {
+		pNSSMService->m_uLogCollapse = 0;
+	}
+	bool bMergeLog = pNSSMService->m_bJsonLog || pNSSMService->m_bUtf8Log ||
+		pNSSMService->m_bMergeTags || pNSSMService->m_bMergeSequence ||
+		pNSSMService->m_LogSyslog[0] || pNSSMService->m_LogPipe[0] ||
+		pNSSMService->m_uLogRateLines || pNSSMService->m_uLogRateBytes ||
+		pNSSMService->m_pLogInclude || pNSSMService->m_pLogExclude ||
+		pNSSMService->m_uLogTimeIndex || pNSSMService->m_uLogCollapse;
+
 	// Hook I/O sharing and online rotation need a pipe.
 	pNSSMService->m_bUseStdoutPipe = pNSSMService->m_uRotateStdoutOnline ||
-		pNSSMService->m_bTimestampLog || uHookShareOutputHandles;
+		pNSSMService->m_bTimestampLog || bMergeLog || uHookShareOutputHandles;
 	pNSSMService->m_bUseStderrPipe = pNSSMService->m_uRotateStderrOnline ||
-		pNSSMService->m_bTimestampLog || uHookShareOutputHandles;
+		pNSSMService->m_bTimestampLog || bMergeLog || uHookShareOutputHandles;
 
 	if (get_number(hKey, g_NSSMRegRotateSeconds,
 			&pNSSMService->m_uRotateSeconds, false) != 1)
 		pNSSMService->m_uRotateSeconds = 0;
+	if (get_number(hKey, g_NSSMRegRotateInterval,
+			&pNSSMService->m_uRotateInterval, false) != 1) {
+		pNSSMService->m_uRotateInterval = 0;
+	}
 
 	if (get_number(hKey, g_NSSMRegRotateBytesLow,
 			&pNSSMService->m_uRotateBytesLow, false) != 1) {
@@ -1527,10 +1942,81 @@ int get_parameters(
 		pNSSMService->m_uRotateBytesHigh = 0;
 	}
 
+	// Try to get the logging buffer limits - may fail.
+	if (get_number(hKey, g_NSSMRegLogBufferMin,
+			&pNSSMService->m_uLogBufferMin, false) != 1) {
+		pNSSMService->m_uLogBufferMin = NSSM_LOG_BUFFER_MIN;
+	}
+	if (get_number(hKey, g_NSSMRegLogBufferMax,
+			&pNSSMService->m_uLogBufferMax, false) != 1) {
+		pNSSMService->m_uLogBufferMax = NSSM_LOG_BUFFER_MAX;
+	}
+	if (pNSSMService->m_uLogBufferMin < NSSM_LOG_BUFFER_FLOOR) {
+		pNSSMService->m_uLogBufferMin = NSSM_LOG_BUFFER_FLOOR;
+	}
+	if (pNSSMService->m_uLogBufferMax < pNSSMService->m_uLogBufferMin) {
+		pNSSMService->m_uLogBufferMax = pNSSMService->m_uLogBufferMin;
+	}
+	if (get_number(hKey, g_NSSMRegLogSpillMax, &pNSSMService->m_uLogSpillMax,
+			false) != 1) {
+		pNSSMService->m_uLogSpillMax = NSSM_LOG_SPILL_MAX;
+	}
+	if ((get_number(hKey, g_NSSMRegLogBackpressure,
+			 &pNSSMService->m_uLogBackpressure, false) != 1) ||
+		(pNSSMService->m_uLogBackpressure >
+			NSSM_LOG_BACKPRESSURE_DROP_NEWEST)) {
+		pNSSMService->m_uLogBackpressure = NSSM_LOG_BACKPRESSURE_BLOCK;
+	}
+	if (get_number(hKey, g_NSSMRegLogMapWindow, &pNSSMService->m_uLogMapWindow,
+			false) != 1) {
+		pNSSMService->m_uLogMapWindow = 0;
+	}
+	if (pNSSMService->m_uLogMapWindow > NSSM_LOG_MAP_WINDOW_MAX) {
+		pNSSMService->m_uLogMapWindow = NSSM_LOG_MAP_WINDOW_MAX;
+	}
+	if (get_number(hKey, g_NSSMRegLogWriteBuffers,
+			&pNSSMService->m_uLogWriteBuffers, false) != 1) {
+		pNSSMService->m_uLogWriteBuffers = 0;
+	}
+	if (pNSSMService->m_uLogWriteBuffers > NSSM_LOG_WRITE_BUFFERS_MAX) {
+		pNSSMService->m_uLogWriteBuffers = NSSM_LOG_WRITE_BUFFERS_MAX;
+	}
+	if (get_number(hKey, g_NSSMRegLogSinkQueue, &pNSSMService->m_uLogSinkQueue,
+			false) != 1) {
+		pNSSMService->m_uLogSinkQueue = NSSM_LOG_SINK_QUEUE;
+	}
+	if (pNSSMService->m_uLogSinkQueue < NSSM_LOG_BUFFER_FLOOR) {
+		pNSSMService->m_uLogSinkQueue = NSSM_LOG_BUFFER_FLOOR;
+	}
+
 	override_milliseconds(pNSSMService->m_Name, hKey, g_NSSMRegRotateDelay,
 		&pNSSMService->m_uRotateDelay, NSSM_ROTATE_DELAY,
 		NSSM_EVENT_BOGUS_THROTTLE);
 
+	// Try to get the compression level for rotated files - may fail.
+	if (get_number(hKey, g_NSSMRegRotateCompress,
+			&pNSSMService->m_uRotateCompress, false) != 1) {
+		pNSSMService->m_uRotateCompress = 0;
+	}
+
+	// Try to get the retention limits for rotated files - may fail.
+	if (get_number(hKey, g_NSSMRegRotateMaxFiles,
+			&pNSSMService->m_uRotateMaxFiles, false) != 1) {
+		pNSSMService->m_uRotateMaxFiles = 0;
+	}
+	if (get_number(hKey, g_NSSMRegRotateMaxBytesLow,
+			&pNSSMService->m_uRotateMaxBytesLow, false) != 1) {
+		pNSSMService->m_uRotateMaxBytesLow = 0;
+	}
+	if (get_number(hKey, g_NSSMRegRotateMaxBytesHigh,
+			&pNSSMService->m_uRotateMaxBytesHigh, false) != 1) {
+		pNSSMService->m_uRotateMaxBytesHigh = 0;
+	}
+	if (get_number(hKey, g_NSSMRegRotateMaxAge,
+			&pNSSMService->m_uRotateMaxAge, false) != 1) {
+		pNSSMService->m_uRotateMaxAge = 0;
+	}
+
 	// Try to get force new console setting - may fail.
 	if (get_number(hKey, g_NSSMRegNoConsole, &pNSSMService->m_bDontSpawnConsole,
 			false) != 1) {
@@ -28,6 +28,8 @@ extern int create_exit_action(
 extern int get_environment(const wchar_t* pServiceName, HKEY hKey,
 	const wchar_t* pValueName, wchar_t** ppEnvironmentVariables,
 	uintptr_t* pEnvironmentVariablesLength);
+extern int get_string_list(HKEY hKey, const wchar_t* pValueName,
+	wchar_t** ppList, uintptr_t* pListLength);
 extern int get_string(HKEY hKey, const wchar_t* pValueName, wchar_t* pBuffer,
 	uint32_t uBufferLength, bool bExpand, bool bSanitize, bool bMustExist);
 extern int get_string(HKEY hKey, const wchar_t* pValueName, wchar_t* pBuffer,
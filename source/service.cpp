@@ -1121,6 +1121,12 @@ void set_nssm_service_defaults(nssm_service_t* pNSSMService)
 		pNSSMService->m_uKillWindowDelay = NSSM_KILL_WINDOW_GRACE_PERIOD;
 		pNSSMService->m_uKillThreadsDelay = NSSM_KILL_THREADS_GRACE_PERIOD;
 		pNSSMService->m_bKillProcessTree = true;
+		pNSSMService->m_uLogBufferMin = NSSM_LOG_BUFFER_MIN;
+		pNSSMService->m_uLogBufferMax = NSSM_LOG_BUFFER_MAX;
+		pNSSMService->m_uLogSpillMax = NSSM_LOG_SPILL_MAX;
+		pNSSMService->m_uLogSinkQueue = NSSM_LOG_SINK_QUEUE;
+		pNSSMService->m_uLogRateBurst = NSSM_LOG_RATE_BURST;
+		pNSSMService->m_uLogTail = NSSM_LOG_TAIL;
 	}
 }
 
@@ -1158,6 +1164,12 @@ void cleanup_nssm_service(nssm_service_t* pNSSMService)
 		if (pNSSMService->m_pExtraEnvironmentVariables) {
 			heap_free(pNSSMService->m_pExtraEnvironmentVariables);
 		}
+		if (pNSSMService->m_pLogInclude) {
+			heap_free(pNSSMService->m_pLogInclude);
+		}
+		if (pNSSMService->m_pLogExclude) {
+			heap_free(pNSSMService->m_pLogExclude);
+		}
 		if (pNSSMService->m_hServiceControlManager) {
 			CloseServiceHandle(pNSSMService->m_hServiceControlManager);
 		}
@@ -23,6 +23,8 @@
 #define NSSM_ROTATE_ONLINE 1
 #define NSSM_ROTATE_ONLINE_ASAP 2
 
+struct log_tail_t;
+
 struct nssm_service_t {
 
 	// CPU affinity flags
@@ -56,6 +58,16 @@ struct nssm_service_t {
 	// Length of m_pExtraEnvironmentVariables
 	uintptr_t m_uExtraEnvironmentVariablesLength;
 
+	// Patterns a line of output must contain one of to be logged
+	wchar_t* m_pLogInclude;
+	// Length of m_pLogInclude
+	uintptr_t m_uLogIncludeLength;
+
+	// Patterns which stop a line of output being logged
+	wchar_t* m_pLogExclude;
+	// Length of m_pLogExclude
+	uintptr_t m_uLogExcludeLength;
+
 	// String with the initial environment variables
 	wchar_t* m_pInitialEnvironmentVariables;
 
@@ -66,16 +78,21 @@ struct nssm_service_t {
 	HANDLE m_hStdoutInputPipe;
 	// Stdout output pipe
 	HANDLE m_hStdoutOutputPipe;
-	// Stdout thread handle
+	// Event signalled when the stdout logger has finished
 	HANDLE m_hStdoutThread;
 
 	// Stderr input pipe
 	HANDLE m_hStderrInputPipe;
 	// Stderr output pipe
 	HANDLE m_hStderrOutputPipe;
-	// Stderr thread handle
+	// Event signalled when the stderr logger has finished
 	HANDLE m_hStderrThread;
 
+	// Recent output of the stdout and stderr loggers, kept across restarts
+	log_tail_t* volatile m_pTails[2];
+	// Thread serving m_pTails to nssm tail
+	HANDLE m_hTailServer;
+
 	// Handle for the throttling timer
 	HANDLE m_hThrottleTimer;
 	// Handle for the process under our control
@@ -131,10 +148,49 @@ struct nssm_service_t {
 	uint32_t m_uRotateDelay;
 	// Restrict rotation to files older than this length in seconds
 	uint32_t m_uRotateSeconds;
+	// Seconds between online rotations on wall clock boundaries, 0 for none
+	uint32_t m_uRotateInterval;
 	// Lower 32 bits of the file size needed to rotate logs
 	uint32_t m_uRotateBytesLow;
 	// Upper 32 bits of the file size needed to rotate logs
 	uint32_t m_uRotateBytesHigh;
+	// Smallest size in bytes of the logging thread's read buffer
+	uint32_t m_uLogBufferMin;
+	// Largest size in bytes of the logging thread's read buffer
+	uint32_t m_uLogBufferMax;
+	// Largest size in bytes of output held while the log disk is full
+	uint32_t m_uLogSpillMax;
+	// NSSM_LOG_BACKPRESSURE_* policy when the log buffer is full
+	uint32_t m_uLogBackpressure;
+	// Bytes of the log file mapped at once to write through, 0 for none
+	uint32_t m_uLogMapWindow;
+	// Overlapped writes to each log file in flight at once, 0 for none
+	uint32_t m_uLogWriteBuffers;
+	// Largest size in bytes of the queue for each syslog or pipe sink
+	uint32_t m_uLogSinkQueue;
+	// Lines per second written to each log file, 0 for no limit
+	uint32_t m_uLogRateLines;
+	// Bytes per second written to each log file, 0 for no limit
+	uint32_t m_uLogRateBytes;
+	// Milliseconds of output let through at once by the rate limit
+	uint32_t m_uLogRateBurst;
+	// Bytes of recent output kept in memory for nssm tail, 0 for none
+	uint32_t m_uLogTail;
+	// Bytes of output between entries in the log files' time index, 0 for none
+	uint32_t m_uLogTimeIndex;
+	// Milliseconds before repeats of a line are counted in the log, 0 to
+	// write every line
+	uint32_t m_uLogCollapse;
+	// gzip level for compressing rotated logs, 0 to leave them alone
+	uint32_t m_uRotateCompress;
+	// Most rotated logs to keep, 0 for no limit
+	uint32_t m_uRotateMaxFiles;
+	// Lower 32 bits of the most bytes of rotated logs to keep
+	uint32_t m_uRotateMaxBytesLow;
+	// Upper 32 bits of the most bytes of rotated logs to keep
+	uint32_t m_uRotateMaxBytesHigh;
+	// Delete rotated logs older than this length in seconds, 0 to keep them
+	uint32_t m_uRotateMaxAge;
 
 	// Stdin file sharing flags for CreateFileW()
 	uint32_t m_uStdinSharing;
@@ -149,7 +205,11 @@ struct nssm_service_t {
 	uint32_t m_uStdoutDisposition;
 	// Stdout file flags for CreateFileW()
 	uint32_t m_uStdoutFlags;
-	// Stdout file thread ID
+	// NSSM_LOG_FLUSH_* policy for the stdout log file
+	uint32_t m_uStdoutFlush;
+	// Milliseconds or bytes between flushes of stdout, 0 for the default
+	uint32_t m_uStdoutFlushAfter;
+	// ID of the thread logging stdout
 	uint32_t m_uStdoutTID;
 	// NSSM_ROTATE_* enumeration for stdout
 	uint32_t m_uRotateStdoutOnline;
@@ -160,7 +220,11 @@ struct nssm_service_t {
 	uint32_t m_uStderrDisposition;
 	// Stderr file flags for CreateFileW()
 	uint32_t m_uStderrFlags;
-	// Stderr file thread ID
+	// NSSM_LOG_FLUSH_* policy for the stderr log file
+	uint32_t m_uStderrFlush;
+	// Milliseconds or bytes between flushes of stderr, 0 for the default
+	uint32_t m_uStderrFlushAfter;
+	// ID of the thread logging stderr
 	uint32_t m_uStderrTID;
 	// NSSM_ROTATE_* enumeration for stderr
 	uint32_t m_uRotateStderrOnline;
@@ -199,6 +263,10 @@ struct nssm_service_t {
 	wchar_t m_StdoutPathname[PATH_LENGTH];
 	// Pathname of file to point to for stderr
 	wchar_t m_StderrPathname[PATH_LENGTH];
+	// host[:port] of a syslog server to send output to as well
+	wchar_t m_LogSyslog[PATH_LENGTH];
+	// Named pipe to send output to as well
+	wchar_t m_LogPipe[PATH_LENGTH];
 
 	// Redirect stdout
 	bool m_bUseStdoutPipe;
@@ -215,8 +283,18 @@ struct nssm_service_t {
 	bool m_bKillProcessTree;
 	// True if log files are rotated
 	bool m_bRotateFiles;
+	// Reserve disk space for log files up to the rotation size
+	bool m_bRotatePreallocate;
 	// Add a timestamp when logging
 	bool m_bTimestampLog;
+	// Log each line as a JSON object
+	bool m_bJsonLog;
+	// Convert logged output to UTF-8
+	bool m_bUtf8Log;
+	// Tag merged stdout and stderr lines with their source
+	bool m_bMergeTags;
+	// Number merged stdout and stderr lines
+	bool m_bMergeSequence;
 
 	// m_ThrottleSection is valid
 	bool m_bThrottleSectionValid;
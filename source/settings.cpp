@@ -936,6 +936,126 @@ static int setting_dump_environment(const wchar_t* pServiceName, void* pParam,
 	return 0;
 }
 
+/***************************************
+
+	Functions to manage lists of strings, one per line when shown
+
+***************************************/
+
+static int setting_set_string_list(const wchar_t* pServiceName, void* pParam,
+	const wchar_t* pName, void* /* pDefaultValue */, value_t* pValue,
+	const wchar_t* /* pAdditional */)
+{
+	HKEY hKey = static_cast<HKEY>(pParam);
+	if (!hKey) {
+		return -1;
+	}
+
+	wchar_t* pList = NULL;
+	uintptr_t uLength = 0;
+	if (pValue && pValue->m_pString &&
+		unformat_double_null(pValue->m_pString, wcslen(pValue->m_pString),
+			&pList, &uLength)) {
+		return -1;
+	}
+
+	if (!uLength) {
+		long iError = RegDeleteValueW(hKey, pName);
+		if ((iError == ERROR_SUCCESS) || (iError == ERROR_FILE_NOT_FOUND)) {
+			return 0;
+		}
+		print_message(stderr, NSSM_MESSAGE_REGDELETEVALUE_FAILED, pName,
+			pServiceName, error_string(static_cast<uint32_t>(iError)));
+		return -1;
+	}
+
+	if (RegSetValueExW(hKey, pName, 0, REG_MULTI_SZ,
+			reinterpret_cast<const BYTE*>(pList),
+			static_cast<DWORD>(uLength * sizeof(wchar_t))) != ERROR_SUCCESS) {
+		heap_free(pList);
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_SETVALUE_FAILED, pName,
+			error_string(GetLastError()), NULL);
+		return -1;
+	}
+
+	heap_free(pList);
+	return 1;
+}
+
+static int setting_get_string_list(const wchar_t* /* pServiceName */,
+	void* pParam, const wchar_t* pName, void* /* pDefaultValue */,
+	value_t* pValue, const wchar_t* /* pAdditional */)
+{
+	HKEY hKey = static_cast<HKEY>(pParam);
+	if (!hKey) {
+		return -1;
+	}
+
+	wchar_t* pList = NULL;
+	uintptr_t uLength;
+	if (get_string_list(hKey, pName, &pList, &uLength)) {
+		return -1;
+	}
+	if (!uLength) {
+		return 0;
+	}
+
+	wchar_t* pFormatted = NULL;
+	uintptr_t uNewLength;
+	int iResult = format_double_null(pList, uLength, &pFormatted, &uNewLength);
+	heap_free(pList);
+	if (iResult) {
+		return -1;
+	}
+
+	iResult = value_from_string(pName, pValue, pFormatted);
+	heap_free(pFormatted);
+	return iResult;
+}
+
+static int setting_dump_string_list(const wchar_t* pServiceName, void* pParam,
+	const wchar_t* pName, void* /* pDefaultValue */, value_t* /* pValue */,
+	const wchar_t* /* pAdditional */)
+{
+	HKEY hKey = static_cast<HKEY>(pParam);
+	if (!hKey) {
+		return -1;
+	}
+
+	wchar_t* pList = NULL;
+	uintptr_t uLength;
+	if (get_string_list(hKey, pName, &pList, &uLength)) {
+		return -1;
+	}
+	if (!uLength) {
+		return 0;
+	}
+
+	wchar_t quoted_service_name[SERVICE_NAME_LENGTH * 2];
+	wchar_t quoted_nssm[EXE_LENGTH * 2];
+	if (quote(pServiceName, quoted_service_name,
+			RTL_NUMBER_OF(quoted_service_name)) ||
+		quote(nssm_exe(), quoted_nssm, RTL_NUMBER_OF(quoted_nssm))) {
+		heap_free(pList);
+		return 1;
+	}
+
+	/* Each string is a separate argument, as it would have been given. */
+	wprintf(L"%s set %s %s", quoted_nssm, quoted_service_name, pName);
+	for (const wchar_t* s = pList; *s; s += wcslen(s) + 1) {
+		wchar_t quoted_value[VALUE_LENGTH * 2];
+		if (quote(s, quoted_value, RTL_NUMBER_OF(quoted_value))) {
+			heap_free(pList);
+			wprintf(L"\n");
+			return 2;
+		}
+		wprintf(L" %s", quoted_value);
+	}
+	wprintf(L"\n");
+	heap_free(pList);
+	return 0;
+}
+
 static int setting_set_priority(const wchar_t* pServiceName, void* pParam,
 	const wchar_t* pName, void* pDefaultValue, value_t* pValue,
 	const wchar_t* /* pAdditional */)
@@ -2232,6 +2352,10 @@ const settings_t g_Settings[] = {
 		setting_set_number, setting_get_number, NULL},
 	{g_NSSMRegStdOutCopyAndTruncate, REG_DWORD, NULL, false, 0,
 		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegStdOutFlush, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegStdOutFlushAfter, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
 	{g_NSSMRegStdErr, REG_EXPAND_SZ, NULL, false, 0, setting_set_string,
 		setting_get_string, NULL},
 	{g_NSSMRegStdErrSharing, REG_DWORD, (void*)NSSM_STDERR_SHARING, false, 0,
@@ -2242,6 +2366,10 @@ const settings_t g_Settings[] = {
 		setting_set_number, setting_get_number, 0},
 	{g_NSSMRegStdErrCopyAndTruncate, REG_DWORD, NULL, false, 0,
 		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegStdErrFlush, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegStdErrFlushAfter, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
 	{g_NSSMRegStopMethodSkip, REG_DWORD, NULL, false, 0, setting_set_number,
 		setting_get_number, NULL},
 	{g_NSSMRegKillConsoleGracePeriod, REG_DWORD,
@@ -2265,14 +2393,72 @@ const settings_t g_Settings[] = {
 		setting_get_number, NULL},
 	{g_NSSMRegRotateSeconds, REG_DWORD, NULL, false, 0, setting_set_number,
 		setting_get_number, NULL},
+	{g_NSSMRegRotateInterval, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
 	{g_NSSMRegRotateBytesLow, REG_DWORD, NULL, false, 0, setting_set_number,
 		setting_get_number, NULL},
 	{g_NSSMRegRotateBytesHigh, REG_DWORD, NULL, false, 0, setting_set_number,
 		setting_get_number, NULL},
+	{g_NSSMRegRotatePreallocate, REG_DWORD, NULL, false, 0,
+		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegLogBufferMin, REG_DWORD, (void*)NSSM_LOG_BUFFER_MIN, false, 0,
+		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegLogBufferMax, REG_DWORD, (void*)NSSM_LOG_BUFFER_MAX, false, 0,
+		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegLogSpillMax, REG_DWORD, (void*)NSSM_LOG_SPILL_MAX, false, 0,
+		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegLogBackpressure, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegLogMapWindow, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegLogWriteBuffers, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegLogSyslog, REG_SZ, NULL, false, 0, setting_set_string,
+		setting_get_string, NULL},
+	{g_NSSMRegLogPipe, REG_SZ, NULL, false, 0, setting_set_string,
+		setting_get_string, NULL},
+	{g_NSSMRegLogSinkQueue, REG_DWORD, (void*)NSSM_LOG_SINK_QUEUE, false, 0,
+		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegLogRateLines, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegLogRateBytes, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegLogRateBurst, REG_DWORD, (void*)NSSM_LOG_RATE_BURST, false, 0,
+		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegLogInclude, REG_MULTI_SZ, NULL, false, ADDITIONAL_CRLF,
+		setting_set_string_list, setting_get_string_list,
+		setting_dump_string_list},
+	{g_NSSMRegLogExclude, REG_MULTI_SZ, NULL, false, ADDITIONAL_CRLF,
+		setting_set_string_list, setting_get_string_list,
+		setting_dump_string_list},
+	{g_NSSMRegLogCollapse, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegLogTail, REG_DWORD, (void*)NSSM_LOG_TAIL, false, 0,
+		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegLogTimeIndex, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
 	{g_NSSMRegRotateDelay, REG_DWORD, (void*)NSSM_ROTATE_DELAY, false, 0,
 		setting_set_number, setting_get_number, NULL},
+	{g_NSSMRegRotateCompress, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegRotateMaxFiles, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegRotateMaxBytesLow, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegRotateMaxBytesHigh, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegRotateMaxAge, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
 	{g_NSSMRegTimeStampLog, REG_DWORD, NULL, false, 0, setting_set_number,
 		setting_get_number, NULL},
+	{g_NSSMRegJsonLog, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegUtf8Log, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegMergeTags, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
+	{g_NSSMRegMergeSequence, REG_DWORD, NULL, false, 0, setting_set_number,
+		setting_get_number, NULL},
 	{g_NSSMNativeDependOnGroup, REG_MULTI_SZ, NULL, true, ADDITIONAL_CRLF,
 		native_set_dependongroup, native_get_dependongroup,
 		native_dump_dependongroup},
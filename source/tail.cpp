@@ -0,0 +1,439 @@
+/***************************************
+
+	Recent output kept in memory
+
+	Each logger copies what it writes into a ring which outlives it, so
+	the last output of the application can be read without opening the
+	log file, even across restarts.  The logging thread is the only writer
+	and never waits for readers.  It claims the space it is about to
+	overwrite, copies, then publishes the new end.  A reader copies what
+	it wants and then checks the claim to see how much of its copy may
+	have been overwritten meanwhile, throwing that part away.
+
+	The service serves the rings on a named pipe, one thread per client,
+	for nssm tail.
+
+***************************************/
+
+#include "tail.h"
+#include "event.h"
+#include "memorymanager.h"
+#include "messages.h"
+#include "nssm.h"
+#include "service.h"
+
+#include <sddl.h>
+#include <stdio.h>
+#include <wchar.h>
+
+#include <strsafe.h>
+
+// Only Administrators and SYSTEM may read output, and not over the network
+#define NSSM_TAIL_SDDL L"D:P(D;;GA;;;NU)(A;;GA;;;SY)(A;;GA;;;BA)"
+
+struct tail_client_t {
+	// Service whose output is served
+	nssm_service_t* m_pNSSMService;
+	// Server end of the pipe
+	HANDLE m_hPipe;
+};
+
+/* Read a 64 bit counter written by another thread. */
+static inline uint64_t tail_counter(volatile LONG64* pCounter)
+{
+	return static_cast<uint64_t>(InterlockedCompareExchange64(pCounter, 0, 0));
+}
+
+/***************************************
+
+	Allocate a ring holding at least uSize bytes
+
+***************************************/
+
+log_tail_t* create_tail(uint32_t uSize)
+{
+	uint32_t uRing = 4096;
+	while (uRing < uSize) {
+		uRing <<= 1;
+	}
+
+	log_tail_t* pTail =
+		static_cast<log_tail_t*>(heap_calloc(sizeof(log_tail_t)));
+	if (!pTail) {
+		return NULL;
+	}
+	pTail->m_pData = static_cast<uint8_t*>(heap_alloc(uRing));
+	if (!pTail->m_pData) {
+		heap_free(pTail);
+		return NULL;
+	}
+	pTail->m_uSize = uRing;
+	return pTail;
+}
+
+/***************************************
+
+	Add output to the ring, overwriting the oldest
+
+	Only ever called from the logging thread.
+
+***************************************/
+
+void tail_put(log_tail_t* pTail, const void* pData, uint32_t uLength)
+{
+	const uint8_t* pInput = static_cast<const uint8_t*>(pData);
+	uint64_t uWritten = static_cast<uint64_t>(pTail->m_iWritten);
+
+	/* Only the end of a write bigger than the ring would survive it. */
+	if (uLength > pTail->m_uSize) {
+		uint32_t uSkip = uLength - pTail->m_uSize;
+		pInput += uSkip;
+		uWritten += uSkip;
+		uLength = pTail->m_uSize;
+	}
+
+	InterlockedExchange64(
+		&pTail->m_iClaimed, static_cast<LONG64>(uWritten + uLength));
+	uint32_t uOffset = static_cast<uint32_t>(uWritten) & (pTail->m_uSize - 1);
+	uint32_t uFirst = pTail->m_uSize - uOffset;
+	if (uFirst > uLength) {
+		uFirst = uLength;
+	}
+	memcpy(pTail->m_pData + uOffset, pInput, uFirst);
+	memcpy(pTail->m_pData, pInput + uFirst, uLength - uFirst);
+	InterlockedExchange64(
+		&pTail->m_iWritten, static_cast<LONG64>(uWritten + uLength));
+}
+
+/***************************************
+
+	Copy output from the ring
+
+	Copies up to uMax bytes starting at position *pFrom, or at the oldest
+	output still in the ring if that has been overwritten.  *pFrom is
+	moved past what was copied.  Returns the number of bytes copied.
+
+***************************************/
+
+static uint32_t tail_get(
+	log_tail_t* pTail, uint64_t* pFrom, uint8_t* pOutput, uint32_t uMax)
+{
+	while (true) {
+		uint64_t uEnd = tail_counter(&pTail->m_iWritten);
+		uint64_t uStart = *pFrom;
+		if (uEnd - uStart > pTail->m_uSize) {
+			uStart = uEnd - pTail->m_uSize;
+		}
+		if (uStart >= uEnd) {
+			return 0;
+		}
+		if (uEnd - uStart > uMax) {
+			uEnd = uStart + uMax;
+		}
+
+		uint32_t uLength = static_cast<uint32_t>(uEnd - uStart);
+		uint32_t uOffset =
+			static_cast<uint32_t>(uStart) & (pTail->m_uSize - 1);
+		uint32_t uFirst = pTail->m_uSize - uOffset;
+		if (uFirst > uLength) {
+			uFirst = uLength;
+		}
+		memcpy(pOutput, pTail->m_pData + uOffset, uFirst);
+		memcpy(pOutput + uFirst, pTail->m_pData, uLength - uFirst);
+
+		/* Anything the writer got to first is no good. */
+		uint64_t uClaimed = tail_counter(&pTail->m_iClaimed);
+		uint64_t uSafe = uClaimed - pTail->m_uSize;
+		if ((uClaimed <= pTail->m_uSize) || (uSafe <= uStart)) {
+			*pFrom = uEnd;
+			return uLength;
+		}
+		if (uSafe >= uEnd) {
+			*pFrom = uSafe;
+			continue;
+		}
+		uint32_t uLost = static_cast<uint32_t>(uSafe - uStart);
+		memmove(pOutput, pOutput + uLost, uLength - uLost);
+		*pFrom = uEnd;
+		return uLength - uLost;
+	}
+}
+
+/* Returns true if the client has gone away. */
+static bool tail_client_gone(HANDLE hPipe)
+{
+	DWORD uAvailable;
+	return !PeekNamedPipe(hPipe, NULL, 0, NULL, &uAvailable, NULL) &&
+		(GetLastError() == ERROR_BROKEN_PIPE);
+}
+
+/***************************************
+
+	Send one client the output it asked for
+
+	Everything in the ring at the time is sent.  A follower then gets
+	new output as it arrives until it disconnects.
+
+***************************************/
+
+static unsigned long WINAPI serve_tail_client(void* pParam)
+{
+	tail_client_t* pClient = static_cast<tail_client_t*>(pParam);
+	HANDLE hPipe = pClient->m_hPipe;
+	nssm_service_t* pNSSMService = pClient->m_pNSSMService;
+	heap_free(pClient);
+
+	log_tail_request_t request;
+	DWORD uBytes;
+	if (!ReadFile(hPipe, &request, sizeof(request), &uBytes, NULL) ||
+		(uBytes != sizeof(request))) {
+		CloseHandle(hPipe);
+		return 1;
+	}
+
+	/* Merged stderr is in the stdout logger. */
+	log_tail_t* pTail = NULL;
+	if (request.m_uStream == NSSM_TAIL_STDERR) {
+		pTail = pNSSMService->m_pTails[NSSM_TAIL_STDERR];
+	}
+	if (!pTail) {
+		pTail = pNSSMService->m_pTails[NSSM_TAIL_STDOUT];
+	}
+
+	uint32_t uStatus = pTail ? NSSM_TAIL_OK : NSSM_TAIL_NONE;
+	uint8_t* pBuffer = NULL;
+	if (pTail) {
+		pBuffer = static_cast<uint8_t*>(heap_alloc(NSSM_TAIL_SEND));
+		if (!pBuffer) {
+			uStatus = NSSM_TAIL_NONE;
+		}
+	}
+	if (!WriteFile(hPipe, &uStatus, sizeof(uStatus), &uBytes, NULL) ||
+		(uStatus != NSSM_TAIL_OK)) {
+		heap_free(pBuffer);
+		FlushFileBuffers(hPipe);
+		DisconnectNamedPipe(hPipe);
+		CloseHandle(hPipe);
+		return 0;
+	}
+
+	uint64_t uFrom = 0;
+	uint64_t uStop = tail_counter(&pTail->m_iWritten);
+	while (true) {
+		uint32_t uLength = tail_get(pTail, &uFrom, pBuffer, NSSM_TAIL_SEND);
+		if (uLength) {
+			if (!WriteFile(hPipe, pBuffer, uLength, &uBytes, NULL)) {
+				break;
+			}
+		}
+		if (!request.m_uFollow) {
+			if (!uLength || (uFrom >= uStop)) {
+				FlushFileBuffers(hPipe);
+				break;
+			}
+		} else if (uLength < NSSM_TAIL_SEND) {
+			if (tail_client_gone(hPipe)) {
+				break;
+			}
+			Sleep(NSSM_TAIL_POLL);
+		}
+	}
+
+	heap_free(pBuffer);
+	DisconnectNamedPipe(hPipe);
+	CloseHandle(hPipe);
+	return 0;
+}
+
+/***************************************
+
+	Accept clients on the service's tail pipe
+
+	Runs for the life of the service process.  The first instance of the
+	pipe is created with FILE_FLAG_FIRST_PIPE_INSTANCE so another process
+	can't have got in first with a pipe of the same name.
+
+***************************************/
+
+static unsigned long WINAPI tail_server(void* pParam)
+{
+	nssm_service_t* pNSSMService = static_cast<nssm_service_t*>(pParam);
+
+	wchar_t pipe_name[NSSM_TAIL_PIPE_LENGTH];
+	if (StringCchPrintfW(pipe_name, RTL_NUMBER_OF(pipe_name),
+			NSSM_TAIL_PIPE_FORMAT, pNSSMService->m_Name) < 0) {
+		return 1;
+	}
+
+	SECURITY_ATTRIBUTES attributes;
+	ZeroMemory(&attributes, sizeof(attributes));
+	attributes.nLength = sizeof(attributes);
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(NSSM_TAIL_SDDL,
+			SDDL_REVISION_1, &attributes.lpSecurityDescriptor, NULL)) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_TAIL_SERVER_FAILED,
+			pNSSMService->m_Name,
+			L"ConvertStringSecurityDescriptorToSecurityDescriptor()",
+			error_string(GetLastError()), NULL);
+		return 2;
+	}
+
+	uint32_t uFirst = FILE_FLAG_FIRST_PIPE_INSTANCE;
+	while (true) {
+		HANDLE hPipe = CreateNamedPipeW(pipe_name,
+			PIPE_ACCESS_DUPLEX | uFirst,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+			PIPE_UNLIMITED_INSTANCES, NSSM_TAIL_SEND,
+			sizeof(log_tail_request_t), 0, &attributes);
+		if (hPipe == INVALID_HANDLE_VALUE) {
+			log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_TAIL_SERVER_FAILED,
+				pNSSMService->m_Name, L"CreateNamedPipe()",
+				error_string(GetLastError()), NULL);
+			break;
+		}
+		uFirst = 0;
+
+		if (!ConnectNamedPipe(hPipe, NULL) &&
+			(GetLastError() != ERROR_PIPE_CONNECTED)) {
+			CloseHandle(hPipe);
+			continue;
+		}
+
+		tail_client_t* pClient =
+			static_cast<tail_client_t*>(heap_alloc(sizeof(tail_client_t)));
+		HANDLE hThread = NULL;
+		if (pClient) {
+			pClient->m_pNSSMService = pNSSMService;
+			pClient->m_hPipe = hPipe;
+			hThread =
+				CreateThread(NULL, 0, serve_tail_client, pClient, 0, NULL);
+		}
+		if (!hThread) {
+			heap_free(pClient);
+			DisconnectNamedPipe(hPipe);
+			CloseHandle(hPipe);
+			continue;
+		}
+		CloseHandle(hThread);
+	}
+
+	LocalFree(attributes.lpSecurityDescriptor);
+	return 3;
+}
+
+/* Start serving the service's recent output, once. */
+int start_tail_server(nssm_service_t* pNSSMService)
+{
+	if (pNSSMService->m_hTailServer) {
+		return 0;
+	}
+	pNSSMService->m_hTailServer =
+		CreateThread(NULL, 0, tail_server, pNSSMService, 0, NULL);
+	if (!pNSSMService->m_hTailServer) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_TAIL_SERVER_FAILED,
+			pNSSMService->m_Name, L"CreateThread()",
+			error_string(GetLastError()), NULL);
+		return 1;
+	}
+	return 0;
+}
+
+/***************************************
+
+	Print a service's recent output
+
+	nssm tail <servicename> [stdout|stderr] [follow]
+
+	Connects to the service's tail pipe and copies what it sends to
+	stdout.  With follow it carries on until killed or the service stops.
+
+***************************************/
+
+int tail_service(int iArgc, wchar_t** ppArgv)
+{
+	if (iArgc < 1) {
+		return usage(1);
+	}
+
+	log_tail_request_t request;
+	request.m_uStream = NSSM_TAIL_STDOUT;
+	request.m_uFollow = 0;
+	for (int i = 1; i < iArgc; i++) {
+		if (str_equiv(ppArgv[i], L"stdout")) {
+			request.m_uStream = NSSM_TAIL_STDOUT;
+		} else if (str_equiv(ppArgv[i], L"stderr")) {
+			request.m_uStream = NSSM_TAIL_STDERR;
+		} else if (str_equiv(ppArgv[i], L"follow")) {
+			request.m_uFollow = 1;
+		} else {
+			return usage(1);
+		}
+	}
+
+	SC_HANDLE hOpenServices = open_service_manager(SC_MANAGER_CONNECT);
+	if (!hOpenServices) {
+		print_message(stderr, NSSM_MESSAGE_OPEN_SERVICE_MANAGER_FAILED);
+		return 1;
+	}
+	wchar_t canonical_name[SERVICE_NAME_LENGTH];
+	SC_HANDLE hService = open_service(hOpenServices, ppArgv[0],
+		SERVICE_QUERY_STATUS, canonical_name, RTL_NUMBER_OF(canonical_name));
+	CloseServiceHandle(hOpenServices);
+	if (!hService) {
+		return 1;
+	}
+	CloseServiceHandle(hService);
+
+	wchar_t pipe_name[NSSM_TAIL_PIPE_LENGTH];
+	if (StringCchPrintfW(pipe_name, RTL_NUMBER_OF(pipe_name),
+			NSSM_TAIL_PIPE_FORMAT, canonical_name) < 0) {
+		return 1;
+	}
+
+	HANDLE hPipe;
+	while (true) {
+		hPipe = CreateFileW(pipe_name, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			OPEN_EXISTING, 0, NULL);
+		if (hPipe != INVALID_HANDLE_VALUE) {
+			break;
+		}
+		DWORD error = GetLastError();
+		if ((error == ERROR_PIPE_BUSY) &&
+			WaitNamedPipeW(pipe_name, NSSM_TAIL_CONNECT)) {
+			continue;
+		}
+		if (error == ERROR_FILE_NOT_FOUND) {
+			print_message(
+				stderr, NSSM_MESSAGE_TAIL_UNAVAILABLE, canonical_name);
+		} else {
+			fwprintf(stderr, L"%s: %s\n", canonical_name, error_string(error));
+		}
+		return 1;
+	}
+
+	DWORD uBytes;
+	uint32_t uStatus = NSSM_TAIL_NONE;
+	if (!WriteFile(hPipe, &request, sizeof(request), &uBytes, NULL) ||
+		!ReadFile(hPipe, &uStatus, sizeof(uStatus), &uBytes, NULL) ||
+		(uBytes != sizeof(uStatus)) || (uStatus != NSSM_TAIL_OK)) {
+		print_message(stderr, NSSM_MESSAGE_TAIL_UNAVAILABLE, canonical_name);
+		CloseHandle(hPipe);
+		return 1;
+	}
+
+	/* UTF-16 output was converted to UTF-8 as it was kept. */
+	uint8_t* pBuffer = static_cast<uint8_t*>(heap_alloc(NSSM_TAIL_SEND));
+	if (!pBuffer) {
+		print_message(stderr, NSSM_MESSAGE_OUT_OF_MEMORY, L"buffer",
+			L"tail_service()");
+		CloseHandle(hPipe);
+		return 1;
+	}
+	HANDLE hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	while (ReadFile(hPipe, pBuffer, NSSM_TAIL_SEND, &uBytes, NULL) && uBytes) {
+		DWORD uWritten;
+		WriteFile(hOutput, pBuffer, uBytes, &uWritten, NULL);
+	}
+	heap_free(pBuffer);
+	CloseHandle(hPipe);
+	return 0;
+}
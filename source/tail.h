@@ -0,0 +1,67 @@
+/***************************************
+
+	Recent output kept in memory
+
+***************************************/
+
+#ifndef __TAIL_H__
+#define __TAIL_H__
+
+#include <stdint.h>
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+// Name of the pipe a service's recent output is served on
+#define NSSM_TAIL_PIPE_FORMAT L"\\\\.\\pipe\\nssm-tail-%s"
+
+// Characters in a pipe name, with room for the longest service name
+#define NSSM_TAIL_PIPE_LENGTH 288
+
+// Most bytes handed to a client in one write
+#define NSSM_TAIL_SEND 65536
+
+// Milliseconds between looks for new output while following
+#define NSSM_TAIL_POLL 200
+
+// Milliseconds to wait for a busy pipe
+#define NSSM_TAIL_CONNECT 5000
+
+// Streams a client may ask for
+#define NSSM_TAIL_STDOUT 0
+#define NSSM_TAIL_STDERR 1
+#define NSSM_TAIL_STREAMS 2
+
+// Status sent back before any output
+#define NSSM_TAIL_OK 0
+#define NSSM_TAIL_NONE 1
+
+struct nssm_service_t;
+
+struct log_tail_t {
+	// Ring of the most recent output, with UTF-16 converted to UTF-8
+	uint8_t* m_pData;
+	// Size of m_pData in bytes, a power of two
+	uint32_t m_uSize;
+	// Bytes ever added, once they are in m_pData
+	volatile LONG64 m_iWritten;
+	// Bytes ever added, including any being copied into m_pData now
+	volatile LONG64 m_iClaimed;
+};
+
+struct log_tail_request_t {
+	// NSSM_TAIL_STDOUT or NSSM_TAIL_STDERR
+	uint32_t m_uStream;
+	// Nonzero to keep sending output as it arrives
+	uint32_t m_uFollow;
+};
+
+extern log_tail_t* create_tail(uint32_t uSize);
+extern void tail_put(log_tail_t* pTail, const void* pData, uint32_t uLength);
+extern int start_tail_server(nssm_service_t* pNSSMService);
+extern int tail_service(int iArgc, wchar_t** ppArgv);
+
+#endif
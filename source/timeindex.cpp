@@ -0,0 +1,855 @@
+/***************************************
+
+	Time index of log files
+
+	Each log file can have an index file next to it, named by appending
+	.idx, holding the time and file offset of a write every so many bytes
+	or seconds of output.  Entries are held in memory and appended to the
+	index in batches.  When the log file is rotated its index is renamed
+	along with it, so every rotated file has its own index.
+
+	nssm logs reads the indexes to go straight to the output written
+	between two times instead of reading every log file from the start.
+
+***************************************/
+
+#include "timeindex.h"
+#include "constants.h"
+#include "event.h"
+#include "memorymanager.h"
+#include "messages.h"
+#include "nssm.h"
+#include "nssm_io.h"
+#include "registry.h"
+#include "service.h"
+
+#include <Shlwapi.h>
+#include <stdio.h>
+#include <wchar.h>
+
+#include <strsafe.h>
+
+// Bytes read from a log file at a time by nssm logs
+#define NSSM_LOGS_CHUNK 65536
+
+// Most index entries read for one log file by nssm logs, 1GB worth
+#define NSSM_LOGS_MAX_ENTRIES 0x4000000
+
+// FILETIME units in a second
+#define NSSM_TICKS_PER_SECOND 10000000ULL
+
+struct logs_segment_t {
+	// Next newest file
+	logs_segment_t* m_pNext;
+	// Pathname
+	wchar_t* m_pPath;
+	// Time the file was rotated as a FILETIME, or ~0 for the live file
+	uint64_t m_uTime;
+	// True if the file was compressed after rotation
+	bool m_bCompressed;
+};
+
+/* Name the index file for a log file. */
+void time_index_path(
+	const wchar_t* pLogPath, wchar_t* pIndexPath, uint32_t uIndexPathLength)
+{
+	StringCchPrintfW(pIndexPath, uIndexPathLength, L"%s%s", pLogPath,
+		NSSM_TIME_INDEX_SUFFIX);
+}
+
+/* Start an empty index, writing the header. */
+static int reset_index_file(HANDLE hFile)
+{
+	time_index_header_t header;
+	ZeroMemory(&header, sizeof(header));
+	memcpy(header.m_Magic, NSSM_TIME_INDEX_MAGIC,
+		sizeof(NSSM_TIME_INDEX_MAGIC));
+	header.m_uVersion = NSSM_TIME_INDEX_VERSION;
+	header.m_uEntrySize = sizeof(time_index_entry_t);
+
+	LARGE_INTEGER offset;
+	offset.QuadPart = 0;
+	DWORD uWritten;
+	if (!SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN) ||
+		!SetEndOfFile(hFile) ||
+		!WriteFile(hFile, &header, sizeof(header), &uWritten, NULL)) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+  Read the header of an index file and check it is one.
+  Returns the number of whole entries in the file or -1 if it isn't one.
+*/
+static int64_t check_index_file(HANDLE hFile)
+{
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size) ||
+		(static_cast<uint64_t>(size.QuadPart) < sizeof(time_index_header_t))) {
+		return -1;
+	}
+	time_index_header_t header;
+	DWORD uRead;
+	if (!ReadFile(hFile, &header, sizeof(header), &uRead, NULL) ||
+		(uRead != sizeof(header)) ||
+		memcmp(header.m_Magic, NSSM_TIME_INDEX_MAGIC,
+			sizeof(NSSM_TIME_INDEX_MAGIC)) ||
+		(header.m_uVersion != NSSM_TIME_INDEX_VERSION) ||
+		(header.m_uEntrySize != sizeof(time_index_entry_t))) {
+		return -1;
+	}
+	return static_cast<int64_t>(
+		(static_cast<uint64_t>(size.QuadPart) - sizeof(header)) /
+		sizeof(time_index_entry_t));
+}
+
+/***************************************
+
+	Open the index for appending
+
+	An index left from before is kept if it fits the log file, with any
+	partly written entry at the end cut off.  Otherwise, as when the log
+	file was deleted or truncated behind NSSM's back, it is started again.
+	Returns 0 on success or the error code.
+
+***************************************/
+
+static unsigned long open_index_file(time_index_t* pIndex, uint64_t uFileSize)
+{
+	HANDLE hFile = CreateFileW(pIndex->m_pPath,
+		FILE_READ_DATA | FILE_WRITE_DATA, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return GetLastError();
+	}
+
+	int64_t iEntries = check_index_file(hFile);
+	bool bReset = iEntries < 0;
+	LARGE_INTEGER offset;
+	if (iEntries > 0) {
+		offset.QuadPart = static_cast<LONGLONG>(sizeof(time_index_header_t) +
+			(iEntries - 1) * sizeof(time_index_entry_t));
+		time_index_entry_t last;
+		DWORD uRead;
+		if (!SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN) ||
+			!ReadFile(hFile, &last, sizeof(last), &uRead, NULL) ||
+			(uRead != sizeof(last)) || (last.m_uOffset > uFileSize)) {
+			bReset = true;
+		}
+	}
+
+	if (bReset) {
+		if (reset_index_file(hFile)) {
+			unsigned long error = GetLastError();
+			CloseHandle(hFile);
+			return error;
+		}
+	} else {
+		offset.QuadPart = static_cast<LONGLONG>(sizeof(time_index_header_t) +
+			iEntries * sizeof(time_index_entry_t));
+		if (SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN)) {
+			SetEndOfFile(hFile);
+		}
+	}
+
+	pIndex->m_hFile = hFile;
+	/* The first write after a restart always gets an entry. */
+	pIndex->m_uBytes = pIndex->m_uInterval;
+	pIndex->m_uPending = 0;
+	return 0;
+}
+
+/***************************************
+
+	Open the index of a log file which is about to be written to
+
+	uFileSize is the size of the log file now and uInterval the number of
+	bytes of output between entries.  Returns NULL if the index couldn't
+	be opened, in which case the log file is written without one.
+
+***************************************/
+
+time_index_t* open_time_index(const wchar_t* pServiceName,
+	const wchar_t* pLogPath, uint64_t uFileSize, uint32_t uInterval)
+{
+	uintptr_t uPathLength =
+		wcslen(pLogPath) + RTL_NUMBER_OF(NSSM_TIME_INDEX_SUFFIX);
+	time_index_t* pIndex = static_cast<time_index_t*>(heap_calloc(
+		sizeof(time_index_t) + uPathLength * sizeof(wchar_t)));
+	if (!pIndex) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_OUT_OF_MEMORY,
+			L"time index", L"open_time_index()", NULL);
+		return NULL;
+	}
+	pIndex->m_pServiceName = pServiceName;
+	pIndex->m_pPath = reinterpret_cast<wchar_t*>(pIndex + 1);
+	time_index_path(
+		pLogPath, pIndex->m_pPath, static_cast<uint32_t>(uPathLength));
+	pIndex->m_uInterval = uInterval;
+
+	unsigned long error = open_index_file(pIndex, uFileSize);
+	if (error) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_TIME_INDEX_FAILED,
+			pServiceName, pIndex->m_pPath, L"CreateFile()",
+			error_string(error), NULL);
+		heap_free(pIndex);
+		return NULL;
+	}
+	return pIndex;
+}
+
+/* Append the entries held back to the index file. */
+void flush_time_index(time_index_t* pIndex)
+{
+	if (!pIndex->m_uPending) {
+		return;
+	}
+	uint32_t uLength = pIndex->m_uPending * sizeof(time_index_entry_t);
+	pIndex->m_uPending = 0;
+	if (!pIndex->m_hFile) {
+		return;
+	}
+
+	DWORD uWritten;
+	if (!WriteFile(pIndex->m_hFile, pIndex->m_Pending, uLength, &uWritten,
+			NULL) ||
+		(uWritten != uLength)) {
+		if (!pIndex->m_bComplained) {
+			log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_TIME_INDEX_FAILED,
+				pIndex->m_pServiceName, pIndex->m_pPath, L"WriteFile()",
+				error_string(GetLastError()), NULL);
+			pIndex->m_bComplained = true;
+		}
+		/* A torn entry would throw out the ones after it. */
+		reset_index_file(pIndex->m_hFile);
+	}
+}
+
+void close_time_index(time_index_t* pIndex)
+{
+	if (!pIndex) {
+		return;
+	}
+	flush_time_index(pIndex);
+	if (pIndex->m_hFile) {
+		CloseHandle(pIndex->m_hFile);
+	}
+	heap_free(pIndex);
+}
+
+/***************************************
+
+	Note a write about to be made to the log file
+
+	Makes an entry for it if enough output or time has gone by since the
+	last one.  Only the entry costs a system call, to find where in the log
+	file the write goes, so most writes cost a subtraction or two.  If hLog
+	is NULL the write goes at uOffset instead, which is the case when the
+	log file is written through a mapped view.
+
+***************************************/
+
+void time_index_write(
+	time_index_t* pIndex, HANDLE hLog, uint64_t uOffset, uint32_t uLength)
+{
+	uint32_t uNow = GetTickCount();
+	bool bDue = (pIndex->m_uBytes >= pIndex->m_uInterval) ||
+		((uNow - pIndex->m_uLastEntry) >= NSSM_TIME_INDEX_SECONDS * 1000U);
+	pIndex->m_uBytes += uLength;
+
+	if (bDue) {
+		LARGE_INTEGER zero;
+		LARGE_INTEGER position;
+		zero.QuadPart = 0;
+		position.QuadPart = static_cast<LONGLONG>(uOffset);
+		if (!hLog ||
+			SetFilePointerEx(hLog, zero, &position, FILE_CURRENT)) {
+			FILETIME ft;
+			GetSystemTimeAsFileTime(&ft);
+			ULARGE_INTEGER uTime;
+			uTime.LowPart = ft.dwLowDateTime;
+			uTime.HighPart = ft.dwHighDateTime;
+			if (!pIndex->m_uPending) {
+				pIndex->m_uFirstPending = uNow;
+			}
+			time_index_entry_t* pEntry =
+				&pIndex->m_Pending[pIndex->m_uPending++];
+			pEntry->m_uTime = uTime.QuadPart;
+			pEntry->m_uOffset = static_cast<uint64_t>(position.QuadPart);
+			pIndex->m_uBytes = uLength;
+			pIndex->m_uLastEntry = uNow;
+		}
+	}
+
+	if ((pIndex->m_uPending == NSSM_TIME_INDEX_BATCH) ||
+		(pIndex->m_uPending &&
+			((uNow - pIndex->m_uFirstPending) >= NSSM_TIME_INDEX_FLUSH))) {
+		flush_time_index(pIndex);
+	}
+}
+
+/* Rename a log file's index to go with the file it was rotated to. */
+void move_time_index(const wchar_t* pLogPath, const wchar_t* pRotated)
+{
+	wchar_t index[PATH_LENGTH];
+	wchar_t rotated[PATH_LENGTH];
+	time_index_path(pLogPath, index, RTL_NUMBER_OF(index));
+	time_index_path(pRotated, rotated, RTL_NUMBER_OF(rotated));
+	MoveFileExW(index, rotated, MOVEFILE_REPLACE_EXISTING);
+}
+
+/* Delete the index of a log file which is gone. */
+void delete_time_index(const wchar_t* pLogPath)
+{
+	wchar_t index[PATH_LENGTH];
+	time_index_path(pLogPath, index, RTL_NUMBER_OF(index));
+	DeleteFileW(index);
+}
+
+/***************************************
+
+	Hand the index over to the file the log was rotated to
+
+	The index is renamed with it and a new one started for the new log
+	file.  If pRotated is NULL the old output is gone and so is its index.
+
+***************************************/
+
+void rotate_time_index(time_index_t* pIndex, const wchar_t* pLogPath,
+	const wchar_t* pRotated)
+{
+	if (!pIndex) {
+		return;
+	}
+	flush_time_index(pIndex);
+	if (pIndex->m_hFile) {
+		CloseHandle(pIndex->m_hFile);
+		pIndex->m_hFile = NULL;
+	}
+	if (pRotated) {
+		move_time_index(pLogPath, pRotated);
+	} else {
+		DeleteFileW(pIndex->m_pPath);
+	}
+
+	unsigned long error = open_index_file(pIndex, 0);
+	if (error && !pIndex->m_bComplained) {
+		log_event(EVENTLOG_ERROR_TYPE, NSSM_EVENT_TIME_INDEX_FAILED,
+			pIndex->m_pServiceName, pIndex->m_pPath, L"CreateFile()",
+			error_string(error), NULL);
+		pIndex->m_bComplained = true;
+	}
+}
+
+/***************************************
+
+	Parse a time given to nssm logs
+
+	Either YYYY-MM-DD, optionally followed by T or a space and HH:MM with
+	optional :SS and .mmm, in UTC like the timestamps NSSM writes, or a
+	number followed by s, m, h or d for that long ago.  Returns 0 and sets
+	pTime to a FILETIME on success.
+
+***************************************/
+
+static const wchar_t* parse_digits(
+	const wchar_t* pInput, uint32_t uDigits, uint32_t* pValue)
+{
+	uint32_t uValue = 0;
+	for (uint32_t i = 0; i < uDigits; i++) {
+		if ((pInput[i] < L'0') || (pInput[i] > L'9')) {
+			return NULL;
+		}
+		uValue = uValue * 10 + static_cast<uint32_t>(pInput[i] - L'0');
+	}
+	*pValue = uValue;
+	return pInput + uDigits;
+}
+
+static int parse_log_time(const wchar_t* pInput, uint64_t* pTime)
+{
+	FILETIME ft;
+	ULARGE_INTEGER uTime;
+
+	/* A length of time ago. */
+	wchar_t* pUnit;
+	unsigned long long uAgo = wcstoull(pInput, &pUnit, 10);
+	if ((pUnit != pInput) && *pUnit && !pUnit[1]) {
+		uint64_t uSeconds;
+		switch (*pUnit) {
+		case L's':
+			uSeconds = 1;
+			break;
+		case L'm':
+			uSeconds = 60;
+			break;
+		case L'h':
+			uSeconds = 3600;
+			break;
+		case L'd':
+			uSeconds = 86400;
+			break;
+		default:
+			return 1;
+		}
+		GetSystemTimeAsFileTime(&ft);
+		uTime.LowPart = ft.dwLowDateTime;
+		uTime.HighPart = ft.dwHighDateTime;
+		uint64_t uBack = uAgo * uSeconds * NSSM_TICKS_PER_SECOND;
+		*pTime = (uBack < uTime.QuadPart) ? uTime.QuadPart - uBack : 0;
+		return 0;
+	}
+
+	uint32_t Fields[7] = {0, 0, 0, 0, 0, 0, 0};
+	const wchar_t* p = parse_digits(pInput, 4, &Fields[0]);
+	if (!p || (*p++ != L'-') || !(p = parse_digits(p, 2, &Fields[1])) ||
+		(*p++ != L'-') || !(p = parse_digits(p, 2, &Fields[2]))) {
+		return 1;
+	}
+	if ((*p == L'T') || (*p == L' ')) {
+		if (!(p = parse_digits(p + 1, 2, &Fields[3])) || (*p++ != L':') ||
+			!(p = parse_digits(p, 2, &Fields[4]))) {
+			return 1;
+		}
+		if ((*p == L':') && !(p = parse_digits(p + 1, 2, &Fields[5]))) {
+			return 1;
+		}
+		if ((*p == L'.') && !(p = parse_digits(p + 1, 3, &Fields[6]))) {
+			return 1;
+		}
+	}
+	if (*p == L'Z') {
+		p++;
+	}
+	if (*p) {
+		return 1;
+	}
+
+	SYSTEMTIME st;
+	st.wYear = static_cast<WORD>(Fields[0]);
+	st.wMonth = static_cast<WORD>(Fields[1]);
+	st.wDayOfWeek = 0;
+	st.wDay = static_cast<WORD>(Fields[2]);
+	st.wHour = static_cast<WORD>(Fields[3]);
+	st.wMinute = static_cast<WORD>(Fields[4]);
+	st.wSecond = static_cast<WORD>(Fields[5]);
+	st.wMilliseconds = static_cast<WORD>(Fields[6]);
+	if (!SystemTimeToFileTime(&st, &ft)) {
+		return 1;
+	}
+	uTime.LowPart = ft.dwLowDateTime;
+	uTime.HighPart = ft.dwHighDateTime;
+	*pTime = uTime.QuadPart;
+	return 0;
+}
+
+/* Add a file to the list, oldest first. */
+static int add_logs_segment(logs_segment_t** ppSegments, const wchar_t* pPath,
+	uint64_t uTime, bool bCompressed)
+{
+	uintptr_t uLength = wcslen(pPath) + 1;
+	logs_segment_t* pSegment = static_cast<logs_segment_t*>(
+		heap_alloc(sizeof(logs_segment_t) + uLength * sizeof(wchar_t)));
+	if (!pSegment) {
+		return 1;
+	}
+	pSegment->m_pPath = reinterpret_cast<wchar_t*>(pSegment + 1);
+	memcpy(pSegment->m_pPath, pPath, uLength * sizeof(wchar_t));
+	pSegment->m_uTime = uTime;
+	pSegment->m_bCompressed = bCompressed;
+
+	while (*ppSegments && ((*ppSegments)->m_uTime <= uTime)) {
+		ppSegments = &(*ppSegments)->m_pNext;
+	}
+	pSegment->m_pNext = *ppSegments;
+	*ppSegments = pSegment;
+	return 0;
+}
+
+/*
+  List the files rotated from a log file, named as rotated_filename()
+  names them, followed by the log file itself.
+  Returns 0 on success or 1 if memory ran out.
+*/
+static int find_logs_segments(const wchar_t* pPath, logs_segment_t** ppSegments)
+{
+	wchar_t pattern[PATH_LENGTH];
+	StringCchCopyW(pattern, RTL_NUMBER_OF(pattern), pPath);
+	wchar_t* pExtension = PathFindExtensionW(pattern);
+	wchar_t extension[PATH_LENGTH];
+	StringCchCopyW(extension, RTL_NUMBER_OF(extension), pExtension);
+	*pExtension = 0;
+	wchar_t* pName = PathFindFileNameW(pattern);
+	uintptr_t uPrefixLength = wcslen(pName);
+	uintptr_t uDirectoryLength = static_cast<uintptr_t>(pName - pattern);
+	uintptr_t uExtensionLength = wcslen(extension);
+	StringCchCatW(pattern, RTL_NUMBER_OF(pattern), L"-*");
+
+	WIN32_FIND_DATAW data;
+	HANDLE hFind = FindFirstFileW(pattern, &data);
+	if (hFind != INVALID_HANDLE_VALUE) {
+		wchar_t path[PATH_LENGTH];
+		do {
+			if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+				(wcslen(data.cFileName) <= uPrefixLength)) {
+				continue;
+			}
+			uint64_t uTime;
+			const wchar_t* pSuffix = data.cFileName + uPrefixLength + 1;
+			uint32_t uParsed = parse_rotated_time(pSuffix, &uTime);
+			if (!uParsed) {
+				continue;
+			}
+			pSuffix += uParsed;
+			if (_wcsnicmp(pSuffix, extension, uExtensionLength)) {
+				continue;
+			}
+			pSuffix += uExtensionLength;
+			bool bCompressed = *pSuffix != 0;
+			if (bCompressed && _wcsicmp(pSuffix, L".gz")) {
+				continue;
+			}
+
+			StringCchCopyW(path, RTL_NUMBER_OF(path), pPath);
+			path[uDirectoryLength] = 0;
+			StringCchCatW(path, RTL_NUMBER_OF(path), data.cFileName);
+			if (add_logs_segment(ppSegments, path, uTime, bCompressed)) {
+				FindClose(hFind);
+				return 1;
+			}
+		} while (FindNextFileW(hFind, &data));
+		FindClose(hFind);
+	}
+
+	return add_logs_segment(ppSegments, pPath, ~0ULL, false);
+}
+
+/* Read from a given offset.  Returns the number of bytes read. */
+static uint32_t read_at(
+	HANDLE hFile, uint64_t uOffset, void* pBuffer, uint32_t uLength)
+{
+	LARGE_INTEGER offset;
+	offset.QuadPart = static_cast<LONGLONG>(uOffset);
+	DWORD uRead = 0;
+	if (!SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN) ||
+		!ReadFile(hFile, pBuffer, uLength, &uRead, NULL)) {
+		return 0;
+	}
+	return uRead;
+}
+
+/* Returns true if the character before uOffset is a newline. */
+static bool at_line_start(HANDLE hFile, uint64_t uOffset, uint32_t uCharsize)
+{
+	wchar_t c = 0;
+	if (read_at(hFile, uOffset - uCharsize, &c, uCharsize) != uCharsize) {
+		return true;
+	}
+	return c == L'\n';
+}
+
+/*
+  Find the start of the line after the one uOffset is in, looking no
+  further than uLimit.
+*/
+static uint64_t next_line(HANDLE hFile, uint64_t uOffset, uint64_t uLimit,
+	uint32_t uCharsize, uint8_t* pBuffer)
+{
+	while (uOffset < uLimit) {
+		uint32_t uWant = NSSM_LOGS_CHUNK;
+		if (uLimit - uOffset < uWant) {
+			uWant = static_cast<uint32_t>(uLimit - uOffset);
+		}
+		uint32_t uRead = read_at(hFile, uOffset, pBuffer, uWant);
+		uRead -= uRead % uCharsize;
+		if (!uRead) {
+			break;
+		}
+		for (uint32_t i = 0; i < uRead; i += uCharsize) {
+			if ((pBuffer[i] == '\n') &&
+				((uCharsize == 1) || !pBuffer[i + 1])) {
+				return uOffset + i + uCharsize;
+			}
+		}
+		uOffset += uRead;
+	}
+	return uLimit;
+}
+
+/*
+  Copy part of a log file to the output, converting UTF-16 to UTF-8.
+  Returns 0 on success or 1 if the output was closed.
+*/
+static int copy_log_range(HANDLE hFile, uint64_t uStart, uint64_t uEnd,
+	uint32_t uCharsize, HANDLE hOutput, uint8_t* pBuffer, char* pConverted)
+{
+	while (uStart < uEnd) {
+		uint32_t uWant = NSSM_LOGS_CHUNK;
+		if (uEnd - uStart < uWant) {
+			uWant = static_cast<uint32_t>(uEnd - uStart);
+		}
+		uint32_t uRead = read_at(hFile, uStart, pBuffer, uWant);
+		const void* pOutput = pBuffer;
+		uint32_t uOutput = uRead;
+		if (uCharsize == sizeof(wchar_t)) {
+			/* Leave a split surrogate pair for the next chunk. */
+			int iCount = static_cast<int>(uRead / sizeof(wchar_t));
+			const wchar_t* pInput = reinterpret_cast<const wchar_t*>(pBuffer);
+			if ((iCount > 1) && (pInput[iCount - 1] >= 0xD800) &&
+				(pInput[iCount - 1] <= 0xDBFF)) {
+				--iCount;
+			}
+			uRead = static_cast<uint32_t>(iCount) * sizeof(wchar_t);
+			uOutput = static_cast<uint32_t>(WideCharToMultiByte(CP_UTF8, 0,
+				pInput, iCount, pConverted,
+				NSSM_LOGS_CHUNK / sizeof(wchar_t) * 3, NULL, NULL));
+			pOutput = pConverted;
+		}
+		if (!uRead) {
+			break;
+		}
+		DWORD uWritten;
+		if (uOutput &&
+			!WriteFile(hOutput, pOutput, uOutput, &uWritten, NULL)) {
+			return 1;
+		}
+		uStart += uRead;
+	}
+	return 0;
+}
+
+/*
+  Read the entries of a log file's index.  Returns the number of entries
+  with ppEntries set to a buffer to free, or 0 if there is no index.
+*/
+static uint32_t read_time_index(
+	const wchar_t* pLogPath, time_index_entry_t** ppEntries)
+{
+	*ppEntries = NULL;
+	wchar_t index[PATH_LENGTH];
+	time_index_path(pLogPath, index, RTL_NUMBER_OF(index));
+	HANDLE hFile = CreateFileW(index, FILE_READ_DATA,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+
+	int64_t iEntries = check_index_file(hFile);
+	uint32_t uEntries = 0;
+	if ((iEntries > 0) && (iEntries <= NSSM_LOGS_MAX_ENTRIES)) {
+		uint32_t uLength =
+			static_cast<uint32_t>(iEntries) * sizeof(time_index_entry_t);
+		*ppEntries = static_cast<time_index_entry_t*>(heap_alloc(uLength));
+		DWORD uRead = 0;
+		if (*ppEntries &&
+			ReadFile(hFile, *ppEntries, uLength, &uRead, NULL)) {
+			uEntries = uRead / sizeof(time_index_entry_t);
+		}
+	}
+	CloseHandle(hFile);
+	if (!uEntries) {
+		heap_free(*ppEntries);
+		*ppEntries = NULL;
+	}
+	return uEntries;
+}
+
+/***************************************
+
+	Print the output in a log file written between two times
+
+	The index gives the last entry written no later than uSince and the
+	first written after uUntil, and the output between them is printed,
+	widened to whole lines.  So the output printed may start and end up to
+	one entry's worth either side of the times asked for, but none of it
+	is missed.  Without an index the whole file is printed.  Zeros at the
+	end of a file written through a mapping aren't output so aren't shown.
+	Returns 0 on success or 1 if the output was closed.
+
+***************************************/
+
+static int show_log_segment(const wchar_t* pPath, uint64_t uSince,
+	uint64_t uUntil, HANDLE hOutput, uint8_t* pBuffer, char* pConverted)
+{
+	HANDLE hFile = CreateFileW(pPath, FILE_READ_DATA,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		fwprintf(stderr, L"%s: %s\n", pPath, error_string(GetLastError()));
+		return 0;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size) || !size.QuadPart) {
+		CloseHandle(hFile);
+		return 0;
+	}
+
+	uint64_t uSize =
+		log_output_end(hFile, static_cast<uint64_t>(size.QuadPart));
+
+	/* A UTF-16 log file starts with a byte order mark. */
+	uint64_t uStart = 0;
+	uint64_t uEnd = uSize;
+	uint32_t uCharsize = 1;
+	wchar_t bom = 0;
+	if ((read_at(hFile, 0, &bom, sizeof(bom)) == sizeof(bom)) &&
+		(bom == L'\ufeff')) {
+		uCharsize = sizeof(wchar_t);
+		uStart = sizeof(bom);
+	}
+	uint64_t uDataStart = uStart;
+
+	time_index_entry_t* pEntries;
+	uint32_t uEntries = read_time_index(pPath, &pEntries);
+	uint32_t i;
+	for (i = 0; i < uEntries; i++) {
+		if ((pEntries[i].m_uTime > uSince) || (pEntries[i].m_uOffset > uEnd)) {
+			break;
+		}
+		if (pEntries[i].m_uOffset > uStart) {
+			uStart = pEntries[i].m_uOffset;
+		}
+	}
+	for (; i < uEntries; i++) {
+		if ((pEntries[i].m_uTime > uUntil) &&
+			(pEntries[i].m_uOffset >= uStart) &&
+			(pEntries[i].m_uOffset < uEnd)) {
+			uEnd = pEntries[i].m_uOffset;
+			break;
+		}
+	}
+	heap_free(pEntries);
+
+	/* Writes needn't start at the start of a line. */
+	if ((uStart > uDataStart) && !at_line_start(hFile, uStart, uCharsize)) {
+		uStart = next_line(hFile, uStart, uSize, uCharsize, pBuffer);
+	}
+	if ((uEnd < uSize) && !at_line_start(hFile, uEnd, uCharsize)) {
+		uEnd = next_line(hFile, uEnd, uSize, uCharsize, pBuffer);
+	}
+
+	int ret = copy_log_range(
+		hFile, uStart, uEnd, uCharsize, hOutput, pBuffer, pConverted);
+	CloseHandle(hFile);
+	return ret;
+}
+
+/***************************************
+
+	Print a service's logged output between two times
+
+	nssm logs <servicename> [stdout|stderr] [--since <time>]
+		[--until <time>]
+
+	Looks at the log file and the files rotated from it, skipping those
+	which were rotated before uSince or started after uUntil.  Compressed
+	files are skipped as they can't be read in place.
+
+***************************************/
+
+int show_logs(int iArgc, wchar_t** ppArgv)
+{
+	if (iArgc < 1) {
+		return usage(1);
+	}
+
+	const wchar_t* pValueName = g_NSSMRegStdOut;
+	uint64_t uSince = 0;
+	uint64_t uUntil = ~0ULL;
+	for (int i = 1; i < iArgc; i++) {
+		if (str_equiv(ppArgv[i], L"stdout")) {
+			pValueName = g_NSSMRegStdOut;
+		} else if (str_equiv(ppArgv[i], L"stderr")) {
+			pValueName = g_NSSMRegStdErr;
+		} else if (str_equiv(ppArgv[i], L"--since") ||
+			str_equiv(ppArgv[i], L"--until")) {
+			uint64_t* pTime =
+				str_equiv(ppArgv[i], L"--since") ? &uSince : &uUntil;
+			if (++i == iArgc) {
+				return usage(1);
+			}
+			if (parse_log_time(ppArgv[i], pTime)) {
+				print_message(stderr, NSSM_MESSAGE_INVALID_LOG_TIME, ppArgv[i]);
+				return 1;
+			}
+		} else {
+			return usage(1);
+		}
+	}
+
+	SC_HANDLE hOpenServices = open_service_manager(SC_MANAGER_CONNECT);
+	if (!hOpenServices) {
+		print_message(stderr, NSSM_MESSAGE_OPEN_SERVICE_MANAGER_FAILED);
+		return 1;
+	}
+	wchar_t canonical_name[SERVICE_NAME_LENGTH];
+	SC_HANDLE hService = open_service(hOpenServices, ppArgv[0],
+		SERVICE_QUERY_STATUS, canonical_name, RTL_NUMBER_OF(canonical_name));
+	CloseServiceHandle(hOpenServices);
+	if (!hService) {
+		return 1;
+	}
+	CloseServiceHandle(hService);
+
+	/* Merged stderr is in the stdout file. */
+	wchar_t path[PATH_LENGTH];
+	path[0] = 0;
+	HKEY hKey = open_registry(canonical_name, KEY_READ);
+	if (hKey) {
+		expand_parameter(
+			hKey, pValueName, path, RTL_NUMBER_OF(path), true, false);
+		if (!path[0]) {
+			expand_parameter(hKey, g_NSSMRegStdOut, path, RTL_NUMBER_OF(path),
+				true, false);
+		}
+		RegCloseKey(hKey);
+	}
+	if (!path[0]) {
+		print_message(stderr, NSSM_MESSAGE_NO_LOG_FILE, canonical_name);
+		return 1;
+	}
+
+	logs_segment_t* pSegments = NULL;
+	uint8_t* pBuffer = static_cast<uint8_t*>(heap_alloc(NSSM_LOGS_CHUNK));
+	char* pConverted = static_cast<char*>(
+		heap_alloc(NSSM_LOGS_CHUNK / sizeof(wchar_t) * 3));
+	if (!pBuffer || !pConverted || find_logs_segments(path, &pSegments)) {
+		print_message(stderr, NSSM_MESSAGE_OUT_OF_MEMORY, L"log files",
+			L"show_logs()");
+		heap_free(pBuffer);
+		heap_free(pConverted);
+		while (pSegments) {
+			logs_segment_t* pNext = pSegments->m_pNext;
+			heap_free(pSegments);
+			pSegments = pNext;
+		}
+		return 1;
+	}
+
+	/* A file holds output from when the one before it was rotated. */
+	HANDLE hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	uint64_t uStarted = 0;
+	bool bWriting = true;
+	while (pSegments) {
+		logs_segment_t* pSegment = pSegments;
+		pSegments = pSegment->m_pNext;
+		if (bWriting && (pSegment->m_uTime >= uSince) &&
+			(uStarted <= uUntil)) {
+			if (pSegment->m_bCompressed) {
+				print_message(stderr, NSSM_MESSAGE_LOG_FILE_COMPRESSED,
+					pSegment->m_pPath);
+			} else if (show_log_segment(pSegment->m_pPath, uSince, uUntil,
+						   hOutput, pBuffer, pConverted)) {
+				bWriting = false;
+			}
+		}
+		uStarted = pSegment->m_uTime;
+		heap_free(pSegment);
+	}
+
+	heap_free(pBuffer);
+	heap_free(pConverted);
+	return 0;
+}
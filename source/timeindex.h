@@ -0,0 +1,87 @@
+/***************************************
+
+	Time index of log files
+
+***************************************/
+
+#ifndef __TIMEINDEX_H__
+#define __TIMEINDEX_H__
+
+#include <stdint.h>
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <Windows.h>
+
+// Appended to the name of a log file to name its index
+#define NSSM_TIME_INDEX_SUFFIX L".idx"
+
+// Start of every index file, followed by the version and entry size
+#define NSSM_TIME_INDEX_MAGIC "NSSMTIX"
+#define NSSM_TIME_INDEX_VERSION 1
+
+// Most seconds between entries while output keeps coming
+#define NSSM_TIME_INDEX_SECONDS 10
+
+// Entries held back to be written to the index together
+#define NSSM_TIME_INDEX_BATCH 128
+
+// Most milliseconds an entry is held back
+#define NSSM_TIME_INDEX_FLUSH 5000
+
+struct time_index_header_t {
+	// NSSM_TIME_INDEX_MAGIC with its terminating zero
+	char m_Magic[8];
+	// NSSM_TIME_INDEX_VERSION
+	uint32_t m_uVersion;
+	// sizeof(time_index_entry_t)
+	uint32_t m_uEntrySize;
+};
+
+struct time_index_entry_t {
+	// UTC time the output at m_uOffset was written, as a FILETIME
+	uint64_t m_uTime;
+	// Offset of the output in the log file
+	uint64_t m_uOffset;
+};
+
+struct time_index_t {
+	// Name of the service being logged
+	const wchar_t* m_pServiceName;
+	// Pathname of the index file
+	wchar_t* m_pPath;
+	// Handle for appending to the index file, NULL if it couldn't be opened
+	HANDLE m_hFile;
+	// Bytes of output written since the last entry
+	uint64_t m_uBytes;
+	// Bytes of output between entries
+	uint32_t m_uInterval;
+	// GetTickCount() when the last entry was made
+	uint32_t m_uLastEntry;
+	// GetTickCount() when the first entry in m_Pending was made
+	uint32_t m_uFirstPending;
+	// Number of entries in m_Pending
+	uint32_t m_uPending;
+	// Entries not written to the index file yet
+	time_index_entry_t m_Pending[NSSM_TIME_INDEX_BATCH];
+	// True once a failure to write the index has been logged
+	bool m_bComplained;
+};
+
+extern void time_index_path(
+	const wchar_t* pLogPath, wchar_t* pIndexPath, uint32_t uIndexPathLength);
+extern time_index_t* open_time_index(const wchar_t* pServiceName,
+	const wchar_t* pLogPath, uint64_t uFileSize, uint32_t uInterval);
+extern void close_time_index(time_index_t* pIndex);
+extern void time_index_write(
+	time_index_t* pIndex, HANDLE hLog, uint64_t uOffset, uint32_t uLength);
+extern void flush_time_index(time_index_t* pIndex);
+extern void rotate_time_index(time_index_t* pIndex, const wchar_t* pLogPath,
+	const wchar_t* pRotated);
+extern void move_time_index(const wchar_t* pLogPath, const wchar_t* pRotated);
+extern void delete_time_index(const wchar_t* pLogPath);
+extern int show_logs(int iArgc, wchar_t** ppArgv);
+
+#endif